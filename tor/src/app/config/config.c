@@ -575,6 +575,7 @@ static const config_var_t option_vars_[] = {
   V(OutboundBindAddressOR,       LINELIST,   NULL),
   V(OutboundBindAddressExit,     LINELIST,   NULL),
   V(OutboundBindAddressPT,       LINELIST,   NULL),
+  V(ParallelDirParsing,          BOOL,     "0"),
 
   OBSOLETE("PathBiasDisableRate"),
   V(PathBiasCircThreshold,       INT,      "-1"),
@@ -674,6 +675,7 @@ static const config_var_t option_vars_[] = {
   V(UseGuardFraction,            AUTOBOOL, "auto"),
   V(VanguardsLiteEnabled,        AUTOBOOL, "auto"),
   V(UseMicrodescriptors,         AUTOBOOL, "auto"),
+  V_IMMUTABLE(UseKernelTLS,      BOOL,     "0"),
   OBSOLETE("UseNTorHandshake"),
   VAR("__AlwaysCongestionControl",  BOOL, AlwaysCongestionControl, "0"),
   VAR("__SbwsExit",  BOOL, SbwsExit, "0"),
@@ -433,6 +433,9 @@ struct or_options_t {
   uint64_t PerConnBWRate; /**< Long-term bw on a single TLS conn, if set. */
   uint64_t PerConnBWBurst; /**< Allowed burst on a single TLS conn, if set. */
   int NumCPUs; /**< How many CPUs should we try to use? */
+  /** Boolean: should we split up parsing networkstatus documents and checking
+   * their signatures between the cpuworkers? */
+  int ParallelDirParsing;
   struct config_line_t *RendConfigLines; /**< List of configuration lines
                                           * for rendezvous services. */
   char *ClientOnionAuthDir; /**< Directory to keep client
@@ -961,6 +964,10 @@ struct or_options_t {
    * should guess a suitable value. */
   int SSLKeyLifetime;
 
+  /** Boolean: should we ask the TLS library to hand the record layer of our
+   * OR connections to the kernel (kTLS) when it can? */
+  int UseKernelTLS;
+
   /** How long (seconds) do we keep a guard before picking a new one? */
   int GuardLifetime;
 
@@ -48,6 +48,7 @@
 #include "feature/stats/bwhist.h"
 #include "feature/stats/geoip_stats.h"
 #include "feature/stats/rephist.h"
+#include "lib/buf/buffers.h"
 #include "lib/evloop/compat_libevent.h"
 #include "lib/geoip/geoip.h"
 
@@ -139,6 +140,7 @@ tor_free_all(int postfork)
   circuitmux_ewma_free_all();
   accounting_free_all();
   circpad_free_all();
+  buf_shrink_freelists(1);
 
   if (!postfork) {
     config_free_all();
@@ -4809,6 +4809,33 @@ connection_buf_add_buf(connection_t *conn, buf_t *buf)
   connection_write_to_buf_commit(conn);
 }
 
+/**
+ * Append the <b>len</b> bytes at <b>data</b> to <b>conn</b>'s outbuf without
+ * copying them, and ask it to start writing.  The bytes must stay valid until
+ * the outbuf is done with them and calls
+ * <b>release_fn</b>(<b>release_arg</b>): see buf_add_external().
+ */
+void
+connection_buf_add_external(const char *data, size_t len, connection_t *conn,
+                            void (*release_fn)(void *), void *release_arg)
+{
+  int r;
+  tor_assert(conn);
+
+  if (!connection_may_write_to_buf(conn)) {
+    release_fn(release_arg);
+    return;
+  }
+
+  CONN_LOG_PROTECT(conn, r = buf_add_external(conn->outbuf, data, len,
+                                              release_fn, release_arg));
+  if (r < 0) {
+    connection_write_to_buf_failed(conn);
+    return;
+  }
+  connection_write_to_buf_commit(conn);
+}
+
 #define CONN_GET_ALL_TEMPLATE(var, test) \
   STMT_BEGIN \
     smartlist_t *conns = get_connection_array();   \
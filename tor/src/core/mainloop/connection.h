@@ -273,6 +273,10 @@ connection_buf_add(const char *string, size_t len, struct connection_t *conn)
 void connection_buf_add_compress(const char *string, size_t len,
                                  struct dir_connection_t *conn, int done);
 void connection_buf_add_buf(struct connection_t *conn, struct buf_t *buf);
+void connection_buf_add_external(const char *data, size_t len,
+                                 struct connection_t *conn,
+                                 void (*release_fn)(void *),
+                                 void *release_arg);
 
 size_t connection_get_inbuf_len(const struct connection_t *conn);
 size_t connection_get_outbuf_len(const struct connection_t *conn);
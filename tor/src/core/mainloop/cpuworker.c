@@ -14,7 +14,8 @@
  * Right now, we use this infrastructure
  *  <ul><li>for processing onionskins in onion.c
  *      <li>for compressing consensuses in consdiffmgr.c,
- *      <li>and for calculating diffs and compressing them in consdiffmgr.c.
+ *      <li>for calculating diffs and compressing them in consdiffmgr.c,
+ *      <li>and for splitting directory parsing into batches in ns_parse.c.
  *  </ul>
  **/
 #include "core/or/or.h"
@@ -33,6 +34,8 @@
 #include "feature/stats/rephist.h"
 #include "feature/relay/router.h"
 #include "lib/evloop/workqueue.h"
+#include "lib/lock/compat_mutex.h"
+#include "lib/thread/threads.h"
 #include "core/crypto/onion_crypto.h"
 
 #include "core/or/or_circuit_st.h"
@@ -533,6 +536,150 @@ cpuworker_queue_work,(workqueue_priority_t priority,
                                         arg);
 }
 
+/** Return the number of threads in the cpuworker threadpool, or 0 if we
+ * have not launched any cpuworkers. */
+MOCK_IMPL(int,
+cpuworker_get_n_threads,(void))
+{
+  if (!threadpool)
+    return 0;
+  return get_num_cpus(get_options()) + 1;
+}
+
+/** A set of independent items of work, shared between the thread that
+ * started it and any cpuworkers that help with it. */
+struct cpuworker_batch_t {
+  /** Protects every field below. */
+  tor_mutex_t lock;
+  /** Signalled when the last item in progress is done. */
+  tor_cond_t cond;
+  /** Function to call on each item. */
+  void (*fn)(void *arg, int idx);
+  /** Argument to pass to <b>fn</b>. */
+  void *arg;
+  /** Number of items in this batch. */
+  int n_items;
+  /** Index of the next item that nobody has claimed yet. */
+  int next_item;
+  /** Number of items that have been finished. */
+  int n_done;
+  /** Number of threads holding a reference to this batch: the thread that
+   * started it, plus one for each queued cpuworker job. */
+  int refcnt;
+};
+
+/** Drop one reference to <b>batch</b>, freeing it if it was the last. */
+static void
+cpuworker_batch_decref(cpuworker_batch_t *batch)
+{
+  int last;
+  tor_mutex_acquire(&batch->lock);
+  last = (--batch->refcnt == 0);
+  tor_mutex_release(&batch->lock);
+  if (last) {
+    tor_mutex_uninit(&batch->lock);
+    tor_cond_uninit(&batch->cond);
+    tor_free(batch);
+  }
+}
+
+/** Claim and run items from <b>batch</b> until none are left. */
+static void
+cpuworker_batch_run_items(cpuworker_batch_t *batch)
+{
+  tor_mutex_acquire(&batch->lock);
+  while (batch->next_item < batch->n_items) {
+    int idx = batch->next_item++;
+    tor_mutex_release(&batch->lock);
+    batch->fn(batch->arg, idx);
+    tor_mutex_acquire(&batch->lock);
+    if (++batch->n_done == batch->n_items)
+      tor_cond_signal_all(&batch->cond);
+  }
+  tor_mutex_release(&batch->lock);
+}
+
+/** Threadpool function: help with the batch in <b>work_</b>. A cpuworker
+ * that only gets to run once the batch is over finds nothing left to claim,
+ * and never touches the memory of whoever started it. */
+static workqueue_reply_t
+cpuworker_batch_threadfn(void *state_, void *work_)
+{
+  cpuworker_batch_t *batch = work_;
+  (void)state_;
+
+  cpuworker_batch_run_items(batch);
+  cpuworker_batch_decref(batch);
+  return WQ_RPL_REPLY;
+}
+
+/** Reply function for cpuworker_batch_threadfn(): the cpuworker already
+ * released the batch, so there is nothing to do. */
+static void
+cpuworker_batch_replyfn(void *work_)
+{
+  (void)work_;
+}
+
+/** Start running <b>fn</b>(<b>arg</b>, <i>i</i>) for every <i>i</i> in
+ * [0, <b>n_items</b>), on the cpuworker threads if we have any. The items
+ * must be independent of one another, and <b>fn</b> must be safe to call
+ * outside the main thread.
+ *
+ * The caller may do other work in the meantime, but must eventually call
+ * cpuworker_batch_finish() on the result, and must keep <b>arg</b> alive
+ * until then. */
+cpuworker_batch_t *
+cpuworker_batch_start(int n_items, void (*fn)(void *arg, int idx), void *arg)
+{
+  cpuworker_batch_t *batch = tor_malloc_zero(sizeof(cpuworker_batch_t));
+  int n_helpers, i;
+
+  tor_assert(n_items >= 0);
+  tor_mutex_init_for_cond(&batch->lock);
+  tor_cond_init(&batch->cond);
+  batch->fn = fn;
+  batch->arg = arg;
+  batch->n_items = n_items;
+  batch->refcnt = 1;
+
+  n_helpers = MIN(cpuworker_get_n_threads(), n_items);
+  for (i = 0; i < n_helpers; ++i) {
+    tor_mutex_acquire(&batch->lock);
+    ++batch->refcnt;
+    tor_mutex_release(&batch->lock);
+    if (!cpuworker_queue_work(WQ_PRI_MED, cpuworker_batch_threadfn,
+                              cpuworker_batch_replyfn, batch)) {
+      /* We'll do the work ourselves. */
+      tor_mutex_acquire(&batch->lock);
+      --batch->refcnt;
+      tor_mutex_release(&batch->lock);
+      break;
+    }
+  }
+
+  return batch;
+}
+
+/** Run whatever items of <b>batch</b> no cpuworker has claimed yet, wait
+ * for the ones in progress, and release <b>batch</b>. When this returns,
+ * every item has been run exactly once. */
+void
+cpuworker_batch_finish(cpuworker_batch_t *batch)
+{
+  if (!batch)
+    return;
+
+  cpuworker_batch_run_items(batch);
+
+  tor_mutex_acquire(&batch->lock);
+  while (batch->n_done < batch->n_items)
+    tor_cond_wait(&batch->cond, &batch->lock, NULL);
+  tor_mutex_release(&batch->lock);
+
+  cpuworker_batch_decref(batch);
+}
+
 /** Try to tell a cpuworker to perform the public key operations necessary to
  * respond to <b>onionskin</b> for the circuit <b>circ</b>.
  *
@@ -23,6 +23,15 @@ MOCK_DECL(struct workqueue_entry_t *, cpuworker_queue_work, (
                     void (*reply_fn)(void *),
                     void *arg));
 
+MOCK_DECL(int, cpuworker_get_n_threads, (void));
+
+/** Opaque type for a batch of work items shared with the cpuworkers. */
+typedef struct cpuworker_batch_t cpuworker_batch_t;
+cpuworker_batch_t *cpuworker_batch_start(int n_items,
+                                         void (*fn)(void *arg, int idx),
+                                         void *arg);
+void cpuworker_batch_finish(cpuworker_batch_t *batch);
+
 struct create_cell_t;
 int assign_onionskin_to_cpuworker(or_circuit_t *circ,
                                   struct create_cell_t *onionskin);
@@ -1367,6 +1367,7 @@ CALLBACK(reset_padding_counts);
 CALLBACK(retry_listeners);
 CALLBACK(rotate_x509_certificate);
 CALLBACK(save_state);
+CALLBACK(shrink_buf_freelists);
 CALLBACK(write_stats_file);
 CALLBACK(control_per_second_events);
 CALLBACK(second_elapsed);
@@ -1413,6 +1414,7 @@ STATIC periodic_event_item_t mainloop_periodic_events[] = {
   CALLBACK(save_state, NET_PARTICIPANT, FL(RUN_ON_DISABLE)),
   CALLBACK(write_stats_file, NET_PARTICIPANT, FL(RUN_ON_DISABLE)),
   CALLBACK(prune_old_routers, NET_PARTICIPANT, FL(RUN_ON_DISABLE)),
+  CALLBACK(shrink_buf_freelists, NET_PARTICIPANT, FL(RUN_ON_DISABLE)),
 
   /* Hidden Service service only. */
   CALLBACK(hs_service, HS_SERVICE, FL(NEED_NET)), // XXXX break this down more
@@ -2042,6 +2044,20 @@ clean_caches_callback(time_t now, const or_options_t *options)
   return CLEAN_CACHES_INTERVAL;
 }
 
+/**
+ * Periodic callback: Release the buffer chunks that have been sitting unused
+ * on the freelists since the last time we ran.
+ */
+static int
+shrink_buf_freelists_callback(time_t now, const or_options_t *options)
+{
+  (void) now;
+  (void) options;
+  buf_shrink_freelists(0);
+#define SHRINK_BUF_FREELISTS_INTERVAL 60
+  return SHRINK_BUF_FREELISTS_INTERVAL;
+}
+
 /**
  * Periodic callback: Clean the cache of failed hidden service lookups
  * frequently.
@@ -942,6 +942,8 @@ channel_free_(channel_t *chan)
     chan->cmux = NULL;
   }
 
+  channel_free_circid_table(chan);
+
   tor_free(chan);
 }
 
@@ -1013,6 +1015,8 @@ channel_force_xfree(channel_t *chan)
     chan->cmux = NULL;
   }
 
+  channel_free_circid_table(chan);
+
   tor_free(chan);
 }
 
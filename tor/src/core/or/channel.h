@@ -409,6 +409,9 @@ struct channel_t {
   /** For how many circuits are we n_chan?  What about p_chan? */
   unsigned int num_n_circuits, num_p_circuits;
 
+  /** Table of the circuit IDs in use on this channel: see circuitlist.c. */
+  struct chan_circid_table_t *circid_table;
+
   /**
    * True iff this channel shouldn't get any new circs attached to it,
    * because the connection is too old, or because there's a better one.
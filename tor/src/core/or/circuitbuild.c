@@ -1578,16 +1578,11 @@ node_handles_some_port(const node_t *node, smartlist_t *needed_ports)
   uint16_t port;
 
   for (i = 0; i < smartlist_len(needed_ports); ++i) {
-    addr_policy_result_t r;
     /* alignment issues aren't a worry for this dereference, since
        needed_ports is explicitly a smartlist of uint16_t's */
     port = *(uint16_t *)smartlist_get(needed_ports, i);
     tor_assert(port);
-    if (node)
-      r = compare_tor_addr_to_node_policy(NULL, port, node);
-    else
-      continue;
-    if (r != ADDR_POLICY_REJECTED && r != ADDR_POLICY_PROBABLY_REJECTED)
+    if (node && node_exit_policy_allows_port(node, port))
       return 1;
   }
   return 0;
@@ -214,7 +214,8 @@ chan_circid_entry_hash_(chan_circid_circuit_map_t *a)
   return (unsigned) siphash24g(array, sizeof(array));
 }
 
-/** Map from [chan,circid] to circuit. */
+/** Map from [chan,circid] to circuit. It owns its entries, but lookups go
+ * through the chan_circid_table_t of each channel instead. */
 static HT_HEAD(chan_circid_map, chan_circid_circuit_map_t)
      chan_circid_map = HT_INITIALIZER();
 HT_PROTOTYPE(chan_circid_map, chan_circid_circuit_map_t, node,
@@ -223,6 +224,189 @@ HT_GENERATE2(chan_circid_map, chan_circid_circuit_map_t, node,
              chan_circid_entry_hash_, chan_circid_entries_eq_, 0.6,
              tor_reallocarray_, tor_free_);
 
+/** One slot of a chan_circid_table_t. */
+typedef struct chan_circid_table_slot_t {
+  circid_t circ_id;
+  /** The entry of chan_circid_map for circ_id, or NULL if the slot is
+   * empty. */
+  chan_circid_circuit_map_t *ent;
+} chan_circid_table_slot_t;
+
+/** An open-addressing table from circuit ID to the chan_circid_map entries
+ * of a single channel.
+ *
+ * Each entry of chan_circid_map is also in the table of its channel, so
+ * that finding the circuit of an incoming cell only probes a small array
+ * owned by that channel, instead of hashing the channel and circuit ID into
+ * the global map. The global map still owns the entries: the table never
+ * dereferences them. */
+typedef struct chan_circid_table_t {
+  /** Secret mixed into the hash of circuit IDs, so that a peer can't choose
+   * circuit IDs that all land in the same few slots. */
+  uint32_t key;
+  /** Number of slots, minus one. The number of slots is a power of two. */
+  unsigned mask;
+  /** Number of slots in use. We keep it under half the number of slots, so
+   * that probes stay short and always end on an empty slot. */
+  unsigned n_entries;
+  chan_circid_table_slot_t *slots;
+  /** Index of this table in chan_circid_tables. */
+  int tables_idx;
+} chan_circid_table_t;
+
+/** List of all the chan_circid_table_t, so that circuit_free_all() can empty
+ * them when it frees the entries of chan_circid_map. */
+static smartlist_t *chan_circid_tables = NULL;
+
+/** Smallest number of slots of a chan_circid_table_t. */
+#define CHAN_CIRCID_TABLE_MIN_SLOTS 16
+
+/** Return the slot where the search for <b>circ_id</b> in <b>table</b>
+ * starts. */
+static inline unsigned
+chan_circid_table_home(const chan_circid_table_t *table, circid_t circ_id)
+{
+  uint32_t h = ((uint32_t) circ_id) ^ table->key;
+  /* Mix the bits so that the low ones depend on all of them. */
+  h ^= h >> 16;
+  h *= 0x7feb352d;
+  h ^= h >> 15;
+  h *= 0x846ca68b;
+  h ^= h >> 16;
+  return h & table->mask;
+}
+
+/** Return the index of the slot of <b>table</b> that holds <b>circ_id</b>,
+ * or of the empty slot where it would go. */
+static inline unsigned
+chan_circid_table_probe(const chan_circid_table_t *table, circid_t circ_id)
+{
+  unsigned i = chan_circid_table_home(table, circ_id);
+  while (table->slots[i].ent && table->slots[i].circ_id != circ_id)
+    i = (i + 1) & table->mask;
+  return i;
+}
+
+/** Return the entry for <b>circ_id</b> in the circuit ID table of
+ * <b>chan</b>, or NULL if there is none. */
+static inline chan_circid_circuit_map_t *
+chan_circid_table_find(const channel_t *chan, circid_t circ_id)
+{
+  const chan_circid_table_t *table = chan->circid_table;
+  if (!table)
+    return NULL;
+  return table->slots[chan_circid_table_probe(table, circ_id)].ent;
+}
+
+/** Reallocate the slots of <b>table</b> to hold <b>n_slots</b> slots, and
+ * put the entries back into them. */
+static void
+chan_circid_table_resize(chan_circid_table_t *table, unsigned n_slots)
+{
+  chan_circid_table_slot_t *old_slots = table->slots;
+  const unsigned old_n_slots = table->mask + 1;
+
+  table->slots = tor_calloc(n_slots, sizeof(chan_circid_table_slot_t));
+  table->mask = n_slots - 1;
+  for (unsigned i = 0; i < old_n_slots; ++i) {
+    if (old_slots[i].ent)
+      table->slots[chan_circid_table_probe(table, old_slots[i].circ_id)] =
+        old_slots[i];
+  }
+  tor_free(old_slots);
+}
+
+/** Make <b>ent</b> the entry for its circuit ID in the circuit ID table of
+ * its channel, replacing any entry that was there. */
+static void
+chan_circid_table_set(chan_circid_circuit_map_t *ent)
+{
+  chan_circid_table_t *table = ent->chan->circid_table;
+  unsigned i;
+
+  if (!table) {
+    table = ent->chan->circid_table = tor_malloc_zero(sizeof(*table));
+    table->key = crypto_rand_u32();
+    table->mask = CHAN_CIRCID_TABLE_MIN_SLOTS - 1;
+    table->slots = tor_calloc(CHAN_CIRCID_TABLE_MIN_SLOTS,
+                              sizeof(chan_circid_table_slot_t));
+    if (!chan_circid_tables)
+      chan_circid_tables = smartlist_new();
+    table->tables_idx = smartlist_len(chan_circid_tables);
+    smartlist_add(chan_circid_tables, table);
+  }
+
+  i = chan_circid_table_probe(table, ent->circ_id);
+  if (!table->slots[i].ent) {
+    if ((table->n_entries + 1) * 2 > table->mask + 1) {
+      chan_circid_table_resize(table, (table->mask + 1) * 2);
+      i = chan_circid_table_probe(table, ent->circ_id);
+    }
+    ++table->n_entries;
+  }
+  table->slots[i].circ_id = ent->circ_id;
+  table->slots[i].ent = ent;
+}
+
+/** Remove the entry for <b>circ_id</b>, if any, from the circuit ID table of
+ * <b>chan</b>. */
+static void
+chan_circid_table_remove(channel_t *chan, circid_t circ_id)
+{
+  chan_circid_table_t *table = chan->circid_table;
+  chan_circid_table_slot_t *slots;
+  unsigned i, j;
+
+  if (!table)
+    return;
+  slots = table->slots;
+  i = chan_circid_table_probe(table, circ_id);
+  if (!slots[i].ent)
+    return;
+
+  /* Linear probing without tombstones: fill the hole with the next entry
+   * whose probe sequence went through it, until we find an empty slot. */
+  slots[i].ent = NULL;
+  for (j = (i + 1) & table->mask; slots[j].ent; j = (j + 1) & table->mask) {
+    const unsigned home = chan_circid_table_home(table, slots[j].circ_id);
+    /* Can the entry at j stay there, because its home is cyclically in
+     * (i, j]? */
+    if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+      continue;
+    slots[i] = slots[j];
+    slots[j].ent = NULL;
+    i = j;
+  }
+
+  --table->n_entries;
+  if (table->n_entries * 8 < table->mask + 1 &&
+      table->mask + 1 > CHAN_CIRCID_TABLE_MIN_SLOTS)
+    chan_circid_table_resize(table, (table->mask + 1) / 2);
+}
+
+/** Free the circuit ID table of <b>chan</b>. The entries it had stay in
+ * chan_circid_map. */
+void
+channel_free_circid_table(channel_t *chan)
+{
+  chan_circid_table_t *table = chan->circid_table;
+  if (!table)
+    return;
+
+  smartlist_del(chan_circid_tables, table->tables_idx);
+  if (table->tables_idx < smartlist_len(chan_circid_tables)) {
+    chan_circid_table_t *moved =
+      smartlist_get(chan_circid_tables, table->tables_idx);
+    moved->tables_idx = table->tables_idx;
+  }
+  if (smartlist_len(chan_circid_tables) == 0)
+    smartlist_free(chan_circid_tables);
+
+  tor_free(table->slots);
+  tor_free(table);
+  chan->circid_table = NULL;
+}
+
 /** The most recently returned entry from circuit_get_by_circid_chan;
  * used to improve performance when many cells arrive in a row from the
  * same circuit.
@@ -286,6 +470,7 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
     search.chan = old_chan;
     found = HT_REMOVE(chan_circid_map, &chan_circid_map, &search);
     if (found) {
+      chan_circid_table_remove(old_chan, old_id);
       tor_free(found);
       if (direction == CELL_DIRECTION_OUT) {
         /* One fewer circuits use old_chan as n_chan */
@@ -319,6 +504,7 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
     found->circuit = circ;
     HT_INSERT(chan_circid_map, &chan_circid_map, found);
   }
+  chan_circid_table_set(found);
 
   /*
    * Attach to the circuitmux if we're changing channels or IDs and
@@ -371,6 +557,7 @@ channel_mark_circid_unusable(channel_t *chan, circid_t id)
     /* It's already marked. */
     if (!ent->made_placeholder_at)
       ent->made_placeholder_at = approx_time();
+    chan_circid_table_set(ent);
   } else {
     ent = tor_malloc_zero(sizeof(chan_circid_circuit_map_t));
     ent->chan = chan;
@@ -378,6 +565,7 @@ channel_mark_circid_unusable(channel_t *chan, circid_t id)
     /* leave circuit at NULL. */
     ent->made_placeholder_at = approx_time();
     HT_INSERT(chan_circid_map, &chan_circid_map, ent);
+    chan_circid_table_set(ent);
   }
 }
 
@@ -395,6 +583,8 @@ channel_mark_circid_usable(channel_t *chan, circid_t id)
   search.chan = chan;
   search.circ_id = id;
   ent = HT_REMOVE(chan_circid_map, &chan_circid_map, &search);
+  if (ent)
+    chan_circid_table_remove(chan, id);
   if (ent && ent->circuit) {
     log_warn(LD_BUG, "Tried to mark %u usable on %p, but there was already "
              "a circuit there.", (unsigned)id, chan);
@@ -1366,6 +1556,15 @@ circuit_free_all(void)
     }
   }
   HT_CLEAR(chan_circid_map, &chan_circid_map);
+  _last_circid_chan_ent = NULL;
+  /* The channels may outlive the entries we just freed. */
+  if (chan_circid_tables) {
+    SMARTLIST_FOREACH_BEGIN(chan_circid_tables, chan_circid_table_t *, t) {
+      memset(t->slots, 0,
+             ((size_t) t->mask + 1) * sizeof(chan_circid_table_slot_t));
+      t->n_entries = 0;
+    } SMARTLIST_FOREACH_END(t);
+  }
 }
 
 /** A helper function for circuit_dump_by_conn() below. Log a bunch
@@ -1461,7 +1660,6 @@ static inline circuit_t *
 circuit_get_by_circid_channel_impl(circid_t circ_id, channel_t *chan,
                                    int *found_entry_out)
 {
-  chan_circid_circuit_map_t search;
   chan_circid_circuit_map_t *found;
 
   if (_last_circid_chan_ent &&
@@ -1469,9 +1667,7 @@ circuit_get_by_circid_channel_impl(circid_t circ_id, channel_t *chan,
       chan == _last_circid_chan_ent->chan) {
     found = _last_circid_chan_ent;
   } else {
-    search.circ_id = circ_id;
-    search.chan = chan;
-    found = HT_FIND(chan_circid_map, &chan_circid_map, &search);
+    found = chan_circid_table_find(chan, circ_id);
     _last_circid_chan_ent = found;
   }
   if (found && found->circuit) {
@@ -1570,14 +1766,7 @@ circuit_id_in_use_on_channel(circid_t circ_id, channel_t *chan)
 time_t
 circuit_id_when_marked_unusable_on_channel(circid_t circ_id, channel_t *chan)
 {
-  chan_circid_circuit_map_t search;
-  chan_circid_circuit_map_t *found;
-
-  memset(&search, 0, sizeof(search));
-  search.circ_id = circ_id;
-  search.chan = chan;
-
-  found = HT_FIND(chan_circid_map, &chan_circid_map, &search);
+  chan_circid_circuit_map_t *found = chan_circid_table_find(chan, circ_id);
 
   if (! found || found->circuit)
     return 0;
@@ -2652,6 +2841,7 @@ circuits_handle_oom(size_t current_allocation)
              tor_zstd_get_total_allocation(),
              tor_lzma_get_total_allocation(),
              hs_cache_get_total_allocation());
+  connection_dump_buffer_mem_stats(LOG_NOTICE);
   {
     size_t mem_target = (size_t)(get_options()->MaxMemInQueues *
                                  FRACTION_OF_DATA_TO_RETAIN_ON_OOM);
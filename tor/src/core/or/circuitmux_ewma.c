@@ -19,8 +19,9 @@
  * cell: that would be horribly inefficient.  Instead, we we keep the cell
  * count on all circuits on the same circuitmux scaled relative to a single
  * tick.  When we add a new cell, we scale its weight depending on the time
- * that has elapsed since the tick.  We do re-scale the circuits on the
- * circuitmux periodically, so that we don't overflow double.
+ * that has elapsed since the tick.  We only re-scale the circuits on the
+ * circuitmux when that weight gets too large, so that we don't overflow
+ * double.
  *
  *
  * This module should be used through the interfaces in circuitmux.c, which it
@@ -61,14 +62,22 @@ static int ewma_tick_len = EWMA_TICK_LEN_DEFAULT;
 #define EPSILON 0.00001
 /** The natural logarithm of 0.5. */
 #define LOG_ONEHALF -0.69314718055994529
+/** The largest weight we let a newly sent cell have, relative to one sent at
+ * the start of its circuitmux's scale tick, before we rescale all of that
+ * circuitmux's circuits to the current tick.  With the default halflife this
+ * lets a circuitmux go the better part of an hour between rescalings; with
+ * even a million cells per circuit, counts stay far from overflowing. */
+#define EWMA_MAX_LAZY_SCALE 1e30
+/** Bytes to align each circuitmux's heap of active circuits to. */
+#define EWMA_HEAP_ALIGN 64
 
 /*** Static declarations for circuitmux_ewma.c ***/
 
 static void add_cell_ewma(ewma_policy_data_t *pol, cell_ewma_t *ewma);
-static int compare_cell_ewma_counts(const void *p1, const void *p2);
 static circuit_t * cell_ewma_to_circuit(cell_ewma_t *ewma);
 static inline double get_scale_factor(unsigned from_tick, unsigned to_tick);
-static cell_ewma_t * pop_first_cell_ewma(ewma_policy_data_t *pol);
+static double catch_up_scale_tick(ewma_policy_data_t *pol, unsigned cur_tick);
+static void ewma_heap_sift_down(ewma_policy_data_t *pol, int idx);
 static void remove_cell_ewma(ewma_policy_data_t *pol, cell_ewma_t *ewma);
 static void scale_single_cell_ewma(cell_ewma_t *ewma, unsigned cur_tick);
 static void scale_active_circuits(ewma_policy_data_t *pol,
@@ -168,8 +177,7 @@ ewma_alloc_cmux_data(circuitmux_t *cmux)
 
   pol = tor_malloc_zero(sizeof(*pol));
   pol->base_.magic = EWMA_POL_DATA_MAGIC;
-  pol->active_circuit_pqueue = smartlist_new();
-  pol->active_circuit_pqueue_last_recalibrated = cell_ewma_get_tick();
+  pol->active_circuits_scale_tick = cell_ewma_get_tick();
 
   return TO_CMUX_POL_DATA(pol);
 }
@@ -189,7 +197,7 @@ ewma_free_cmux_data(circuitmux_t *cmux,
 
   pol = TO_EWMA_POL_DATA(pol_data);
 
-  smartlist_free(pol->active_circuit_pqueue);
+  tor_free(pol->active_circuits_mem);
   memwipe(pol, 0xda, sizeof(ewma_policy_data_t));
   tor_free(pol);
 }
@@ -327,8 +335,8 @@ ewma_notify_xmit_cells(circuitmux_t *cmux,
   ewma_policy_data_t *pol = NULL;
   ewma_policy_circ_data_t *cdata = NULL;
   unsigned int tick;
-  double fractional_tick, ewma_increment;
-  cell_ewma_t *cell_ewma, *tmp;
+  double fractional_tick, ewma_increment, scale;
+  cell_ewma_t *cell_ewma;
 
   tor_assert(cmux);
   tor_assert(pol_data);
@@ -339,28 +347,25 @@ ewma_notify_xmit_cells(circuitmux_t *cmux,
   pol = TO_EWMA_POL_DATA(pol_data);
   cdata = TO_EWMA_POL_CIRC_DATA(pol_circ_data);
 
-  /* Rescale the EWMAs if needed */
+  /* How much is a cell sent now worth, relative to one sent at the start of
+   * the tick our counts are scaled to?  Rescale the EWMAs if that has grown
+   * too large. */
   tick = cell_ewma_get_current_tick_and_fraction(&fractional_tick);
-
-  if (tick != pol->active_circuit_pqueue_last_recalibrated) {
-    scale_active_circuits(pol, tick);
-  }
+  scale = catch_up_scale_tick(pol, tick);
 
   /* How much do we adjust the cell count in cell_ewma by? */
   ewma_increment =
-    ((double)(n_cells)) * pow(ewma_scale_factor, -fractional_tick);
-
-  /* Do the adjustment */
-  cell_ewma = &(cdata->cell_ewma);
-  cell_ewma->cell_count += ewma_increment;
+    ((double)(n_cells)) * scale * pow(ewma_scale_factor, -fractional_tick);
 
   /*
    * Since we just sent on this circuit, it should be at the head of
-   * the queue.  Pop the head, assert that it matches, then re-add.
+   * the queue.  Its count only goes up, so sift it down from there.
    */
-  tmp = pop_first_cell_ewma(pol);
-  tor_assert(tmp == cell_ewma);
-  add_cell_ewma(pol, cell_ewma);
+  cell_ewma = &(cdata->cell_ewma);
+  tor_assert(cell_ewma->heap_index == 0);
+  cell_ewma->cell_count += ewma_increment;
+  pol->active_circuits[0].cell_count = cell_ewma->cell_count;
+  ewma_heap_sift_down(pol, 0);
 }
 
 /**
@@ -382,9 +387,9 @@ ewma_pick_active_circuit(circuitmux_t *cmux,
 
   pol = TO_EWMA_POL_DATA(pol_data);
 
-  if (smartlist_len(pol->active_circuit_pqueue) > 0) {
+  if (pol->n_active_circuits > 0) {
     /* Get the head of the queue */
-    cell_ewma = smartlist_get(pol->active_circuit_pqueue, 0);
+    cell_ewma = pol->active_circuits[0].ewma;
     circ = cell_ewma_to_circuit(cell_ewma);
   }
 
@@ -401,7 +406,6 @@ ewma_cmp_cmux(circuitmux_t *cmux_1, circuitmux_policy_data_t *pol_data_1,
               circuitmux_t *cmux_2, circuitmux_policy_data_t *pol_data_2)
 {
   ewma_policy_data_t *p1 = NULL, *p2 = NULL;
-  cell_ewma_t *ce1 = NULL, *ce2 = NULL;
 
   tor_assert(cmux_1);
   tor_assert(pol_data_1);
@@ -412,24 +416,31 @@ ewma_cmp_cmux(circuitmux_t *cmux_1, circuitmux_policy_data_t *pol_data_1,
   p2 = TO_EWMA_POL_DATA(pol_data_2);
 
   if (p1 != p2) {
-    /* Get the head cell_ewma_t from each queue */
-    if (smartlist_len(p1->active_circuit_pqueue) > 0) {
-      ce1 = smartlist_get(p1->active_circuit_pqueue, 0);
-    }
-
-    if (smartlist_len(p2->active_circuit_pqueue) > 0) {
-      ce2 = smartlist_get(p2->active_circuit_pqueue, 0);
-    }
-
-    /* Got both of them? */
-    if (ce1 != NULL && ce2 != NULL) {
-      /* Pick whichever one has the better best circuit */
-      return compare_cell_ewma_counts(ce1, ce2);
+    /* Got a head circuit on both of them? */
+    if (p1->n_active_circuits > 0 && p2->n_active_circuits > 0) {
+      /* Pick whichever one has the better best circuit, once both counts
+       * are on the same scale.  Always scale the older count forward, so
+       * that the factor is at most 1 however far apart the ticks are. */
+      double c1 = p1->active_circuits[0].cell_count;
+      double c2 = p2->active_circuits[0].cell_count;
+      if ((int)(p1->active_circuits_scale_tick -
+                p2->active_circuits_scale_tick) >= 0)
+        c2 *= get_scale_factor(p2->active_circuits_scale_tick,
+                               p1->active_circuits_scale_tick);
+      else
+        c1 *= get_scale_factor(p1->active_circuits_scale_tick,
+                               p2->active_circuits_scale_tick);
+      if (c1 < c2)
+        return -1;
+      else if (c1 > c2)
+        return 1;
+      else
+        return 0;
     } else {
-      if (ce1 != NULL) {
+      if (p1->n_active_circuits > 0) {
         /* We only have a circuit on cmux_1, so prefer it */
         return -1;
-      } else if (ce2 != NULL) {
+      } else if (p2->n_active_circuits > 0) {
         /* We only have a circuit on cmux_2, so prefer it */
         return 1;
       } else {
@@ -443,20 +454,6 @@ ewma_cmp_cmux(circuitmux_t *cmux_1, circuitmux_policy_data_t *pol_data_1,
   }
 }
 
-/** Helper for sorting cell_ewma_t values in their priority queue. */
-static int
-compare_cell_ewma_counts(const void *p1, const void *p2)
-{
-  const cell_ewma_t *e1 = p1, *e2 = p2;
-
-  if (e1->cell_count < e2->cell_count)
-    return -1;
-  else if (e1->cell_count > e2->cell_count)
-    return 1;
-  else
-    return 0;
-}
-
 /** Given a cell_ewma_t, return a pointer to the circuit containing it. */
 static circuit_t *
 cell_ewma_to_circuit(cell_ewma_t *ewma)
@@ -494,11 +491,12 @@ cell_ewma_to_circuit(cell_ewma_t *ewma)
    time we wanted to send a cell.
 
    So as a compromise, we divide time into 'ticks' (currently, 10-second
-   increments) and say that a cell sent at the start of a current tick is
-   worth 1.0, a cell sent N seconds before the start of the current tick is
-   worth F^N, and a cell sent N seconds after the start of the current tick is
-   worth F^-N.  This way we don't overflow, and we don't need to constantly
-   rescale.
+   increments) and say that a cell sent at the start of a circuitmux's scale
+   tick is worth 1.0, a cell sent N seconds before the start of that tick is
+   worth F^N, and a cell sent N seconds after the start of that tick is
+   worth F^-N.  We only move the scale tick forward, rescaling all the
+   circuits on the circuitmux, once F^-N gets large enough to worry about.
+   This way we don't overflow, and we rarely need to rescale.
  */
 
 /**
@@ -645,31 +643,138 @@ scale_single_cell_ewma(cell_ewma_t *ewma, unsigned cur_tick)
   ewma->last_adjusted_tick = cur_tick;
 }
 
-/** Adjust the cell count of every active circuit on <b>chan</b> so
+/** Adjust the cell count of every active circuit on <b>pol</b> so
  * that they are scaled with respect to <b>cur_tick</b> */
 static void
 scale_active_circuits(ewma_policy_data_t *pol, unsigned cur_tick)
 {
   double factor;
+  int i;
 
   tor_assert(pol);
-  tor_assert(pol->active_circuit_pqueue);
 
   factor =
     get_scale_factor(
-      pol->active_circuit_pqueue_last_recalibrated,
+      pol->active_circuits_scale_tick,
       cur_tick);
   /** Ordinarily it isn't okay to change the value of an element in a heap,
    * but it's okay here, since we are preserving the order. */
-  SMARTLIST_FOREACH_BEGIN(
-      pol->active_circuit_pqueue,
-      cell_ewma_t *, e) {
-    tor_assert(e->last_adjusted_tick ==
-               pol->active_circuit_pqueue_last_recalibrated);
-    e->cell_count *= factor;
-    e->last_adjusted_tick = cur_tick;
-  } SMARTLIST_FOREACH_END(e);
-  pol->active_circuit_pqueue_last_recalibrated = cur_tick;
+  for (i = 0; i < pol->n_active_circuits; ++i) {
+    ewma_heap_slot_t *slot = &pol->active_circuits[i];
+    tor_assert(slot->ewma->last_adjusted_tick ==
+               pol->active_circuits_scale_tick);
+    slot->ewma->cell_count *= factor;
+    slot->ewma->last_adjusted_tick = cur_tick;
+    slot->cell_count = slot->ewma->cell_count;
+  }
+  pol->active_circuits_scale_tick = cur_tick;
+}
+
+/** Make sure that a cell sent during <b>cur_tick</b> weighs no more than
+ * EWMA_MAX_LAZY_SCALE on <b>pol</b>'s scale, rescaling <b>pol</b>'s active
+ * circuits to <b>cur_tick</b> if it would.  A circuitmux with no active
+ * circuits has nothing to rescale, so just move its scale tick up.  Return
+ * the weight, on <b>pol</b>'s scale, of a cell sent at the start of
+ * <b>cur_tick</b>. */
+static double
+catch_up_scale_tick(ewma_policy_data_t *pol, unsigned cur_tick)
+{
+  double scale;
+
+  if (pol->n_active_circuits == 0) {
+    pol->active_circuits_scale_tick = cur_tick;
+    return 1.0;
+  }
+  scale = get_scale_factor(cur_tick, pol->active_circuits_scale_tick);
+  if (scale > EWMA_MAX_LAZY_SCALE) {
+    scale_active_circuits(pol, cur_tick);
+    scale = 1.0;
+  }
+  return scale;
+}
+
+/** Store <b>slot</b> at position <b>idx</b> of <b>pol</b>'s heap, and tell
+ * its cell_ewma_t where it is. */
+static inline void
+ewma_heap_place(ewma_policy_data_t *pol, int idx, ewma_heap_slot_t slot)
+{
+  pol->active_circuits[idx] = slot;
+  slot.ewma->heap_index = idx;
+}
+
+/** Move the slot at <b>idx</b> in <b>pol</b>'s heap towards the root
+ * until its parent is no larger. */
+static void
+ewma_heap_sift_up(ewma_policy_data_t *pol, int idx)
+{
+  ewma_heap_slot_t slot = pol->active_circuits[idx];
+  while (idx > 0) {
+    int parent = (idx - 1) / EWMA_HEAP_ARITY;
+    if (pol->active_circuits[parent].cell_count <= slot.cell_count)
+      break;
+    ewma_heap_place(pol, idx, pol->active_circuits[parent]);
+    idx = parent;
+  }
+  ewma_heap_place(pol, idx, slot);
+}
+
+/** Move the slot at <b>idx</b> in <b>pol</b>'s heap away from the root
+ * until none of its children is smaller. */
+static void
+ewma_heap_sift_down(ewma_policy_data_t *pol, int idx)
+{
+  ewma_heap_slot_t slot = pol->active_circuits[idx];
+  const int n = pol->n_active_circuits;
+  for (;;) {
+    int first = idx * EWMA_HEAP_ARITY + 1, last, best, c;
+    if (first >= n)
+      break;
+    last = MIN(first + EWMA_HEAP_ARITY, n);
+    best = first;
+    for (c = first + 1; c < last; ++c) {
+      if (pol->active_circuits[c].cell_count <
+          pol->active_circuits[best].cell_count)
+        best = c;
+    }
+    if (pol->active_circuits[best].cell_count >= slot.cell_count)
+      break;
+    ewma_heap_place(pol, idx, pol->active_circuits[best]);
+    idx = best;
+  }
+  ewma_heap_place(pol, idx, slot);
+}
+
+/** Make sure that <b>pol</b>'s heap has room for one more circuit. */
+static void
+ewma_heap_reserve(ewma_policy_data_t *pol)
+{
+  char *mem;
+  uintptr_t aligned;
+  ewma_heap_slot_t *slots;
+  int new_capacity;
+
+  if (pol->n_active_circuits < pol->active_circuits_capacity)
+    return;
+
+  new_capacity = pol->active_circuits_capacity ?
+    pol->active_circuits_capacity * 2 : 16;
+  /* Leave room to align the storage, and to start the heap
+   * EWMA_HEAP_ARITY-1 slots in, so that slot 1 (and every later group of
+   * siblings) starts on an EWMA_HEAP_ALIGN boundary. */
+  mem = tor_malloc(EWMA_HEAP_ALIGN +
+                   sizeof(ewma_heap_slot_t) *
+                   (new_capacity + EWMA_HEAP_ARITY - 1));
+  aligned = ((uintptr_t)mem + EWMA_HEAP_ALIGN - 1) &
+    ~(uintptr_t)(EWMA_HEAP_ALIGN - 1);
+  slots = ((ewma_heap_slot_t *)aligned) + (EWMA_HEAP_ARITY - 1);
+
+  if (pol->n_active_circuits)
+    memcpy(slots, pol->active_circuits,
+           sizeof(ewma_heap_slot_t) * pol->n_active_circuits);
+  tor_free(pol->active_circuits_mem);
+  pol->active_circuits_mem = mem;
+  pol->active_circuits = slots;
+  pol->active_circuits_capacity = new_capacity;
 }
 
 /** Rescale <b>ewma</b> to the same scale as <b>pol</b>, and add it to
@@ -677,47 +782,51 @@ scale_active_circuits(ewma_policy_data_t *pol, unsigned cur_tick)
 static void
 add_cell_ewma(ewma_policy_data_t *pol, cell_ewma_t *ewma)
 {
+  ewma_heap_slot_t slot;
+
   tor_assert(pol);
-  tor_assert(pol->active_circuit_pqueue);
   tor_assert(ewma);
   tor_assert(ewma->heap_index == -1);
 
+  /* A circuit's count is never scaled to a tick later than now, so once the
+   * scale tick is caught up, this scaling can't overflow. */
+  catch_up_scale_tick(pol, cell_ewma_get_tick());
   scale_single_cell_ewma(
       ewma,
-      pol->active_circuit_pqueue_last_recalibrated);
+      pol->active_circuits_scale_tick);
 
-  smartlist_pqueue_add(pol->active_circuit_pqueue,
-                       compare_cell_ewma_counts,
-                       offsetof(cell_ewma_t, heap_index),
-                       ewma);
+  ewma_heap_reserve(pol);
+  slot.cell_count = ewma->cell_count;
+  slot.ewma = ewma;
+  pol->active_circuits[pol->n_active_circuits] = slot;
+  ewma_heap_sift_up(pol, pol->n_active_circuits++);
 }
 
 /** Remove <b>ewma</b> from <b>pol</b>'s priority queue of active circuits */
 static void
 remove_cell_ewma(ewma_policy_data_t *pol, cell_ewma_t *ewma)
 {
+  int idx;
+
   tor_assert(pol);
-  tor_assert(pol->active_circuit_pqueue);
   tor_assert(ewma);
-  tor_assert(ewma->heap_index != -1);
-
-  smartlist_pqueue_remove(pol->active_circuit_pqueue,
-                          compare_cell_ewma_counts,
-                          offsetof(cell_ewma_t, heap_index),
-                          ewma);
-}
+  idx = ewma->heap_index;
+  tor_assert(idx >= 0 && idx < pol->n_active_circuits);
+  tor_assert(pol->active_circuits[idx].ewma == ewma);
 
-/** Remove and return the first cell_ewma_t from pol's priority queue of
- * active circuits.  Requires that the priority queue is nonempty. */
-static cell_ewma_t *
-pop_first_cell_ewma(ewma_policy_data_t *pol)
-{
-  tor_assert(pol);
-  tor_assert(pol->active_circuit_pqueue);
+  ewma->heap_index = -1;
+  if (idx == --pol->n_active_circuits)
+    return;
 
-  return smartlist_pqueue_pop(pol->active_circuit_pqueue,
-                              compare_cell_ewma_counts,
-                              offsetof(cell_ewma_t, heap_index));
+  /* Fill the hole with the last slot, and restore the heap property in
+   * whichever direction it was broken. */
+  ewma_heap_place(pol, idx, pol->active_circuits[pol->n_active_circuits]);
+  if (idx > 0 &&
+      pol->active_circuits[(idx - 1) / EWMA_HEAP_ARITY].cell_count >
+      pol->active_circuits[idx].cell_count)
+    ewma_heap_sift_up(pol, idx);
+  else
+    ewma_heap_sift_down(pol, idx);
 }
 
 /**
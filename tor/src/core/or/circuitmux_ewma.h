@@ -28,6 +28,7 @@ void circuitmux_ewma_free_all(void);
 typedef struct cell_ewma_t cell_ewma_t;
 typedef struct ewma_policy_data_t ewma_policy_data_t;
 typedef struct ewma_policy_circ_data_t ewma_policy_circ_data_t;
+typedef struct ewma_heap_slot_t ewma_heap_slot_t;
 
 /**
  * The cell_ewma_t structure keeps track of how many cells a circuit has
@@ -53,23 +54,45 @@ struct cell_ewma_t {
   int heap_index;
 };
 
+/** How many children each node of an ewma_policy_data_t's heap has. */
+#define EWMA_HEAP_ARITY 4
+
+/**
+ * One slot of an ewma_policy_data_t's heap of active circuits.  Each slot
+ * carries a copy of its circuit's EWMA, so that sifting compares the
+ * adjacent slots of a node's children rather than chasing a pointer to each.
+ */
+struct ewma_heap_slot_t {
+  /** Same as ewma->cell_count. */
+  double cell_count;
+  cell_ewma_t *ewma;
+};
+
 struct ewma_policy_data_t {
   circuitmux_policy_data_t base_;
 
   /**
-   * Priority queue of cell_ewma_t for circuits with queued cells waiting
-   * for room to free up on the channel that owns this circuitmux.  Kept
-   * in heap order according to EWMA.  This was formerly in channel_t, and
-   * in or_connection_t before that.
+   * A EWMA_HEAP_ARITY-ary min-heap of the circuits with queued cells waiting
+   * for room to free up on the channel that owns this circuitmux, ordered
+   * by EWMA.  The children of slot i are slots EWMA_HEAP_ARITY*i+1 through
+   * EWMA_HEAP_ARITY*i+EWMA_HEAP_ARITY; the storage is aligned so that they
+   * share one cache line.
    */
-  smartlist_t *active_circuit_pqueue;
+  ewma_heap_slot_t *active_circuits;
+  /** How many circuits are in active_circuits? */
+  int n_active_circuits;
+  /** How many slots have we allocated for active_circuits? */
+  int active_circuits_capacity;
+  /** The allocation that active_circuits points into. */
+  void *active_circuits_mem;
 
   /**
-   * The tick on which the cell_ewma_ts in active_circuit_pqueue last had
-   * their ewma values rescaled.  This was formerly in channel_t, and in
-   * or_connection_t before that.
+   * The tick that the cell_counts in active_circuits are scaled to.  A cell
+   * sent at the start of this tick has weight 1.0.  Rather than rescaling
+   * every active circuit on each new tick, we let the weight of new cells
+   * grow, and only rescale when it would grow too large.
    */
-  unsigned int active_circuit_pqueue_last_recalibrated;
+  unsigned int active_circuits_scale_tick;
 };
 
 struct ewma_policy_circ_data_t {
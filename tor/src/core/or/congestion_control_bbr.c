@@ -0,0 +1,364 @@
+/* Copyright (c) 2022, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file congestion_control_bbr.c
+ * \brief Code that implements the TOR_BBR congestion control algorithm.
+ *
+ * This follows the model of TCP BBR: the bottleneck bandwidth is the
+ * maximum delivery rate seen over the last few rounds, the propagation
+ * delay is the minimum RTT seen over the last few seconds, and the BDP is
+ * their product. Rather than waiting for queue delay to tell it to back
+ * off, as Vegas does, it sets cwnd from that model.
+ *
+ * Tor does not pace cells on a circuit, so the pacing gains of TCP BBR
+ * become cwnd gains here: the steady state cycles cwnd through a probe
+ * above the BDP, a drain below it, and six rounds at the BDP. A round is
+ * one congestion window worth of SENDMEs.
+ */
+
+#define TOR_CONGESTION_CONTROL_BBR_PRIVATE
+
+#include "core/or/or.h"
+
+#include "core/or/crypt_path.h"
+#include "core/or/or_circuit_st.h"
+#include "core/or/sendme.h"
+#include "core/or/congestion_control_st.h"
+#include "core/or/congestion_control_common.h"
+#include "core/or/congestion_control_bbr.h"
+#include "core/or/circuitlist.h"
+#include "core/or/origin_circuit_st.h"
+#include "core/or/channel.h"
+#include "feature/nodelist/networkstatus.h"
+#include "feature/control/control_events.h"
+#include "lib/time/compat_time.h"
+
+#define BBR_PROBE_GAIN_PCT_DFLT (125)
+#define BBR_DRAIN_GAIN_PCT_DFLT (75)
+#define BBR_STARTUP_GROWTH_PCT_DFLT (125)
+#define BBR_STARTUP_ROUNDS_DFLT (3)
+#define BBR_RTT_WINDOW_MSEC_DFLT (10*1000)
+#define BBR_PROBE_RTT_MSEC_DFLT (200)
+
+/** During startup, never let cwnd go above this percentage of the BDP. */
+#define BBR_STARTUP_GAIN_PCT (289)
+
+/** Number of rounds in the PROBE_BW gain cycle. */
+#define BBR_CYCLE_LEN 8
+/** Where the PROBE_BW gain cycle starts: right after the drain phase, so
+ * that we don't probe right after leaving DRAIN. */
+#define BBR_CYCLE_START 2
+
+/** Return the bottleneck bandwidth estimate of <b>cc</b>, in cells per
+ * second. */
+static uint64_t
+bbr_max_bw(const congestion_control_t *cc)
+{
+  uint64_t bw = 0;
+  for (int i = 0; i < BBR_BW_WINDOW_ROUNDS; ++i)
+    bw = MAX(bw, cc->bbr_params.round_max_bw[i]);
+  return bw;
+}
+
+/** Return the BDP estimate of <b>cc</b>, in cells, or 0 if we have no
+ * estimate yet. */
+static uint64_t
+bbr_bdp(const congestion_control_t *cc)
+{
+  return bbr_max_bw(cc) * cc->bbr_params.min_rtt_usec / (1000*1000);
+}
+
+/** Return the cwnd gain (percent) of the current PROBE_BW round. */
+static uint64_t
+bbr_cycle_gain_pct(const congestion_control_t *cc)
+{
+  const struct bbr_params_t *bbr = &cc->bbr_params;
+  uint64_t gain = 100;
+
+  if (bbr->cycle_idx == 0)
+    gain = bbr->probe_gain_pct;
+  else if (bbr->cycle_idx == 1)
+    gain = bbr->drain_gain_pct;
+
+  /* Probing for bandwidth is pointless if our own channel is the
+   * bottleneck. */
+  if (cc->blocked_chan)
+    gain = MIN(gain, 100);
+  return gain;
+}
+
+/**
+ * Cache BBR consensus parameters, and reset the BBR state of <b>cc</b>.
+ */
+void
+congestion_control_bbr_set_params(congestion_control_t *cc, cc_path_t path)
+{
+  struct bbr_params_t *bbr = &cc->bbr_params;
+
+  tor_assert(cc->cc_alg == CC_ALG_BBR);
+  (void) path;
+
+  memset(bbr, 0, sizeof(*bbr));
+
+  bbr->probe_gain_pct =
+    networkstatus_get_param(NULL, "cc_bbr_probe_gain",
+        BBR_PROBE_GAIN_PCT_DFLT,
+        100,
+        400);
+  bbr->drain_gain_pct =
+    networkstatus_get_param(NULL, "cc_bbr_drain_gain",
+        BBR_DRAIN_GAIN_PCT_DFLT,
+        1,
+        100);
+  bbr->startup_growth_pct =
+    networkstatus_get_param(NULL, "cc_bbr_startup_growth",
+        BBR_STARTUP_GROWTH_PCT_DFLT,
+        101,
+        400);
+  bbr->startup_rounds =
+    networkstatus_get_param(NULL, "cc_bbr_startup_rounds",
+        BBR_STARTUP_ROUNDS_DFLT,
+        1,
+        20);
+  bbr->rtt_window_msec =
+    networkstatus_get_param(NULL, "cc_bbr_rtt_window",
+        BBR_RTT_WINDOW_MSEC_DFLT,
+        1000,
+        INT32_MAX);
+  bbr->probe_rtt_msec =
+    networkstatus_get_param(NULL, "cc_bbr_probe_rtt",
+        BBR_PROBE_RTT_MSEC_DFLT,
+        0,
+        10*1000);
+
+  bbr->mode = BBR_MODE_STARTUP;
+  bbr->round_acks_left = MAX(SENDME_PER_CWND(cc), 1);
+}
+
+/** Log the state of <b>cc</b> on <b>circ</b>. */
+static void
+congestion_control_bbr_log(const circuit_t *circ,
+                           const congestion_control_t *cc)
+{
+  tor_assert(circ);
+  tor_assert(cc);
+
+  if (CIRCUIT_IS_ORIGIN(circ)) {
+    log_info(LD_CIRC,
+               "CC TOR_BBR: Circuit %d "
+               "CWND: %"PRIu64", "
+               "INFL: %"PRIu64", "
+               "BW: %"PRIu64", "
+               "MINRTT: %"PRIu64", "
+               "MODE: %d",
+             CONST_TO_ORIGIN_CIRCUIT(circ)->global_identifier,
+             cc->cwnd,
+             cc->inflight,
+             bbr_max_bw(cc),
+             cc->bbr_params.min_rtt_usec/1000,
+             cc->bbr_params.mode);
+  } else {
+    log_info(LD_CIRC,
+               "CC TOR_BBR: Circuit %"PRIu64":%d "
+               "CWND: %"PRIu64", "
+               "INFL: %"PRIu64", "
+               "BW: %"PRIu64", "
+               "MINRTT: %"PRIu64", "
+               "MODE: %d",
+             CONST_TO_OR_CIRCUIT(circ)->p_chan->global_identifier,
+             CONST_TO_OR_CIRCUIT(circ)->p_circ_id,
+             cc->cwnd,
+             cc->inflight,
+             bbr_max_bw(cc),
+             cc->bbr_params.min_rtt_usec/1000,
+             cc->bbr_params.mode);
+  }
+}
+
+/**
+ * Leave startup: the delivery rate stopped growing, so the pipe is full.
+ */
+static void
+congestion_control_bbr_exit_startup(const circuit_t *circ,
+                                    congestion_control_t *cc)
+{
+  cc->bbr_params.mode = BBR_MODE_DRAIN;
+  cc->in_slow_start = 0;
+  congestion_control_bbr_log(circ, cc);
+
+  /* We need to report that slow start has exited ASAP,
+   * for sbws bandwidth measurement. */
+  if (CIRCUIT_IS_ORIGIN(circ)) {
+    /* We must discard const here because the event modifies fields :/ */
+    control_event_circ_bandwidth_used_for_circ(
+            TO_ORIGIN_CIRCUIT((circuit_t*)circ));
+  }
+}
+
+/**
+ * Feed the delivery rate and RTT measured by the common code for the
+ * SENDME that just arrived at <b>now_usec</b> into the BBR model.
+ */
+static void
+bbr_update_model(congestion_control_t *cc, uint64_t now_usec)
+{
+  struct bbr_params_t *bbr = &cc->bbr_params;
+  const smartlist_t *acks = cc->sendme_arrival_timestamps;
+  const int n_acks = smartlist_len(acks);
+
+  /* The delivery rate over the SENDMEs that the common code keeps for its
+   * own SENDME-rate BDP estimate. It clears them when the circuit runs out
+   * of data, so that we don't measure idle time. */
+  if (n_acks >= 2) {
+    const uint64_t first = *(const uint64_t *) smartlist_get(acks, 0);
+    const uint64_t last = *(const uint64_t *) smartlist_get(acks, n_acks-1);
+    if (last > first) {
+      const uint64_t bw =
+        (uint64_t)(n_acks-1) * cc->sendme_inc * 1000 * 1000 / (last - first);
+      bbr->round_max_bw[bbr->round_idx] =
+        MAX(bbr->round_max_bw[bbr->round_idx], bw);
+    }
+  }
+
+  if (cc->ewma_rtt_usec) {
+    /* Until we have a sample, there is nothing to expire: min_rtt_at_usec
+     * is still 0, and the monotonic clock started with the process. */
+    const bool expired = bbr->min_rtt_usec &&
+      bbr->min_rtt_at_usec + bbr->rtt_window_msec*UINT64_C(1000) < now_usec;
+    if (!bbr->min_rtt_usec || cc->ewma_rtt_usec <= bbr->min_rtt_usec ||
+        expired) {
+      bbr->min_rtt_usec = cc->ewma_rtt_usec;
+      bbr->min_rtt_at_usec = now_usec;
+    }
+    /* Our minimum RTT is old: our own queue may have been hiding a lower
+     * one all along. Drain it to find out. */
+    if (expired && bbr->mode != BBR_MODE_PROBE_RTT) {
+      bbr->mode = BBR_MODE_PROBE_RTT;
+      bbr->probe_rtt_done_usec = 0;
+    }
+  }
+}
+
+/**
+ * Called once every round (a cwnd worth of SENDMEs): open a new slot in the
+ * bandwidth window, check whether startup filled the pipe, and move along
+ * the PROBE_BW gain cycle.
+ */
+static void
+bbr_start_round(const circuit_t *circ, congestion_control_t *cc)
+{
+  struct bbr_params_t *bbr = &cc->bbr_params;
+
+  if (bbr->mode == BBR_MODE_STARTUP) {
+    const uint64_t bw = bbr_max_bw(cc);
+    if (bw >= bbr->full_bw * bbr->startup_growth_pct / 100) {
+      bbr->full_bw = bw;
+      bbr->full_bw_rounds = 0;
+    } else if (++bbr->full_bw_rounds >= bbr->startup_rounds) {
+      congestion_control_bbr_exit_startup(circ, cc);
+    }
+  } else if (bbr->mode == BBR_MODE_PROBE_BW) {
+    bbr->cycle_idx = (bbr->cycle_idx + 1) % BBR_CYCLE_LEN;
+  }
+
+  bbr->round_idx = (bbr->round_idx + 1) % BBR_BW_WINDOW_ROUNDS;
+  bbr->round_max_bw[bbr->round_idx] = 0;
+  bbr->round_acks_left = MAX(SENDME_PER_CWND(cc), 1);
+}
+
+/**
+ * Process a SENDME and update the congestion window according to the
+ * rules of TOR_BBR.
+ *
+ * The common code updates the RTT and the SENDME arrival times first; we
+ * take the delivery rate and minimum RTT from those, and set cwnd to a
+ * multiple of their product that depends on the state we're in.
+ */
+int
+congestion_control_bbr_process_sendme(congestion_control_t *cc,
+                                      const circuit_t *circ,
+                                      const crypt_path_t *layer_hint)
+{
+  struct bbr_params_t *bbr = &cc->bbr_params;
+  uint64_t now_usec, bdp;
+
+  tor_assert(cc && cc->cc_alg == CC_ALG_BBR);
+  tor_assert(circ);
+
+  /* If we did not successfully update the estimates, we have no new
+   * samples for the model. */
+  if (!congestion_control_update_circuit_estimates(cc, circ, layer_hint)) {
+    cc->inflight = cc->inflight - cc->sendme_inc;
+    return 0;
+  }
+  now_usec = monotime_absolute_usec();
+
+  bbr_update_model(cc, now_usec);
+  if (bbr->round_acks_left)
+    bbr->round_acks_left--;
+  if (bbr->round_acks_left == 0)
+    bbr_start_round(circ, cc);
+
+  /* A blocked local channel means that the pipe is full. */
+  if (bbr->mode == BBR_MODE_STARTUP && cc->blocked_chan)
+    congestion_control_bbr_exit_startup(circ, cc);
+
+  bdp = bbr_bdp(cc);
+
+  switch (bbr->mode) {
+    case BBR_MODE_STARTUP:
+      /* Grow by what this SENDME acked, which doubles cwnd every round. */
+      if (!bdp || cc->cwnd < bdp * BBR_STARTUP_GAIN_PCT / 100)
+        cc->cwnd += cc->sendme_inc;
+      break;
+
+    case BBR_MODE_DRAIN:
+      cc->cwnd = bdp + cc->sendme_inc;
+      if (cc->inflight <= cc->cwnd) {
+        bbr->mode = BBR_MODE_PROBE_BW;
+        bbr->cycle_idx = BBR_CYCLE_START;
+      }
+      break;
+
+    case BBR_MODE_PROBE_BW:
+      /* The drain phase only has to remove the queue that the probe made:
+       * holding cwnd below the BDP any longer would leave the pipe empty. */
+      if (bbr->cycle_idx == 1 && cc->inflight <= bdp)
+        bbr->cycle_idx++;
+      /* One SENDME worth of headroom over the BDP, so that the pipe stays
+       * full while the next SENDME is on its way. */
+      cc->cwnd = bdp * bbr_cycle_gain_pct(cc) / 100 + cc->sendme_inc;
+      break;
+
+    case BBR_MODE_PROBE_RTT:
+      cc->cwnd = cc->cwnd_min;
+      if (!bbr->probe_rtt_done_usec) {
+        if (cc->inflight <= cc->cwnd_min + cc->sendme_inc)
+          bbr->probe_rtt_done_usec =
+            now_usec + bbr->probe_rtt_msec*UINT64_C(1000);
+      } else if (now_usec >= bbr->probe_rtt_done_usec) {
+        bbr->mode = cc->in_slow_start ? BBR_MODE_STARTUP : BBR_MODE_PROBE_BW;
+        cc->cwnd = MAX(cc->cwnd, bdp + cc->sendme_inc);
+      }
+      break;
+  }
+
+  /* cwnd can never fall below 1 increment */
+  cc->cwnd = MAX(cc->cwnd, cc->cwnd_min);
+
+  congestion_control_bbr_log(circ, cc);
+
+  /* Update inflight with ack */
+  cc->inflight = cc->inflight - cc->sendme_inc;
+
+  return 0;
+}
+
+/** The TOR_BBR congestion control algorithm. */
+const congestion_control_alg_t bbr_cc_alg = {
+  .name = "bbr",
+  .default_bdp_alg = BDP_ALG_PIECEWISE,
+  .set_params = congestion_control_bbr_set_params,
+  .process_sendme = congestion_control_bbr_process_sendme,
+};
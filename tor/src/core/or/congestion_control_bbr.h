@@ -0,0 +1,25 @@
+/* Copyright (c) 2022, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file congestion_control_bbr.h
+ * \brief Private-ish APIs for the TOR_BBR congestion control algorithm
+ **/
+
+#ifndef TOR_CONGESTION_CONTROL_BBR_H
+#define TOR_CONGESTION_CONTROL_BBR_H
+
+#include "core/or/crypt_path_st.h"
+#include "core/or/circuit_st.h"
+#include "core/or/congestion_control_common.h"
+
+/* Processing SENDME cell. */
+int congestion_control_bbr_process_sendme(struct congestion_control_t *cc,
+                                          const circuit_t *circ,
+                                          const crypt_path_t *layer_hint);
+void congestion_control_bbr_set_params(struct congestion_control_t *cc,
+                                       cc_path_t path);
+
+extern const congestion_control_alg_t bbr_cc_alg;
+
+#endif /* !defined(TOR_CONGESTION_CONTROL_BBR_H) */
@@ -22,6 +22,7 @@
 #include "core/or/congestion_control_vegas.h"
 #include "core/or/congestion_control_nola.h"
 #include "core/or/congestion_control_westwood.h"
+#include "core/or/congestion_control_bbr.h"
 #include "core/or/congestion_control_st.h"
 #include "core/or/trace_probes_cc.h"
 #include "lib/time/compat_time.h"
@@ -56,12 +57,6 @@
 
 #define RTT_RESET_PCT_DFLT (100)
 
-/* BDP algorithms for each congestion control algorithms use the piecewise
- * estimattor. See section 3.1.4 of proposal 324. */
-#define WESTWOOD_BDP_ALG BDP_ALG_PIECEWISE
-#define VEGAS_BDP_MIX_ALG BDP_ALG_PIECEWISE
-#define NOLA_BDP_ALG BDP_ALG_PIECEWISE
-
 /* Indicate OR connection buffer limitations used to stop or start accepting
  * cells in its outbuf.
  *
@@ -91,6 +86,16 @@ static bool congestion_control_update_circuit_bdp(congestion_control_t *,
 /* For unit tests */
 void congestion_control_set_cc_enabled(void);
 
+/** The congestion control algorithms, indexed by cc_alg_t. CC_ALG_SENDME
+ * has none: circuits that use it have no congestion_control_t. */
+static const congestion_control_alg_t *const cc_algs[NUM_CC_ALGS] = {
+  [CC_ALG_SENDME] = NULL,
+  [CC_ALG_WESTWOOD] = &westwood_cc_alg,
+  [CC_ALG_VEGAS] = &vegas_cc_alg,
+  [CC_ALG_NOLA] = &nola_cc_alg,
+  [CC_ALG_BBR] = &bbr_cc_alg,
+};
+
 /* Number of times the RTT value was reset. For MetricsPort. */
 static uint64_t num_rtt_reset;
 
@@ -304,38 +309,22 @@ congestion_control_init_params(congestion_control_t *cc,
     cc->cc_alg = cc_alg;
   }
 
-  bdp_alg_t default_bdp_alg = 0;
-
-  switch (cc->cc_alg) {
-    case CC_ALG_WESTWOOD:
-      default_bdp_alg = WESTWOOD_BDP_ALG;
-      break;
-    case CC_ALG_VEGAS:
-      default_bdp_alg = VEGAS_BDP_MIX_ALG;
-      break;
-    case CC_ALG_NOLA:
-      default_bdp_alg = NOLA_BDP_ALG;
-      break;
-    case CC_ALG_SENDME:
-    default:
-      tor_fragile_assert();
-      return; // No alg-specific params
+  const congestion_control_alg_t *alg = cc_algs[cc->cc_alg];
+  if (!alg) {
+    tor_fragile_assert();
+    return; // No alg-specific params
   }
 
+  /* BDP algorithms for each congestion control algorithms use the piecewise
+   * estimator by default. See section 3.1.4 of proposal 324. */
   cc->bdp_alg =
     networkstatus_get_param(NULL, "cc_bdp_alg",
-        default_bdp_alg,
+        alg->default_bdp_alg,
         0,
         NUM_BDP_ALGS-1);
 
   /* Algorithm-specific parameters */
-  if (cc->cc_alg == CC_ALG_WESTWOOD) {
-    congestion_control_westwood_set_params(cc);
-  } else if (cc->cc_alg == CC_ALG_VEGAS) {
-    congestion_control_vegas_set_params(cc, path);
-  } else if (cc->cc_alg == CC_ALG_NOLA) {
-    congestion_control_nola_set_params(cc);
-  }
+  alg->set_params(cc, path);
 }
 
 /** Returns true if congestion control is enabled in the most recent
@@ -1175,30 +1164,17 @@ congestion_control_dispatch_cc_alg(congestion_control_t *cc,
                                    const circuit_t *circ,
                                    const crypt_path_t *layer_hint)
 {
-  int ret = -END_CIRC_REASON_INTERNAL;
-  switch (cc->cc_alg) {
-    case CC_ALG_WESTWOOD:
-      ret = congestion_control_westwood_process_sendme(cc, circ, layer_hint);
-      break;
-
-    case CC_ALG_VEGAS:
-      ret = congestion_control_vegas_process_sendme(cc, circ, layer_hint);
-      break;
+  const congestion_control_alg_t *alg = cc_algs[cc->cc_alg];
+  int ret;
 
-    case CC_ALG_NOLA:
-      ret = congestion_control_nola_process_sendme(cc, circ, layer_hint);
-      break;
-
-    case CC_ALG_SENDME:
-    default:
-      tor_assert(0);
-  }
+  tor_assert(alg);
+  ret = alg->process_sendme(cc, circ, layer_hint);
 
   if (cc->cwnd > cwnd_max) {
     static ratelim_t cwnd_limit = RATELIM_INIT(60);
     log_fn_ratelim(&cwnd_limit, LOG_NOTICE, LD_CIRC,
-           "Congestion control cwnd %"PRIu64" exceeds max %d, clamping.",
-           cc->cwnd, cwnd_max);
+           "Congestion control (%s) cwnd %"PRIu64" exceeds max %d, "
+           "clamping.", alg->name, cc->cwnd, cwnd_max);
     cc->cwnd = cwnd_max;
   }
 
@@ -34,6 +34,27 @@ typedef enum {
 /** The length of a path for sbws measurement */
 #define SBWS_ROUTE_LEN 2
 
+/**
+ * A congestion control algorithm. Each cc_alg_t but CC_ALG_SENDME has one,
+ * and congestion_control_t objects call it through this table.
+ */
+typedef struct congestion_control_alg_t {
+  /** Name of the algorithm, for logs. */
+  const char *name;
+  /** Which BDP estimate the algorithm uses, unless the consensus says
+   * otherwise. */
+  int default_bdp_alg;
+  /** Cache the algorithm's consensus parameters in <b>cc</b>, and set up its
+   * state, for a circuit on a path of type <b>path</b>. */
+  void (*set_params)(congestion_control_t *cc, cc_path_t path);
+  /** Update <b>cc</b> for a SENDME that just arrived on <b>circ</b>. This
+   * must update the RTT and BDP estimates, and acknowledge sendme_inc cells
+   * of inflight. Return 0 on success, or a negative END_CIRC_REASON on
+   * failure. */
+  int (*process_sendme)(congestion_control_t *cc, const circuit_t *circ,
+                        const crypt_path_t *layer_hint);
+} congestion_control_alg_t;
+
 /** Wrapper for the free function, set the CC pointer to NULL after free */
 #define congestion_control_free(cc) \
     FREE_AND_NULL(congestion_control_t, congestion_control_free_, cc)
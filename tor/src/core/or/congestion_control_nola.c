@@ -30,8 +30,9 @@
  * Cache NOLA consensus parameters.
  */
 void
-congestion_control_nola_set_params(congestion_control_t *cc)
+congestion_control_nola_set_params(congestion_control_t *cc, cc_path_t path)
 {
+  (void) path;
   tor_assert(cc->cc_alg == CC_ALG_NOLA);
 
   cc->nola_params.bdp_overshoot =
@@ -137,3 +138,11 @@ congestion_control_nola_process_sendme(congestion_control_t *cc,
 
   return 0;
 }
+
+/** The TOR_NOLA congestion control algorithm. */
+const congestion_control_alg_t nola_cc_alg = {
+  .name = "nola",
+  .default_bdp_alg = BDP_ALG_PIECEWISE,
+  .set_params = congestion_control_nola_set_params,
+  .process_sendme = congestion_control_nola_process_sendme,
+};
@@ -44,10 +44,19 @@ typedef enum {
    * avoid out-competition. It seems a bit better throughput than Vegas,
    * but its agressive BDP and rapid updates may lead to more queue latency. */
   CC_ALG_NOLA = 3,
+
+  /**
+   * TOR_BBR - BBR-style model-based control. Instead of reacting to queue
+   * delay like Vegas, it keeps a windowed maximum of the delivery rate and a
+   * windowed minimum of the RTT, and sets cwnd to a gain-cycled multiple of
+   * their product. Periodic probing above the BDP lets it find capacity on
+   * high-BDP paths, where Vegas' queue-delay signal is too noisy to grow
+   * cwnd to the full BDP. */
+  CC_ALG_BBR = 4,
 } cc_alg_t;
 
 /* Total number of CC algs in cc_alg_t enum */
-#define NUM_CC_ALGS  (CC_ALG_NOLA+1)
+#define NUM_CC_ALGS  (CC_ALG_BBR+1)
 
 /** Signifies how we estimate circuit BDP */
 typedef enum {
@@ -120,6 +129,58 @@ struct nola_params_t {
     uint16_t bdp_overshoot;
 };
 
+/** Number of rounds over which BBR keeps the maximum delivery rate. */
+#define BBR_BW_WINDOW_ROUNDS 10
+
+/** The states of the BBR algorithm. */
+typedef enum {
+  /** Grow cwnd exponentially until the delivery rate stops growing. */
+  BBR_MODE_STARTUP = 0,
+  /** Bring cwnd back to the BDP, to drain the queue made in startup. */
+  BBR_MODE_DRAIN = 1,
+  /** Steady state: cycle cwnd around the BDP to probe for more capacity. */
+  BBR_MODE_PROBE_BW = 2,
+  /** Drop cwnd to its minimum to measure the RTT without our own queue. */
+  BBR_MODE_PROBE_RTT = 3,
+} bbr_mode_t;
+
+/** BBR consensus params, and per-circuit state */
+struct bbr_params_t {
+    /** Gain (percent) of the BDP for cwnd while probing for bandwidth */
+    uint16_t probe_gain_pct;
+    /** Gain (percent) of the BDP for cwnd while draining after a probe */
+    uint16_t drain_gain_pct;
+    /** Growth (percent) of the delivery rate per round that keeps us in
+     * startup */
+    uint16_t startup_growth_pct;
+    /** Rounds without that growth before startup ends */
+    uint8_t startup_rounds;
+    /** How long a minimum RTT stays valid, in msec */
+    uint32_t rtt_window_msec;
+    /** How long we stay at the minimum cwnd to measure the RTT, in msec */
+    uint32_t probe_rtt_msec;
+
+    /** Current state */
+    bbr_mode_t mode;
+    /** Index in the gain cycle, in PROBE_BW */
+    uint8_t cycle_idx;
+    /** Acks left until the current round ends */
+    uint64_t round_acks_left;
+    /** Maximum delivery rate of each recent round, in cells per second */
+    uint64_t round_max_bw[BBR_BW_WINDOW_ROUNDS];
+    /** Index of the current round in round_max_bw */
+    uint8_t round_idx;
+    /** Delivery rate to beat to stay in startup, and how many rounds
+     * haven't beaten it */
+    uint64_t full_bw;
+    uint8_t full_bw_rounds;
+    /** Minimum RTT, in usec, and when we measured it */
+    uint64_t min_rtt_usec;
+    uint64_t min_rtt_at_usec;
+    /** When PROBE_RTT ends, or 0 if inflight hasn't drained yet */
+    uint64_t probe_rtt_done_usec;
+};
+
 /** Fields common to all congestion control algorithms */
 struct congestion_control_t {
   /**
@@ -204,6 +265,7 @@ struct congestion_control_t {
     struct westwood_params_t westwood_params;
     struct vegas_params_t vegas_params;
     struct nola_params_t nola_params;
+    struct bbr_params_t bbr_params;
   };
 };
 
@@ -354,3 +354,11 @@ congestion_control_vegas_process_sendme(congestion_control_t *cc,
 
   return 0;
 }
+
+/** The TOR_VEGAS congestion control algorithm. */
+const congestion_control_alg_t vegas_cc_alg = {
+  .name = "vegas",
+  .default_bdp_alg = BDP_ALG_PIECEWISE,
+  .set_params = congestion_control_vegas_set_params,
+  .process_sendme = congestion_control_vegas_process_sendme,
+};
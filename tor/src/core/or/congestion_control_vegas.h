@@ -11,6 +11,7 @@
 
 #include "core/or/crypt_path_st.h"
 #include "core/or/circuit_st.h"
+#include "core/or/congestion_control_common.h"
 
 /* Processing SENDME cell. */
 int congestion_control_vegas_process_sendme(struct congestion_control_t *cc,
@@ -19,6 +20,8 @@ int congestion_control_vegas_process_sendme(struct congestion_control_t *cc,
 void congestion_control_vegas_set_params(struct congestion_control_t *cc,
                                          cc_path_t path);
 
+extern const congestion_control_alg_t vegas_cc_alg;
+
 /* Private section starts. */
 #ifdef TOR_CONGESTION_CONTROL_VEGAS_PRIVATE
 
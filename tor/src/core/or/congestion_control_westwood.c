@@ -35,8 +35,10 @@
  * Cache westwood consensus parameters.
  */
 void
-congestion_control_westwood_set_params(congestion_control_t *cc)
+congestion_control_westwood_set_params(congestion_control_t *cc,
+                                       cc_path_t path)
 {
+  (void) path;
   tor_assert(cc->cc_alg == CC_ALG_WESTWOOD);
 
   cc->westwood_params.cwnd_backoff_m =
@@ -239,3 +241,11 @@ congestion_control_westwood_process_sendme(congestion_control_t *cc,
 
   return 0;
 }
+
+/** The TOR_WESTWOOD congestion control algorithm. */
+const congestion_control_alg_t westwood_cc_alg = {
+  .name = "westwood",
+  .default_bdp_alg = BDP_ALG_PIECEWISE,
+  .set_params = congestion_control_westwood_set_params,
+  .process_sendme = congestion_control_westwood_process_sendme,
+};
@@ -11,12 +11,16 @@
 
 #include "core/or/crypt_path_st.h"
 #include "core/or/circuit_st.h"
+#include "core/or/congestion_control_common.h"
 
 /* Processing SENDME cell. */
 int congestion_control_westwood_process_sendme(struct congestion_control_t *cc,
                                                const circuit_t *circ,
                                                const crypt_path_t *layer_hint);
-void congestion_control_westwood_set_params(struct congestion_control_t *cc);
+void congestion_control_westwood_set_params(struct congestion_control_t *cc,
+                                            cc_path_t path);
+
+extern const congestion_control_alg_t westwood_cc_alg;
 
 /* Private section starts. */
 #ifdef TOR_CONGESTION_CONTROL_WESTWOOD_PRIVATE
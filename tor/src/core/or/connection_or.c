@@ -469,23 +469,6 @@ cell_pack(packed_cell_t *dst, const cell_t *src, int wide_circ_ids)
   memcpy(dest+1, src->payload, CELL_PAYLOAD_SIZE);
 }
 
-/** Unpack the network-order buffer <b>src</b> into a host-order
- * cell_t structure <b>dest</b>.
- */
-static void
-cell_unpack(cell_t *dest, const char *src, int wide_circ_ids)
-{
-  if (wide_circ_ids) {
-    dest->circ_id = ntohl(get_uint32(src));
-    src += 4;
-  } else {
-    dest->circ_id = ntohs(get_uint16(src));
-    src += 2;
-  }
-  dest->command = get_uint8(src);
-  memcpy(dest->payload, src+1, CELL_PAYLOAD_SIZE);
-}
-
 /** Write the header of <b>cell</b> into the first VAR_CELL_MAX_HEADER_SIZE
  * bytes of <b>hdr_out</b>. Returns number of bytes used. */
 int
@@ -2287,6 +2270,14 @@ connection_or_set_state_open(or_connection_t *conn)
   conn->handshake_state = NULL;
   connection_start_reading(TO_CONN(conn));
 
+  if (get_options()->UseKernelTLS && conn->tls) {
+    int ktls_send, ktls_recv;
+    tor_tls_get_kernel_offload(conn->tls, &ktls_send, &ktls_recv);
+    log_info(LD_OR, "Kernel TLS on %s: send %s, receive %s.",
+             connection_describe(TO_CONN(conn)),
+             ktls_send ? "on" : "off", ktls_recv ? "on" : "off");
+  }
+
   return 0;
 }
 
@@ -2405,12 +2396,11 @@ connection_or_process_cells_from_inbuf(or_connection_t *conn)
       channel_tls_handle_var_cell(var_cell, conn);
       var_cell_free(var_cell);
     } else {
-      const int wide_circ_ids = conn->wide_circ_ids;
-      size_t cell_network_size = get_cell_network_size(conn->wide_circ_ids);
-      char buf[CELL_MAX_NETWORK_SIZE];
       cell_t cell;
-      if (connection_get_inbuf_len(TO_CONN(conn))
-          < cell_network_size) /* whole response available? */
+      /* Decode the cell straight out of the inbuf's chunks into a
+       * host-order cell_t. */
+      if (!fetch_cell_from_buf(conn->base_.inbuf, &cell,
+                               conn->wide_circ_ids))
         return 0; /* not yet */
 
       /* Touch the channel's active timestamp if there is one */
@@ -2418,11 +2408,6 @@ connection_or_process_cells_from_inbuf(or_connection_t *conn)
         channel_timestamp_active(TLS_CHAN_TO_BASE(conn->chan));
 
       circuit_build_times_network_is_live(get_circuit_build_times_mutable());
-      connection_buf_get_bytes(buf, cell_network_size, TO_CONN(conn));
-
-      /* retrieve cell info from buf (create the host-order struct from the
-       * network-order string) */
-      cell_unpack(&cell, buf, wide_circ_ids);
 
       channel_tls_handle_cell(&cell, conn);
     }
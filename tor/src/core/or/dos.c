@@ -23,6 +23,7 @@
 #include "lib/crypt_ops/crypto_rand.h"
 
 #include "core/or/dos.h"
+#include "core/or/dos_sketch.h"
 #include "core/or/dos_sys.h"
 
 #include "core/or/dos_options_st.h"
@@ -73,6 +74,14 @@ static int32_t dos_conn_connect_defense_time_period =
 static uint64_t conn_num_addr_rejected;
 static uint64_t conn_num_addr_connect_rejected;
 
+/* If DoSConnectionSketchSize is set, the fixed-size sketch holding the
+ * per-address connection statistics instead of the geoip client map, and
+ * the size it was allocated for. */
+static dos_conn_sketch_t *conn_sketch = NULL;
+static uint64_t conn_sketch_size = 0;
+
+static void conn_sketch_update(void);
+
 /** Consensus parameter: How many times a client IP is allowed to hit the
  * circ_max_cell_queue_size_out limit before being marked. */
 static uint32_t dos_num_circ_max_outq;
@@ -279,6 +288,7 @@ set_dos_parameters(const networkstatus_t *ns)
   dos_conn_connect_burst = get_param_conn_connect_burst(ns);
   dos_conn_connect_defense_time_period =
     get_param_conn_connect_defense_time_period(ns);
+  conn_sketch_update();
 
   /* Circuit. */
   dos_num_circ_max_outq = get_param_dos_num_circ_max_outq(ns);
@@ -415,15 +425,28 @@ cc_stats_refill_bucket(cc_client_stats_t *stats, const tor_addr_t *addr)
   return;
 }
 
+/* Return the number of concurrent connections of the client address addr,
+ * whose geoip statistics are stats. */
+static uint32_t
+conn_get_concurrent_count(const dos_client_stats_t *stats,
+                          const tor_addr_t *addr)
+{
+  if (conn_sketch) {
+    return dos_conn_sketch_get_concurrent_count(conn_sketch, addr);
+  }
+  return stats->conn_stats.concurrent_count;
+}
+
 /* Return true iff the circuit bucket is down to 0 and the number of
  * concurrent connections is greater or equal the minimum threshold set the
  * consensus parameter. */
 static int
-cc_has_exhausted_circuits(const dos_client_stats_t *stats)
+cc_has_exhausted_circuits(const dos_client_stats_t *stats,
+                          const tor_addr_t *addr)
 {
   tor_assert(stats);
   return stats->cc_stats.circuit_bucket == 0 &&
-         stats->conn_stats.concurrent_count >= dos_cc_min_concurrent_conn;
+         conn_get_concurrent_count(stats, addr) >= dos_cc_min_concurrent_conn;
 }
 
 /* Mark client address by setting a timestamp in the stats object which tells
@@ -479,18 +502,54 @@ cc_channel_addr_is_marked(channel_t *chan)
 
 /* Concurrent connection private API. */
 
+/* Return the timestamp until which a client address detected now should
+ * remain marked. */
+static time_t
+conn_get_marked_until_ts(void)
+{
+  /* We add a random offset of a maximum of half the defense time so it is
+   * less predictable and thus more difficult to game. */
+  return approx_time() + dos_conn_connect_defense_time_period +
+    crypto_rand_int_range(1, dos_conn_connect_defense_time_period / 2);
+}
+
 /* Mark client connection stats by setting a timestamp which tells us until
  * when it is marked as positively detected. */
 static void
 conn_mark_client(conn_client_stats_t *stats)
 {
   tor_assert(stats);
+  stats->marked_until_ts = conn_get_marked_until_ts();
+}
 
-  /* We add a random offset of a maximum of half the defense time so it is
-   * less predictable and thus more difficult to game. */
-  stats->marked_until_ts =
-    approx_time() + dos_conn_connect_defense_time_period +
-    crypto_rand_int_range(1, dos_conn_connect_defense_time_period / 2);
+/* Allocate, resize or free the connection sketch so it matches the
+ * DoSConnectionSketchSize option. A new sketch starts empty: connections
+ * counted in a previous one are forgotten, so closing them must not touch
+ * the new one. */
+static void
+conn_sketch_update(void)
+{
+  const uint64_t size = dos_get_options()->DoSConnectionSketchSize;
+
+  if (size == conn_sketch_size) {
+    return;
+  }
+
+  if (conn_sketch) {
+    SMARTLIST_FOREACH_BEGIN(get_connection_array(), connection_t *, conn) {
+      if (conn->type == CONN_TYPE_OR) {
+        TO_OR_CONN(conn)->tracked_in_dos_sketch = 0;
+      }
+    } SMARTLIST_FOREACH_END(conn);
+    dos_conn_sketch_free(conn_sketch);
+  }
+
+  conn_sketch_size = size;
+  if (size) {
+    conn_sketch = dos_conn_sketch_new((size_t) MIN(size, SIZE_MAX));
+    log_info(LD_DOS, "Tracking client connections in a %" TOR_PRIuSZ
+             " bytes sketch.", dos_conn_sketch_get_allocation(conn_sketch));
+  }
 }
 
 /* Free everything for the connection DoS mitigation subsystem. */
@@ -549,6 +608,33 @@ conn_update_on_connect(conn_client_stats_t *stats, const tor_addr_t *addr)
             token_bucket_ctr_get(&stats->connect_count));
 }
 
+/** Sketch counterpart of conn_update_on_connect(): called when a new client
+ * connection from addr has arrived, with the sketch backend. */
+static void
+conn_sketch_update_on_connect(const tor_addr_t *addr)
+{
+  const uint32_t now = (uint32_t) approx_time();
+  uint32_t connect_level;
+
+  connect_level = dos_conn_sketch_note_connect(conn_sketch, addr, now,
+                                               dos_conn_connect_rate);
+
+  /* The level counts connections the way the token bucket counts spent
+   * tokens: reaching the burst is the same as the bucket running dry. As
+   * with the bucket, don't extend the marking of a marked address. */
+  if (connect_level >= dos_conn_connect_burst &&
+      !dos_conn_sketch_is_marked(conn_sketch, addr, now)) {
+    dos_conn_sketch_mark(conn_sketch, addr,
+                         (uint32_t) conn_get_marked_until_ts());
+  }
+
+  log_debug(LD_DOS, "Client address %s has now at most %u concurrent "
+                    "connections and a connect level of %u.",
+            fmt_addr(addr),
+            dos_conn_sketch_get_concurrent_count(conn_sketch, addr),
+            connect_level);
+}
+
 /** Called when a client connection is closed. The following will update
  * the client connection statistics.
  *
@@ -672,7 +758,7 @@ dos_cc_new_create_cell(channel_t *chan)
 
   /* This is the detection. Assess at every CREATE cell if the client should
    * get marked as malicious. This should be kept as fast as possible. */
-  if (cc_has_exhausted_circuits(&entry->dos_stats)) {
+  if (cc_has_exhausted_circuits(&entry->dos_stats, &addr)) {
     /* If this is the first time we mark this entry, log it.
      * Under heavy DDoS, logging each time we mark would results in lots and
      * lots of logs. */
@@ -730,6 +816,22 @@ dos_conn_addr_get_defense_type(const tor_addr_t *addr)
     goto end;
   }
 
+  /* Same checks as below, on the sketch. Marks expire by themselves there,
+   * so there is nothing to reset. */
+  if (conn_sketch) {
+    if (dos_conn_sketch_is_marked(conn_sketch, addr,
+                                  (uint32_t) approx_time())) {
+      conn_num_addr_connect_rejected++;
+      return dos_conn_defense_type;
+    }
+    if (dos_conn_sketch_get_concurrent_count(conn_sketch, addr) >
+        dos_conn_max_concurrent_count) {
+      conn_num_addr_rejected++;
+      return dos_conn_defense_type;
+    }
+    goto end;
+  }
+
   /* We are only interested in client connection from the geoip cache. */
   entry = geoip_lookup_client(addr, NULL, GEOIP_CLIENT_CONNECT);
   if (entry == NULL) {
@@ -981,6 +1083,13 @@ dos_new_client_conn(or_connection_t *or_conn, const char *transport_name)
     goto end;
   }
 
+  /* With the sketch backend, the geoip cache is not involved. */
+  if (conn_sketch) {
+    conn_sketch_update_on_connect(&TO_CONN(or_conn)->addr);
+    or_conn->tracked_in_dos_sketch = 1;
+    goto end;
+  }
+
   /* We are only interested in client connection from the geoip cache. */
   entry = geoip_lookup_client(&TO_CONN(or_conn)->addr, transport_name,
                               GEOIP_CLIENT_CONNECT);
@@ -1008,6 +1117,12 @@ dos_close_client_conn(const or_connection_t *or_conn)
 
   tor_assert(or_conn);
 
+  /* Same as below for the sketch, which outlives the subsystem being
+   * disabled. The flag is cleared whenever the sketch is replaced. */
+  if (or_conn->tracked_in_dos_sketch && conn_sketch) {
+    dos_conn_sketch_note_close(conn_sketch, &TO_CONN(or_conn)->addr);
+  }
+
   /* We have to decrement the count on tracked connection only even if the
    * subsystem has been disabled at runtime because it might be re-enabled
    * after and we need to keep a synchronized counter at all time. */
@@ -1059,6 +1174,15 @@ dos_enabled(void)
   return dos_is_enabled();
 }
 
+/* Return true iff the DoS mitigation subsystem needs client connections to
+ * be noted in the geoip client map. The circuit creation statistics are
+ * always kept there, the connection statistics only without a sketch. */
+int
+dos_uses_geoip_client_map(void)
+{
+  return dos_cc_enabled || (dos_conn_enabled && !conn_sketch);
+}
+
 /* Free everything from the Denial of Service subsystem. */
 void
 dos_free_all(void)
@@ -1070,6 +1194,8 @@ dos_free_all(void)
   /* Free the connection mitigation subsystem. It is safe to do this even if
    * it wasn't initialized. */
   conn_free_all();
+  dos_conn_sketch_free(conn_sketch);
+  conn_sketch_size = 0;
 }
 
 /* Initialize the Denial of Service subsystem. */
@@ -0,0 +1,238 @@
+/* Copyright (c) 2022, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * @file dos_sketch.c
+ * @brief Fixed-size count-min sketch of per-address connection statistics
+ *        for the DoS mitigation subsystem.
+ *
+ * The geoip client map keeps one entry per client address, so an attacker
+ * spraying connections from many addresses makes it grow without bound. The
+ * sketch instead keeps DOS_CONN_SKETCH_DEPTH rows of a fixed number of
+ * counters: an address maps to one counter per row, using independent keyed
+ * hashes, and its statistics are read as the minimum over its counters.
+ * Collisions can only make an address look busier than it is, never less
+ * busy, and memory and lookup time don't depend on the number of addresses.
+ **/
+
+#include "core/or/or.h"
+#include "core/or/dos_sketch.h"
+
+#include "lib/intmath/bits.h"
+
+/** One counter of a connection sketch. Every field is shared by all the
+ * addresses that hash to this counter in its row. */
+typedef struct dos_conn_sketch_cell_t {
+  /** Number of open connections. */
+  uint32_t concurrent_count;
+  /** Connection rate: incremented on each connection and drained at the
+   * configured rate per second, so it behaves like the connect token bucket
+   * of the geoip backend turned upside down. */
+  uint32_t connect_level;
+  /** When was connect_level last drained? */
+  uint32_t last_connect_ts;
+  /** Until when is this counter marked? */
+  uint32_t marked_until_ts;
+} dos_conn_sketch_cell_t;
+
+/** A connection sketch. */
+struct dos_conn_sketch_t {
+  /** Number of counters per row, minus one. The width is a power of two. */
+  uint32_t width_mask;
+  /** DOS_CONN_SKETCH_DEPTH rows of width_mask + 1 counters, row-major. */
+  dos_conn_sketch_cell_t *cells;
+};
+
+/** Return a new connection sketch using at most <b>max_bytes</b> for its
+ * counters, and never less than DOS_CONN_SKETCH_MIN_WIDTH counters per
+ * row. */
+dos_conn_sketch_t *
+dos_conn_sketch_new(size_t max_bytes)
+{
+  dos_conn_sketch_t *sketch = tor_malloc_zero(sizeof(*sketch));
+  uint64_t width = max_bytes /
+    (DOS_CONN_SKETCH_DEPTH * sizeof(dos_conn_sketch_cell_t));
+
+  if (width < DOS_CONN_SKETCH_MIN_WIDTH)
+    width = DOS_CONN_SKETCH_MIN_WIDTH;
+  if (width > (UINT64_C(1) << 30))
+    width = UINT64_C(1) << 30;
+  /* Round down to a power of two so that rows are indexed with a mask. */
+  width = UINT64_C(1) << tor_log2(width);
+
+  sketch->width_mask = (uint32_t) (width - 1);
+  sketch->cells = tor_calloc(DOS_CONN_SKETCH_DEPTH * width,
+                             sizeof(dos_conn_sketch_cell_t));
+  return sketch;
+}
+
+/** Free all storage held by <b>sketch</b>. */
+void
+dos_conn_sketch_free_(dos_conn_sketch_t *sketch)
+{
+  if (!sketch)
+    return;
+  tor_free(sketch->cells);
+  tor_free(sketch);
+}
+
+/** Return the number of bytes allocated for <b>sketch</b>. */
+size_t
+dos_conn_sketch_get_allocation(const dos_conn_sketch_t *sketch)
+{
+  if (!sketch)
+    return 0;
+  return sizeof(*sketch) + DOS_CONN_SKETCH_DEPTH *
+    ((size_t) sketch->width_mask + 1) * sizeof(dos_conn_sketch_cell_t);
+}
+
+/** Set <b>cells_out</b> to the counters of <b>addr</b> in <b>sketch</b>, one
+ * per row.
+ *
+ * The per-row indices come from a single keyed hash of the address, combined
+ * as h1 + i * h2 for row i. The hash key is secret, so a remote attacker
+ * can't pick addresses that collide with a given client on purpose. */
+static void
+dos_conn_sketch_get_cells(const dos_conn_sketch_t *sketch,
+                          const tor_addr_t *addr,
+                          dos_conn_sketch_cell_t **cells_out)
+{
+  const uint64_t h = tor_addr_hash(addr);
+  const uint32_t h1 = (uint32_t) h;
+  /* An odd step visits a different counter in each row. */
+  const uint32_t h2 = ((uint32_t) (h >> 32)) | 1;
+  const size_t width = (size_t) sketch->width_mask + 1;
+
+  for (int i = 0; i < DOS_CONN_SKETCH_DEPTH; ++i) {
+    const uint32_t idx = (h1 + (uint32_t) i * h2) & sketch->width_mask;
+    cells_out[i] = &sketch->cells[i * width + idx];
+  }
+}
+
+/** Return the connect level of <b>cell</b> at <b>now</b>, once drained at
+ * <b>rate</b> per second since its last connection. */
+static uint32_t
+dos_conn_sketch_cell_drained_level(const dos_conn_sketch_cell_t *cell,
+                                   uint32_t now, uint32_t rate)
+{
+  uint64_t drain;
+
+  /* Our clock jumped backward: forgive, like the token bucket refills fully
+   * in that case. */
+  if (now < cell->last_connect_ts)
+    return 0;
+  drain = (uint64_t) (now - cell->last_connect_ts) * rate;
+  if (drain >= cell->connect_level)
+    return 0;
+  return cell->connect_level - (uint32_t) drain;
+}
+
+/** Note a new connection from <b>addr</b> at <b>now</b> in <b>sketch</b>,
+ * with connect levels draining at <b>rate</b> per second. Return the
+ * estimated connect level of <b>addr</b>, including this connection.
+ *
+ * The connect level uses a conservative update: a counter is only raised up
+ * to the new estimate, which keeps addresses that share a counter with a
+ * busy one from looking busier than needed. */
+uint32_t
+dos_conn_sketch_note_connect(dos_conn_sketch_t *sketch,
+                             const tor_addr_t *addr,
+                             uint32_t now, uint32_t rate)
+{
+  dos_conn_sketch_cell_t *cells[DOS_CONN_SKETCH_DEPTH];
+  uint32_t levels[DOS_CONN_SKETCH_DEPTH];
+  uint32_t estimate = UINT32_MAX;
+
+  tor_assert(sketch);
+  tor_assert(addr);
+
+  dos_conn_sketch_get_cells(sketch, addr, cells);
+  for (int i = 0; i < DOS_CONN_SKETCH_DEPTH; ++i) {
+    levels[i] = dos_conn_sketch_cell_drained_level(cells[i], now, rate);
+    estimate = MIN(estimate, levels[i]);
+  }
+  if (estimate < UINT32_MAX)
+    estimate++;
+
+  for (int i = 0; i < DOS_CONN_SKETCH_DEPTH; ++i) {
+    dos_conn_sketch_cell_t *cell = cells[i];
+    if (cell->concurrent_count < UINT32_MAX)
+      cell->concurrent_count++;
+    cell->connect_level = MAX(levels[i], estimate);
+    cell->last_connect_ts = now;
+  }
+  return estimate;
+}
+
+/** Note that a connection from <b>addr</b>, previously passed to
+ * dos_conn_sketch_note_connect(), was closed. */
+void
+dos_conn_sketch_note_close(dos_conn_sketch_t *sketch, const tor_addr_t *addr)
+{
+  dos_conn_sketch_cell_t *cells[DOS_CONN_SKETCH_DEPTH];
+
+  tor_assert(sketch);
+  tor_assert(addr);
+
+  dos_conn_sketch_get_cells(sketch, addr, cells);
+  for (int i = 0; i < DOS_CONN_SKETCH_DEPTH; ++i) {
+    /* Every close matches a connect, so this can only be zero if the counter
+     * saturated. Stay safe anyway. */
+    if (cells[i]->concurrent_count > 0)
+      cells[i]->concurrent_count--;
+  }
+}
+
+/** Return an upper bound on the number of open connections from
+ * <b>addr</b>. */
+uint32_t
+dos_conn_sketch_get_concurrent_count(const dos_conn_sketch_t *sketch,
+                                     const tor_addr_t *addr)
+{
+  dos_conn_sketch_cell_t *cells[DOS_CONN_SKETCH_DEPTH];
+  uint32_t count = UINT32_MAX;
+
+  tor_assert(sketch);
+  tor_assert(addr);
+
+  dos_conn_sketch_get_cells(sketch, addr, cells);
+  for (int i = 0; i < DOS_CONN_SKETCH_DEPTH; ++i) {
+    count = MIN(count, cells[i]->concurrent_count);
+  }
+  return count;
+}
+
+/** Return true iff <b>addr</b> is marked in <b>sketch</b> at <b>now</b>. An
+ * address is only considered marked if all its counters are. */
+int
+dos_conn_sketch_is_marked(const dos_conn_sketch_t *sketch,
+                          const tor_addr_t *addr, uint32_t now)
+{
+  dos_conn_sketch_cell_t *cells[DOS_CONN_SKETCH_DEPTH];
+
+  tor_assert(sketch);
+  tor_assert(addr);
+
+  dos_conn_sketch_get_cells(sketch, addr, cells);
+  for (int i = 0; i < DOS_CONN_SKETCH_DEPTH; ++i) {
+    if (cells[i]->marked_until_ts < now)
+      return 0;
+  }
+  return 1;
+}
+
+/** Mark <b>addr</b> in <b>sketch</b> until <b>until</b>. */
+void
+dos_conn_sketch_mark(dos_conn_sketch_t *sketch, const tor_addr_t *addr,
+                     uint32_t until)
+{
+  dos_conn_sketch_cell_t *cells[DOS_CONN_SKETCH_DEPTH];
+
+  tor_assert(sketch);
+  tor_assert(addr);
+
+  dos_conn_sketch_get_cells(sketch, addr, cells);
+  for (int i = 0; i < DOS_CONN_SKETCH_DEPTH; ++i) {
+    cells[i]->marked_until_ts = MAX(cells[i]->marked_until_ts, until);
+  }
+}
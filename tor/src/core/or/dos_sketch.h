@@ -0,0 +1,40 @@
+/* Copyright (c) 2022, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * @file dos_sketch.h
+ * @brief Header for core/or/dos_sketch.c
+ **/
+
+#ifndef TOR_CORE_OR_DOS_SKETCH_H
+#define TOR_CORE_OR_DOS_SKETCH_H
+
+#include "lib/net/address.h"
+
+/** How many rows (independent hash functions) a connection sketch has. */
+#define DOS_CONN_SKETCH_DEPTH 4
+/** Smallest number of counters per row of a connection sketch. */
+#define DOS_CONN_SKETCH_MIN_WIDTH 256
+
+typedef struct dos_conn_sketch_t dos_conn_sketch_t;
+
+dos_conn_sketch_t *dos_conn_sketch_new(size_t max_bytes);
+void dos_conn_sketch_free_(dos_conn_sketch_t *sketch);
+#define dos_conn_sketch_free(sketch) \
+  FREE_AND_NULL(dos_conn_sketch_t, dos_conn_sketch_free_, (sketch))
+
+size_t dos_conn_sketch_get_allocation(const dos_conn_sketch_t *sketch);
+
+uint32_t dos_conn_sketch_note_connect(dos_conn_sketch_t *sketch,
+                                      const tor_addr_t *addr,
+                                      uint32_t now, uint32_t rate);
+void dos_conn_sketch_note_close(dos_conn_sketch_t *sketch,
+                                const tor_addr_t *addr);
+uint32_t dos_conn_sketch_get_concurrent_count(const dos_conn_sketch_t *sketch,
+                                              const tor_addr_t *addr);
+int dos_conn_sketch_is_marked(const dos_conn_sketch_t *sketch,
+                              const tor_addr_t *addr, uint32_t now);
+void dos_conn_sketch_mark(dos_conn_sketch_t *sketch, const tor_addr_t *addr,
+                          uint32_t until);
+
+#endif /* !defined(TOR_CORE_OR_DOS_SKETCH_H) */
@@ -84,6 +84,9 @@ struct or_connection_t {
    * geoip cache and handled by the DoS mitigation subsystem. We use this to
    * insure we have a coherent count of concurrent connection. */
   unsigned int tracked_for_dos_mitigation : 1;
+  /** True iff this is a client connection counted in the DoS connection
+   * sketch (DoSConnectionSketchSize), which we must update on close. */
+  unsigned int tracked_in_dos_sketch : 1;
   /** True iff this connection is using a pluggable transport */
   unsigned int is_pt : 1;
 
@@ -1552,6 +1552,273 @@ compare_tor_addr_to_addr_policy,(const tor_addr_t *addr, uint16_t port,
   }
 }
 
+/** A run of ports that share the same first-matching rule at one node of an
+ * addr_policy_matcher_t. */
+typedef struct policy_port_run_t {
+  uint16_t min_port, max_port;
+  /** Index in the original policy of the first rule covering these ports. */
+  int rule_idx;
+} policy_port_run_t;
+
+/** One node of the binary prefix trie inside an addr_policy_matcher_t.  A
+ * node at depth <i>d</i> holds the rules whose mask is exactly <i>d</i> bits
+ * long. */
+typedef struct policy_trie_node_t {
+  struct policy_trie_node_t *child[2];
+  /** Sorted, disjoint port runs for the rules at this node. */
+  policy_port_run_t *runs;
+  int n_runs;
+  /** Build-time only: indices of the rules at this node, in policy order. */
+  int *rules;
+  int n_rules;
+} policy_trie_node_t;
+
+/** An immutable, compiled form of an address policy, answering the same
+ * question as compare_known_tor_addr_to_addr_policy() in time proportional
+ * to the number of address bits rather than the number of rules.
+ *
+ * Each rule lands at the trie node named by its address prefix.  A lookup
+ * walks the path for the target address, and at each node binary-searches
+ * for the earliest rule covering the port; the smallest rule index along the
+ * path is the rule the linear walk would have hit first. */
+struct addr_policy_matcher_t {
+  policy_trie_node_t *root4;
+  policy_trie_node_t *root6;
+  /** For every rule in the compiled policy, true iff it is an accept. */
+  uint8_t *rule_accepts;
+  int n_rules;
+};
+
+/** Return bit <b>idx</b> (counting from the most significant bit of the
+ * first byte) of the big-endian address in <b>bytes</b>. */
+static inline int
+policy_addr_bit(const uint8_t *bytes, int idx)
+{
+  return (bytes[idx >> 3] >> (7 - (idx & 7))) & 1;
+}
+
+/** Store the big-endian bytes of the IPv4 or IPv6 address <b>addr</b> in
+ * <b>out</b>, and return its length in bits.  Return -1 for any other
+ * family. */
+static int
+policy_addr_get_bits(const tor_addr_t *addr, uint8_t *out)
+{
+  switch (tor_addr_family(addr)) {
+    case AF_INET:
+      set_uint32(out, tor_addr_to_ipv4n(addr));
+      return 32;
+    case AF_INET6:
+      memcpy(out, tor_addr_to_in6_addr8(addr), 16);
+      return 128;
+    default:
+      return -1;
+  }
+}
+
+/** Helper for qsort: compare two uint32_t port edges. */
+static int
+compare_uint32_(const void *x, const void *y)
+{
+  const uint32_t a = *(const uint32_t *)x, b = *(const uint32_t *)y;
+  return (a > b) - (a < b);
+}
+
+/** Turn the build-time rule list of <b>node</b> into its sorted port runs,
+ * using the rules of <b>policy</b>. */
+static void
+policy_trie_node_compile(policy_trie_node_t *node, const smartlist_t *policy)
+{
+  uint32_t *edges;
+  int n_edges = 0, i, j;
+
+  if (!node->n_rules)
+    return;
+
+  /* Every rule's port range starts and ends a segment; between two adjacent
+   * edges, every rule either covers all ports or none. */
+  edges = tor_calloc(node->n_rules * 2, sizeof(uint32_t));
+  for (i = 0; i < node->n_rules; ++i) {
+    const addr_policy_t *p = smartlist_get(policy, node->rules[i]);
+    edges[n_edges++] = p->prt_min;
+    edges[n_edges++] = (uint32_t)p->prt_max + 1;
+  }
+  qsort(edges, n_edges, sizeof(uint32_t), compare_uint32_);
+
+  node->runs = tor_calloc(n_edges, sizeof(policy_port_run_t));
+  for (i = 0; i + 1 < n_edges; ++i) {
+    uint32_t lo = edges[i], hi = edges[i+1] - 1;
+    if (edges[i] == edges[i+1])
+      continue;
+    /* Rules are stored in policy order, so the first hit is the earliest. */
+    for (j = 0; j < node->n_rules; ++j) {
+      const addr_policy_t *p = smartlist_get(policy, node->rules[j]);
+      if (p->prt_min <= lo && hi <= p->prt_max)
+        break;
+    }
+    if (j == node->n_rules)
+      continue;
+    if (node->n_runs &&
+        node->runs[node->n_runs-1].rule_idx == node->rules[j] &&
+        node->runs[node->n_runs-1].max_port + 1 == (int)lo) {
+      node->runs[node->n_runs-1].max_port = hi;
+    } else {
+      node->runs[node->n_runs].min_port = lo;
+      node->runs[node->n_runs].max_port = hi;
+      node->runs[node->n_runs].rule_idx = node->rules[j];
+      ++node->n_runs;
+    }
+  }
+  tor_free(edges);
+  tor_free(node->rules);
+  node->n_rules = 0;
+}
+
+/** Compile <b>node</b> and all of its descendants. */
+static void
+policy_trie_compile(policy_trie_node_t *node, const smartlist_t *policy)
+{
+  if (!node)
+    return;
+  policy_trie_node_compile(node, policy);
+  policy_trie_compile(node->child[0], policy);
+  policy_trie_compile(node->child[1], policy);
+}
+
+/** Release all storage held by <b>node</b> and its descendants. */
+static void
+policy_trie_free(policy_trie_node_t *node)
+{
+  if (!node)
+    return;
+  policy_trie_free(node->child[0]);
+  policy_trie_free(node->child[1]);
+  tor_free(node->runs);
+  tor_free(node->rules);
+  tor_free(node);
+}
+
+/** Return the index of the earliest rule at <b>node</b> covering
+ * <b>port</b>, or INT_MAX if there is none. */
+static inline int
+policy_trie_node_lookup(const policy_trie_node_t *node, uint16_t port)
+{
+  int lo = 0, hi = node->n_runs - 1;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    const policy_port_run_t *r = &node->runs[mid];
+    if (port < r->min_port)
+      hi = mid - 1;
+    else if (port > r->max_port)
+      lo = mid + 1;
+    else
+      return r->rule_idx;
+  }
+  return INT_MAX;
+}
+
+/** Compile the address policy <b>policy</b> into a new
+ * addr_policy_matcher_t.  The matcher does not reference <b>policy</b>
+ * after this function returns. */
+addr_policy_matcher_t *
+addr_policy_matcher_new(const smartlist_t *policy)
+{
+  addr_policy_matcher_t *m = tor_malloc_zero(sizeof(addr_policy_matcher_t));
+  m->root4 = tor_malloc_zero(sizeof(policy_trie_node_t));
+  m->root6 = tor_malloc_zero(sizeof(policy_trie_node_t));
+
+  if (policy) {
+    m->n_rules = smartlist_len(policy);
+    m->rule_accepts = tor_malloc_zero(m->n_rules ? m->n_rules : 1);
+  }
+
+  for (int idx = 0; idx < m->n_rules; ++idx) {
+    const addr_policy_t *p = smartlist_get(policy, idx);
+    policy_trie_node_t *node;
+    uint8_t bytes[16];
+    int nbits = policy_addr_get_bits(&p->addr, bytes);
+
+    m->rule_accepts[idx] = (p->policy_type == ADDR_POLICY_ACCEPT);
+    if (nbits < 0) {
+      /* Only matches AF_UNSPEC addresses, which we never look up here. */
+      continue;
+    }
+    node = (nbits == 32) ? m->root4 : m->root6;
+    for (int depth = 0; depth < MIN((int)p->maskbits, nbits); ++depth) {
+      int bit = policy_addr_bit(bytes, depth);
+      if (!node->child[bit])
+        node->child[bit] = tor_malloc_zero(sizeof(policy_trie_node_t));
+      node = node->child[bit];
+    }
+    node->rules = tor_reallocarray(node->rules, node->n_rules + 1,
+                                   sizeof(int));
+    node->rules[node->n_rules++] = idx;
+  }
+
+  policy_trie_compile(m->root4, policy);
+  policy_trie_compile(m->root6, policy);
+  return m;
+}
+
+/** Release all storage held by <b>m</b>. */
+void
+addr_policy_matcher_free_(addr_policy_matcher_t *m)
+{
+  if (!m)
+    return;
+  policy_trie_free(m->root4);
+  policy_trie_free(m->root6);
+  tor_free(m->rule_accepts);
+  tor_free(m);
+}
+
+/** Decide whether the non-null IPv4 or IPv6 address <b>addr</b> and nonzero
+ * port <b>port</b> are accepted or rejected by the compiled policy <b>m</b>.
+ * Gives the same answer as compare_tor_addr_to_addr_policy() on the policy
+ * that <b>m</b> was compiled from. */
+addr_policy_result_t
+addr_policy_matcher_lookup(const addr_policy_matcher_t *m,
+                           const tor_addr_t *addr, uint16_t port)
+{
+  const policy_trie_node_t *node;
+  uint8_t bytes[16];
+  int nbits, best = INT_MAX;
+
+  tor_assert(port != 0);
+  nbits = policy_addr_get_bits(addr, bytes);
+  tor_assert(nbits > 0);
+
+  node = (nbits == 32) ? m->root4 : m->root6;
+  for (int depth = 0; node; ++depth) {
+    int idx = policy_trie_node_lookup(node, port);
+    if (idx < best)
+      best = idx;
+    if (depth == nbits)
+      break;
+    node = node->child[policy_addr_bit(bytes, depth)];
+  }
+
+  if (best == INT_MAX)
+    return ADDR_POLICY_ACCEPTED; /* accept all by default. */
+  return m->rule_accepts[best] ? ADDR_POLICY_ACCEPTED : ADDR_POLICY_REJECTED;
+}
+
+/** As compare_tor_addr_to_addr_policy(), but use the compiled form
+ * <b>matcher</b> of <b>policy</b>, if there is one, whenever both the
+ * address and the port are known. */
+addr_policy_result_t
+compare_tor_addr_to_compiled_policy(const tor_addr_t *addr, uint16_t port,
+                                    const smartlist_t *policy,
+                                    const addr_policy_matcher_t *matcher)
+{
+  if (matcher && policy && addr && port &&
+      (tor_addr_family(addr) == AF_INET ||
+       tor_addr_family(addr) == AF_INET6) &&
+      !tor_addr_is_null(addr)) {
+    return addr_policy_matcher_lookup(matcher, addr, port);
+  }
+  return compare_tor_addr_to_addr_policy(addr, port, policy);
+}
+
 /** Return true iff the address policy <b>a</b> covers every case that
  * would be covered by <b>b</b>, so that a,b is redundant. */
 static int
@@ -2194,6 +2461,7 @@ void
 policies_set_node_exitpolicy_to_reject_all(node_t *node)
 {
   node->rejects_all = 1;
+  nodelist_note_exit_policy_changed(node);
 }
 
 /** Return 1 if there is at least one /8 subnet in <b>policy</b> that
@@ -2793,6 +3061,13 @@ parse_short_policy(const char *summary)
   result->is_accept = is_accept;
   result->n_entries = n_entries;
   memcpy(result->entries, entries, sizeof(short_policy_entry_t)*n_entries);
+  result->entries_sorted = 1;
+  for (int i = 1; i < n_entries; ++i) {
+    if (entries[i].min_port <= entries[i-1].max_port) {
+      result->entries_sorted = 0;
+      break;
+    }
+  }
   return result;
 
  bad_ent:
@@ -2855,11 +3130,29 @@ compare_tor_addr_to_short_policy(const tor_addr_t *addr, uint16_t port,
       (tor_addr_is_internal(addr, 0) || tor_addr_is_loopback(addr)))
     return ADDR_POLICY_REJECTED;
 
-  for (i=0; i < policy->n_entries; ++i) {
-    const short_policy_entry_t *e = &policy->entries[i];
-    if (e->min_port <= port && port <= e->max_port) {
-      found_match = 1;
-      break;
+  if (policy->entries_sorted) {
+    /* Summaries we generate ourselves, and those in the consensus, are
+     * always sorted; look the port up directly. */
+    int lo = 0, hi = policy->n_entries - 1;
+    while (lo <= hi) {
+      int mid = (lo + hi) / 2;
+      const short_policy_entry_t *e = &policy->entries[mid];
+      if (port < e->min_port) {
+        hi = mid - 1;
+      } else if (port > e->max_port) {
+        lo = mid + 1;
+      } else {
+        found_match = 1;
+        break;
+      }
+    }
+  } else {
+    for (i=0; i < policy->n_entries; ++i) {
+      const short_policy_entry_t *e = &policy->entries[i];
+      if (e->min_port <= port && port <= e->max_port) {
+        found_match = 1;
+        break;
+      }
     }
   }
 
@@ -2923,7 +3216,15 @@ compare_tor_addr_to_node_policy(const tor_addr_t *addr, uint16_t port,
   }
 
   if (node->ri) {
-    return compare_tor_addr_to_addr_policy(addr, port, node->ri->exit_policy);
+    routerinfo_t *ri = node->ri;
+    /* Most parsed descriptors are never asked about; only compile the
+     * policy once somebody actually looks up an address in it. */
+    if (!ri->exit_policy_matcher && ri->exit_policy && addr && port &&
+        tor_addr_family(addr) == AF_INET && !tor_addr_is_null(addr)) {
+      ri->exit_policy_matcher = addr_policy_matcher_new(ri->exit_policy);
+    }
+    return compare_tor_addr_to_compiled_policy(addr, port, ri->exit_policy,
+                                               ri->exit_policy_matcher);
   } else if (node->md) {
     if (node->md->exit_policy == NULL)
       return ADDR_POLICY_REJECTED;
@@ -58,8 +58,11 @@ typedef struct short_policy_t {
   /** True if the members of 'entries' are port ranges to accept; false if
    * they are port ranges to reject */
   unsigned int is_accept : 1;
+  /** True if 'entries' are in ascending order and do not overlap, so that
+   * they can be binary-searched. */
+  unsigned int entries_sorted : 1;
   /** The actual number of values in 'entries'. */
-  unsigned int n_entries : 31;
+  unsigned int n_entries : 30;
   /** An array of 0 or more short_policy_entry_t values, each describing a
    * range of ports that this policy accepts or rejects (depending on the
    * value of is_accept).
@@ -120,6 +123,19 @@ MOCK_DECL(addr_policy_result_t, compare_tor_addr_to_addr_policy,
 addr_policy_result_t compare_tor_addr_to_node_policy(const tor_addr_t *addr,
                               uint16_t port, const node_t *node);
 
+typedef struct addr_policy_matcher_t addr_policy_matcher_t;
+addr_policy_matcher_t *addr_policy_matcher_new(const smartlist_t *policy);
+void addr_policy_matcher_free_(addr_policy_matcher_t *m);
+#define addr_policy_matcher_free(m) \
+  FREE_AND_NULL(addr_policy_matcher_t, addr_policy_matcher_free_, (m))
+addr_policy_result_t addr_policy_matcher_lookup(
+                          const addr_policy_matcher_t *m,
+                          const tor_addr_t *addr, uint16_t port);
+addr_policy_result_t compare_tor_addr_to_compiled_policy(
+                          const tor_addr_t *addr, uint16_t port,
+                          const smartlist_t *policy,
+                          const addr_policy_matcher_t *matcher);
+
 int policies_parse_exit_policy_from_options(
                                           const or_options_t *or_options,
                                           const tor_addr_t *ipv4_local_address,
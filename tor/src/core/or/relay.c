@@ -118,6 +118,9 @@ static int circuit_resume_edge_reading_helper(edge_connection_t *conn,
 static int circuit_consider_stop_edge_reading(circuit_t *circ,
                                               crypt_path_t *layer_hint);
 static int circuit_queue_streams_are_blocked(circuit_t *circ);
+static int connection_exit_package_bulk(edge_connection_t *conn,
+                                        or_circuit_t *or_circ, int max_cells,
+                                        int *n_packaged_out);
 static void adjust_exit_policy_from_exitpolicy_failure(origin_circuit_t *circ,
                                                   entry_connection_t *conn,
                                                   node_t *node,
@@ -2210,6 +2213,15 @@ connection_edge_get_inbuf_bytes_to_package(size_t n_available,
   return package_length;
 }
 
+/** Package data from an exit stream's inbuf with
+ * connection_exit_package_bulk() once it holds at least this many cells'
+ * worth of it. */
+#define BULK_PACKAGE_MIN_CELLS 4
+/** Never package more than this many cells in one batch with
+ * connection_exit_package_bulk(), so that the OOM handler and the circuitmux
+ * hear about them soon enough. */
+#define BULK_PACKAGE_MAX_CELLS 64
+
 /** If <b>conn</b> has an entire relay payload of bytes on its inbuf (or
  * <b>package_partial</b> is true), and the appropriate package windows aren't
  * empty, grab a cell and send it down the circuit.
@@ -2282,6 +2294,25 @@ connection_edge_package_raw_inbuf(edge_connection_t *conn, int package_partial,
     bytes_to_process = connection_get_inbuf_len(TO_CONN(conn));
   }
 
+  /* An exit relaying a bulk download usually has many cells' worth of data
+   * waiting: package them as a batch. */
+  if (conn->base_.type == CONN_TYPE_EXIT && !TO_CONN(conn)->linked &&
+      !CIRCUIT_IS_ORIGIN(circ) &&
+      bytes_to_process >= RELAY_PAYLOAD_SIZE * BULK_PACKAGE_MIN_CELLS) {
+    const int batch_max = max_cells ? *max_cells : INT_MAX;
+    int n_packaged = 0;
+    const int r = connection_exit_package_bulk(conn, TO_OR_CIRCUIT(circ),
+                                               batch_max, &n_packaged);
+    if (r < 0)
+      return -1;
+    if (max_cells)
+      *max_cells -= n_packaged;
+    if (r > 0 || (max_cells && *max_cells <= 0))
+      return 0;
+    if (n_packaged)
+      goto repeat_connection_edge_package_raw_inbuf;
+  }
+
   length = connection_edge_get_inbuf_bytes_to_package(bytes_to_process,
                                                       package_partial, circ);
   if (!length)
@@ -2806,6 +2837,11 @@ cell_queues_check_size(void)
       /* Note this overload down */
       rep_hist_note_overload(OVERLOAD_GENERAL);
 
+      /* Spare chunks on the buffer freelists don't count against
+       * MaxMemInQueues, but they are the cheapest memory we can give back:
+       * nobody is using them. */
+      buf_shrink_freelists(1);
+
       /* If we're spending over 20% of the memory limit on hidden service
        * descriptors, free them until we're down to 10%. Do the same for geoip
        * client cache. */
@@ -3325,6 +3361,119 @@ append_cell_to_circuit_queue(circuit_t *circ, channel_t *chan,
   scheduler_channel_has_waiting_cells(chan);
 }
 
+/** Package up to <b>max_cells</b> RELAY_DATA cells from the inbuf of the exit
+ * stream <b>conn</b>, and queue them on <b>or_circ</b> toward the client. Only
+ * full payloads are packaged. Set *<b>n_packaged_out</b> to the number of
+ * cells queued.
+ *
+ * This does what connection_edge_send_command() and
+ * append_cell_to_circuit_queue() would do for each cell, except that each
+ * payload goes straight from the inbuf into the cell, and that the OOM
+ * handler, the circuitmux and the scheduler only hear about the batch once
+ * it's queued.
+ *
+ * Return -1 if <b>conn</b> should be marked for close, 1 if we should stop
+ * packaging its data for now, and 0 otherwise.
+ *
+ * This function is part of the fast path. */
+static int
+connection_exit_package_bulk(edge_connection_t *conn, or_circuit_t *or_circ,
+                             int max_cells, int *n_packaged_out)
+{
+  circuit_t *circ = TO_CIRCUIT(or_circ);
+  channel_t *chan = or_circ->p_chan;
+  cell_queue_t *queue = &or_circ->p_chan_cells;
+  const int streams_blocked = circ->streams_blocked_on_p_chan;
+  int n_packaged = 0;
+  int result = 0;
+  cell_t cell;
+
+  *n_packaged_out = 0;
+  if (circ->marked_for_close || !chan)
+    return 0;
+
+  /* Leave full queues to append_cell_to_circuit_queue(), which knows what to
+   * do about them. */
+  max_cells = MIN(max_cells, BULK_PACKAGE_MAX_CELLS);
+  max_cells = MIN(max_cells, max_circuit_cell_queue_size - queue->n);
+
+  memset(&cell, 0, sizeof(cell));
+  cell.command = CELL_RELAY;
+  cell.circ_id = or_circ->p_circ_id;
+
+  while (n_packaged < max_cells) {
+    relay_header_t rh;
+    size_t length;
+
+    if (congestion_control_get_package_window(circ, NULL) <= 0 ||
+        conn->package_window <= 0)
+      break;
+    length = connection_edge_get_inbuf_bytes_to_package(
+                           connection_get_inbuf_len(TO_CONN(conn)), 0, circ);
+    if (!length)
+      break;
+
+    stats_n_data_bytes_packaged += length;
+    stats_n_data_cells_packaged += 1;
+
+    memset(&rh, 0, sizeof(rh));
+    rh.command = RELAY_COMMAND_DATA;
+    rh.stream_id = conn->stream_id;
+    rh.length = length;
+    relay_header_pack(cell.payload, &rh);
+    connection_buf_get_bytes((char *) cell.payload + RELAY_HEADER_SIZE,
+                             length, TO_CONN(conn));
+    /* We reuse the cell: clear what the previous one left after the data. */
+    memset(cell.payload + RELAY_HEADER_SIZE + length, 0,
+           CELL_PAYLOAD_SIZE - RELAY_HEADER_SIZE - length);
+    pad_cell_payload(cell.payload, length);
+
+    circpad_deliver_sent_relay_cell_events(circ, RELAY_COMMAND_DATA);
+    relay_encrypt_cell_inbound(&cell, or_circ);
+    ++stats_n_relay_cells_relayed;
+    cell_queue_append_packed_copy(circ, queue, 0, &cell,
+                                  chan->wide_circ_ids, 1);
+    sendme_record_cell_digest_on_circ(circ, NULL);
+    ++n_packaged;
+
+    if (sendme_note_circuit_data_packaged(circ, NULL) < 0) {
+      log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
+             "Circuit package window is below 0. Closing circuit.");
+      conn->end_reason = END_STREAM_REASON_TORPROTOCOL;
+      result = -1;
+      break;
+    }
+    if (sendme_note_stream_data_packaged(conn, length) < 0) {
+      connection_stop_reading(TO_CONN(conn));
+      log_debug(LD_EXIT, "conn->package_window reached 0.");
+      circuit_consider_stop_edge_reading(circ, NULL);
+      result = 1;
+      break;
+    }
+  }
+
+  *n_packaged_out = n_packaged;
+  if (!n_packaged)
+    return result;
+
+  /* Check and run the OOM if needed. */
+  if (PREDICT_UNLIKELY(cell_queues_check_size())) {
+    /* We ran the OOM handler which might have closed this circuit. */
+    if (circ->marked_for_close)
+      return result ? result : 1;
+  }
+
+  if (!streams_blocked &&
+      queue->n + or_circ->p_delay_queue.n >= cell_queue_highwatermark())
+    set_streams_blocked_on_circ(circ, chan, 1, 0); /* block streams */
+  if (streams_blocked)
+    set_streams_blocked_on_circ(circ, chan, 1, conn->stream_id);
+
+  update_circuit_on_cmux(circ, CELL_DIRECTION_IN);
+  scheduler_channel_has_waiting_cells(chan);
+  return result;
+}
+
 /** Append an encoded value of <b>addr</b> to <b>payload_out</b>, which must
  * have at least 18 bytes of free space.  The encoding is, as specified in
  * tor-spec.txt:
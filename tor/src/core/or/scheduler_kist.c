@@ -326,9 +326,9 @@ update_socket_info_impl, (socket_table_ent_t *ent))
 
 /* Given a socket that isn't in the table, add it.
  * Given a socket that is in the table, re-init values that need init-ing
- * every scheduling run
+ * every scheduling run. Return the socket's table entry.
  */
-static void
+static socket_table_ent_t *
 init_socket_info(socket_table_t *table, const channel_t *chan)
 {
   socket_table_ent_t *ent = NULL;
@@ -341,6 +341,7 @@ init_socket_info(socket_table_t *table, const channel_t *chan)
     HT_INSERT(socket_table_s, table, ent);
   }
   ent->written = 0;
+  return ent;
 }
 
 /* Add chan to the outbuf table if it isn't already in it. If it is, then don't
@@ -385,13 +386,13 @@ set_scheduler_run_interval(void)
   }
 }
 
-/* Return true iff the channel hasn't hit its kist-imposed write limit yet */
-static int
-socket_can_write(socket_table_t *table, const channel_t *chan)
+/* Return true iff the channel of the socket table entry ent hasn't hit its
+ * kist-imposed write limit yet. A NULL ent means we have no information on
+ * the socket so kist doesn't limit it. */
+static inline int
+socket_can_write(const socket_table_ent_t *ent)
 {
-  socket_table_ent_t *ent = NULL;
-  ent = socket_table_search(table, chan);
-  if (SCHED_BUG(!ent, chan)) {
+  if (!ent) {
     return 1; // Just return true, saying that kist wouldn't limit the socket
   }
 
@@ -405,15 +406,11 @@ socket_can_write(socket_table_t *table, const channel_t *chan)
   return kist_limit_space > 0;
 }
 
-/* Update the channel's socket kernel information. */
+/* Update the kernel information of the socket table entry ent. */
 static void
-update_socket_info(socket_table_t *table, const channel_t *chan)
+update_socket_info(socket_table_ent_t *ent)
 {
-  socket_table_ent_t *ent = NULL;
-  ent = socket_table_search(table, chan);
-  if (SCHED_BUG(!ent, chan)) {
-    return; // Whelp. Entry didn't exist for some reason so nothing to do.
-  }
+  tor_assert(ent);
   update_socket_info_impl(ent);
   log_debug(LD_SCHED, "chan=%" PRIu64 " updated socket info, limit: %" PRIu64
                       ", cwnd: %" PRIu32 ", unacked: %" PRIu32
@@ -422,18 +419,18 @@ update_socket_info(socket_table_t *table, const channel_t *chan)
             ent->notsent, ent->mss);
 }
 
-/* Increment the channel's socket written value by the number of bytes. */
+/* Increment the written value of the socket table entry ent by the number
+ * of bytes. */
 static void
-update_socket_written(socket_table_t *table, channel_t *chan, size_t bytes)
+update_socket_written(socket_table_ent_t *ent, size_t bytes)
 {
-  socket_table_ent_t *ent = NULL;
-  ent = socket_table_search(table, chan);
-  if (SCHED_BUG(!ent, chan)) {
+  if (!ent) {
     return; // Whelp. Entry didn't exist so nothing to do.
   }
 
   log_debug(LD_SCHED, "chan=%" PRIu64 " wrote %lu bytes, old was %" PRIi64,
-            chan->global_identifier, (unsigned long) bytes, ent->written);
+            ent->chan->global_identifier, (unsigned long) bytes,
+            ent->written);
 
   ent->written += bytes;
 }
@@ -596,6 +593,7 @@ kist_scheduler_run(void)
 {
   /* Define variables */
   channel_t *chan = NULL; // current working channel
+  socket_table_ent_t *ent = NULL; // socket table entry of chan
   /* The last distinct chan served in a sched loop. */
   channel_t *prev_chan = NULL;
   int flush_result; // temporarily store results from flush calls
@@ -607,8 +605,7 @@ kist_scheduler_run(void)
 
   /* For each pending channel, collect new kernel information */
   SMARTLIST_FOREACH_BEGIN(cp, const channel_t *, pchan) {
-      init_socket_info(&socket_table, pchan);
-      update_socket_info(&socket_table, pchan);
+      update_socket_info(init_socket_info(&socket_table, pchan));
   } SMARTLIST_FOREACH_END(pchan);
 
   log_debug(LD_SCHED, "Running the scheduler. %d channels pending",
@@ -626,6 +623,11 @@ kist_scheduler_run(void)
       continue;
     }
     outbuf_table_add(&outbuf_table, chan);
+    /* Look the socket up once: the entry lives as long as the channel does,
+     * and every write limit check below for this channel uses it. Without
+     * an entry, kist doesn't limit the socket. */
+    ent = socket_table_search(&socket_table, chan);
+    (void) SCHED_BUG(!ent, chan);
 
     /* if we have switched to a new channel, consider writing the previous
      * channel's outbuf to the kernel. */
@@ -641,7 +643,7 @@ kist_scheduler_run(void)
     }
 
     /* Only flush and write if the per-socket limit hasn't been hit */
-    if (socket_can_write(&socket_table, chan)) {
+    if (socket_can_write(ent)) {
       /* flush to channel queue/outbuf */
       flush_result = (int)channel_flush_some_cells(chan, 1); // 1 for num cells
       /* XXX: While flushing cells, it is possible that the connection write
@@ -658,7 +660,7 @@ kist_scheduler_run(void)
       }
       /* flush_result has the # cells flushed */
       if (flush_result > 0) {
-        update_socket_written(&socket_table, chan, flush_result *
+        update_socket_written(ent, flush_result *
                               (CELL_MAX_NETWORK_SIZE + TLS_PER_CELL_OVERHEAD));
       } else {
         /* XXX: This can happen because tor sometimes does flush in an
@@ -681,8 +683,7 @@ kist_scheduler_run(void)
 
     /* Decide what to do with the channel now */
 
-    if (!channel_more_to_flush(chan) &&
-        !socket_can_write(&socket_table, chan)) {
+    if (!channel_more_to_flush(chan) && !socket_can_write(ent)) {
 
       /* Case 1: no more cells to send, and cannot write */
 
@@ -707,7 +708,7 @@ kist_scheduler_run(void)
       /* Case 2: no more cells to send, but still open for writes */
 
       scheduler_set_channel_state(chan, SCHED_CHAN_WAITING_FOR_CELLS);
-    } else if (!socket_can_write(&socket_table, chan)) {
+    } else if (!socket_can_write(ent)) {
 
       /* Case 3: cells to send, but cannot write */
 
@@ -745,18 +746,16 @@ kist_scheduler_run(void)
             smartlist_len(cp),
             (to_readd ? smartlist_len(to_readd) : -1));
 
-  /* Re-add any channels we need to */
+  /* Re-add any channels we need to. A channel is in channels_pending iff its
+   * sched_heap_idx is set, so that is all we need to check: scanning the
+   * pending list for each channel would make this loop quadratic in the
+   * number of channels. */
   if (to_readd) {
     SMARTLIST_FOREACH_BEGIN(to_readd, channel_t *, readd_chan) {
       scheduler_set_channel_state(readd_chan, SCHED_CHAN_PENDING);
-      if (!smartlist_contains(cp, readd_chan)) {
-        if (!SCHED_BUG(readd_chan->sched_heap_idx != -1, readd_chan)) {
-          /* XXXX Note that the check above is in theory redundant with
-           * the smartlist_contains check.  But let's make sure we're
-           * not messing anything up, and leave them both for now. */
-          smartlist_pqueue_add(cp, scheduler_compare_channels,
+      if (readd_chan->sched_heap_idx == -1) {
+        smartlist_pqueue_add(cp, scheduler_compare_channels,
                              offsetof(channel_t, sched_heap_idx), readd_chan);
-        }
       }
     } SMARTLIST_FOREACH_END(readd_chan);
     smartlist_free(to_readd);
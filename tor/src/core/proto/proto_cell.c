@@ -8,8 +8,6 @@
  * @file proto_cell.c
  * @brief Decodes Tor cells from buffers.
  **/
-/* Right now it only handles variable-length cells, but eventually
- * we should refactor other cell-reading code into here. */
 
 #include "core/or/or.h"
 #include "lib/buf/buffers.h"
@@ -17,6 +15,7 @@
 
 #include "core/or/connection_or.h"
 
+#include "core/or/cell_st.h"
 #include "core/or/var_cell_st.h"
 
 /** True iff the cell command <b>command</b> is one that implies a
@@ -90,3 +89,30 @@ fetch_var_cell_from_buf(buf_t *buf, var_cell_t **out, int linkproto)
   *out = result;
   return 1;
 }
+
+/** Check <b>buf</b> for a fixed-length cell using <b>wide_circ_ids</b>-sized
+ * circuit IDs.  If a whole cell is there, pull it off the buffer into
+ * *<b>out</b> and return 1.  Otherwise leave the buffer alone and return 0.
+ *
+ * The payload is copied straight from the buffer's chunks into
+ * <b>out</b>, without going through an intermediate wire-format copy. */
+int
+fetch_cell_from_buf(buf_t *buf, cell_t *out, int wide_circ_ids)
+{
+  char hdr[4 + 1];
+  const int circ_id_len = get_circ_id_size(wide_circ_ids);
+  const size_t header_len = circ_id_len + 1;
+
+  if (buf_datalen(buf) < header_len + CELL_PAYLOAD_SIZE)
+    return 0;
+
+  buf_get_bytes(buf, hdr, header_len);
+  if (wide_circ_ids)
+    out->circ_id = ntohl(get_uint32(hdr));
+  else
+    out->circ_id = ntohs(get_uint16(hdr));
+  out->command = get_uint8(hdr + circ_id_len);
+
+  buf_get_bytes(buf, (char *) out->payload, CELL_PAYLOAD_SIZE);
+  return 1;
+}
@@ -13,9 +13,12 @@
 #define TOR_PROTO_CELL_H
 
 struct buf_t;
+struct cell_t;
 struct var_cell_t;
 
 int fetch_var_cell_from_buf(struct buf_t *buf, struct var_cell_t **out,
                             int linkproto);
+int fetch_cell_from_buf(struct buf_t *buf, struct cell_t *out,
+                        int wide_circ_ids);
 
 #endif /* !defined(TOR_PROTO_CELL_H) */
@@ -8,6 +8,7 @@
 #include "core/or/or.h"
 #include "app/config/config.h"
 #include "app/config/resolve_addr.h"
+#include "core/mainloop/cpuworker.h"
 #include "core/or/policies.h"
 #include "core/or/protover.h"
 #include "core/or/tor_version_st.h"
@@ -64,6 +65,7 @@
 #include "lib/container/order.h"
 #include "lib/encoding/confline.h"
 #include "lib/crypt_ops/crypto_format.h"
+#include "lib/thread/threads.h"
 
 /* Algorithm to use for the bandwidth file digest. */
 #define DIGEST_ALG_BW_FILE DIGEST_SHA256
@@ -735,10 +737,14 @@ compute_routerstatus_consensus(smartlist_t *votes, int consensus_method,
     most_alt_orport = smartlist_get_most_frequent(alt_orports,
                                                   compare_orports_);
     if (most_alt_orport) {
+      /* Not fmt_addrport(): we may be running on a cpuworker. */
+      char addr_buf[TOR_ADDR_BUF_LEN];
       memcpy(best_alt_orport_out, most_alt_orport, sizeof(tor_addr_port_t));
-      log_debug(LD_DIR, "\"a\" line winner for %s is %s",
-                most->status.nickname,
-                fmt_addrport(&most_alt_orport->addr, most_alt_orport->port));
+      if (!tor_addr_to_str(addr_buf, &most_alt_orport->addr,
+                           sizeof(addr_buf), 1))
+        strlcpy(addr_buf, "???", sizeof(addr_buf));
+      log_debug(LD_DIR, "\"a\" line winner for %s is %s:%u",
+                most->status.nickname, addr_buf, most_alt_orport->port);
     }
 
     SMARTLIST_FOREACH(alt_orports, tor_addr_port_t *, ap, tor_free(ap));
@@ -1495,12 +1501,608 @@ remove_flag(smartlist_t *sl, const char *flag)
     smartlist_del_keeporder(sl, idx);
 }
 
-/** Given a list of vote networkstatus_t in <b>votes</b>, our public
- * authority <b>identity_key</b>, our private authority <b>signing_key</b>,
- * and the number of <b>total_authorities</b> that we believe exist in our
- * voting quorum, generate the text of a new v3 consensus or microdescriptor
- * consensus (depending on <b>flavor</b>), and return the value in a newly
- * allocated string.
+/** A range of router entries in a consensus that we are computing, as
+ * produced by consensus_build_compute_range(). */
+typedef struct consensus_router_range_t {
+  /** The text of the router entries in this range, in order. */
+  smartlist_t *chunks;
+  /** The bandwidths of the routers in this range, to add to the totals that
+   * we use for the bandwidth weights. */
+  int64_t G, M, E, D, T;
+} consensus_router_range_t;
+
+/** A consensus that networkstatus_compute_consensus_start() has begun, and
+ * that networkstatus_compute_consensus_finish() will complete. */
+struct consensus_build_t {
+  /** The flavor and method of the consensus. */
+  consensus_flavor_t flavor;
+  int consensus_method;
+  /** The number of authorities we believe exist in our voting quorum. */
+  int total_authorities;
+  /** The text of the consensus before its router entries. */
+  smartlist_t *chunks;
+  /** The flags that any vote knows about, sorted. */
+  smartlist_t *flags;
+  /** The consensus parameters, as a string and as a list. */
+  char *params;
+  smartlist_t *param_list;
+  char *client_versions;
+  char *server_versions;
+  char *packages;
+
+  /* Everything below is read-only once the router entries are being
+   * computed, so that the ranges can be computed at the same time. */
+
+  /** The number of votes, and the routers from all the votes, collated. */
+  int n_votes;
+  dircollator_t *collator;
+  /** n_voter_flags[j] is the number of flags that votes[j] knows about. */
+  int *n_voter_flags;
+  /** n_flag_voters[f] is the number of votes that care about flags[f]. */
+  int *n_flag_voters;
+  /** flag_map[j][b] is an index f such that flag_map[f] is the same flag as
+   * votes[j]->known_flags[b]. */
+  int **flag_map;
+  /** Index of the flag "Named" for votes[j] */
+  int *named_flag;
+  /** Index of the flag "Unnamed" for votes[j] */
+  int *unnamed_flag;
+  /** Map from nickname to the identity that the Named voters agree on: or
+   * to <b>conflict</b> or <b>unknown</b>. */
+  strmap_t *name_to_id_map;
+  char conflict[DIGEST_LEN];
+  char unknown[DIGEST_LEN];
+  int n_authorities_measuring_bandwidth;
+  uint32_t max_unmeasured_bw_kb;
+  bool badexit_flag_is_listed;
+
+  /** The router entries, in ranges of <b>routers_per_range</b> routers. */
+  int routers_per_range;
+  int n_ranges;
+  consensus_router_range_t *ranges;
+  /** If the ranges are being computed on the cpuworkers, the batch that is
+   * computing them. */
+  cpuworker_batch_t *batch;
+};
+
+/** How many routers should go into each range of router entries, when we
+ * compute them on the cpuworkers? */
+STATIC int consensus_routers_per_range = 256;
+
+/** Return true iff we should compute the router entries of our consensuses
+ * on the cpuworkers. */
+static int
+dirvote_parallel_consensus_enabled(void)
+{
+  return dirauth_get_options()->AuthDirParallelConsensus &&
+    in_main_thread() &&
+    cpuworker_get_n_threads() > 0;
+}
+
+/** Compute the consensus router entries for the <b>idx</b>th range of
+ * routers in the consensus_build_t <b>arg</b>.  This only reads the shared
+ * parts of the build, so we can compute several ranges at once, from any
+ * thread. */
+static void
+consensus_build_compute_range(void *arg, int idx)
+{
+  const consensus_build_t *build = arg;
+  consensus_router_range_t *range = &build->ranges[idx];
+  const consensus_flavor_t flavor = build->flavor;
+  const int consensus_method = build->consensus_method;
+  const int total_authorities = build->total_authorities;
+  const int n_votes = build->n_votes;
+  smartlist_t *flags = build->flags;
+  const int *n_voter_flags = build->n_voter_flags;
+  const int *n_flag_voters = build->n_flag_voters;
+  int * const *flag_map = build->flag_map;
+  const int *named_flag = build->named_flag;
+  strmap_t *name_to_id_map = build->name_to_id_map;
+  const int n_authorities_measuring_bandwidth =
+    build->n_authorities_measuring_bandwidth;
+  const uint32_t max_unmeasured_bw_kb = build->max_unmeasured_bw_kb;
+  const bool badexit_flag_is_listed = build->badexit_flag_is_listed;
+  const routerstatus_format_type_t rs_format =
+    flavor == FLAV_NS ? NS_V3_CONSENSUS : NS_V3_CONSENSUS_MICRODESC;
+  const int num_routers = dircollator_n_routers(build->collator);
+  const int first = idx * build->routers_per_range;
+  const int last = MIN(first + build->routers_per_range, num_routers);
+  smartlist_t *chunks = smartlist_new();
+  int64_t G = 0, M = 0, E = 0, D = 0, T = 0; /* For bandwidth weights */
+  int *flag_counts; /* The number of voters that list flag[j] for the
+                     * currently considered router. */
+  int i;
+  smartlist_t *matching_descs = smartlist_new();
+  smartlist_t *chosen_flags = smartlist_new();
+  smartlist_t *versions = smartlist_new();
+  smartlist_t *protocols = smartlist_new();
+  smartlist_t *exitsummaries = smartlist_new();
+  uint32_t *bandwidths_kb = tor_calloc(n_votes, sizeof(uint32_t));
+  uint32_t *measured_bws_kb = tor_calloc(n_votes, sizeof(uint32_t));
+  uint32_t *measured_guardfraction = tor_calloc(n_votes, sizeof(uint32_t));
+  int num_bandwidths;
+  int num_mbws;
+  int num_guardfraction_inputs;
+
+  flag_counts = tor_calloc(smartlist_len(flags), sizeof(int));
+  for (i = first; i < last; ++i) {
+    vote_routerstatus_t **vrs_lst =
+      dircollator_get_votes_for_router(build->collator, i);
+
+    vote_routerstatus_t *rs;
+    routerstatus_t rs_out;
+    const char *current_rsa_id = NULL;
+    const char *chosen_version;
+    const char *chosen_protocol_list;
+    const char *chosen_name = NULL;
+    int exitsummary_disagreement = 0;
+    int is_named = 0, is_unnamed = 0, is_running = 0, is_valid = 0;
+    int is_guard = 0, is_exit = 0, is_bad_exit = 0, is_middle_only = 0;
+    int naming_conflict = 0;
+    int n_listing = 0;
+    char microdesc_digest[DIGEST256_LEN];
+    tor_addr_port_t alt_orport = {TOR_ADDR_NULL, 0};
+
+    memset(flag_counts, 0, sizeof(int)*smartlist_len(flags));
+    smartlist_clear(matching_descs);
+    smartlist_clear(chosen_flags);
+    smartlist_clear(versions);
+    smartlist_clear(protocols);
+    num_bandwidths = 0;
+    num_mbws = 0;
+    num_guardfraction_inputs = 0;
+    int ed_consensus = 0;
+    const uint8_t *ed_consensus_val = NULL;
+
+    /* Okay, go through all the entries for this digest. */
+    for (int voter_idx = 0; voter_idx < n_votes; ++voter_idx) {
+      if (vrs_lst[voter_idx] == NULL)
+        continue; /* This voter had nothing to say about this entry. */
+      rs = vrs_lst[voter_idx];
+      ++n_listing;
+
+      current_rsa_id = rs->status.identity_digest;
+
+      smartlist_add(matching_descs, rs);
+      if (rs->version && rs->version[0])
+        smartlist_add(versions, rs->version);
+
+      if (rs->protocols) {
+        /* We include this one even if it's empty: voting for an
+         * empty protocol list actually is meaningful. */
+        smartlist_add(protocols, rs->protocols);
+      }
+
+      /* Tally up all the flags. */
+      for (int flag = 0; flag < n_voter_flags[voter_idx]; ++flag) {
+        if (rs->flags & (UINT64_C(1) << flag))
+          ++flag_counts[flag_map[voter_idx][flag]];
+      }
+      if (named_flag[voter_idx] >= 0 &&
+          (rs->flags & (UINT64_C(1) << named_flag[voter_idx]))) {
+        if (chosen_name && strcmp(chosen_name, rs->status.nickname)) {
+          log_notice(LD_DIR, "Conflict on naming for router: %s vs %s",
+                     chosen_name, rs->status.nickname);
+          naming_conflict = 1;
+        }
+        chosen_name = rs->status.nickname;
+      }
+
+      /* Count guardfraction votes and note down the values. */
+      if (rs->status.has_guardfraction) {
+        measured_guardfraction[num_guardfraction_inputs++] =
+          rs->status.guardfraction_percentage;
+      }
+
+      /* count bandwidths */
+      if (rs->has_measured_bw)
+        measured_bws_kb[num_mbws++] = rs->measured_bw_kb;
+
+      if (rs->status.has_bandwidth)
+        bandwidths_kb[num_bandwidths++] = rs->status.bandwidth_kb;
+
+      /* Count number for which ed25519 is canonical. */
+      if (rs->ed25519_reflects_consensus) {
+        ++ed_consensus;
+        if (ed_consensus_val) {
+          tor_assert(fast_memeq(ed_consensus_val, rs->ed25519_id,
+                                ED25519_PUBKEY_LEN));
+        } else {
+          ed_consensus_val = rs->ed25519_id;
+        }
+      }
+    }
+
+    /* We don't include this router at all unless more than half of
+     * the authorities we believe in list it. */
+    if (n_listing <= total_authorities/2)
+      continue;
+
+    if (ed_consensus > 0) {
+      if (ed_consensus <= total_authorities / 2) {
+        log_warn(LD_BUG, "Not enough entries had ed_consensus set; how "
+                 "can we have a consensus of %d?", ed_consensus);
+      }
+    }
+
+    /* The clangalyzer can't figure out that this will never be NULL
+     * if n_listing is at least 1 */
+    tor_assert(current_rsa_id);
+
+    /* Figure out the most popular opinion of what the most recent
+     * routerinfo and its contents are. */
+    memset(microdesc_digest, 0, sizeof(microdesc_digest));
+    rs = compute_routerstatus_consensus(matching_descs, consensus_method,
+                                        microdesc_digest, &alt_orport);
+    /* Copy bits of that into rs_out. */
+    memset(&rs_out, 0, sizeof(rs_out));
+    tor_assert(fast_memeq(current_rsa_id,
+                          rs->status.identity_digest,DIGEST_LEN));
+    memcpy(rs_out.identity_digest, current_rsa_id, DIGEST_LEN);
+    memcpy(rs_out.descriptor_digest, rs->status.descriptor_digest,
+           DIGEST_LEN);
+    tor_addr_copy(&rs_out.ipv4_addr, &rs->status.ipv4_addr);
+    rs_out.ipv4_dirport = rs->status.ipv4_dirport;
+    rs_out.ipv4_orport = rs->status.ipv4_orport;
+    tor_addr_copy(&rs_out.ipv6_addr, &alt_orport.addr);
+    rs_out.ipv6_orport = alt_orport.port;
+    rs_out.has_bandwidth = 0;
+    rs_out.has_exitsummary = 0;
+
+    time_t published_on = rs->published_on;
+
+    /* Starting with this consensus method, we no longer include a
+       meaningful published_on time for microdescriptor consensuses.  This
+       makes their diffs smaller and more compressible.
+
+       We need to keep including a meaningful published_on time for NS
+       consensuses, however, until 035 relays are all obsolete. (They use
+       it for a purpose similar to the current StaleDesc flag.)
+    */
+    if (consensus_method >= MIN_METHOD_TO_SUPPRESS_MD_PUBLISHED &&
+        flavor == FLAV_MICRODESC) {
+      published_on = -1;
+    }
+
+    if (chosen_name && !naming_conflict) {
+      strlcpy(rs_out.nickname, chosen_name, sizeof(rs_out.nickname));
+    } else {
+      strlcpy(rs_out.nickname, rs->status.nickname, sizeof(rs_out.nickname));
+    }
+
+    {
+      const char *d = strmap_get_lc(name_to_id_map, rs_out.nickname);
+      if (!d) {
+        is_named = is_unnamed = 0;
+      } else if (fast_memeq(d, current_rsa_id, DIGEST_LEN)) {
+        is_named = 1; is_unnamed = 0;
+      } else {
+        is_named = 0; is_unnamed = 1;
+      }
+    }
+
+    /* Set the flags. */
+    SMARTLIST_FOREACH_BEGIN(flags, const char *, fl) {
+      if (!strcmp(fl, "Named")) {
+        if (is_named)
+          smartlist_add(chosen_flags, (char*)fl);
+      } else if (!strcmp(fl, "Unnamed")) {
+        if (is_unnamed)
+          smartlist_add(chosen_flags, (char*)fl);
+      } else if (!strcmp(fl, "NoEdConsensus")) {
+        if (ed_consensus <= total_authorities/2)
+          smartlist_add(chosen_flags, (char*)fl);
+      } else {
+        if (flag_counts[fl_sl_idx] > n_flag_voters[fl_sl_idx]/2) {
+          smartlist_add(chosen_flags, (char*)fl);
+          if (!strcmp(fl, "Exit"))
+            is_exit = 1;
+          else if (!strcmp(fl, "Guard"))
+            is_guard = 1;
+          else if (!strcmp(fl, "Running"))
+            is_running = 1;
+          else if (!strcmp(fl, "BadExit"))
+            is_bad_exit = 1;
+          else if (!strcmp(fl, "MiddleOnly"))
+            is_middle_only = 1;
+          else if (!strcmp(fl, "Valid"))
+            is_valid = 1;
+        }
+      }
+    } SMARTLIST_FOREACH_END(fl);
+
+    /* Starting with consensus method 4 we do not list servers
+     * that are not running in a consensus.  See Proposal 138 */
+    if (!is_running)
+      continue;
+
+    /* Starting with consensus method 24, we don't list servers
+     * that are not valid in a consensus.  See Proposal 272 */
+    if (!is_valid)
+      continue;
+
+    /* Starting with consensus method 32, we handle the middle-only
+     * flag specially: when it is present, we clear some flags, and
+     * set others. */
+    if (is_middle_only && consensus_method >= MIN_METHOD_FOR_MIDDLEONLY) {
+      remove_flag(chosen_flags, "Exit");
+      remove_flag(chosen_flags, "V2Dir");
+      remove_flag(chosen_flags, "Guard");
+      remove_flag(chosen_flags, "HSDir");
+      is_exit = is_guard = 0;
+      if (! is_bad_exit && badexit_flag_is_listed) {
+        is_bad_exit = 1;
+        smartlist_add(chosen_flags, (char *)"BadExit");
+        smartlist_sort_strings(chosen_flags); // restore order.
+      }
+    }
+
+    /* Pick the version. */
+    if (smartlist_len(versions)) {
+      sort_version_list(versions, 0);
+      chosen_version = get_most_frequent_member(versions);
+    } else {
+      chosen_version = NULL;
+    }
+
+    /* Pick the protocol list */
+    if (smartlist_len(protocols)) {
+      smartlist_sort_strings(protocols);
+      chosen_protocol_list = get_most_frequent_member(protocols);
+    } else {
+      chosen_protocol_list = NULL;
+    }
+
+    /* If it's a guard and we have enough guardfraction votes,
+       calculate its consensus guardfraction value. */
+    if (is_guard && num_guardfraction_inputs > 2) {
+      rs_out.has_guardfraction = 1;
+      rs_out.guardfraction_percentage = median_uint32(measured_guardfraction,
+                                                   num_guardfraction_inputs);
+      /* final value should be an integer percentage! */
+      tor_assert(rs_out.guardfraction_percentage <= 100);
+    }
+
+    /* Pick a bandwidth */
+    if (num_mbws > 2) {
+      rs_out.has_bandwidth = 1;
+      rs_out.bw_is_unmeasured = 0;
+      rs_out.bandwidth_kb = median_uint32(measured_bws_kb, num_mbws);
+    } else if (num_bandwidths > 0) {
+      rs_out.has_bandwidth = 1;
+      rs_out.bw_is_unmeasured = 1;
+      rs_out.bandwidth_kb = median_uint32(bandwidths_kb, num_bandwidths);
+      if (n_authorities_measuring_bandwidth > 2) {
+        /* Cap non-measured bandwidths. */
+        if (rs_out.bandwidth_kb > max_unmeasured_bw_kb) {
+          rs_out.bandwidth_kb = max_unmeasured_bw_kb;
+        }
+      }
+    }
+
+    /* Fix bug 2203: Do not count BadExit nodes as Exits for bw weights */
+    is_exit = is_exit && !is_bad_exit;
+
+    /* Update total bandwidth weights with the bandwidths of this router. */
+    {
+      update_total_bandwidth_weights(&rs_out,
+                                     is_exit, is_guard,
+                                     &G, &M, &E, &D, &T);
+    }
+
+    /* Ok, we already picked a descriptor digest we want to list
+     * previously.  Now we want to use the exit policy summary from
+     * that descriptor.  If everybody plays nice all the voters who
+     * listed that descriptor will have the same summary.  If not then
+     * something is fishy and we'll use the most common one (breaking
+     * ties in favor of lexicographically larger one (only because it
+     * lets me reuse more existing code)).
+     *
+     * The other case that can happen is that no authority that voted
+     * for that descriptor has an exit policy summary.  That's
+     * probably quite unlikely but can happen.  In that case we use
+     * the policy that was most often listed in votes, again breaking
+     * ties like in the previous case.
+     */
+    {
+      /* Okay, go through all the votes for this router.  We prepared
+       * that list previously */
+      const char *chosen_exitsummary = NULL;
+      smartlist_clear(exitsummaries);
+      SMARTLIST_FOREACH_BEGIN(matching_descs, vote_routerstatus_t *, vsr) {
+        /* Check if the vote where this status comes from had the
+         * proper descriptor */
+        tor_assert(fast_memeq(rs_out.identity_digest,
+                           vsr->status.identity_digest,
+                           DIGEST_LEN));
+        if (vsr->status.has_exitsummary &&
+             fast_memeq(rs_out.descriptor_digest,
+                     vsr->status.descriptor_digest,
+                     DIGEST_LEN)) {
+          tor_assert(vsr->status.exitsummary);
+          smartlist_add(exitsummaries, vsr->status.exitsummary);
+          if (!chosen_exitsummary) {
+            chosen_exitsummary = vsr->status.exitsummary;
+          } else if (strcmp(chosen_exitsummary, vsr->status.exitsummary)) {
+            /* Great.  There's disagreement among the voters.  That
+             * really shouldn't be */
+            exitsummary_disagreement = 1;
+          }
+        }
+      } SMARTLIST_FOREACH_END(vsr);
+
+      if (exitsummary_disagreement) {
+        char id[HEX_DIGEST_LEN+1];
+        char dd[HEX_DIGEST_LEN+1];
+        base16_encode(id, sizeof(dd), rs_out.identity_digest, DIGEST_LEN);
+        base16_encode(dd, sizeof(dd), rs_out.descriptor_digest, DIGEST_LEN);
+        log_warn(LD_DIR, "The voters disagreed on the exit policy summary "
+                 " for router %s with descriptor %s.  This really shouldn't"
+                 " have happened.", id, dd);
+
+        smartlist_sort_strings(exitsummaries);
+        chosen_exitsummary = get_most_frequent_member(exitsummaries);
+      } else if (!chosen_exitsummary) {
+        char id[HEX_DIGEST_LEN+1];
+        char dd[HEX_DIGEST_LEN+1];
+        base16_encode(id, sizeof(dd), rs_out.identity_digest, DIGEST_LEN);
+        base16_encode(dd, sizeof(dd), rs_out.descriptor_digest, DIGEST_LEN);
+        log_warn(LD_DIR, "Not one of the voters that made us select"
+                 "descriptor %s for router %s had an exit policy"
+                 "summary", dd, id);
+
+        /* Ok, none of those voting for the digest we chose had an
+         * exit policy for us.  Well, that kinda sucks.
+         */
+        smartlist_clear(exitsummaries);
+        SMARTLIST_FOREACH(matching_descs, vote_routerstatus_t *, vsr, {
+          if (vsr->status.has_exitsummary)
+            smartlist_add(exitsummaries, vsr->status.exitsummary);
+        });
+        smartlist_sort_strings(exitsummaries);
+        chosen_exitsummary = get_most_frequent_member(exitsummaries);
+
+        if (!chosen_exitsummary)
+          log_warn(LD_DIR, "Wow, not one of the voters had an exit "
+                   "policy summary for %s.  Wow.", id);
+      }
+
+      if (chosen_exitsummary) {
+        rs_out.has_exitsummary = 1;
+        /* yea, discards the const */
+        rs_out.exitsummary = (char *)chosen_exitsummary;
+      }
+    }
+
+    if (flavor == FLAV_MICRODESC &&
+        tor_digest256_is_zero(microdesc_digest)) {
+      /* With no microdescriptor digest, we omit the entry entirely. */
+      continue;
+    }
+
+    {
+      char *buf;
+      /* Okay!! Now we can write the descriptor... */
+      /*     First line goes into "buf". */
+      buf = routerstatus_format_entry(&rs_out, NULL, NULL,
+                                      rs_format, NULL, published_on);
+      if (buf)
+        smartlist_add(chunks, buf);
+    }
+    /*     Now an m line, if applicable. */
+    if (flavor == FLAV_MICRODESC &&
+        !tor_digest256_is_zero(microdesc_digest)) {
+      char m[BASE64_DIGEST256_LEN+1];
+      digest256_to_base64(m, microdesc_digest);
+      smartlist_add_asprintf(chunks, "m %s\n", m);
+    }
+    /*     Next line is all flags.  The "\n" is missing. */
+    smartlist_add_asprintf(chunks, "s%s",
+                           smartlist_len(chosen_flags)?" ":"");
+    smartlist_add(chunks,
+                  smartlist_join_strings(chosen_flags, " ", 0, NULL));
+    /*     Now the version line. */
+    if (chosen_version) {
+      smartlist_add_strdup(chunks, "\nv ");
+      smartlist_add_strdup(chunks, chosen_version);
+    }
+    smartlist_add_strdup(chunks, "\n");
+    if (chosen_protocol_list) {
+      smartlist_add_asprintf(chunks, "pr %s\n", chosen_protocol_list);
+    }
+    /*     Now the weight line. */
+    if (rs_out.has_bandwidth) {
+      char *guardfraction_str = NULL;
+      int unmeasured = rs_out.bw_is_unmeasured;
+
+      /* If we have guardfraction info, include it in the 'w' line. */
+      if (rs_out.has_guardfraction) {
+        tor_asprintf(&guardfraction_str,
+                     " GuardFraction=%u", rs_out.guardfraction_percentage);
+      }
+      smartlist_add_asprintf(chunks, "w Bandwidth=%d%s%s\n",
+                             rs_out.bandwidth_kb,
+                             unmeasured?" Unmeasured=1":"",
+                             guardfraction_str ? guardfraction_str : "");
+
+      tor_free(guardfraction_str);
+    }
+
+    /*     Now the exitpolicy summary line. */
+    if (rs_out.has_exitsummary && flavor == FLAV_NS) {
+      smartlist_add_asprintf(chunks, "p %s\n", rs_out.exitsummary);
+    }
+
+    /* And the loop is over and we move on to the next router */
+  }
+
+  tor_free(flag_counts);
+  smartlist_free(matching_descs);
+  smartlist_free(chosen_flags);
+  smartlist_free(versions);
+  smartlist_free(protocols);
+  smartlist_free(exitsummaries);
+  tor_free(bandwidths_kb);
+  tor_free(measured_bws_kb);
+  tor_free(measured_guardfraction);
+
+  range->chunks = chunks;
+  range->G = G;
+  range->M = M;
+  range->E = E;
+  range->D = D;
+  range->T = T;
+}
+
+/** Release all storage held in <b>build</b>. */
+static void
+consensus_build_free_(consensus_build_t *build)
+{
+  int i;
+  if (!build)
+    return;
+
+  dircollator_free(build->collator);
+  tor_free(build->client_versions);
+  tor_free(build->server_versions);
+  tor_free(build->packages);
+  SMARTLIST_FOREACH(build->flags, char *, cp, tor_free(cp));
+  smartlist_free(build->flags);
+  SMARTLIST_FOREACH(build->chunks, char *, cp, tor_free(cp));
+  smartlist_free(build->chunks);
+  SMARTLIST_FOREACH(build->param_list, char *, cp, tor_free(cp));
+  smartlist_free(build->param_list);
+
+  tor_free(build->n_voter_flags);
+  tor_free(build->n_flag_voters);
+  for (i = 0; i < build->n_votes; ++i)
+    tor_free(build->flag_map[i]);
+  tor_free(build->flag_map);
+  tor_free(build->named_flag);
+  tor_free(build->unnamed_flag);
+  strmap_free(build->name_to_id_map, NULL);
+
+  for (i = 0; i < build->n_ranges; ++i) {
+    smartlist_t *chunks = build->ranges[i].chunks;
+    if (chunks) {
+      SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
+      smartlist_free(chunks);
+    }
+  }
+  tor_free(build->ranges);
+  tor_free(build);
+}
+#define consensus_build_free(b) \
+  FREE_AND_NULL(consensus_build_t, consensus_build_free_, (b))
+
+/** Given a list of vote networkstatus_t in <b>votes</b>, and the number of
+ * <b>total_authorities</b> that we believe exist in our voting quorum, begin
+ * generating the text of a new v3 consensus or microdescriptor consensus
+ * (depending on <b>flavor</b>).  Return a consensus_build_t to pass to
+ * networkstatus_compute_consensus_finish(), or NULL on failure.
+ *
+ * If AuthDirParallelConsensus is set, the router entries are computed on
+ * the cpuworkers: the caller can start another flavor while they run.
  *
  * Note: this function DOES NOT check whether the votes are from
  * recognized authorities.   (dirvote_add_vote does that.)
@@ -1514,17 +2116,13 @@ remove_flag(smartlist_t *sl, const char *flag)
  * behavior, and make the new behavior conditional on a new-enough
  * consensus_method.
  **/
-STATIC char *
-networkstatus_compute_consensus(smartlist_t *votes,
-                                int total_authorities,
-                                crypto_pk_t *identity_key,
-                                crypto_pk_t *signing_key,
-                                const char *legacy_id_key_digest,
-                                crypto_pk_t *legacy_signing_key,
-                                consensus_flavor_t flavor)
+STATIC consensus_build_t *
+networkstatus_compute_consensus_start(smartlist_t *votes,
+                                      int total_authorities,
+                                      consensus_flavor_t flavor)
 {
+  consensus_build_t *build;
   smartlist_t *chunks;
-  char *result = NULL;
   int consensus_method;
   time_t valid_after, fresh_until, valid_until;
   int vote_seconds, dist_seconds;
@@ -1532,12 +2130,8 @@ networkstatus_compute_consensus(smartlist_t *votes,
   smartlist_t *flags;
   const char *flavor_name;
   uint32_t max_unmeasured_bw_kb = DEFAULT_MAX_UNMEASURED_BW_KB;
-  int64_t G, M, E, D, T; /* For bandwidth weights */
-  const routerstatus_format_type_t rs_format =
-    flavor == FLAV_NS ? NS_V3_CONSENSUS : NS_V3_CONSENSUS_MICRODESC;
   char *params = NULL;
   char *packages = NULL;
-  int added_weights = 0;
   dircollator_t *collator = NULL;
   smartlist_t *param_list = NULL;
 
@@ -1564,13 +2158,6 @@ networkstatus_compute_consensus(smartlist_t *votes,
     consensus_method = MAX_SUPPORTED_CONSENSUS_METHOD;
   }
 
-  {
-    /* It's smarter to initialize these weights to 1, so that later on,
-     * we can't accidentally divide by zero. */
-    G = M = E = D = 1;
-    T = 4;
-  }
-
   /* Compute medians of time-related things, and figure out how many
    * routers we might need to talk about. */
   {
@@ -1787,27 +2374,25 @@ networkstatus_compute_consensus(smartlist_t *votes,
     }
   }
 
-  /* Add the actual router entries. */
+  build = tor_malloc_zero(sizeof(consensus_build_t));
+  build->flavor = flavor;
+  build->consensus_method = consensus_method;
+  build->total_authorities = total_authorities;
+  build->chunks = chunks;
+  build->flags = flags;
+  build->params = params;
+  build->param_list = param_list;
+  build->client_versions = client_versions;
+  build->server_versions = server_versions;
+  build->packages = packages;
+  build->n_votes = smartlist_len(votes);
+  build->max_unmeasured_bw_kb = max_unmeasured_bw_kb;
+  build->badexit_flag_is_listed = badexit_flag_is_listed;
+
+  /* Get ready to add the actual router entries. */
   {
     int *size; /* size[j] is the number of routerstatuses in votes[j]. */
-    int *flag_counts; /* The number of voters that list flag[j] for the
-                       * currently considered router. */
     int i;
-    smartlist_t *matching_descs = smartlist_new();
-    smartlist_t *chosen_flags = smartlist_new();
-    smartlist_t *versions = smartlist_new();
-    smartlist_t *protocols = smartlist_new();
-    smartlist_t *exitsummaries = smartlist_new();
-    uint32_t *bandwidths_kb = tor_calloc(smartlist_len(votes),
-                                         sizeof(uint32_t));
-    uint32_t *measured_bws_kb = tor_calloc(smartlist_len(votes),
-                                           sizeof(uint32_t));
-    uint32_t *measured_guardfraction = tor_calloc(smartlist_len(votes),
-                                                  sizeof(uint32_t));
-    int num_bandwidths;
-    int num_mbws;
-    int num_guardfraction_inputs;
-
     int *n_voter_flags; /* n_voter_flags[j] is the number of flags that
                          * votes[j] knows about. */
     int *n_flag_voters; /* n_flag_voters[f] is the number of votes that care
@@ -1819,10 +2404,10 @@ networkstatus_compute_consensus(smartlist_t *votes,
     int n_authorities_measuring_bandwidth;
 
     strmap_t *name_to_id_map = strmap_new();
-    char conflict[DIGEST_LEN];
-    char unknown[DIGEST_LEN];
-    memset(conflict, 0, sizeof(conflict));
-    memset(unknown, 0xff, sizeof(conflict));
+    char *conflict = build->conflict;
+    char *unknown = build->unknown;
+    memset(conflict, 0, DIGEST_LEN);
+    memset(unknown, 0xff, DIGEST_LEN);
 
     size = tor_calloc(smartlist_len(votes), sizeof(int));
     n_voter_flags = tor_calloc(smartlist_len(votes), sizeof(int));
@@ -1928,438 +2513,93 @@ networkstatus_compute_consensus(smartlist_t *votes,
 
     dircollator_collate(collator, consensus_method);
 
-    /* Now go through all the votes */
-    flag_counts = tor_calloc(smartlist_len(flags), sizeof(int));
-    const int num_routers = dircollator_n_routers(collator);
-    for (i = 0; i < num_routers; ++i) {
-      vote_routerstatus_t **vrs_lst =
-        dircollator_get_votes_for_router(collator, i);
-
-      vote_routerstatus_t *rs;
-      routerstatus_t rs_out;
-      const char *current_rsa_id = NULL;
-      const char *chosen_version;
-      const char *chosen_protocol_list;
-      const char *chosen_name = NULL;
-      int exitsummary_disagreement = 0;
-      int is_named = 0, is_unnamed = 0, is_running = 0, is_valid = 0;
-      int is_guard = 0, is_exit = 0, is_bad_exit = 0, is_middle_only = 0;
-      int naming_conflict = 0;
-      int n_listing = 0;
-      char microdesc_digest[DIGEST256_LEN];
-      tor_addr_port_t alt_orport = {TOR_ADDR_NULL, 0};
-
-      memset(flag_counts, 0, sizeof(int)*smartlist_len(flags));
-      smartlist_clear(matching_descs);
-      smartlist_clear(chosen_flags);
-      smartlist_clear(versions);
-      smartlist_clear(protocols);
-      num_bandwidths = 0;
-      num_mbws = 0;
-      num_guardfraction_inputs = 0;
-      int ed_consensus = 0;
-      const uint8_t *ed_consensus_val = NULL;
-
-      /* Okay, go through all the entries for this digest. */
-      for (int voter_idx = 0; voter_idx < smartlist_len(votes); ++voter_idx) {
-        if (vrs_lst[voter_idx] == NULL)
-          continue; /* This voter had nothing to say about this entry. */
-        rs = vrs_lst[voter_idx];
-        ++n_listing;
-
-        current_rsa_id = rs->status.identity_digest;
-
-        smartlist_add(matching_descs, rs);
-        if (rs->version && rs->version[0])
-          smartlist_add(versions, rs->version);
-
-        if (rs->protocols) {
-          /* We include this one even if it's empty: voting for an
-           * empty protocol list actually is meaningful. */
-          smartlist_add(protocols, rs->protocols);
-        }
-
-        /* Tally up all the flags. */
-        for (int flag = 0; flag < n_voter_flags[voter_idx]; ++flag) {
-          if (rs->flags & (UINT64_C(1) << flag))
-            ++flag_counts[flag_map[voter_idx][flag]];
-        }
-        if (named_flag[voter_idx] >= 0 &&
-            (rs->flags & (UINT64_C(1) << named_flag[voter_idx]))) {
-          if (chosen_name && strcmp(chosen_name, rs->status.nickname)) {
-            log_notice(LD_DIR, "Conflict on naming for router: %s vs %s",
-                       chosen_name, rs->status.nickname);
-            naming_conflict = 1;
-          }
-          chosen_name = rs->status.nickname;
-        }
-
-        /* Count guardfraction votes and note down the values. */
-        if (rs->status.has_guardfraction) {
-          measured_guardfraction[num_guardfraction_inputs++] =
-            rs->status.guardfraction_percentage;
-        }
-
-        /* count bandwidths */
-        if (rs->has_measured_bw)
-          measured_bws_kb[num_mbws++] = rs->measured_bw_kb;
-
-        if (rs->status.has_bandwidth)
-          bandwidths_kb[num_bandwidths++] = rs->status.bandwidth_kb;
-
-        /* Count number for which ed25519 is canonical. */
-        if (rs->ed25519_reflects_consensus) {
-          ++ed_consensus;
-          if (ed_consensus_val) {
-            tor_assert(fast_memeq(ed_consensus_val, rs->ed25519_id,
-                                  ED25519_PUBKEY_LEN));
-          } else {
-            ed_consensus_val = rs->ed25519_id;
-          }
-        }
-      }
-
-      /* We don't include this router at all unless more than half of
-       * the authorities we believe in list it. */
-      if (n_listing <= total_authorities/2)
-        continue;
-
-      if (ed_consensus > 0) {
-        if (ed_consensus <= total_authorities / 2) {
-          log_warn(LD_BUG, "Not enough entries had ed_consensus set; how "
-                   "can we have a consensus of %d?", ed_consensus);
-        }
-      }
-
-      /* The clangalyzer can't figure out that this will never be NULL
-       * if n_listing is at least 1 */
-      tor_assert(current_rsa_id);
-
-      /* Figure out the most popular opinion of what the most recent
-       * routerinfo and its contents are. */
-      memset(microdesc_digest, 0, sizeof(microdesc_digest));
-      rs = compute_routerstatus_consensus(matching_descs, consensus_method,
-                                          microdesc_digest, &alt_orport);
-      /* Copy bits of that into rs_out. */
-      memset(&rs_out, 0, sizeof(rs_out));
-      tor_assert(fast_memeq(current_rsa_id,
-                            rs->status.identity_digest,DIGEST_LEN));
-      memcpy(rs_out.identity_digest, current_rsa_id, DIGEST_LEN);
-      memcpy(rs_out.descriptor_digest, rs->status.descriptor_digest,
-             DIGEST_LEN);
-      tor_addr_copy(&rs_out.ipv4_addr, &rs->status.ipv4_addr);
-      rs_out.ipv4_dirport = rs->status.ipv4_dirport;
-      rs_out.ipv4_orport = rs->status.ipv4_orport;
-      tor_addr_copy(&rs_out.ipv6_addr, &alt_orport.addr);
-      rs_out.ipv6_orport = alt_orport.port;
-      rs_out.has_bandwidth = 0;
-      rs_out.has_exitsummary = 0;
-
-      time_t published_on = rs->published_on;
-
-      /* Starting with this consensus method, we no longer include a
-         meaningful published_on time for microdescriptor consensuses.  This
-         makes their diffs smaller and more compressible.
-
-         We need to keep including a meaningful published_on time for NS
-         consensuses, however, until 035 relays are all obsolete. (They use
-         it for a purpose similar to the current StaleDesc flag.)
-      */
-      if (consensus_method >= MIN_METHOD_TO_SUPPRESS_MD_PUBLISHED &&
-          flavor == FLAV_MICRODESC) {
-        published_on = -1;
-      }
-
-      if (chosen_name && !naming_conflict) {
-        strlcpy(rs_out.nickname, chosen_name, sizeof(rs_out.nickname));
-      } else {
-        strlcpy(rs_out.nickname, rs->status.nickname, sizeof(rs_out.nickname));
-      }
-
-      {
-        const char *d = strmap_get_lc(name_to_id_map, rs_out.nickname);
-        if (!d) {
-          is_named = is_unnamed = 0;
-        } else if (fast_memeq(d, current_rsa_id, DIGEST_LEN)) {
-          is_named = 1; is_unnamed = 0;
-        } else {
-          is_named = 0; is_unnamed = 1;
-        }
-      }
-
-      /* Set the flags. */
-      SMARTLIST_FOREACH_BEGIN(flags, const char *, fl) {
-        if (!strcmp(fl, "Named")) {
-          if (is_named)
-            smartlist_add(chosen_flags, (char*)fl);
-        } else if (!strcmp(fl, "Unnamed")) {
-          if (is_unnamed)
-            smartlist_add(chosen_flags, (char*)fl);
-        } else if (!strcmp(fl, "NoEdConsensus")) {
-          if (ed_consensus <= total_authorities/2)
-            smartlist_add(chosen_flags, (char*)fl);
-        } else {
-          if (flag_counts[fl_sl_idx] > n_flag_voters[fl_sl_idx]/2) {
-            smartlist_add(chosen_flags, (char*)fl);
-            if (!strcmp(fl, "Exit"))
-              is_exit = 1;
-            else if (!strcmp(fl, "Guard"))
-              is_guard = 1;
-            else if (!strcmp(fl, "Running"))
-              is_running = 1;
-            else if (!strcmp(fl, "BadExit"))
-              is_bad_exit = 1;
-            else if (!strcmp(fl, "MiddleOnly"))
-              is_middle_only = 1;
-            else if (!strcmp(fl, "Valid"))
-              is_valid = 1;
-          }
-        }
-      } SMARTLIST_FOREACH_END(fl);
-
-      /* Starting with consensus method 4 we do not list servers
-       * that are not running in a consensus.  See Proposal 138 */
-      if (!is_running)
-        continue;
-
-      /* Starting with consensus method 24, we don't list servers
-       * that are not valid in a consensus.  See Proposal 272 */
-      if (!is_valid)
-        continue;
-
-      /* Starting with consensus method 32, we handle the middle-only
-       * flag specially: when it is present, we clear some flags, and
-       * set others. */
-      if (is_middle_only && consensus_method >= MIN_METHOD_FOR_MIDDLEONLY) {
-        remove_flag(chosen_flags, "Exit");
-        remove_flag(chosen_flags, "V2Dir");
-        remove_flag(chosen_flags, "Guard");
-        remove_flag(chosen_flags, "HSDir");
-        is_exit = is_guard = 0;
-        if (! is_bad_exit && badexit_flag_is_listed) {
-          is_bad_exit = 1;
-          smartlist_add(chosen_flags, (char *)"BadExit");
-          smartlist_sort_strings(chosen_flags); // restore order.
-        }
-      }
-
-      /* Pick the version. */
-      if (smartlist_len(versions)) {
-        sort_version_list(versions, 0);
-        chosen_version = get_most_frequent_member(versions);
-      } else {
-        chosen_version = NULL;
-      }
-
-      /* Pick the protocol list */
-      if (smartlist_len(protocols)) {
-        smartlist_sort_strings(protocols);
-        chosen_protocol_list = get_most_frequent_member(protocols);
-      } else {
-        chosen_protocol_list = NULL;
-      }
-
-      /* If it's a guard and we have enough guardfraction votes,
-         calculate its consensus guardfraction value. */
-      if (is_guard && num_guardfraction_inputs > 2) {
-        rs_out.has_guardfraction = 1;
-        rs_out.guardfraction_percentage = median_uint32(measured_guardfraction,
-                                                     num_guardfraction_inputs);
-        /* final value should be an integer percentage! */
-        tor_assert(rs_out.guardfraction_percentage <= 100);
-      }
-
-      /* Pick a bandwidth */
-      if (num_mbws > 2) {
-        rs_out.has_bandwidth = 1;
-        rs_out.bw_is_unmeasured = 0;
-        rs_out.bandwidth_kb = median_uint32(measured_bws_kb, num_mbws);
-      } else if (num_bandwidths > 0) {
-        rs_out.has_bandwidth = 1;
-        rs_out.bw_is_unmeasured = 1;
-        rs_out.bandwidth_kb = median_uint32(bandwidths_kb, num_bandwidths);
-        if (n_authorities_measuring_bandwidth > 2) {
-          /* Cap non-measured bandwidths. */
-          if (rs_out.bandwidth_kb > max_unmeasured_bw_kb) {
-            rs_out.bandwidth_kb = max_unmeasured_bw_kb;
-          }
-        }
-      }
-
-      /* Fix bug 2203: Do not count BadExit nodes as Exits for bw weights */
-      is_exit = is_exit && !is_bad_exit;
-
-      /* Update total bandwidth weights with the bandwidths of this router. */
-      {
-        update_total_bandwidth_weights(&rs_out,
-                                       is_exit, is_guard,
-                                       &G, &M, &E, &D, &T);
-      }
-
-      /* Ok, we already picked a descriptor digest we want to list
-       * previously.  Now we want to use the exit policy summary from
-       * that descriptor.  If everybody plays nice all the voters who
-       * listed that descriptor will have the same summary.  If not then
-       * something is fishy and we'll use the most common one (breaking
-       * ties in favor of lexicographically larger one (only because it
-       * lets me reuse more existing code)).
-       *
-       * The other case that can happen is that no authority that voted
-       * for that descriptor has an exit policy summary.  That's
-       * probably quite unlikely but can happen.  In that case we use
-       * the policy that was most often listed in votes, again breaking
-       * ties like in the previous case.
-       */
-      {
-        /* Okay, go through all the votes for this router.  We prepared
-         * that list previously */
-        const char *chosen_exitsummary = NULL;
-        smartlist_clear(exitsummaries);
-        SMARTLIST_FOREACH_BEGIN(matching_descs, vote_routerstatus_t *, vsr) {
-          /* Check if the vote where this status comes from had the
-           * proper descriptor */
-          tor_assert(fast_memeq(rs_out.identity_digest,
-                             vsr->status.identity_digest,
-                             DIGEST_LEN));
-          if (vsr->status.has_exitsummary &&
-               fast_memeq(rs_out.descriptor_digest,
-                       vsr->status.descriptor_digest,
-                       DIGEST_LEN)) {
-            tor_assert(vsr->status.exitsummary);
-            smartlist_add(exitsummaries, vsr->status.exitsummary);
-            if (!chosen_exitsummary) {
-              chosen_exitsummary = vsr->status.exitsummary;
-            } else if (strcmp(chosen_exitsummary, vsr->status.exitsummary)) {
-              /* Great.  There's disagreement among the voters.  That
-               * really shouldn't be */
-              exitsummary_disagreement = 1;
-            }
-          }
-        } SMARTLIST_FOREACH_END(vsr);
-
-        if (exitsummary_disagreement) {
-          char id[HEX_DIGEST_LEN+1];
-          char dd[HEX_DIGEST_LEN+1];
-          base16_encode(id, sizeof(dd), rs_out.identity_digest, DIGEST_LEN);
-          base16_encode(dd, sizeof(dd), rs_out.descriptor_digest, DIGEST_LEN);
-          log_warn(LD_DIR, "The voters disagreed on the exit policy summary "
-                   " for router %s with descriptor %s.  This really shouldn't"
-                   " have happened.", id, dd);
-
-          smartlist_sort_strings(exitsummaries);
-          chosen_exitsummary = get_most_frequent_member(exitsummaries);
-        } else if (!chosen_exitsummary) {
-          char id[HEX_DIGEST_LEN+1];
-          char dd[HEX_DIGEST_LEN+1];
-          base16_encode(id, sizeof(dd), rs_out.identity_digest, DIGEST_LEN);
-          base16_encode(dd, sizeof(dd), rs_out.descriptor_digest, DIGEST_LEN);
-          log_warn(LD_DIR, "Not one of the voters that made us select"
-                   "descriptor %s for router %s had an exit policy"
-                   "summary", dd, id);
-
-          /* Ok, none of those voting for the digest we chose had an
-           * exit policy for us.  Well, that kinda sucks.
-           */
-          smartlist_clear(exitsummaries);
-          SMARTLIST_FOREACH(matching_descs, vote_routerstatus_t *, vsr, {
-            if (vsr->status.has_exitsummary)
-              smartlist_add(exitsummaries, vsr->status.exitsummary);
-          });
-          smartlist_sort_strings(exitsummaries);
-          chosen_exitsummary = get_most_frequent_member(exitsummaries);
-
-          if (!chosen_exitsummary)
-            log_warn(LD_DIR, "Wow, not one of the voters had an exit "
-                     "policy summary for %s.  Wow.", id);
-        }
+    build->collator = collator;
+    build->n_voter_flags = n_voter_flags;
+    build->n_flag_voters = n_flag_voters;
+    build->flag_map = flag_map;
+    build->named_flag = named_flag;
+    build->unnamed_flag = unnamed_flag;
+    build->name_to_id_map = name_to_id_map;
+    build->n_authorities_measuring_bandwidth =
+      n_authorities_measuring_bandwidth;
+    tor_free(size);
+  }
 
-        if (chosen_exitsummary) {
-          rs_out.has_exitsummary = 1;
-          /* yea, discards the const */
-          rs_out.exitsummary = (char *)chosen_exitsummary;
-        }
-      }
+  /* Now go through all the votes, one range of routers at a time. */
+  {
+    const int num_routers = dircollator_n_routers(build->collator);
+    int i;
+    build->routers_per_range = num_routers;
+    if (dirvote_parallel_consensus_enabled())
+      build->routers_per_range = consensus_routers_per_range;
+    build->routers_per_range = MAX(build->routers_per_range, 1);
+    build->n_ranges = CEIL_DIV(num_routers, build->routers_per_range);
+    build->ranges = tor_calloc(MAX(build->n_ranges, 1),
+                               sizeof(consensus_router_range_t));
+    if (build->n_ranges > 1) {
+      build->batch = cpuworker_batch_start(build->n_ranges,
+                                           consensus_build_compute_range,
+                                           build);
+    } else {
+      for (i = 0; i < build->n_ranges; ++i)
+        consensus_build_compute_range(build, i);
+    }
+  }
 
-      if (flavor == FLAV_MICRODESC &&
-          tor_digest256_is_zero(microdesc_digest)) {
-        /* With no microdescriptor digest, we omit the entry entirely. */
-        continue;
-      }
+  return build;
+}
 
-      {
-        char *buf;
-        /* Okay!! Now we can write the descriptor... */
-        /*     First line goes into "buf". */
-        buf = routerstatus_format_entry(&rs_out, NULL, NULL,
-                                        rs_format, NULL, published_on);
-        if (buf)
-          smartlist_add(chunks, buf);
-      }
-      /*     Now an m line, if applicable. */
-      if (flavor == FLAV_MICRODESC &&
-          !tor_digest256_is_zero(microdesc_digest)) {
-        char m[BASE64_DIGEST256_LEN+1];
-        digest256_to_base64(m, microdesc_digest);
-        smartlist_add_asprintf(chunks, "m %s\n", m);
-      }
-      /*     Next line is all flags.  The "\n" is missing. */
-      smartlist_add_asprintf(chunks, "s%s",
-                             smartlist_len(chosen_flags)?" ":"");
-      smartlist_add(chunks,
-                    smartlist_join_strings(chosen_flags, " ", 0, NULL));
-      /*     Now the version line. */
-      if (chosen_version) {
-        smartlist_add_strdup(chunks, "\nv ");
-        smartlist_add_strdup(chunks, chosen_version);
-      }
-      smartlist_add_strdup(chunks, "\n");
-      if (chosen_protocol_list) {
-        smartlist_add_asprintf(chunks, "pr %s\n", chosen_protocol_list);
-      }
-      /*     Now the weight line. */
-      if (rs_out.has_bandwidth) {
-        char *guardfraction_str = NULL;
-        int unmeasured = rs_out.bw_is_unmeasured;
-
-        /* If we have guardfraction info, include it in the 'w' line. */
-        if (rs_out.has_guardfraction) {
-          tor_asprintf(&guardfraction_str,
-                       " GuardFraction=%u", rs_out.guardfraction_percentage);
-        }
-        smartlist_add_asprintf(chunks, "w Bandwidth=%d%s%s\n",
-                               rs_out.bandwidth_kb,
-                               unmeasured?" Unmeasured=1":"",
-                               guardfraction_str ? guardfraction_str : "");
+/** Finish generating the consensus that we began with
+ * networkstatus_compute_consensus_start() in <b>build</b>, using our public
+ * authority <b>identity_key</b> and our private authority
+ * <b>signing_key</b>, and return its text in a newly allocated string, or
+ * NULL on failure.  Frees <b>build</b>.
+ **/
+STATIC char *
+networkstatus_compute_consensus_finish(consensus_build_t *build,
+                                       crypto_pk_t *identity_key,
+                                       crypto_pk_t *signing_key,
+                                       const char *legacy_id_key_digest,
+                                       crypto_pk_t *legacy_signing_key)
+{
+  char *result = NULL;
+  smartlist_t *chunks;
+  consensus_flavor_t flavor;
+  int consensus_method;
+  int64_t G, M, E, D, T; /* For bandwidth weights */
+  const char *params;
+  smartlist_t *param_list;
+  int added_weights = 0;
+  int i;
 
-        tor_free(guardfraction_str);
-      }
+  if (!build)
+    return NULL;
 
-      /*     Now the exitpolicy summary line. */
-      if (rs_out.has_exitsummary && flavor == FLAV_NS) {
-        smartlist_add_asprintf(chunks, "p %s\n", rs_out.exitsummary);
-      }
+  chunks = build->chunks;
+  flavor = build->flavor;
+  consensus_method = build->consensus_method;
+  params = build->params;
+  param_list = build->param_list;
 
-      /* And the loop is over and we move on to the next router */
-    }
+  {
+    /* It's smarter to initialize these weights to 1, so that later on,
+     * we can't accidentally divide by zero. */
+    G = M = E = D = 1;
+    T = 4;
+  }
 
-    tor_free(size);
-    tor_free(n_voter_flags);
-    tor_free(n_flag_voters);
-    for (i = 0; i < smartlist_len(votes); ++i)
-      tor_free(flag_map[i]);
-    tor_free(flag_map);
-    tor_free(flag_counts);
-    tor_free(named_flag);
-    tor_free(unnamed_flag);
-    strmap_free(name_to_id_map, NULL);
-    smartlist_free(matching_descs);
-    smartlist_free(chosen_flags);
-    smartlist_free(versions);
-    smartlist_free(protocols);
-    smartlist_free(exitsummaries);
-    tor_free(bandwidths_kb);
-    tor_free(measured_bws_kb);
-    tor_free(measured_guardfraction);
+  /* Add the actual router entries, in order. */
+  cpuworker_batch_finish(build->batch);
+  build->batch = NULL;
+  for (i = 0; i < build->n_ranges; ++i) {
+    consensus_router_range_t *range = &build->ranges[i];
+    smartlist_add_all(chunks, range->chunks);
+    smartlist_clear(range->chunks);
+    G += range->G;
+    M += range->M;
+    E += range->E;
+    D += range->D;
+    T += range->T;
   }
 
   /* Mark the directory footer region */
@@ -2463,20 +2703,42 @@ networkstatus_compute_consensus(smartlist_t *votes,
 
  done:
 
-  dircollator_free(collator);
-  tor_free(client_versions);
-  tor_free(server_versions);
-  tor_free(packages);
-  SMARTLIST_FOREACH(flags, char *, cp, tor_free(cp));
-  smartlist_free(flags);
-  SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
-  smartlist_free(chunks);
-  SMARTLIST_FOREACH(param_list, char *, cp, tor_free(cp));
-  smartlist_free(param_list);
+  consensus_build_free(build);
 
   return result;
 }
 
+#ifdef TOR_UNIT_TESTS
+/** Given a list of vote networkstatus_t in <b>votes</b>, our public
+ * authority <b>identity_key</b>, our private authority <b>signing_key</b>,
+ * and the number of <b>total_authorities</b> that we believe exist in our
+ * voting quorum, generate the text of a new v3 consensus or microdescriptor
+ * consensus (depending on <b>flavor</b>), and return the value in a newly
+ * allocated string.
+ *
+ * This is networkstatus_compute_consensus_start() followed by
+ * networkstatus_compute_consensus_finish(), for the unit tests.
+ **/
+STATIC char *
+networkstatus_compute_consensus(smartlist_t *votes,
+                                int total_authorities,
+                                crypto_pk_t *identity_key,
+                                crypto_pk_t *signing_key,
+                                const char *legacy_id_key_digest,
+                                crypto_pk_t *legacy_signing_key,
+                                consensus_flavor_t flavor)
+{
+  consensus_build_t *build;
+
+  build = networkstatus_compute_consensus_start(votes, total_authorities,
+                                                flavor);
+  return networkstatus_compute_consensus_finish(build, identity_key,
+                                                signing_key,
+                                                legacy_id_key_digest,
+                                                legacy_signing_key);
+}
+#endif /* defined(TOR_UNIT_TESTS) */
+
 /** Extract the value of a parameter from a string encoding a list of
  * parameters, badly.
  *
@@ -3495,6 +3757,7 @@ dirvote_compute_consensuses(void)
     crypto_pk_t *legacy_sign=NULL;
     char *legacy_id_digest = NULL;
     int n_generated = 0;
+    consensus_build_t *builds[N_CONSENSUS_FLAVORS];
     if (get_options()->V3AuthUseLegacyKey) {
       authority_cert_t *cert = get_my_v3_legacy_cert();
       legacy_sign = get_my_v3_legacy_signing_key();
@@ -3508,13 +3771,18 @@ dirvote_compute_consensuses(void)
       }
     }
 
+    /* Start every flavor before we finish any of them, so that their
+     * router entries can be computed at the same time. */
+    for (flav = 0; flav < N_CONSENSUS_FLAVORS; ++flav) {
+      builds[flav] = networkstatus_compute_consensus_start(votes, n_voters,
+                                                           flav);
+    }
     for (flav = 0; flav < N_CONSENSUS_FLAVORS; ++flav) {
       const char *flavor_name = networkstatus_get_flavor_name(flav);
-      consensus_body = networkstatus_compute_consensus(
-        votes, n_voters,
+      consensus_body = networkstatus_compute_consensus_finish(
+        builds[flav],
         my_cert->identity_key,
-        get_my_v3_authority_signing_key(), legacy_id_digest, legacy_sign,
-        flav);
+        get_my_v3_authority_signing_key(), legacy_id_digest, legacy_sign);
 
       if (!consensus_body) {
         log_warn(LD_DIR, "Couldn't generate a %s consensus at all!",
@@ -240,6 +240,19 @@ STATIC int
 networkstatus_compute_bw_weights_v10(smartlist_t *chunks, int64_t G,
                                      int64_t M, int64_t E, int64_t D,
                                      int64_t T, int64_t weight_scale);
+typedef struct consensus_build_t consensus_build_t;
+STATIC consensus_build_t *networkstatus_compute_consensus_start(
+                                      smartlist_t *votes,
+                                      int total_authorities,
+                                      consensus_flavor_t flavor);
+STATIC char *networkstatus_compute_consensus_finish(
+                                      consensus_build_t *build,
+                                      crypto_pk_t *identity_key,
+                                      crypto_pk_t *signing_key,
+                                      const char *legacy_identity_key_digest,
+                                      crypto_pk_t *legacy_signing_key);
+#ifdef TOR_UNIT_TESTS
+extern int consensus_routers_per_range;
 STATIC
 char *networkstatus_compute_consensus(smartlist_t *votes,
                                       int total_authorities,
@@ -248,6 +261,7 @@ char *networkstatus_compute_consensus(smartlist_t *votes,
                                       const char *legacy_identity_key_digest,
                                       crypto_pk_t *legacy_signing_key,
                                       consensus_flavor_t flavor);
+#endif /* defined(TOR_UNIT_TESTS) */
 STATIC
 int networkstatus_add_detached_signatures(networkstatus_t *target,
                                           ns_detached_signatures_t *sigs,
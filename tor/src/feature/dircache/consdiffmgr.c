@@ -25,6 +25,7 @@
 #include "lib/evloop/workqueue.h"
 #include "lib/compress/compress.h"
 #include "lib/encoding/confline.h"
+#include "lib/lock/compat_mutex.h"
 
 #include "feature/nodelist/networkstatus_st.h"
 #include "feature/nodelist/networkstatus_voter_info_st.h"
@@ -201,8 +202,12 @@ static int consdiffmgr_ensure_space_for_files(int n);
 static int consensus_queue_compression_work(const char *consensus,
                                             size_t consensus_len,
                                             const networkstatus_t *as_parsed);
+typedef struct consensus_diff_target_t consensus_diff_target_t;
+static consensus_diff_target_t *consensus_diff_target_new(
+                                          consensus_cache_entry_t *ent);
+static void consensus_diff_target_decref(consensus_diff_target_t *target);
 static int consensus_diff_queue_diff_work(consensus_cache_entry_t *diff_from,
-                                          consensus_cache_entry_t *diff_to);
+                                          consensus_diff_target_t *target);
 static void consdiffmgr_set_cache_flags(void);
 
 /* =====
@@ -923,6 +928,7 @@ consdiffmgr_rescan_flavor_(consensus_flavor_t flavor)
   smartlist_t *diffs = NULL;
   smartlist_t *compute_diffs_from = NULL;
   strmap_t *have_diff_from = NULL;
+  consensus_diff_target_t *target = NULL;
 
   // look for the most recent consensus, and for all previous in-range
   // consensuses.  Do they all have diffs to it?
@@ -1003,7 +1009,9 @@ consdiffmgr_rescan_flavor_(consensus_flavor_t flavor)
   //    target consensuses.
   cdm_diff_ht_purge(flavor, most_recent_sha3);
 
-  // 5. Actually launch the requests.
+  // 5. Actually launch the requests.  All of them share one copy of the
+  //    most recent consensus, which the first worker to need it prepares.
+  target = consensus_diff_target_new(most_recent);
   SMARTLIST_FOREACH_BEGIN(compute_diffs_from, consensus_cache_entry_t *, c) {
     if (BUG(c == most_recent))
       continue; // LCOV_EXCL_LINE
@@ -1020,10 +1028,11 @@ consdiffmgr_rescan_flavor_(consensus_flavor_t flavor)
       // This is already pending, or we encountered an error.
       continue;
     }
-    consensus_diff_queue_diff_work(c, most_recent);
+    consensus_diff_queue_diff_work(c, target);
   } SMARTLIST_FOREACH_END(c);
 
  done:
+  consensus_diff_target_decref(target);
   smartlist_free(matches);
   smartlist_free(diffs);
   smartlist_free(compute_diffs_from);
@@ -1397,6 +1406,30 @@ store_multiple(consensus_cache_entry_handle_t **handles_out,
  * An object passed to a worker thread that will try to produce a consensus
  * diff.
  */
+/**
+ * The consensus that a set of diff jobs are all computing diffs to.  We
+ * uncompress it and split it into lines only once, in whichever worker
+ * thread gets to it first, and share the result among the jobs.
+ */
+struct consensus_diff_target_t {
+  /**
+   * The cache entry for the consensus.  Holds a reference to the entry, whose
+   * body must be mapped into memory in the main thread.
+   */
+  consensus_cache_entry_t *ent;
+  /** Number of jobs (and other users) holding this object.  Only touched
+   * from the main thread. */
+  int refcnt;
+  /** Protects all the fields below. */
+  tor_mutex_t lock;
+  /** True iff some worker has tried to prepare <b>input</b>. */
+  bool prepared;
+  /** The uncompressed consensus, if we needed to uncompress it. */
+  char *owned_body;
+  /** The consensus, ready to diff against; NULL if we couldn't prepare it. */
+  consensus_diff_input_t *input;
+};
+
 typedef struct consensus_diff_worker_job_t {
   /**
    * Input: The consensus to compute the diff from.  Holds a reference to the
@@ -1410,6 +1443,10 @@ typedef struct consensus_diff_worker_job_t {
    * the main thread. The body must be mapped into memory in the main thread.
    */
   consensus_cache_entry_t *diff_to;
+  /**
+   * Input: The shared, prepared form of <b>diff_to</b>.  Holds a reference.
+   */
+  consensus_diff_target_t *target;
 
   /** Output: labels and bodies */
   compressed_result_t out[ARRAY_LENGTH(compress_diffs_with)];
@@ -1454,6 +1491,70 @@ uncompress_or_set_ptr(const char **out, size_t *outlen,
   return rv;
 }
 
+/**
+ * Return a new consensus_diff_target_t for the consensus in <b>ent</b>,
+ * holding one reference.  Must be called from the main thread.
+ */
+static consensus_diff_target_t *
+consensus_diff_target_new(consensus_cache_entry_t *ent)
+{
+  tor_assert(in_main_thread());
+  consensus_diff_target_t *target = tor_malloc_zero(sizeof(*target));
+  consensus_cache_entry_incref(ent);
+  target->ent = ent;
+  target->refcnt = 1;
+  tor_mutex_init_nonrecursive(&target->lock);
+  return target;
+}
+
+/**
+ * Release a reference to <b>target</b>, and free it if that was the last
+ * one.  Must be called from the main thread.
+ */
+static void
+consensus_diff_target_decref(consensus_diff_target_t *target)
+{
+  tor_assert(in_main_thread());
+  if (!target || --target->refcnt > 0)
+    return;
+  consensus_diff_input_free(target->input);
+  tor_free(target->owned_body);
+  tor_mutex_uninit(&target->lock);
+  consensus_cache_entry_decref(target->ent);
+  tor_free(target);
+}
+
+/**
+ * Return the prepared form of the consensus in <b>target</b>, preparing it
+ * first if no other thread has done so.  Return NULL if it can't be
+ * prepared.  May be called from any thread.
+ */
+static const consensus_diff_input_t *
+consensus_diff_target_get_input(consensus_diff_target_t *target)
+{
+  const consensus_diff_input_t *input;
+
+  tor_mutex_acquire(&target->lock);
+  if (!target->prepared) {
+    const char *body = NULL;
+    size_t bodylen;
+    uint8_t sha3[DIGEST256_LEN];
+
+    target->prepared = true;
+    if (cdm_entry_get_sha3_value(sha3, target->ent,
+                                 LABEL_SHA3_DIGEST_UNCOMPRESSED) == 0 &&
+        uncompress_or_set_ptr(&body, &bodylen, &target->owned_body,
+                              target->ent) == 0) {
+      tor_assert(body);
+      target->input = consensus_diff_input_new(body, bodylen, sha3);
+    }
+  }
+  input = target->input;
+  tor_mutex_release(&target->lock);
+
+  return input;
+}
+
 /**
  * Worker function. This function runs inside a worker thread and receives
  * a consensus_diff_worker_job_t as its input.
@@ -1516,33 +1617,37 @@ consensus_diff_worker_threadfn(void *state_, void *work_)
     return WQ_RPL_REPLY; // LCOV_EXCL_LINE
   }
 
-  char *consensus_diff;
+  char *consensus_diff = NULL;
   {
-    const char *diff_from_nt = NULL, *diff_to_nt = NULL;
-    char *owned1 = NULL, *owned2 = NULL;
-    size_t diff_from_nt_len, diff_to_nt_len;
+    const char *diff_from_nt = NULL;
+    char *owned1 = NULL;
+    size_t diff_from_nt_len;
+    uint8_t from_sha3[DIGEST256_LEN];
+    consensus_diff_input_t *from = NULL;
+    const consensus_diff_input_t *to;
 
-    if (uncompress_or_set_ptr(&diff_from_nt, &diff_from_nt_len, &owned1,
-                              job->diff_from) < 0) {
+    /* We already know both digests from the labels, so there's no need for
+     * consensus_diff_generate() to compute them again. */
+    if (cdm_entry_get_sha3_value(from_sha3, job->diff_from,
+                                 LABEL_SHA3_DIGEST_AS_SIGNED) < 0) {
       return WQ_RPL_REPLY;
     }
-    if (uncompress_or_set_ptr(&diff_to_nt, &diff_to_nt_len, &owned2,
-                              job->diff_to) < 0) {
-      tor_free(owned1);
+    to = consensus_diff_target_get_input(job->target);
+    if (!to) {
+      return WQ_RPL_REPLY;
+    }
+    if (uncompress_or_set_ptr(&diff_from_nt, &diff_from_nt_len, &owned1,
+                              job->diff_from) < 0) {
       return WQ_RPL_REPLY;
     }
     tor_assert(diff_from_nt);
-    tor_assert(diff_to_nt);
-
-    // XXXX ugh; this is going to calculate the SHA3 of both its
-    // XXXX inputs again, even though we already have that. Maybe it's time
-    // XXXX to change the API here?
-    consensus_diff = consensus_diff_generate(diff_from_nt,
-                                             diff_from_nt_len,
-                                             diff_to_nt,
-                                             diff_to_nt_len);
+
+    from = consensus_diff_input_new(diff_from_nt, diff_from_nt_len,
+                                    from_sha3);
+    if (from)
+      consensus_diff = consensus_diff_generate_from_inputs(from, to);
+    consensus_diff_input_free(from);
     tor_free(owned1);
-    tor_free(owned2);
   }
   if (!consensus_diff) {
     /* Couldn't generate consensus; we'll leave the reply blank. */
@@ -1612,6 +1717,7 @@ consensus_diff_worker_job_free_(consensus_diff_worker_job_t *job)
   }
   consensus_cache_entry_decref(job->diff_from);
   consensus_cache_entry_decref(job->diff_to);
+  consensus_diff_target_decref(job->target);
   tor_free(job);
 }
 
@@ -1700,21 +1806,24 @@ consensus_diff_worker_replyfn(void *work_)
 }
 
 /**
- * Queue the job of computing the diff from <b>diff_from</b> to <b>diff_to</b>
- * in a worker thread.
+ * Queue the job of computing the diff from <b>diff_from</b> to the consensus
+ * in <b>target</b> in a worker thread.
  */
 static int
 consensus_diff_queue_diff_work(consensus_cache_entry_t *diff_from,
-                               consensus_cache_entry_t *diff_to)
+                               consensus_diff_target_t *target)
 {
   tor_assert(in_main_thread());
+  consensus_cache_entry_t *diff_to = target->ent;
 
   consensus_cache_entry_incref(diff_from);
   consensus_cache_entry_incref(diff_to);
+  ++target->refcnt;
 
   consensus_diff_worker_job_t *job = tor_malloc_zero(sizeof(*job));
   job->diff_from = diff_from;
   job->diff_to = diff_to;
+  job->target = target;
 
   /* Make sure body is mapped. */
   const uint8_t *body;
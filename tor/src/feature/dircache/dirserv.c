@@ -382,6 +382,25 @@ spooled_resource_free_(spooled_resource_t *spooled)
 /** When spooling data from a cached_dir_t object, we always add
  * at least this much. */
 #define DIRSERV_CACHED_DIR_CHUNK_SIZE 8192
+/** As DIRSERV_CACHED_DIR_CHUNK_SIZE, but for when we add the data to the
+ * outbuf without copying it, and so can afford to add more at once. */
+#define DIRSERV_CACHED_DIR_EXTERNAL_CHUNK_SIZE 65536
+
+/** Release a reference to a cached_dir_t that an outbuf held while it was
+ * sending part of it. */
+static void
+cached_dir_release_from_buf(void *arg)
+{
+  cached_dir_decref(arg);
+}
+
+/** Release a reference to a consensus_cache_entry_t that an outbuf held while
+ * it was sending part of it. */
+static void
+consensus_cache_entry_release_from_buf(void *arg)
+{
+  consensus_cache_entry_decref(arg);
+}
 
 /** Return an compression ratio for compressing objects from <b>source</b>.
  */
@@ -507,10 +526,28 @@ spooled_resource_flush_some(spooled_resource_t *spooled,
     remaining = total_len - spooled->cached_dir_offset;
     if (BUG(remaining < 0))
       return SRFS_ERR;
-    ssize_t bytes = (ssize_t) MIN(DIRSERV_CACHED_DIR_CHUNK_SIZE, remaining);
-
-    connection_dir_buf_add(ptr + spooled->cached_dir_offset,
-                           bytes, conn, 0);
+    ssize_t bytes = (ssize_t) MIN(conn->compress_state ?
+                                  DIRSERV_CACHED_DIR_CHUNK_SIZE :
+                                  DIRSERV_CACHED_DIR_EXTERNAL_CHUNK_SIZE,
+                                  remaining);
+
+    if (conn->compress_state) {
+      connection_dir_buf_add(ptr + spooled->cached_dir_offset,
+                             bytes, conn, 0);
+    } else if (cached) {
+      /* The outbuf can refer to the object instead of copying it, but it
+       * needs a reference of its own, since it can outlive the spool. */
+      ++cached->refcnt;
+      connection_buf_add_external(ptr + spooled->cached_dir_offset,
+                                  bytes, TO_CONN(conn),
+                                  cached_dir_release_from_buf, cached);
+    } else {
+      consensus_cache_entry_incref(cce);
+      connection_buf_add_external(ptr + spooled->cached_dir_offset,
+                                  bytes, TO_CONN(conn),
+                                  consensus_cache_entry_release_from_buf,
+                                  cce);
+    }
 
     spooled->cached_dir_offset += bytes;
     if (spooled->cached_dir_offset >= (off_t)total_len) {
@@ -42,16 +42,33 @@
 #include "feature/dircommon/consdiff.h"
 #include "lib/memarea/memarea.h"
 #include "feature/dirparse/ns_parse.h"
+#include "ext/siphash.h"
 
 static const char* ns_diff_version = "network-status-diff-version 1";
 static const char* hash_token = "hash";
 
 static char *consensus_join_lines(const smartlist_t *inp);
 
+/** Return the hash we use to tell lines apart for the <b>len</b> bytes
+ * at <b>s</b>.  Never returns 0, which marks a line with no hash. */
+static inline uint64_t
+cdline_hash(const char *s, size_t len)
+{
+  uint64_t h = siphash24g(s, len);
+  return h ? h : 1;
+}
+
 /** Return true iff a and b have the same contents. */
 STATIC int
 lines_eq(const cdline_t *a, const cdline_t *b)
 {
+  if (a == b)
+    return 1;
+  /* Lines with different hashes can't be equal: most of the lines we
+   * compare while looking for common subsequences differ, so this saves us
+   * most of the memcmp() calls.  Equal hashes still get compared in full. */
+  if (a->hash && b->hash && a->hash != b->hash)
+    return 0;
   return a->len == b->len && fast_memeq(a->s, b->s, a->len);
 }
 
@@ -61,7 +78,7 @@ line_str_eq(const cdline_t *a, const char *b)
 {
   const size_t len = strlen(b);
   tor_assert(len <= UINT32_MAX);
-  cdline_t bline = { b, (uint32_t)len };
+  cdline_t bline = { b, (uint32_t)len, 0 };
   return lines_eq(a, &bline);
 }
 
@@ -85,6 +102,7 @@ cdline_linecpy(memarea_t *area, const char *s)
   cdline_t *line = memarea_alloc(area, sizeof(cdline_t));
   line->s = ss;
   line->len = (uint32_t)len;
+  line->hash = cdline_hash(ss, len);
   return line;
 }
 
@@ -424,6 +442,7 @@ get_id_hash(const cdline_t *line, cdline_t *hash_out)
   tor_assert(hash_end >= hash);
   tor_assert((size_t)(hash_end - hash) <= UINT32_MAX);
   hash_out->len = (uint32_t)(hash_end - hash);
+  hash_out->hash = 0;
 
   return 0;
 }
@@ -534,7 +553,7 @@ typedef struct router_id_iterator_t {
 /**
  * Initializer for a router_id_iterator_t.
  */
-#define ROUTER_ID_ITERATOR_INIT { { NULL, 0 }, { NULL, 0 } }
+#define ROUTER_ID_ITERATOR_INIT { { NULL, 0, 0 }, { NULL, 0, 0 } }
 #endif /* !defined(COCCI) */
 
 /** Given an index *<b>idxp</b> into the consensus at <b>cons</b>, advance
@@ -1305,6 +1324,7 @@ consensus_split_lines(smartlist_t *out,
     cdline_t *line = memarea_alloc(area, sizeof(cdline_t));
     line->s = s;
     line->len = (uint32_t)(eol - s);
+    line->hash = cdline_hash(s, line->len);
     smartlist_add(out, line);
     s = eol+1;
   }
@@ -1334,6 +1354,79 @@ consensus_join_lines(const smartlist_t *inp)
   return result;
 }
 
+/** A consensus that has been split into lines, along with its digest, ready
+ * to be used as either side of a diff.  Building one of these is most of the
+ * cost of a diff that isn't about the footer, so a caller that diffs many
+ * consensuses against the same one should build it only once. */
+struct consensus_diff_input_t {
+  /** Memory area holding the cdline_t objects in <b>lines</b>. */
+  memarea_t *area;
+  /** The lines of the consensus, as cdline_t referring into the original
+   * string. */
+  smartlist_t *lines;
+  /** The SHA3-256 digest to put in the diff header for this consensus. */
+  consensus_digest_t digest;
+};
+
+/** Split the consensus of <b>len</b> bytes in <b>cons</b> into lines, and
+ * return a new consensus_diff_input_t for it.  <b>cons</b> must stay valid
+ * and unchanged until the returned object is freed.
+ *
+ * The caller must supply the SHA3-256 digest to use in <b>sha3_digest</b>:
+ * the digest "as signed" if the consensus will be the old side of a diff, or
+ * the digest of the whole document if it will be the new side.  Return NULL
+ * if the consensus can't be split into lines. */
+consensus_diff_input_t *
+consensus_diff_input_new(const char *cons, size_t len,
+                         const uint8_t *sha3_digest)
+{
+  consensus_diff_input_t *input = tor_malloc_zero(sizeof(*input));
+  input->area = memarea_new();
+  input->lines = smartlist_new();
+  memcpy(input->digest.sha3_256, sha3_digest, DIGEST256_LEN);
+  if (consensus_split_lines(input->lines, cons, len, input->area) < 0) {
+    consensus_diff_input_free(input);
+    return NULL;
+  }
+  return input;
+}
+
+/** Release all storage held in <b>input</b>. */
+void
+consensus_diff_input_free_(consensus_diff_input_t *input)
+{
+  if (!input)
+    return;
+  smartlist_free(input->lines);
+  memarea_drop_all(input->area);
+  tor_free(input);
+}
+
+/** Given two prepared consensuses, try to compute a diff from <b>from</b> to
+ * <b>to</b>.  On success, return a newly allocated string containing that
+ * diff.  On failure, return NULL.
+ *
+ * Neither input is modified, so several threads may diff against the same
+ * input at once. */
+char *
+consensus_diff_generate_from_inputs(const consensus_diff_input_t *from,
+                                    const consensus_diff_input_t *to)
+{
+  smartlist_t *result_lines;
+  char *result = NULL;
+  memarea_t *area = memarea_new();
+
+  result_lines = consdiff_gen_diff(from->lines, to->lines,
+                                   &from->digest, &to->digest, area);
+  if (result_lines) {
+    result = consensus_join_lines(result_lines);
+    smartlist_free(result_lines);
+  }
+
+  memarea_drop_all(area);
+  return result;
+}
+
 /** Given two consensus documents, try to compute a diff between them.  On
  * success, return a newly allocated string containing that diff.  On failure,
  * return NULL. */
@@ -1342,7 +1435,7 @@ consensus_diff_generate(const char *cons1, size_t cons1len,
                         const char *cons2, size_t cons2len)
 {
   consensus_digest_t d1, d2;
-  smartlist_t *lines1 = NULL, *lines2 = NULL, *result_lines = NULL;
+  consensus_diff_input_t *from = NULL, *to = NULL;
   int r1, r2;
   char *result = NULL;
 
@@ -1351,25 +1444,13 @@ consensus_diff_generate(const char *cons1, size_t cons1len,
   if (BUG(r1 < 0 || r2 < 0))
     return NULL; // LCOV_EXCL_LINE
 
-  memarea_t *area = memarea_new();
-  lines1 = smartlist_new();
-  lines2 = smartlist_new();
-  if (consensus_split_lines(lines1, cons1, cons1len, area) < 0)
-    goto done;
-  if (consensus_split_lines(lines2, cons2, cons2len, area) < 0)
-    goto done;
-
-  result_lines = consdiff_gen_diff(lines1, lines2, &d1, &d2, area);
+  from = consensus_diff_input_new(cons1, cons1len, d1.sha3_256);
+  to = consensus_diff_input_new(cons2, cons2len, d2.sha3_256);
+  if (from && to)
+    result = consensus_diff_generate_from_inputs(from, to);
 
- done:
-  if (result_lines) {
-    result = consensus_join_lines(result_lines);
-    smartlist_free(result_lines);
-  }
-
-  memarea_drop_all(area);
-  smartlist_free(lines1);
-  smartlist_free(lines2);
+  consensus_diff_input_free(from);
+  consensus_diff_input_free(to);
 
   return result;
 }
@@ -14,6 +14,16 @@
 
 char *consensus_diff_generate(const char *cons1, size_t cons1len,
                               const char *cons2, size_t cons2len);
+
+typedef struct consensus_diff_input_t consensus_diff_input_t;
+consensus_diff_input_t *consensus_diff_input_new(const char *cons,
+                                                 size_t len,
+                                                 const uint8_t *sha3_digest);
+void consensus_diff_input_free_(consensus_diff_input_t *input);
+#define consensus_diff_input_free(input) \
+  FREE_AND_NULL(consensus_diff_input_t, consensus_diff_input_free_, (input))
+char *consensus_diff_generate_from_inputs(const consensus_diff_input_t *from,
+                                          const consensus_diff_input_t *to);
 char *consensus_diff_apply(const char *consensus, size_t consensus_len,
                            const char *diff, size_t diff_len);
 
@@ -30,6 +40,9 @@ struct memarea_t;
 typedef struct cdline_t {
   const char *s;
   uint32_t len;
+  /** Hash of the contents of this line, or 0 if we didn't compute one.  Two
+   * lines with different nonzero hashes are never equal. */
+  uint64_t hash;
 } cdline_t;
 
 typedef struct consensus_digest_t {
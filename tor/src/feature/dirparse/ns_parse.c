@@ -13,12 +13,14 @@
 
 #include "core/or/or.h"
 #include "app/config/config.h"
+#include "core/mainloop/cpuworker.h"
 #include "core/or/protover.h"
 #include "core/or/versions.h"
 #include "feature/client/entrynodes.h"
 #include "feature/dirauth/dirvote.h"
 #include "feature/dirparse/authcert_parse.h"
 #include "feature/dirparse/ns_parse.h"
+#include "feature/dirparse/ns_snapshot.h"
 #include "feature/dirparse/parsecommon.h"
 #include "feature/dirparse/routerparse.h"
 #include "feature/dirparse/sigcommon.h"
@@ -286,45 +288,31 @@ routerstatus_parse_guardfraction(const char *guardfraction_str,
   return 0;
 }
 
-/** Given a string at *<b>s</b>, containing a routerstatus object, and an
- * empty smartlist at <b>tokens</b>, parse and return the first router status
- * object in the string, and advance *<b>s</b> to just after the end of the
- * router status.  Return NULL and advance *<b>s</b> on error.
- *
- * If <b>vote</b> and <b>vote_rs</b> are provided, don't allocate a fresh
- * routerstatus but use <b>vote_rs</b> instead.
- *
- * If <b>consensus_method</b> is nonzero, this routerstatus is part of a
- * consensus, and we should parse it according to the method used to
- * make that consensus.
- *
- * Parse according to the syntax used by the consensus flavor <b>flav</b>.
- **/
-STATIC routerstatus_t *
-routerstatus_parse_entry_from_string(memarea_t *area,
-                                     const char **s, const char *s_eos,
+/** Helper for routerstatus_parse_entry_from_string(): given the
+ * <b>tokens</b> of the router status object at <b>s</b>, parse and return
+ * it.  If <b>tokens</b> is NULL, tokenizing the object failed.  Return NULL
+ * on error.  Other arguments are as for
+ * routerstatus_parse_entry_from_string(). */
+static routerstatus_t *
+routerstatus_parse_entry_from_tokens(const char *s,
                                      smartlist_t *tokens,
                                      networkstatus_t *vote,
                                      vote_routerstatus_t *vote_rs,
                                      int consensus_method,
                                      consensus_flavor_t flav)
 {
-  const char *eos, *s_dup = *s;
   routerstatus_t *rs = NULL;
   directory_token_t *tok;
   char timebuf[ISO_TIME_LEN+1];
   struct in_addr in;
   int offset = 0;
-  tor_assert(tokens);
   tor_assert(bool_eq(vote, vote_rs));
 
   if (!consensus_method)
     flav = FLAV_NS;
   tor_assert(flav == FLAV_NS || flav == FLAV_MICRODESC);
 
-  eos = find_start_of_next_routerstatus(*s, s_eos);
-
-  if (tokenize_string(area,*s, eos, tokens, rtrstatus_token_table,0)) {
+  if (!tokens) {
     log_warn(LD_DIR, "Error tokenizing router status");
     goto err;
   }
@@ -582,13 +570,49 @@ routerstatus_parse_entry_from_string(memarea_t *area,
   if (!strcasecmp(rs->nickname, UNNAMED_ROUTER_NICKNAME))
     rs->is_named = 0;
 
-  goto done;
+  return rs;
  err:
-  dump_desc(s_dup, "routerstatus entry");
+  dump_desc(s, "routerstatus entry");
   if (rs && !vote_rs)
     routerstatus_free(rs);
-  rs = NULL;
- done:
+  return NULL;
+}
+
+/** Given a string at *<b>s</b>, containing a routerstatus object, and an
+ * empty smartlist at <b>tokens</b>, parse and return the first router status
+ * object in the string, and advance *<b>s</b> to just after the end of the
+ * router status.  Return NULL and advance *<b>s</b> on error.
+ *
+ * If <b>vote</b> and <b>vote_rs</b> are provided, don't allocate a fresh
+ * routerstatus but use <b>vote_rs</b> instead.
+ *
+ * If <b>consensus_method</b> is nonzero, this routerstatus is part of a
+ * consensus, and we should parse it according to the method used to
+ * make that consensus.
+ *
+ * Parse according to the syntax used by the consensus flavor <b>flav</b>.
+ **/
+STATIC routerstatus_t *
+routerstatus_parse_entry_from_string(memarea_t *area,
+                                     const char **s, const char *s_eos,
+                                     smartlist_t *tokens,
+                                     networkstatus_t *vote,
+                                     vote_routerstatus_t *vote_rs,
+                                     int consensus_method,
+                                     consensus_flavor_t flav)
+{
+  const char *eos;
+  routerstatus_t *rs;
+  int r;
+  tor_assert(tokens);
+
+  eos = find_start_of_next_routerstatus(*s, s_eos);
+
+  r = tokenize_string(area,*s, eos, tokens, rtrstatus_token_table,0);
+  rs = routerstatus_parse_entry_from_tokens(*s, r ? NULL : tokens,
+                                            vote, vote_rs,
+                                            consensus_method, flav);
+
   SMARTLIST_FOREACH(tokens, directory_token_t *, t, token_clear(t));
   smartlist_clear(tokens);
   if (area) {
@@ -600,6 +624,286 @@ routerstatus_parse_entry_from_string(memarea_t *area,
   return rs;
 }
 
+/** A router status object that a cpuworker tokenized ahead of time. */
+typedef struct rs_pretokenized_t {
+  /** Start of the router status object. */
+  const char *start;
+  /** End of the router status object. */
+  const char *end;
+  /** Its tokens, or NULL if tokenizing it failed. */
+  smartlist_t *tokens;
+} rs_pretokenized_t;
+
+/** A run of router status objects for one cpuworker to tokenize. */
+typedef struct rs_chunk_t {
+  /** Where the first router status object in this chunk starts. */
+  const char *start;
+  /** Where the next chunk starts. */
+  const char *end;
+  /** Memory for the tokens of this chunk. */
+  memarea_t *area;
+  /** List of rs_pretokenized_t, in the order they appear. */
+  smartlist_t *entries;
+} rs_chunk_t;
+
+/** The router status objects of a networkstatus document, split into
+ * chunks that the cpuworkers tokenize while we parse the header. */
+typedef struct rs_chunk_job_t {
+  /** End of the whole document. */
+  const char *eos;
+  /** Number of chunks in <b>chunks</b>. */
+  int n_chunks;
+  /** Array of chunks, in the order they appear. */
+  rs_chunk_t *chunks;
+  /** Tokenizing the chunks, or NULL if it's done. */
+  cpuworker_batch_t *batch;
+  /** Index into <b>chunks</b> of the next entry to look at in
+   * rs_chunk_job_get_entry(). */
+  int cur_chunk;
+  /** Index into that chunk's entries of the next entry to look at. */
+  int cur_entry;
+} rs_chunk_job_t;
+
+/** We don't give a cpuworker less than this many bytes of router status
+ * objects to tokenize. Overridable for testing. */
+STATIC size_t rs_chunk_min_bytes = 64*1024;
+/** Largest number of chunks we split router status objects into. */
+#define RS_MAX_CHUNKS 64
+
+/** Batch function: tokenize every router status object in the chunk at
+ * <b>idx</b> of the rs_chunk_job_t in <b>arg</b>.  Runs in a cpuworker, so
+ * this mustn't touch anything that isn't part of the chunk. */
+static void
+rs_chunk_tokenize(void *arg, int idx)
+{
+  rs_chunk_job_t *job = arg;
+  rs_chunk_t *chunk = &job->chunks[idx];
+  const char *s = chunk->start;
+
+  while (s < chunk->end && job->eos - s >= 2 && fast_memeq(s, "r ", 2)) {
+    rs_pretokenized_t *ent = memarea_alloc(chunk->area, sizeof(*ent));
+    ent->start = s;
+    ent->end = find_start_of_next_routerstatus(s, job->eos);
+    ent->tokens = smartlist_new();
+    smartlist_add(chunk->entries, ent);
+    if (tokenize_string(chunk->area, s, ent->end, ent->tokens,
+                        rtrstatus_token_table, 0)) {
+      SMARTLIST_FOREACH(ent->tokens, directory_token_t *, t, token_clear(t));
+      smartlist_free(ent->tokens);
+      /* We'd stop parsing here anyway. */
+      break;
+    }
+    s = ent->end;
+  }
+}
+
+/** Split the router status objects between <b>start</b> and <b>eos</b> into
+ * chunks, and start tokenizing them on the cpuworkers. */
+static rs_chunk_job_t *
+rs_chunk_job_start(const char *start, const char *eos)
+{
+  rs_chunk_job_t *job = tor_malloc_zero(sizeof(rs_chunk_job_t));
+  size_t chunk_len;
+  const char *s = start;
+  int n_chunks;
+
+  n_chunks = (int) MIN((size_t)(eos - start) / rs_chunk_min_bytes + 1,
+                       RS_MAX_CHUNKS);
+  chunk_len = (eos - start) / n_chunks + 1;
+  job->eos = eos;
+  job->chunks = tor_calloc(n_chunks, sizeof(rs_chunk_t));
+
+  /* Every chunk but the first starts at an "r" line, so that the chunks
+   * split the entries the way find_start_of_next_routerstatus() does. */
+  while (s && job->n_chunks < n_chunks) {
+    rs_chunk_t *chunk = &job->chunks[job->n_chunks++];
+    const char *next = NULL;
+    chunk->start = s;
+    chunk->area = memarea_new();
+    chunk->entries = smartlist_new();
+    if (job->n_chunks < n_chunks && (size_t)(eos - s) > chunk_len &&
+        (next = tor_memstr(s + chunk_len, eos - s - chunk_len, "\nr ")))
+      ++next;
+    chunk->end = next ? next : eos;
+    s = next;
+  }
+
+  job->batch = cpuworker_batch_start(job->n_chunks, rs_chunk_tokenize, job);
+  return job;
+}
+
+/** Return the pretokenized router status object in <b>job</b> that starts
+ * at <b>s</b>, or NULL if there is none.  Must be called in order of
+ * increasing <b>s</b>. */
+static rs_pretokenized_t *
+rs_chunk_job_get_entry(rs_chunk_job_t *job, const char *s)
+{
+  cpuworker_batch_finish(job->batch);
+  job->batch = NULL;
+
+  for ( ; job->cur_chunk < job->n_chunks; ++job->cur_chunk) {
+    smartlist_t *entries = job->chunks[job->cur_chunk].entries;
+    for ( ; job->cur_entry < smartlist_len(entries); ++job->cur_entry) {
+      rs_pretokenized_t *ent = smartlist_get(entries, job->cur_entry);
+      if (ent->start == s)
+        return ent;
+      if (ent->start > s)
+        return NULL;
+    }
+    job->cur_entry = 0;
+  }
+  return NULL;
+}
+
+#define rs_chunk_job_free(job) \
+  FREE_AND_NULL(rs_chunk_job_t, rs_chunk_job_free_, (job))
+
+/** Wait for the cpuworkers to finish with <b>job</b>, and free it. */
+static void
+rs_chunk_job_free_(rs_chunk_job_t *job)
+{
+  int i;
+  if (!job)
+    return;
+  cpuworker_batch_finish(job->batch);
+  for (i = 0; i < job->n_chunks; ++i) {
+    rs_chunk_t *chunk = &job->chunks[i];
+    SMARTLIST_FOREACH_BEGIN(chunk->entries, rs_pretokenized_t *, ent) {
+      if (ent->tokens) {
+        SMARTLIST_FOREACH(ent->tokens, directory_token_t *, t,
+                          token_clear(t));
+        smartlist_free(ent->tokens);
+      }
+    } SMARTLIST_FOREACH_END(ent);
+    smartlist_free(chunk->entries);
+    memarea_drop_all(chunk->area);
+  }
+  tor_free(job->chunks);
+  tor_free(job);
+}
+
+/** Like routerstatus_parse_entry_from_string(), but use the tokens from
+ * <b>job</b> if a cpuworker already tokenized the object at *<b>s</b>. */
+static routerstatus_t *
+routerstatus_parse_next_entry(rs_chunk_job_t *job, memarea_t *area,
+                              const char **s, const char *eos,
+                              smartlist_t *tokens,
+                              networkstatus_t *vote,
+                              vote_routerstatus_t *vote_rs,
+                              int consensus_method,
+                              consensus_flavor_t flav)
+{
+  rs_pretokenized_t *ent = job ? rs_chunk_job_get_entry(job, *s) : NULL;
+  routerstatus_t *rs;
+
+  if (!ent)
+    return routerstatus_parse_entry_from_string(area, s, eos, tokens,
+                                                vote, vote_rs,
+                                                consensus_method, flav);
+
+  rs = routerstatus_parse_entry_from_tokens(*s, ent->tokens, vote, vote_rs,
+                                            consensus_method, flav);
+  *s = ent->end;
+  return rs;
+}
+
+/** The digests of the signed part of a networkstatus document, computed on
+ * the cpuworkers. */
+typedef struct ns_digest_job_t {
+  /** Start of the signed part of the document. */
+  const char *start;
+  /** Length of the signed part of the document. */
+  size_t len;
+  /** The SHA1 and SHA256 digests of the signed part. */
+  common_digests_t digests;
+  /** The SHA3-256 digest of the signed part. */
+  uint8_t sha3_as_signed[DIGEST256_LEN];
+  /** Nonzero for each digest we failed to compute. */
+  int failed[3];
+  /** Computing the digests, or NULL if it's done. */
+  cpuworker_batch_t *batch;
+} ns_digest_job_t;
+
+/** Batch function: compute one of the digests of the ns_digest_job_t in
+ * <b>arg</b>. */
+static void
+ns_digest_compute(void *arg, int idx)
+{
+  ns_digest_job_t *job = arg;
+  switch (idx) {
+    case 0:
+      job->failed[idx] = crypto_digest(job->digests.d[DIGEST_SHA1],
+                                       job->start, job->len) < 0;
+      break;
+    case 1:
+      job->failed[idx] = crypto_digest256(job->digests.d[DIGEST_SHA256],
+                                          job->start, job->len,
+                                          DIGEST_SHA256) < 0;
+      break;
+    case 2:
+      job->failed[idx] = crypto_digest256((char *)job->sha3_as_signed,
+                                          job->start, job->len,
+                                          DIGEST_SHA3_256) < 0;
+      break;
+    default:
+      tor_assert_unreached();
+  }
+}
+
+/** Find the signed part of the networkstatus document in <b>s</b>, and
+ * start computing the digests that router_get_networkstatus_v3_hashes() and
+ * router_get_networkstatus_v3_sha3_as_signed() would give for it on the
+ * cpuworkers.  Return NULL if there is no signed part. */
+static ns_digest_job_t *
+ns_digest_job_start(const char *s, size_t s_len)
+{
+  const char *start = NULL, *end = NULL;
+  ns_digest_job_t *job;
+
+  if (router_get_hash_impl_helper(s, s_len, "network-status-version",
+                                  "\ndirectory-signature", ' ', LOG_WARN,
+                                  &start, &end) < 0)
+    return NULL;
+
+  job = tor_malloc_zero(sizeof(ns_digest_job_t));
+  job->start = start;
+  job->len = end - start;
+  job->batch = cpuworker_batch_start(ARRAY_LENGTH(job->failed),
+                                     ns_digest_compute, job);
+  return job;
+}
+
+/** Wait for the digests in <b>job</b>, and store them in <b>digests</b> and
+ * <b>sha3_as_signed</b>.  Return 0 on success, -1 on failure. */
+static int
+ns_digest_job_finish(ns_digest_job_t *job, common_digests_t *digests,
+                     uint8_t *sha3_as_signed)
+{
+  cpuworker_batch_finish(job->batch);
+  job->batch = NULL;
+
+  if (job->failed[0] || job->failed[1] || job->failed[2]) {
+    log_warn(LD_BUG,"couldn't compute digests");
+    return -1;
+  }
+  memcpy(digests, &job->digests, sizeof(*digests));
+  memcpy(sha3_as_signed, job->sha3_as_signed, DIGEST256_LEN);
+  return 0;
+}
+
+#define ns_digest_job_free(job) \
+  FREE_AND_NULL(ns_digest_job_t, ns_digest_job_free_, (job))
+
+/** Wait for the cpuworkers to finish with <b>job</b>, and free it. */
+static void
+ns_digest_job_free_(ns_digest_job_t *job)
+{
+  if (!job)
+    return;
+  cpuworker_batch_finish(job->batch);
+  tor_free(job);
+}
+
 int
 compare_vote_routerstatus_entries(const void **_a, const void **_b)
 {
@@ -1088,13 +1392,20 @@ dup_protocols_string(smartlist_t *tokens, bool *error, directory_keyword kw)
   return tor_strdup(tok->args[0]);
 }
 
-/** Parse a v3 networkstatus vote, opinion, or consensus (depending on
- * ns_type), from <b>s</b>, and return the result.  Return NULL on failure. */
-networkstatus_t *
-networkstatus_parse_vote_from_string(const char *s,
-                                     size_t s_len,
-                                     const char **eos_out,
-                                     networkstatus_type_t ns_type)
+/** Helper: parse a v3 networkstatus vote, opinion, or consensus (depending
+ * on ns_type), from <b>s</b>, and return the result.  Return NULL on
+ * failure.
+ *
+ * If <b>snapshot</b> is set, it is a snapshot from ns_snapshot_encode() that
+ * we may use in place of parsing the router status entries of a consensus;
+ * set *<b>used_snapshot_out</b> to 1 if we did, and to 0 if we parsed them
+ * from <b>s</b>. */
+static networkstatus_t *
+networkstatus_parse_impl(const char *s, size_t s_len,
+                         const char **eos_out,
+                         networkstatus_type_t ns_type,
+                         const char *snapshot, size_t snapshot_len,
+                         int *used_snapshot_out)
 {
   smartlist_t *tokens = smartlist_new();
   smartlist_t *rs_tokens = NULL, *footer_tokens = NULL;
@@ -1110,13 +1421,32 @@ networkstatus_parse_vote_from_string(const char *s,
   consensus_flavor_t flav = FLAV_NS;
   char *last_kwd=NULL;
   const char *eos = s + s_len;
+  ns_digest_job_t *digest_job = NULL;
+  rs_chunk_job_t *rs_job = NULL;
+  smartlist_t *snapshot_entries = NULL;
+  size_t snapshot_entries_end = 0;
+  /* With a snapshot there are no entries to parse in parallel, and we need
+   * the digest of the document before we can check the snapshot. */
+  const int parallel = !snapshot && networkstatus_parallel_parsing_enabled();
 
   tor_assert(s);
 
   if (eos_out)
     *eos_out = NULL;
-
-  if (router_get_networkstatus_v3_hashes(s, s_len, &ns_digests) ||
+  if (used_snapshot_out)
+    *used_snapshot_out = 0;
+
+  if (parallel) {
+    /* Hash the document on the cpuworkers while we parse it.  Votes need
+     * their digest for the header, so for them we wait right away. */
+    digest_job = ns_digest_job_start(s, s_len);
+    if (!digest_job ||
+        (ns_type != NS_TYPE_CONSENSUS &&
+         ns_digest_job_finish(digest_job, &ns_digests, sha3_as_signed)<0)) {
+      log_warn(LD_DIR, "Unable to compute digest of network-status");
+      goto err;
+    }
+  } else if (router_get_networkstatus_v3_hashes(s, s_len, &ns_digests) ||
       router_get_networkstatus_v3_sha3_as_signed(sha3_as_signed,
                                                  s, s_len)<0) {
     log_warn(LD_DIR, "Unable to compute digest of network-status");
@@ -1125,6 +1455,8 @@ networkstatus_parse_vote_from_string(const char *s,
 
   area = memarea_new();
   end_of_header = find_start_of_next_routerstatus(s, eos);
+  if (parallel)
+    rs_job = rs_chunk_job_start(end_of_header, eos);
   if (tokenize_string(area, s, end_of_header, tokens,
                       (ns_type == NS_TYPE_CONSENSUS) ?
                       networkstatus_consensus_token_table :
@@ -1134,8 +1466,6 @@ networkstatus_parse_vote_from_string(const char *s,
   }
 
   ns = tor_malloc_zero(sizeof(networkstatus_t));
-  memcpy(&ns->digests, &ns_digests, sizeof(ns_digests));
-  memcpy(&ns->digest_sha3_as_signed, sha3_as_signed, sizeof(sha3_as_signed));
 
   tok = find_by_keyword(tokens, K_NETWORK_STATUS_VERSION);
   tor_assert(tok);
@@ -1472,13 +1802,29 @@ networkstatus_parse_vote_from_string(const char *s,
   rs_tokens = smartlist_new();
   rs_area = memarea_new();
   s = end_of_header;
-  ns->routerstatus_list = smartlist_new();
+
+  if (snapshot && ns->type == NS_TYPE_CONSENSUS)
+    snapshot_entries = ns_snapshot_decode_routerstatuses(
+                                snapshot, snapshot_len, flav, &ns_digests,
+                                end_of_header - s_dup, &snapshot_entries_end);
+  if (snapshot_entries &&
+      snapshot_entries_end <= s_len &&
+      eos - (s_dup + snapshot_entries_end) >= 17 &&
+      fast_memeq(s_dup + snapshot_entries_end, "directory-footer\n", 17)) {
+    ns->routerstatus_list = snapshot_entries;
+    snapshot_entries = NULL;
+    s = s_dup + snapshot_entries_end;
+    if (used_snapshot_out)
+      *used_snapshot_out = 1;
+  } else {
+    ns->routerstatus_list = smartlist_new();
+  }
 
   while (eos - s >= 2 && fast_memeq(s, "r ", 2)) {
     if (ns->type != NS_TYPE_CONSENSUS) {
       vote_routerstatus_t *rs = tor_malloc_zero(sizeof(vote_routerstatus_t));
-      if (routerstatus_parse_entry_from_string(rs_area, &s, eos, rs_tokens, ns,
-                                               rs, 0, 0)) {
+      if (routerstatus_parse_next_entry(rs_job, rs_area, &s, eos, rs_tokens,
+                                        ns, rs, 0, 0)) {
         smartlist_add(ns->routerstatus_list, rs);
       } else {
         vote_routerstatus_free(rs);
@@ -1486,11 +1832,11 @@ networkstatus_parse_vote_from_string(const char *s,
       }
     } else {
       routerstatus_t *rs;
-      if ((rs = routerstatus_parse_entry_from_string(rs_area, &s, eos,
-                                                     rs_tokens,
-                                                     NULL, NULL,
-                                                     ns->consensus_method,
-                                                     flav))) {
+      if ((rs = routerstatus_parse_next_entry(rs_job, rs_area, &s, eos,
+                                              rs_tokens,
+                                              NULL, NULL,
+                                              ns->consensus_method,
+                                              flav))) {
         /* Use exponential-backoff scheduling when downloading microdescs */
         smartlist_add(ns->routerstatus_list, rs);
       } else {
@@ -1532,6 +1878,14 @@ networkstatus_parse_vote_from_string(const char *s,
     digest256map_free(ed_id_map, NULL);
   }
 
+  if (digest_job &&
+      ns_digest_job_finish(digest_job, &ns_digests, sha3_as_signed) < 0) {
+    log_warn(LD_DIR, "Unable to compute digest of network-status");
+    goto err;
+  }
+  memcpy(&ns->digests, &ns_digests, sizeof(ns_digests));
+  memcpy(&ns->digest_sha3_as_signed, sha3_as_signed, sizeof(sha3_as_signed));
+
   /* Parse footer; check signature. */
   footer_tokens = smartlist_new();
   if ((end_of_footer = tor_memstr(s, eos-s, "\nnetwork-status-version ")))
@@ -1733,7 +2087,40 @@ networkstatus_parse_vote_from_string(const char *s,
   }
   if (rs_area)
     memarea_drop_all(rs_area);
+  if (snapshot_entries) {
+    SMARTLIST_FOREACH(snapshot_entries, routerstatus_t *, rs,
+                      routerstatus_free(rs));
+    smartlist_free(snapshot_entries);
+  }
+  rs_chunk_job_free(rs_job);
+  ns_digest_job_free(digest_job);
   tor_free(last_kwd);
 
   return ns;
 }
+
+/** Parse a v3 networkstatus vote, opinion, or consensus (depending on
+ * ns_type), from <b>s</b>, and return the result.  Return NULL on failure. */
+networkstatus_t *
+networkstatus_parse_vote_from_string(const char *s,
+                                     size_t s_len,
+                                     const char **eos_out,
+                                     networkstatus_type_t ns_type)
+{
+  return networkstatus_parse_impl(s, s_len, eos_out, ns_type, NULL, 0, NULL);
+}
+
+/** Parse a consensus from the <b>s_len</b> bytes at <b>s</b>, as
+ * networkstatus_parse_vote_from_string() would.  If <b>snapshot</b> is a
+ * snapshot that we made of this same consensus with ns_snapshot_encode(),
+ * take the router status entries from it rather than parsing them again,
+ * and set *<b>used_snapshot_out</b> to 1.  Otherwise, set it to 0. */
+networkstatus_t *
+networkstatus_parse_consensus_with_snapshot(const char *s, size_t s_len,
+                                            const char *snapshot,
+                                            size_t snapshot_len,
+                                            int *used_snapshot_out)
+{
+  return networkstatus_parse_impl(s, s_len, NULL, NS_TYPE_CONSENSUS,
+                                  snapshot, snapshot_len, used_snapshot_out);
+}
@@ -27,6 +27,11 @@ networkstatus_t *networkstatus_parse_vote_from_string(const char *s,
                                            size_t len,
                                            const char **eos_out,
                                            enum networkstatus_type_t ns_type);
+networkstatus_t *networkstatus_parse_consensus_with_snapshot(const char *s,
+                                                     size_t s_len,
+                                                     const char *snapshot,
+                                                     size_t snapshot_len,
+                                                     int *used_snapshot_out);
 
 #ifdef NS_PARSE_PRIVATE
 STATIC int routerstatus_parse_guardfraction(const char *guardfraction_str,
@@ -42,6 +47,9 @@ STATIC routerstatus_t *routerstatus_parse_entry_from_string(
                                      vote_routerstatus_t *vote_rs,
                                      int consensus_method,
                                      consensus_flavor_t flav);
+#ifdef TOR_UNIT_TESTS
+extern size_t rs_chunk_min_bytes;
+#endif
 #endif /* defined(NS_PARSE_PRIVATE) */
 
 #endif /* !defined(TOR_NS_PARSE_H) */
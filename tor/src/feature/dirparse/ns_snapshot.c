@@ -0,0 +1,384 @@
+/* Copyright (c) 2022, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file ns_snapshot.c
+ * \brief Binary snapshots of the router status entries in a consensus.
+ *
+ * Parsing the router status entries is most of the work of loading a
+ * consensus, and on every restart we parse the same cached consensus that
+ * we parsed last time.  So once we have accepted a consensus, we also save
+ * its entries in a simple binary form.  When we load the cached consensus
+ * again, ns_parse.c still parses its header and footer, but takes the
+ * entries from the snapshot instead of tokenizing them.
+ *
+ * A snapshot only applies to the exact document it was made from: we key it
+ * on the SHA256 digest of the consensus as signed, which we compute while
+ * parsing anyway.  It also records the version of Tor that wrote it, since
+ * another version might parse the same entries differently, and a checksum
+ * of its contents.  If anything doesn't match, we ignore the snapshot and
+ * parse the text as usual.
+ *
+ * A snapshot starts with a header of NS_SNAPSHOT_HEADER_LEN bytes; all
+ * integers are in network order:
+ *
+ *    8 bytes   "TorNsSn\n"
+ *    4 bytes   Format version (1)
+ *    4 bytes   Consensus flavor
+ *   32 bytes   SHA256 of the consensus as signed
+ *    4 bytes   Offset of the first router status entry in the consensus
+ *    4 bytes   Offset just after the last one
+ *    4 bytes   Number of entries
+ *   32 bytes   SHA256 of everything after the header
+ *   64 bytes   Version of Tor that wrote the snapshot, NUL-padded
+ *
+ * followed by the entries themselves, in the same order as in the consensus.
+ * See ns_snapshot_encode_entry() for their format.
+ **/
+
+#define NS_SNAPSHOT_PRIVATE
+
+#include "core/or/or.h"
+#include "feature/dirparse/ns_snapshot.h"
+#include "feature/nodelist/networkstatus.h"
+#include "lib/crypt_ops/crypto_digest.h"
+#include "lib/version/torversion.h"
+
+#include "feature/nodelist/networkstatus_st.h"
+#include "feature/nodelist/routerstatus_st.h"
+
+/** Magic bytes at the start of every snapshot. */
+#define NS_SNAPSHOT_MAGIC "TorNsSn\n"
+/** The snapshot format we write and understand. */
+#define NS_SNAPSHOT_FORMAT_VERSION 1
+/** Space for the Tor version in the header. */
+#define NS_SNAPSHOT_TOR_VERSION_LEN 64
+
+/** Largest encoding of a single entry, not counting its exit summary. */
+#define NS_SNAPSHOT_MAX_ENTRY_LEN \
+  (1 + MAX_NICKNAME_LEN + DIGEST_LEN + DIGEST256_LEN + 8 + 1 + 16 + 2 + \
+   4 + sizeof(protover_summary_flags_t) + 8 + 2)
+
+/** @{ */
+/** Bits for the boolean fields of routerstatus_t in a snapshot entry. */
+#define RS_BIT_AUTHORITY       (1u<<0)
+#define RS_BIT_EXIT            (1u<<1)
+#define RS_BIT_STABLE          (1u<<2)
+#define RS_BIT_FAST            (1u<<3)
+#define RS_BIT_RUNNING         (1u<<4)
+#define RS_BIT_NAMED           (1u<<5)
+#define RS_BIT_UNNAMED         (1u<<6)
+#define RS_BIT_VALID           (1u<<7)
+#define RS_BIT_GUARD           (1u<<8)
+#define RS_BIT_BAD_EXIT        (1u<<9)
+#define RS_BIT_MIDDLE_ONLY     (1u<<10)
+#define RS_BIT_HS_DIR          (1u<<11)
+#define RS_BIT_V2_DIR          (1u<<12)
+#define RS_BIT_STALEDESC       (1u<<13)
+#define RS_BIT_SYBIL           (1u<<14)
+#define RS_BIT_HAS_BANDWIDTH   (1u<<15)
+#define RS_BIT_HAS_EXITSUMMARY (1u<<16)
+#define RS_BIT_UNMEASURED      (1u<<17)
+#define RS_BIT_GUARDFRACTION   (1u<<18)
+/** @} */
+
+/** Return the flag bits to store for <b>rs</b>. */
+static uint32_t
+routerstatus_get_snapshot_bits(const routerstatus_t *rs)
+{
+  uint32_t bits = 0;
+  bits |= rs->is_authority ? RS_BIT_AUTHORITY : 0;
+  bits |= rs->is_exit ? RS_BIT_EXIT : 0;
+  bits |= rs->is_stable ? RS_BIT_STABLE : 0;
+  bits |= rs->is_fast ? RS_BIT_FAST : 0;
+  bits |= rs->is_flagged_running ? RS_BIT_RUNNING : 0;
+  bits |= rs->is_named ? RS_BIT_NAMED : 0;
+  bits |= rs->is_unnamed ? RS_BIT_UNNAMED : 0;
+  bits |= rs->is_valid ? RS_BIT_VALID : 0;
+  bits |= rs->is_possible_guard ? RS_BIT_GUARD : 0;
+  bits |= rs->is_bad_exit ? RS_BIT_BAD_EXIT : 0;
+  bits |= rs->is_middle_only ? RS_BIT_MIDDLE_ONLY : 0;
+  bits |= rs->is_hs_dir ? RS_BIT_HS_DIR : 0;
+  bits |= rs->is_v2_dir ? RS_BIT_V2_DIR : 0;
+  bits |= rs->is_staledesc ? RS_BIT_STALEDESC : 0;
+  bits |= rs->is_sybil ? RS_BIT_SYBIL : 0;
+  bits |= rs->has_bandwidth ? RS_BIT_HAS_BANDWIDTH : 0;
+  bits |= rs->has_exitsummary ? RS_BIT_HAS_EXITSUMMARY : 0;
+  bits |= rs->bw_is_unmeasured ? RS_BIT_UNMEASURED : 0;
+  bits |= rs->has_guardfraction ? RS_BIT_GUARDFRACTION : 0;
+  return bits;
+}
+
+/** Set the boolean fields of <b>rs</b> from the snapshot <b>bits</b>. */
+static void
+routerstatus_set_snapshot_bits(routerstatus_t *rs, uint32_t bits)
+{
+  rs->is_authority = !!(bits & RS_BIT_AUTHORITY);
+  rs->is_exit = !!(bits & RS_BIT_EXIT);
+  rs->is_stable = !!(bits & RS_BIT_STABLE);
+  rs->is_fast = !!(bits & RS_BIT_FAST);
+  rs->is_flagged_running = !!(bits & RS_BIT_RUNNING);
+  rs->is_named = !!(bits & RS_BIT_NAMED);
+  rs->is_unnamed = !!(bits & RS_BIT_UNNAMED);
+  rs->is_valid = !!(bits & RS_BIT_VALID);
+  rs->is_possible_guard = !!(bits & RS_BIT_GUARD);
+  rs->is_bad_exit = !!(bits & RS_BIT_BAD_EXIT);
+  rs->is_middle_only = !!(bits & RS_BIT_MIDDLE_ONLY);
+  rs->is_hs_dir = !!(bits & RS_BIT_HS_DIR);
+  rs->is_v2_dir = !!(bits & RS_BIT_V2_DIR);
+  rs->is_staledesc = !!(bits & RS_BIT_STALEDESC);
+  rs->is_sybil = !!(bits & RS_BIT_SYBIL);
+  rs->has_bandwidth = !!(bits & RS_BIT_HAS_BANDWIDTH);
+  rs->has_exitsummary = !!(bits & RS_BIT_HAS_EXITSUMMARY);
+  rs->bw_is_unmeasured = !!(bits & RS_BIT_UNMEASURED);
+  rs->has_guardfraction = !!(bits & RS_BIT_GUARDFRACTION);
+}
+
+/** Encode <b>rs</b> at <b>out</b>, which must have room for
+ * NS_SNAPSHOT_MAX_ENTRY_LEN bytes plus the length of its exit summary, and
+ * return the number of bytes written.
+ *
+ * An entry holds: the nickname (1 byte of length, then the nickname), the
+ * identity and descriptor digests, the IPv4 address, OR port and dir port
+ * (4+2+2 bytes), the IPv6 address (1 byte that is 1 iff there is one, then
+ * 16 bytes) and OR port (2 bytes), the flag bits (4 bytes), the protocol
+ * summary as it is in memory, the bandwidth and guardfraction (4 bytes
+ * each), and the exit summary (2 bytes of length, then the summary). */
+static size_t
+ns_snapshot_encode_entry(char *out, const routerstatus_t *rs)
+{
+  char *cp = out;
+  const size_t nick_len = strlen(rs->nickname);
+  const size_t summary_len =
+    rs->exitsummary ? strlen(rs->exitsummary) : 0;
+
+  *cp++ = (uint8_t) nick_len;
+  memcpy(cp, rs->nickname, nick_len);
+  cp += nick_len;
+  memcpy(cp, rs->identity_digest, DIGEST_LEN);
+  cp += DIGEST_LEN;
+  memcpy(cp, rs->descriptor_digest, DIGEST256_LEN);
+  cp += DIGEST256_LEN;
+  set_uint32(cp, htonl(tor_addr_to_ipv4h(&rs->ipv4_addr)));
+  set_uint16(cp+4, htons(rs->ipv4_orport));
+  set_uint16(cp+6, htons(rs->ipv4_dirport));
+  cp += 8;
+  if (tor_addr_family(&rs->ipv6_addr) == AF_INET6) {
+    *cp = 1;
+    memcpy(cp+1, tor_addr_to_in6_addr8(&rs->ipv6_addr), 16);
+  } else {
+    memset(cp, 0, 17);
+  }
+  cp += 17;
+  set_uint16(cp, htons(rs->ipv6_orport));
+  cp += 2;
+  set_uint32(cp, htonl(routerstatus_get_snapshot_bits(rs)));
+  cp += 4;
+  memcpy(cp, &rs->pv, sizeof(rs->pv));
+  cp += sizeof(rs->pv);
+  set_uint32(cp, htonl(rs->bandwidth_kb));
+  set_uint32(cp+4, htonl(rs->guardfraction_percentage));
+  cp += 8;
+  set_uint16(cp, htons((uint16_t) summary_len));
+  cp += 2;
+  memcpy(cp, rs->exitsummary ? rs->exitsummary : "", summary_len);
+  cp += summary_len;
+
+  return cp - out;
+}
+
+/** Return a newly allocated snapshot of the router status entries of the
+ * consensus <b>ns</b>, which we parsed from the <b>body_len</b> bytes at
+ * <b>body</b>, and set *<b>len_out</b> to its length.  Return NULL if we
+ * can't make a snapshot of this consensus. */
+char *
+ns_snapshot_encode(const networkstatus_t *ns,
+                   const char *body, size_t body_len,
+                   size_t *len_out)
+{
+  const char *entries_start, *entries_end;
+  const char *version = get_version();
+  size_t alloc_len = NS_SNAPSHOT_HEADER_LEN;
+  char *snapshot, *cp;
+
+  tor_assert(ns);
+  tor_assert(body);
+  tor_assert(len_out);
+
+  if (ns->type != NS_TYPE_CONSENSUS ||
+      smartlist_len(ns->routerstatus_list) == 0 ||
+      strlen(version) >= NS_SNAPSHOT_TOR_VERSION_LEN ||
+      body_len > UINT32_MAX)
+    return NULL;
+
+  /* Find the entries the same way the parser does. */
+  entries_start = tor_memstr(body, body_len, "\nr ");
+  if (!entries_start)
+    return NULL;
+  ++entries_start;
+  entries_end = tor_memstr(entries_start, body + body_len - entries_start,
+                           "\ndirectory-footer\n");
+  if (!entries_end)
+    return NULL;
+  ++entries_end;
+
+  SMARTLIST_FOREACH(ns->routerstatus_list, const routerstatus_t *, rs,
+    alloc_len += NS_SNAPSHOT_MAX_ENTRY_LEN +
+                 (rs->exitsummary ? strlen(rs->exitsummary) : 0));
+  snapshot = tor_malloc_zero(alloc_len);
+
+  cp = snapshot;
+  memcpy(cp, NS_SNAPSHOT_MAGIC, 8);
+  set_uint32(cp+8, htonl(NS_SNAPSHOT_FORMAT_VERSION));
+  set_uint32(cp+12, htonl(ns->flavor));
+  memcpy(cp+16, ns->digests.d[DIGEST_SHA256], DIGEST256_LEN);
+  set_uint32(cp+48, htonl((uint32_t)(entries_start - body)));
+  set_uint32(cp+52, htonl((uint32_t)(entries_end - body)));
+  set_uint32(cp+56, htonl(smartlist_len(ns->routerstatus_list)));
+  /* The checksum at NS_SNAPSHOT_CHECKSUM_OFFSET goes in last. */
+  strlcpy(cp+92, version, NS_SNAPSHOT_TOR_VERSION_LEN);
+  cp += NS_SNAPSHOT_HEADER_LEN;
+
+  SMARTLIST_FOREACH(ns->routerstatus_list, const routerstatus_t *, rs,
+                    cp += ns_snapshot_encode_entry(cp, rs));
+
+  *len_out = cp - snapshot;
+  crypto_digest256(snapshot + NS_SNAPSHOT_CHECKSUM_OFFSET,
+                   snapshot + NS_SNAPSHOT_HEADER_LEN,
+                   *len_out - NS_SNAPSHOT_HEADER_LEN, DIGEST_SHA256);
+  return snapshot;
+}
+
+/** Decode one entry from the bytes between *<b>cp</b> and <b>end</b>,
+ * advance *<b>cp</b> past it, and return it.  Return NULL if the entry is
+ * malformed or truncated. */
+static routerstatus_t *
+ns_snapshot_decode_entry(const char **cp, const char *end)
+{
+  const char *p = *cp;
+  routerstatus_t *rs = NULL;
+  size_t nick_len, summary_len;
+
+#define NEED(n) do {                            \
+    if ((size_t)(end - p) < (size_t)(n))        \
+      goto err;                                 \
+  } while (0)
+
+  rs = tor_malloc_zero(sizeof(routerstatus_t));
+
+  NEED(1);
+  nick_len = (uint8_t) *p++;
+  if (nick_len > MAX_NICKNAME_LEN)
+    goto err;
+  NEED(nick_len + DIGEST_LEN + DIGEST256_LEN + 8 + 17 + 2 + 4 +
+       sizeof(rs->pv) + 8 + 2);
+  memcpy(rs->nickname, p, nick_len);
+  p += nick_len;
+  memcpy(rs->identity_digest, p, DIGEST_LEN);
+  p += DIGEST_LEN;
+  memcpy(rs->descriptor_digest, p, DIGEST256_LEN);
+  p += DIGEST256_LEN;
+  tor_addr_from_ipv4h(&rs->ipv4_addr, ntohl(get_uint32(p)));
+  rs->ipv4_orport = ntohs(get_uint16(p+4));
+  rs->ipv4_dirport = ntohs(get_uint16(p+6));
+  p += 8;
+  if (*p == 1)
+    tor_addr_from_ipv6_bytes(&rs->ipv6_addr, (const uint8_t *)p+1);
+  else if (*p != 0)
+    goto err;
+  p += 17;
+  rs->ipv6_orport = ntohs(get_uint16(p));
+  p += 2;
+  routerstatus_set_snapshot_bits(rs, ntohl(get_uint32(p)));
+  p += 4;
+  memcpy(&rs->pv, p, sizeof(rs->pv));
+  p += sizeof(rs->pv);
+  rs->bandwidth_kb = ntohl(get_uint32(p));
+  rs->guardfraction_percentage = ntohl(get_uint32(p+4));
+  p += 8;
+  summary_len = ntohs(get_uint16(p));
+  p += 2;
+  if (rs->has_exitsummary) {
+    NEED(summary_len);
+    if (memchr(p, '\0', summary_len))
+      goto err;
+    rs->exitsummary = tor_memdup_nulterm(p, summary_len);
+    p += summary_len;
+  } else if (summary_len) {
+    goto err;
+  }
+#undef NEED
+
+  *cp = p;
+  return rs;
+ err:
+  routerstatus_free(rs);
+  return NULL;
+}
+
+/** Try to use the <b>snapshot_len</b>-byte <b>snapshot</b> in place of the
+ * router status entries of a consensus of flavor <b>flavor</b>, whose
+ * digests as signed are in <b>digests</b>, and whose entries start
+ * <b>entries_start</b> bytes into the document.
+ *
+ * If the snapshot was made from that consensus, by this version of Tor, and
+ * isn't damaged, return a new list of the routerstatus_t entries it holds,
+ * and set *<b>entries_end_out</b> to the offset just after the entries in
+ * the consensus.  Otherwise return NULL. */
+smartlist_t *
+ns_snapshot_decode_routerstatuses(const char *snapshot, size_t snapshot_len,
+                                  consensus_flavor_t flavor,
+                                  const common_digests_t *digests,
+                                  size_t entries_start,
+                                  size_t *entries_end_out)
+{
+  const char *version = get_version();
+  char checksum[DIGEST256_LEN];
+  const char *cp, *end = snapshot + snapshot_len;
+  smartlist_t *result = NULL;
+  uint32_t n_entries;
+
+  /* Check the cheap things first: most mismatches are snapshots of an older
+   * consensus. */
+  if (snapshot_len < NS_SNAPSHOT_HEADER_LEN ||
+      fast_memneq(snapshot, NS_SNAPSHOT_MAGIC, 8) ||
+      ntohl(get_uint32(snapshot+8)) != NS_SNAPSHOT_FORMAT_VERSION ||
+      ntohl(get_uint32(snapshot+12)) != (uint32_t) flavor ||
+      fast_memneq(snapshot+16, digests->d[DIGEST_SHA256], DIGEST256_LEN) ||
+      ntohl(get_uint32(snapshot+48)) != entries_start)
+    return NULL;
+  if (strnlen(snapshot+92, NS_SNAPSHOT_TOR_VERSION_LEN) !=
+        strlen(version) ||
+      fast_memneq(snapshot+92, version, strlen(version)))
+    return NULL;
+
+  crypto_digest256(checksum, snapshot + NS_SNAPSHOT_HEADER_LEN,
+                   snapshot_len - NS_SNAPSHOT_HEADER_LEN, DIGEST_SHA256);
+  if (tor_memneq(checksum, snapshot + NS_SNAPSHOT_CHECKSUM_OFFSET,
+                 DIGEST256_LEN))
+    return NULL;
+
+  n_entries = ntohl(get_uint32(snapshot+56));
+  /* Every entry takes more than 64 bytes. */
+  if (n_entries > snapshot_len / 64)
+    return NULL;
+
+  result = smartlist_new();
+  cp = snapshot + NS_SNAPSHOT_HEADER_LEN;
+  for (uint32_t i = 0; i < n_entries; ++i) {
+    routerstatus_t *rs = ns_snapshot_decode_entry(&cp, end);
+    if (!rs)
+      goto err;
+    smartlist_add(result, rs);
+  }
+  if (cp != end)
+    goto err;
+
+  *entries_end_out = ntohl(get_uint32(snapshot+52));
+  return result;
+
+ err:
+  SMARTLIST_FOREACH(result, routerstatus_t *, rs, routerstatus_free(rs));
+  smartlist_free(result);
+  return NULL;
+}
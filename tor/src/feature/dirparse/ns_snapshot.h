@@ -0,0 +1,29 @@
+/* Copyright (c) 2022, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file ns_snapshot.h
+ * \brief Header file for ns_snapshot.c.
+ **/
+
+#ifndef TOR_NS_SNAPSHOT_H
+#define TOR_NS_SNAPSHOT_H
+
+char *ns_snapshot_encode(const networkstatus_t *ns,
+                         const char *body, size_t body_len,
+                         size_t *len_out);
+smartlist_t *ns_snapshot_decode_routerstatuses(const char *snapshot,
+                                               size_t snapshot_len,
+                                               consensus_flavor_t flavor,
+                                               const common_digests_t *digests,
+                                               size_t entries_start,
+                                               size_t *entries_end_out);
+
+#ifdef NS_SNAPSHOT_PRIVATE
+/** Length of the fixed header at the start of a snapshot. */
+#define NS_SNAPSHOT_HEADER_LEN 156
+/** Offset of the checksum within the header. */
+#define NS_SNAPSHOT_CHECKSUM_OFFSET 60
+#endif /* defined(NS_SNAPSHOT_PRIVATE) */
+
+#endif /* !defined(TOR_NS_SNAPSHOT_H) */
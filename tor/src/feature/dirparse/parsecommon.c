@@ -44,6 +44,74 @@ token_clear(directory_token_t *tok)
     crypto_pk_free(tok->key);
 }
 
+/** Bits of tok_char_class: what each byte means to the tokenizer. */
+/** Space, tab or CR: separates keywords and arguments on a line. */
+#define TC_SPACE   (1u<<0)
+/** Newline: ends a line. */
+#define TC_NL      (1u<<1)
+/** Starts a comment, which runs to the end of the line. */
+#define TC_COMMENT (1u<<2)
+/** NUL: ends a string. */
+#define TC_NUL     (1u<<3)
+
+/** Tokenizer class of every byte value, so that the scanning loops below
+ * look up one table entry per byte instead of testing it against each of
+ * the characters that can end a word. The longer scans, for line ends and
+ * object ends, use memchr() and tor_memstr(), which the C library already
+ * vectorizes. */
+static const uint8_t tok_char_class[256] = {
+  ['\0'] = TC_NUL,
+  ['\t'] = TC_SPACE,
+  ['\n'] = TC_NL,
+  ['\r'] = TC_SPACE,
+  [' '] = TC_SPACE,
+  ['#'] = TC_COMMENT,
+};
+
+/** As find_whitespace_eos(): return a pointer to the first byte of <b>s</b>
+ * that is whitespace, <b>#</b> or NUL, or <b>eos</b> if there is none. */
+static inline const char *
+tok_find_whitespace(const char *s, const char *eos)
+{
+  while (s < eos && !tok_char_class[(uint8_t)*s])
+    ++s;
+  return s;
+}
+
+/** As eat_whitespace_eos_no_nl(): return a pointer to the first byte of
+ * <b>s</b> that is not a space, a tab or a CR, or <b>eos</b> if there is
+ * none. */
+static inline const char *
+tok_eat_whitespace_no_nl(const char *s, const char *eos)
+{
+  while (s < eos && tok_char_class[(uint8_t)*s] == TC_SPACE)
+    ++s;
+  return s;
+}
+
+/** As eat_whitespace_eos(): return a pointer to the first byte of <b>s</b>
+ * that is neither whitespace nor part of a comment, or <b>eos</b> if there
+ * is none. */
+static inline const char *
+tok_eat_whitespace(const char *s, const char *eos)
+{
+  while (s < eos) {
+    const uint8_t c = tok_char_class[(uint8_t)*s];
+    if (c & (TC_SPACE|TC_NL)) {
+      ++s;
+    } else if (c & TC_COMMENT) {
+      /* Skip to the end of the line, stopping at NUL as the rest of the
+       * tokenizer does. */
+      ++s;
+      while (s < eos && !(tok_char_class[(uint8_t)*s] & (TC_NL|TC_NUL)))
+        ++s;
+    } else {
+      break;
+    }
+  }
+  return s;
+}
+
 /** Read all tokens from a string between <b>start</b> and <b>end</b>, and add
  * them to <b>out</b>.  Parse according to the token rules in <b>table</b>.
  * Caller must free tokens in <b>out</b>.  If <b>end</b> is NULL, use the
@@ -86,7 +154,7 @@ tokenize_string(memarea_t *area,
     }
     ++counts[tok->tp];
     smartlist_add(out, tok);
-    *s = eat_whitespace_eos(*s, end);
+    *s = tok_eat_whitespace(*s, end);
   }
 
   if (flags & TS_NOCHECK)
@@ -168,17 +236,19 @@ get_token_arguments(memarea_t *area, directory_token_t *tok,
 #define MAX_ARGS 512
   char *mem = memarea_strndup(area, s, eol-s);
   char *cp = mem;
+  /* memarea_strndup() stops at the first NUL, if any. */
+  const char *end = mem + strlen(mem);
   int j = 0;
   char *args[MAX_ARGS];
-  while (*cp) {
+  while (cp < end) {
     if (j == MAX_ARGS)
       return -1;
     args[j++] = cp;
-    cp = (char*)find_whitespace(cp);
-    if (!cp || !*cp)
+    cp = (char*)tok_find_whitespace(cp, end);
+    if (cp == end)
       break; /* End of the line. */
     *cp++ = '\0';
-    cp = (char*)eat_whitespace(cp);
+    cp = (char*)tok_eat_whitespace(cp, end);
   }
   tok->n_args = j;
   tok->args = memarea_memdup(area, args, j*sizeof(char*));
@@ -245,12 +315,19 @@ token_check_object(memarea_t *area, const char *kwd,
 
 /** Return true iff the <b>memlen</b>-byte chunk of memory at
  * <b>memlen</b> is the same length as <b>token</b>, and their
- * contents are equal. */
-static bool
+ * contents are equal. The chunk must not contain NUL. */
+static inline bool
 mem_eq_token(const void *mem, size_t memlen, const char *token)
 {
-  size_t len = strlen(token);
-  return memlen == len && fast_memeq(mem, token, len);
+  /* Keyword lookups compare each line against most of a token table, and
+   * nearly all the entries already differ in their first byte: check it
+   * before looking at the rest of <b>token</b>. */
+  if (memlen == 0)
+    return token[0] == '\0';
+  if (*(const char *)mem != token[0])
+    return false;
+  /* strncmp() stops at the end of token if it is shorter than memlen. */
+  return !strncmp(token, mem, memlen) && token[memlen] == '\0';
 }
 
 /** Helper function: read the next token from *s, advance *s to the end of the
@@ -281,7 +358,7 @@ get_next_token(memarea_t *area,
   tok->tp = ERR_;
 
   /* Set *s to first token, eol to end-of-line, next to after first token */
-  *s = eat_whitespace_eos(*s, eos); /* eat multi-line whitespace */
+  *s = tok_eat_whitespace(*s, eos); /* eat multi-line whitespace */
   tor_assert(eos >= *s);
   eol = memchr(*s, '\n', eos-*s);
   if (!eol)
@@ -290,12 +367,12 @@ get_next_token(memarea_t *area,
     RET_ERR("Line far too long");
   }
 
-  next = find_whitespace_eos(*s, eol);
+  next = tok_find_whitespace(*s, eol);
 
   if (mem_eq_token(*s, next-*s, "opt")) {
     /* Skip past an "opt" at the start of the line. */
-    *s = eat_whitespace_eos_no_nl(next, eol);
-    next = find_whitespace_eos(*s, eol);
+    *s = tok_eat_whitespace_no_nl(next, eol);
+    next = tok_find_whitespace(*s, eol);
   } else if (*s == eos) {  /* If no "opt", and end-of-line, line is invalid */
     RET_ERR("Unexpected EOF");
   }
@@ -308,7 +385,7 @@ get_next_token(memarea_t *area,
       kwd = table[i].t;
       tok->tp = table[i].v;
       o_syn = table[i].os;
-      *s = eat_whitespace_eos_no_nl(next, eol);
+      *s = tok_eat_whitespace_no_nl(next, eol);
       /* We go ahead whether there are arguments or not, so that tok->args is
        * always set if we want arguments. */
       if (table[i].concat_args) {
@@ -348,10 +425,14 @@ get_next_token(memarea_t *area,
   }
 
   /* Check whether there's an object present */
-  *s = eat_whitespace_eos(eol, eos);  /* Scan from end of first line */
+  *s = tok_eat_whitespace(eol, eos);  /* Scan from end of first line */
   tor_assert(eos >= *s);
+  /* Look at the start of the line before looking for its end: most tokens
+   * have no object, and the next token will find the same line end again. */
+  if (eos-*s < 11 || !fast_memeq(*s, "-----BEGIN ", 11)) /* No object. */
+    goto check_object;
   eol = memchr(*s, '\n', eos-*s);
-  if (!eol || eol-*s<11 || strcmpstart(*s, "-----BEGIN ")) /* No object. */
+  if (!eol) /* No object. */
     goto check_object;
 
   if (eol - *s <= 16 || memchr(*s+11,'\0',eol-*s-16) || /* no short lines, */
@@ -1272,61 +1272,99 @@ decode_create2_list(hs_desc_encrypted_data_t *desc, const char *list)
   smartlist_free(tokens);
 }
 
-/** Given a certificate, validate the certificate for certain conditions which
- * are if the given type matches the cert's one, if the signing key is
- * included and if the that key was actually used to sign the certificate.
+/** Given a certificate, check that its type matches <b>type</b> and that it
+ * includes its signing key, without checking its signature.
  *
- * Return 1 iff if all conditions pass or 0 if one of them fails. */
-STATIC int
-cert_is_valid(tor_cert_t *cert, uint8_t type, const char *log_obj_type)
+ * Return 1 iff both conditions pass or 0 if one of them fails. */
+static int
+cert_is_well_formed(const tor_cert_t *cert, uint8_t type,
+                    const char *log_obj_type)
 {
   tor_assert(log_obj_type);
 
   if (cert == NULL) {
     log_warn(LD_REND, "Certificate for %s couldn't be parsed.", log_obj_type);
-    goto err;
+    return 0;
   }
   if (cert->cert_type != type) {
     log_warn(LD_REND, "Invalid cert type %02x for %s.", cert->cert_type,
              log_obj_type);
-    goto err;
+    return 0;
   }
   /* All certificate must have its signing key included. */
   if (!cert->signing_key_included) {
     log_warn(LD_REND, "Signing key is NOT included for %s.", log_obj_type);
-    goto err;
+    return 0;
+  }
+  return 1;
+}
+
+/** Log why the signature check on <b>cert</b> failed. */
+static void
+log_cert_sig_failure(const tor_cert_t *cert, const char *log_obj_type)
+{
+  if (cert->cert_expired) {
+    char expiration_str[ISO_TIME_LEN+1];
+    format_iso_time(expiration_str, cert->valid_until);
+    log_fn(LOG_PROTOCOL_WARN, LD_REND, "Invalid signature for %s: %s (%s)",
+           log_obj_type, tor_cert_describe_signature_status(cert),
+           expiration_str);
+  } else {
+    log_warn(LD_REND, "Invalid signature for %s: %s",
+             log_obj_type, tor_cert_describe_signature_status(cert));
+  }
+}
+
+/** Given a certificate, validate the certificate for certain conditions which
+ * are if the given type matches the cert's one, if the signing key is
+ * included and if the that key was actually used to sign the certificate.
+ *
+ * Return 1 iff if all conditions pass or 0 if one of them fails. */
+STATIC int
+cert_is_valid(tor_cert_t *cert, uint8_t type, const char *log_obj_type)
+{
+  if (!cert_is_well_formed(cert, type, log_obj_type)) {
+    return 0;
   }
 
   /* The following will not only check if the signature matches but also the
    * expiration date and overall validity. */
   if (tor_cert_checksig(cert, &cert->signing_key, approx_time()) < 0) {
-    if (cert->cert_expired) {
-      char expiration_str[ISO_TIME_LEN+1];
-      format_iso_time(expiration_str, cert->valid_until);
-      log_fn(LOG_PROTOCOL_WARN, LD_REND, "Invalid signature for %s: %s (%s)",
-             log_obj_type, tor_cert_describe_signature_status(cert),
-             expiration_str);
-    } else {
-      log_warn(LD_REND, "Invalid signature for %s: %s",
-               log_obj_type, tor_cert_describe_signature_status(cert));
-    }
-    goto err;
+    log_cert_sig_failure(cert, log_obj_type);
+    return 0;
   }
 
   return 1;
- err:
-  return 0;
+}
+
+/** Return 1 iff <b>cert</b> was signed with <b>signing_pubkey</b>, according
+ * to the signing key included in it. Return 0 otherwise.
+ *
+ * This does not check the signature itself: the introduction point
+ * certificates get that from intro_points_check_certs(), all at once. */
+static int
+cert_is_signed_by(const tor_cert_t *cert,
+                  const ed25519_public_key_t *signing_pubkey)
+{
+  tor_assert(cert);
+  tor_assert(signing_pubkey);
+
+  return cert->signing_key_included &&
+         ed25519_pubkey_eq(&cert->signing_key, signing_pubkey);
 }
 
 /** Given some binary data, try to parse it to get a certificate object. If we
  * have a valid cert, validate it using the given wanted type. On error, print
  * a log using the err_msg has the certificate identifier adding semantic to
  * the log and cert_out is set to NULL. On success, 0 is returned and cert_out
- * points to a newly allocated certificate object. */
+ * points to a newly allocated certificate object.
+ *
+ * If <b>check_sig</b> is false, don't check the signature on the
+ * certificate: the caller must do that. */
 static int
 cert_parse_and_validate(tor_cert_t **cert_out, const char *data,
                         size_t data_len, unsigned int cert_type_wanted,
-                        const char *err_msg)
+                        const char *err_msg, bool check_sig)
 {
   tor_cert_t *cert;
 
@@ -1342,7 +1380,8 @@ cert_parse_and_validate(tor_cert_t **cert_out, const char *data,
   }
 
   /* Validate certificate. */
-  if (!cert_is_valid(cert, cert_type_wanted, err_msg)) {
+  if (check_sig ? !cert_is_valid(cert, cert_type_wanted, err_msg) :
+      !cert_is_well_formed(cert, cert_type_wanted, err_msg)) {
     goto err;
   }
 
@@ -1804,9 +1843,13 @@ set_intro_point_onion_key(curve25519_public_key_t *onion_key_out,
 /** Given the start of a section and the end of it, decode a single
  * introduction point from that section. Return a newly allocated introduction
  * point object containing the decoded data. Return NULL if the section can't
- * be decoded. */
-STATIC hs_desc_intro_point_t *
-decode_introduction_point(const hs_descriptor_t *desc, const char *start)
+ * be decoded.
+ *
+ * This doesn't check the signatures on the introduction point certificates:
+ * use intro_points_check_certs() for that. */
+static hs_desc_intro_point_t *
+decode_introduction_point_unchecked(const hs_descriptor_t *desc,
+                                    const char *start)
 {
   hs_desc_intro_point_t *ip = NULL;
   memarea_t *area = NULL;
@@ -1854,14 +1897,14 @@ decode_introduction_point(const hs_descriptor_t *desc, const char *start)
   /* Parse cert and do some validation. */
   if (cert_parse_and_validate(&ip->auth_key_cert, tok->object_body,
                               tok->object_size, CERT_TYPE_AUTH_HS_IP_KEY,
-                              "introduction point auth-key") < 0) {
+                              "introduction point auth-key", false) < 0) {
     goto err;
   }
   /* Validate authentication certificate with descriptor signing key. */
-  if (tor_cert_checksig(ip->auth_key_cert,
-                        &desc->plaintext_data.signing_pubkey, 0) < 0) {
-    log_warn(LD_REND, "Invalid authentication key signature: %s",
-             tor_cert_describe_signature_status(ip->auth_key_cert));
+  if (!cert_is_signed_by(ip->auth_key_cert,
+                         &desc->plaintext_data.signing_pubkey)) {
+    log_warn(LD_REND, "Introduction point auth-key certificate is not "
+                      "signed by the descriptor signing key.");
     goto err;
   }
 
@@ -1893,17 +1936,15 @@ decode_introduction_point(const hs_descriptor_t *desc, const char *start)
   }
   if (cert_parse_and_validate(&ip->enc_key_cert, tok->object_body,
                               tok->object_size, CERT_TYPE_CROSS_HS_IP_KEYS,
-                              "introduction point enc-key-cert") < 0) {
+                              "introduction point enc-key-cert", false) < 0) {
     goto err;
   }
-  if (tor_cert_checksig(ip->enc_key_cert,
-                        &desc->plaintext_data.signing_pubkey, 0) < 0) {
-    log_warn(LD_REND, "Invalid encryption key signature: %s",
-             tor_cert_describe_signature_status(ip->enc_key_cert));
+  if (!cert_is_signed_by(ip->enc_key_cert,
+                         &desc->plaintext_data.signing_pubkey)) {
+    log_warn(LD_REND, "Introduction point enc-key-cert is not signed by "
+                      "the descriptor signing key.");
     goto err;
   }
-  /* It is successfully cross certified. Flag the object. */
-  ip->cross_certified = 1;
 
   /* Do we have a "legacy-key" SP key NL ?*/
   tok = find_opt_by_keyword(tokens, R3_INTRO_LEGACY_KEY);
@@ -1930,6 +1971,68 @@ decode_introduction_point(const hs_descriptor_t *desc, const char *start)
   return ip;
 }
 
+/** Check the signatures on the certificates of every introduction point in
+ * <b>intro_points</b>, as one batch. Remove and free each introduction point
+ * with an expired or mis-signed certificate, and flag the others as cross
+ * certified. */
+static void
+intro_points_check_certs(smartlist_t *intro_points)
+{
+  const int n_certs = smartlist_len(intro_points) * 2;
+  tor_cert_t **certs;
+
+  if (!n_certs) {
+    return;
+  }
+
+  certs = tor_calloc(n_certs, sizeof(tor_cert_t *));
+  SMARTLIST_FOREACH_BEGIN(intro_points, hs_desc_intro_point_t *, ip) {
+    certs[ip_sl_idx * 2] = ip->auth_key_cert;
+    certs[ip_sl_idx * 2 + 1] = ip->enc_key_cert;
+  } SMARTLIST_FOREACH_END(ip);
+
+  tor_cert_checksig_batch(certs, n_certs, approx_time());
+
+  SMARTLIST_FOREACH_BEGIN(intro_points, hs_desc_intro_point_t *, ip) {
+    if (!ip->auth_key_cert->cert_valid) {
+      log_cert_sig_failure(ip->auth_key_cert, "introduction point auth-key");
+    } else if (!ip->enc_key_cert->cert_valid) {
+      log_cert_sig_failure(ip->enc_key_cert,
+                           "introduction point enc-key-cert");
+    } else {
+      /* It is successfully cross certified. Flag the object. */
+      ip->cross_certified = 1;
+      continue;
+    }
+    hs_desc_intro_point_free(ip);
+    SMARTLIST_DEL_CURRENT_KEEPORDER(intro_points, ip);
+  } SMARTLIST_FOREACH_END(ip);
+
+  tor_free(certs);
+}
+
+#ifdef TOR_UNIT_TESTS
+/** Given the start of a section and the end of it, decode a single
+ * introduction point from that section, and check its certificates. Return
+ * a newly allocated introduction point object containing the decoded data.
+ * Return NULL if the section can't be decoded or isn't valid. */
+STATIC hs_desc_intro_point_t *
+decode_introduction_point(const hs_descriptor_t *desc, const char *start)
+{
+  smartlist_t *intro_points = smartlist_new();
+  hs_desc_intro_point_t *ip;
+
+  ip = decode_introduction_point_unchecked(desc, start);
+  if (ip) {
+    smartlist_add(intro_points, ip);
+    intro_points_check_certs(intro_points);
+    ip = smartlist_len(intro_points) ? smartlist_get(intro_points, 0) : NULL;
+  }
+  smartlist_free(intro_points);
+  return ip;
+}
+#endif /* defined(TOR_UNIT_TESTS) */
+
 /** Given a descriptor string at <b>data</b>, decode all possible introduction
  * points that we can find. Add the introduction point object to desc_enc as we
  * find them. This function can't fail and it is possible that zero
@@ -1977,7 +2080,8 @@ decode_intro_points(const hs_descriptor_t *desc,
 
   /* Parse the intro points! */
   SMARTLIST_FOREACH_BEGIN(intro_points, const char *, intro_point) {
-    hs_desc_intro_point_t *ip = decode_introduction_point(desc, intro_point);
+    hs_desc_intro_point_t *ip =
+      decode_introduction_point_unchecked(desc, intro_point);
     if (!ip) {
       /* Malformed introduction point section. We'll ignore this introduction
        * point and continue parsing. New or unknown fields are possible for
@@ -1987,6 +2091,9 @@ decode_intro_points(const hs_descriptor_t *desc,
     smartlist_add(desc_enc->intro_points, ip);
   } SMARTLIST_FOREACH_END(intro_point);
 
+  /* Check all of their certificates at once, and drop the ones that fail. */
+  intro_points_check_certs(desc_enc->intro_points);
+
  done:
   SMARTLIST_FOREACH(chunked_desc, char *, a, tor_free(a));
   smartlist_free(chunked_desc);
@@ -2104,7 +2211,7 @@ desc_decode_plaintext_v3(smartlist_t *tokens,
   }
   if (cert_parse_and_validate(&desc->signing_key_cert, tok->object_body,
                               tok->object_size, CERT_TYPE_SIGNING_HS_DESC,
-                              "service descriptor signing key") < 0) {
+                              "service descriptor signing key", true) < 0) {
     goto err;
   }
 
@@ -330,9 +330,11 @@ STATIC size_t build_plaintext_padding(const char *plaintext,
                                       uint8_t **padded_out);
 /* Decoding. */
 STATIC smartlist_t *decode_link_specifiers(const char *encoded);
+#ifdef TOR_UNIT_TESTS
 STATIC hs_desc_intro_point_t *decode_introduction_point(
                                 const hs_descriptor_t *desc,
                                 const char *text);
+#endif /* defined(TOR_UNIT_TESTS) */
 STATIC int encrypted_data_length_is_valid(size_t len);
 STATIC int cert_is_valid(tor_cert_t *cert, uint8_t type,
                          const char *log_obj_type);
@@ -56,6 +56,7 @@ routerstatus_format_entry(const routerstatus_t *rs, const char *version,
   char published[ISO_TIME_LEN+1];
   char identity64[BASE64_DIGEST_LEN+1];
   char digest64[BASE64_DIGEST_LEN+1];
+  char ipv4_buf[TOR_ADDR_BUF_LEN];
   smartlist_t *chunks = smartlist_new();
 
   if (declared_publish_time >= 0) {
@@ -66,7 +67,11 @@ routerstatus_format_entry(const routerstatus_t *rs, const char *version,
     strlcpy(published, "2038-01-01 00:00:00", sizeof(published));
   }
 
-  const char *ip_str = fmt_addr(&rs->ipv4_addr);
+  /* We don't use fmt_addr() here, since the dirauths format consensus
+   * entries from several threads at once. */
+  const char *ip_str = ipv4_buf;
+  if (!tor_addr_to_str(ipv4_buf, &rs->ipv4_addr, sizeof(ipv4_buf), 0))
+    ip_str = "???";
   if (ip_str[0] == '\0')
     goto err;
 
@@ -91,8 +96,11 @@ routerstatus_format_entry(const routerstatus_t *rs, const char *version,
 
   /* Possible "a" line. At most one for now. */
   if (!tor_addr_is_null(&rs->ipv6_addr)) {
-    smartlist_add_asprintf(chunks, "a %s\n",
-                           fmt_addrport(&rs->ipv6_addr, rs->ipv6_orport));
+    char ipv6_buf[TOR_ADDR_BUF_LEN];
+    if (!tor_addr_to_str(ipv6_buf, &rs->ipv6_addr, sizeof(ipv6_buf), 1))
+      strlcpy(ipv6_buf, "???", sizeof(ipv6_buf));
+    smartlist_add_asprintf(chunks, "a %s:%u\n",
+                           ipv6_buf, rs->ipv6_orport);
   }
 
   if (format == NS_V3_CONSENSUS || format == NS_V3_CONSENSUS_MICRODESC)
@@ -195,15 +195,92 @@ microdesc_reset_outdated_dirservers_list(void)
 
 /****************************************************************************/
 
-/** Write the body of <b>md</b> into <b>f</b>, with appropriate annotations.
- * On success, return the total number of bytes written, and set
- * *<b>annotation_len_out</b> to the number of bytes written as
+/** How many bytes of microdescriptors do we collect before writing them to
+ * disk? */
+#define MD_WRITEBUF_LEN (64*1024)
+
+/** A buffer for writing a lot of microdescriptors to a file with few calls to
+ * write(). */
+typedef struct md_writebuf_t {
+  /** The file we're writing to. */
+  int fd;
+  /** The offset in <b>fd</b> at which the next byte we add will end up. */
+  off_t off;
+  /** Number of bytes in <b>buf</b> that we haven't written yet. */
+  size_t len;
+  /** Bytes that we haven't written yet. */
+  char buf[MD_WRITEBUF_LEN];
+} md_writebuf_t;
+
+/** Return a new md_writebuf_t to append to <b>fd</b>. */
+static md_writebuf_t *
+md_writebuf_new(int fd)
+{
+  md_writebuf_t *wb = tor_malloc(sizeof(md_writebuf_t));
+  wb->fd = fd;
+  /* A file opened for appending starts at offset 0 until we write to it. */
+  if (tor_fd_seekend(fd) < 0)
+    log_warn(LD_FS, "Couldn't seek to the end of a microdescriptor file: %s",
+             strerror(errno));
+  wb->off = tor_fd_getpos(fd);
+  if (wb->off < 0)
+    wb->off = 0;
+  wb->len = 0;
+  return wb;
+}
+
+/** Write every byte that we've added to <b>wb</b> to its file.  Return 0 on
+ * success and -1 on failure. */
+static int
+md_writebuf_flush(md_writebuf_t *wb)
+{
+  ssize_t written;
+  if (!wb->len)
+    return 0;
+  written = write_all_to_fd(wb->fd, wb->buf, wb->len);
+  if (written != (ssize_t)wb->len) {
+    written = written < 0 ? 0 : written;
+    log_warn(LD_DIR,
+             "Couldn't write microdescriptors (wrote %ld out of %lu): %s",
+             (long)written, (unsigned long)wb->len, strerror(errno));
+    wb->len = 0;
+    return -1;
+  }
+  wb->len = 0;
+  return 0;
+}
+
+/** Add the <b>len</b> bytes at <b>data</b> to <b>wb</b>, writing them out as
+ * needed.  Return 0 on success and -1 on failure. */
+static int
+md_writebuf_add(md_writebuf_t *wb, const char *data, size_t len)
+{
+  if (wb->len + len > sizeof(wb->buf)) {
+    if (md_writebuf_flush(wb) < 0)
+      return -1;
+  }
+  if (len > sizeof(wb->buf)) {
+    if (write_all_to_fd(wb->fd, data, len) != (ssize_t)len) {
+      log_warn(LD_DIR, "Couldn't write microdescriptor: %s", strerror(errno));
+      return -1;
+    }
+  } else {
+    memcpy(wb->buf + wb->len, data, len);
+    wb->len += len;
+  }
+  wb->off += len;
+  return 0;
+}
+
+/** Add the body of <b>md</b> to <b>wb</b>, with appropriate annotations.
+ * On success, return the total number of bytes added, and set
+ * *<b>annotation_len_out</b> to the number of bytes added as
  * annotations. */
 static ssize_t
-dump_microdescriptor(int fd, microdesc_t *md, size_t *annotation_len_out)
+dump_microdescriptor(md_writebuf_t *wb, microdesc_t *md,
+                     size_t *annotation_len_out)
 {
   ssize_t r = 0;
-  ssize_t written;
   if (md->body == NULL) {
     *annotation_len_out = 0;
     return 0;
@@ -214,30 +291,19 @@ dump_microdescriptor(int fd, microdesc_t *md, size_t *annotation_len_out)
     char annotation[ISO_TIME_LEN+32];
     format_iso_time(buf, md->last_listed);
     tor_snprintf(annotation, sizeof(annotation), "@last-listed %s\n", buf);
-    if (write_all_to_fd(fd, annotation, strlen(annotation)) < 0) {
-      log_warn(LD_DIR,
-               "Couldn't write microdescriptor annotation: %s",
-               strerror(errno));
+    if (md_writebuf_add(wb, annotation, strlen(annotation)) < 0)
       return -1;
-    }
     r += strlen(annotation);
     *annotation_len_out = r;
   } else {
     *annotation_len_out = 0;
   }
 
-  md->off = tor_fd_getpos(fd);
+  md->off = wb->off;
   warn_if_nul_found(md->body, md->bodylen, (int64_t) md->off,
                     "dumping a microdescriptor");
-  written = write_all_to_fd(fd, md->body, md->bodylen);
-  if (written != (ssize_t)md->bodylen) {
-    written = written < 0 ? 0 : written;
-    log_warn(LD_DIR,
-             "Couldn't dump microdescriptor (wrote %ld out of %lu): %s",
-             (long)written, (unsigned long)md->bodylen,
-             strerror(errno));
+  if (md_writebuf_add(wb, md->body, md->bodylen) < 0)
     return -1;
-  }
   r += md->bodylen;
   return r;
 }
@@ -387,6 +453,7 @@ microdescs_add_list_to_cache(microdesc_cache_t *cache,
   smartlist_t *added;
   open_file_t *open_file = NULL;
   int fd = -1;
+  md_writebuf_t *wb = NULL;
   //  int n_added = 0;
   ssize_t size = 0;
 
@@ -397,6 +464,8 @@ microdescs_add_list_to_cache(microdesc_cache_t *cache,
     if (fd < 0) {
       log_warn(LD_DIR, "Couldn't append to journal in %s: %s",
                cache->journal_fname, strerror(errno));
+    } else {
+      wb = md_writebuf_new(fd);
     }
   }
 
@@ -417,7 +486,7 @@ microdescs_add_list_to_cache(microdesc_cache_t *cache,
     /* Okay, it's a new one. */
     if (fd >= 0) {
       size_t annotation_len;
-      size = dump_microdescriptor(fd, md, &annotation_len);
+      size = dump_microdescriptor(wb, md, &annotation_len);
       if (size < 0) {
         /* we already warned in dump_microdescriptor */
         abort_writing_to_file(open_file);
@@ -439,6 +508,11 @@ microdescs_add_list_to_cache(microdesc_cache_t *cache,
     cache->total_len_seen += md->bodylen;
   } SMARTLIST_FOREACH_END(md);
 
+  if (fd >= 0 && md_writebuf_flush(wb) < 0) {
+    abort_writing_to_file(open_file);
+    fd = -1;
+  }
+  tor_free(wb);
   if (fd >= 0) {
     if (finish_writing_to_file(open_file) < 0) {
       log_warn(LD_DIR, "Error appending to microdescriptor file: %s",
@@ -697,6 +771,20 @@ microdesc_wipe_body(microdesc_t *md)
   md->no_save = 1;
 }
 
+/** Wipe the body of every microdescriptor in <b>cache</b> whose body points
+ * into the cache file, after we have lost our mapping of that file. */
+static void
+microdesc_cache_wipe_mapped_bodies(microdesc_cache_t *cache)
+{
+  microdesc_t **mdp;
+  HT_FOREACH(mdp, microdesc_map, &cache->map) {
+    microdesc_t *md = *mdp;
+    if (md->saved_location == SAVED_IN_CACHE) {
+      microdesc_wipe_body(md);
+    }
+  }
+}
+
 /** Regenerate the main cache file for <b>cache</b>, clear the journal file,
  * and update every microdesc_t in the cache with pointers to its new
  * location.  If <b>force</b> is true, do this unconditionally.  If
@@ -708,8 +796,8 @@ microdesc_cache_rebuild(microdesc_cache_t *cache, int force)
   int fd = -1, res;
   microdesc_t **mdp;
   smartlist_t *wrote;
-  ssize_t size;
-  off_t off = 0, off_real;
+  md_writebuf_t *wb;
+  ssize_t size = 0;
   int orig_size, new_size;
 
   if (cache == NULL) {
@@ -736,40 +824,32 @@ microdesc_cache_rebuild(microdesc_cache_t *cache, int force)
     return -1;
 
   wrote = smartlist_new();
+  wb = md_writebuf_new(fd);
 
+  /* Collect the microdescriptors into large writes.  Until the new file is
+   * in place, every microdescriptor keeps the body it has now. */
   HT_FOREACH(mdp, microdesc_map, &cache->map) {
     microdesc_t *md = *mdp;
     size_t annotation_len;
     if (md->no_save || !md->body)
       continue;
 
-    size = dump_microdescriptor(fd, md, &annotation_len);
-    if (size < 0) {
-      microdesc_wipe_body(md);
-
-      /* rewind, in case it was a partial write. */
-      tor_fd_setpos(fd, off);
-      continue;
-    }
+    size = dump_microdescriptor(wb, md, &annotation_len);
+    if (size < 0)
+      break;
     tor_assert(((size_t)size) == annotation_len + md->bodylen);
-    md->off = off + annotation_len;
-    off += size;
-    off_real = tor_fd_getpos(fd);
-    if (off_real != off) {
-      log_warn(LD_BUG, "Discontinuity in position in microdescriptor cache."
-               "By my count, I'm at %"PRId64
-               ", but I should be at %"PRId64,
-               (int64_t)(off), (int64_t)(off_real));
-      if (off_real >= 0)
-        off = off_real;
-    }
-    if (md->saved_location != SAVED_IN_CACHE) {
-      tor_free(md->body);
-      md->saved_location = SAVED_IN_CACHE;
-    }
     smartlist_add(wrote, md);
   }
 
+  if (size < 0 || md_writebuf_flush(wb) < 0) {
+    /* We already warned in md_writebuf_flush(). */
+    abort_writing_to_file(open_file);
+    tor_free(wb);
+    smartlist_free(wrote);
+    return -1;
+  }
+  tor_free(wb);
+
   /* We must do this unmap _before_ we call finish_writing_to_file(), or
    * windows will not actually replace the file. */
   if (cache->cache_content) {
@@ -786,12 +866,7 @@ microdesc_cache_rebuild(microdesc_cache_t *cache, int force)
              strerror(errno));
     /* Okay. Let's prevent from making things worse elsewhere. */
     cache->cache_content = NULL;
-    HT_FOREACH(mdp, microdesc_map, &cache->map) {
-      microdesc_t *md = *mdp;
-      if (md->saved_location == SAVED_IN_CACHE) {
-        microdesc_wipe_body(md);
-      }
-    }
+    microdesc_cache_wipe_mapped_bodies(cache);
     smartlist_free(wrote);
     return -1;
   }
@@ -801,11 +876,15 @@ microdesc_cache_rebuild(microdesc_cache_t *cache, int force)
   if (!cache->cache_content && smartlist_len(wrote)) {
     log_err(LD_DIR, "Couldn't map file that we just wrote to %s!",
             cache->cache_fname);
+    microdesc_cache_wipe_mapped_bodies(cache);
     smartlist_free(wrote);
     return -1;
   }
   SMARTLIST_FOREACH_BEGIN(wrote, microdesc_t *, md) {
-    tor_assert(md->saved_location == SAVED_IN_CACHE);
+    if (md->saved_location != SAVED_IN_CACHE) {
+      tor_free(md->body);
+      md->saved_location = SAVED_IN_CACHE;
+    }
     md->body = (char*)cache->cache_content->data + md->off;
     if (PREDICT_UNLIKELY(
              md->bodylen < 9 || fast_memneq(md->body, "onion-key", 9) != 0)) {
@@ -40,6 +40,7 @@
 #include "core/or/or.h"
 #include "app/config/config.h"
 #include "core/mainloop/connection.h"
+#include "core/mainloop/cpuworker.h"
 #include "core/mainloop/mainloop.h"
 #include "core/mainloop/netstatus.h"
 #include "core/or/channel.h"
@@ -70,6 +71,7 @@
 #include "feature/dircommon/directory.h"
 #include "feature/dirauth/voting_schedule.h"
 #include "feature/dirparse/ns_parse.h"
+#include "feature/dirparse/ns_snapshot.h"
 #include "feature/hibernate/hibernate.h"
 #include "feature/hs/hs_dos.h"
 #include "feature/nodelist/authcert.h"
@@ -86,6 +88,7 @@
 #include "feature/relay/routermode.h"
 #include "lib/crypt_ops/crypto_rand.h"
 #include "lib/crypt_ops/crypto_util.h"
+#include "lib/thread/threads.h"
 
 #include "feature/dirauth/dirauth_periodic.h"
 #include "feature/dirauth/dirvote.h"
@@ -243,6 +246,39 @@ networkstatus_get_cache_fname,(int flav,
   return get_cachedir_fname(buf);
 }
 
+/** Return the filename used to cache the snapshot of the parsed consensus
+ * of a given flavor.  See ns_snapshot.c. */
+static char *
+networkstatus_get_snapshot_fname(int flav)
+{
+  char *fname = networkstatus_get_cache_fname(flav,
+                                      networkstatus_get_flavor_name(flav), 0);
+  char *result = NULL;
+  tor_asprintf(&result, "%s-snapshot", fname);
+  tor_free(fname);
+  return result;
+}
+
+/** Save a snapshot of the router status entries in <b>c</b>, which we
+ * parsed from the <b>consensus_len</b> bytes at <b>consensus</b>, so that
+ * we can load it faster next time. */
+static void
+networkstatus_write_snapshot(const networkstatus_t *c,
+                             const char *consensus, size_t consensus_len)
+{
+  size_t snapshot_len = 0;
+  char *snapshot = ns_snapshot_encode(c, consensus, consensus_len,
+                                      &snapshot_len);
+  char *fname = networkstatus_get_snapshot_fname(c->flavor);
+  if (snapshot) {
+    write_bytes_to_file(fname, snapshot, snapshot_len, 1);
+  } else if (unlink(fname) != 0 && errno != ENOENT) {
+    log_debug(LD_FS, "Failed to unlink %s: %s", fname, strerror(errno));
+  }
+  tor_free(snapshot);
+  tor_free(fname);
+}
+
 /**
  * Read and return the cached consensus of type <b>flavorname</b>.  If
  * <b>unverified</b> is false, get the one we haven't verified. Return NULL if
@@ -440,6 +476,16 @@ networkstatus_get_voter_by_id(networkstatus_t *vote,
   return NULL;
 }
 
+/** Return true iff we should hand parts of parsing and checking
+ * networkstatus documents to the cpuworkers. */
+int
+networkstatus_parallel_parsing_enabled(void)
+{
+  return get_options()->ParallelDirParsing &&
+    in_main_thread() &&
+    cpuworker_get_n_threads() > 0;
+}
+
 /** Return the signature made by <b>voter</b> using the algorithm
  * <b>alg</b>, or NULL if none is found. */
 document_signature_t *
@@ -454,6 +500,49 @@ networkstatus_get_voter_sig_by_alg(const networkstatus_voter_info_t *voter,
   return NULL;
 }
 
+/** Return true iff <b>sig</b> claims to be made with the signing key in
+ * <b>cert</b>. */
+static int
+document_signature_matches_cert(const document_signature_t *sig,
+                                const authority_cert_t *cert)
+{
+  char key_digest[DIGEST_LEN];
+
+  if (crypto_pk_get_digest(cert->signing_key, key_digest)<0)
+    return 0;
+  return tor_memeq(sig->signing_key_digest, key_digest, DIGEST_LEN) &&
+    tor_memeq(sig->identity_digest, cert->cache_info.identity_digest,
+              DIGEST_LEN);
+}
+
+/** Check the signature <b>sig</b> on <b>consensus</b> against the signing
+ * key in <b>cert</b>, and set its good_signature or bad_signature flag.
+ * Safe to call from a cpuworker. */
+static void
+document_signature_check_with_key(const networkstatus_t *consensus,
+                                  document_signature_t *sig,
+                                  const authority_cert_t *cert)
+{
+  const int dlen = sig->alg == DIGEST_SHA1 ? DIGEST_LEN : DIGEST256_LEN;
+  char *signed_digest;
+  size_t signed_digest_len;
+
+  signed_digest_len = crypto_pk_keysize(cert->signing_key);
+  signed_digest = tor_malloc(signed_digest_len);
+  if (crypto_pk_public_checksig(cert->signing_key,
+                                signed_digest,
+                                signed_digest_len,
+                                sig->signature,
+                                sig->signature_len) < dlen ||
+      tor_memneq(signed_digest, consensus->digests.d[sig->alg], dlen)) {
+    log_warn(LD_DIR, "Got a bad signature on a networkstatus vote");
+    sig->bad_signature = 1;
+  } else {
+    sig->good_signature = 1;
+  }
+  tor_free(signed_digest);
+}
+
 /** Check whether the signature <b>sig</b> is correctly signed with the
  * signing key in <b>cert</b>.  Return -1 if <b>cert</b> doesn't match the
  * signing key; otherwise set the good_signature or bad_signature flag on
@@ -463,16 +552,7 @@ networkstatus_check_document_signature(const networkstatus_t *consensus,
                                        document_signature_t *sig,
                                        const authority_cert_t *cert)
 {
-  char key_digest[DIGEST_LEN];
-  const int dlen = sig->alg == DIGEST_SHA1 ? DIGEST_LEN : DIGEST256_LEN;
-  char *signed_digest;
-  size_t signed_digest_len;
-
-  if (crypto_pk_get_digest(cert->signing_key, key_digest)<0)
-    return -1;
-  if (tor_memneq(sig->signing_key_digest, key_digest, DIGEST_LEN) ||
-      tor_memneq(sig->identity_digest, cert->cache_info.identity_digest,
-                 DIGEST_LEN))
+  if (!document_signature_matches_cert(sig, cert))
     return -1;
 
   if (authority_cert_is_denylisted(cert)) {
@@ -486,23 +566,71 @@ networkstatus_check_document_signature(const networkstatus_t *consensus,
     return 0;
   }
 
-  signed_digest_len = crypto_pk_keysize(cert->signing_key);
-  signed_digest = tor_malloc(signed_digest_len);
-  if (crypto_pk_public_checksig(cert->signing_key,
-                                signed_digest,
-                                signed_digest_len,
-                                sig->signature,
-                                sig->signature_len) < dlen ||
-      tor_memneq(signed_digest, consensus->digests.d[sig->alg], dlen)) {
-    log_warn(LD_DIR, "Got a bad signature on a networkstatus vote");
-    sig->bad_signature = 1;
-  } else {
-    sig->good_signature = 1;
-  }
-  tor_free(signed_digest);
+  document_signature_check_with_key(consensus, sig, cert);
   return 0;
 }
 
+/** A consensus signature for a cpuworker to check. */
+typedef struct sig_check_t {
+  const networkstatus_t *consensus;
+  document_signature_t *sig;
+  const authority_cert_t *cert;
+} sig_check_t;
+
+/** Batch function: check the signature at <b>idx</b> in the smartlist of
+ * sig_check_t in <b>arg</b>. */
+static void
+sig_check_run(void *arg, int idx)
+{
+  smartlist_t *checks = arg;
+  sig_check_t *check = smartlist_get(checks, idx);
+  document_signature_check_with_key(check->consensus, check->sig,
+                                    check->cert);
+}
+
+/** Check, on the cpuworkers, every signature on <b>consensus</b> that
+ * networkstatus_check_consensus_signature() would otherwise check one after
+ * another, so that it finds their good_signature or bad_signature flags
+ * already set. */
+static void
+networkstatus_check_consensus_signatures_in_parallel(
+                                                 networkstatus_t *consensus,
+                                                 time_t now)
+{
+  smartlist_t *checks = smartlist_new();
+
+  SMARTLIST_FOREACH_BEGIN(consensus->voters, networkstatus_voter_info_t *,
+                          voter) {
+    SMARTLIST_FOREACH_BEGIN(voter->sigs, document_signature_t *, sig) {
+      authority_cert_t *cert;
+      sig_check_t *check;
+      if (sig->good_signature || sig->bad_signature || !sig->signature)
+        continue;
+      if (!trusteddirserver_get_by_v3_auth_digest(sig->identity_digest))
+        continue;
+      cert = authority_cert_get_by_digests(sig->identity_digest,
+                                           sig->signing_key_digest);
+      if (!cert || cert->expires < now ||
+          !document_signature_matches_cert(sig, cert) ||
+          authority_cert_is_denylisted(cert))
+        continue;
+      check = tor_malloc_zero(sizeof(sig_check_t));
+      check->consensus = consensus;
+      check->sig = sig;
+      check->cert = cert;
+      smartlist_add(checks, check);
+    } SMARTLIST_FOREACH_END(sig);
+  } SMARTLIST_FOREACH_END(voter);
+
+  if (smartlist_len(checks) > 1) {
+    cpuworker_batch_finish(cpuworker_batch_start(smartlist_len(checks),
+                                                 sig_check_run, checks));
+  }
+
+  SMARTLIST_FOREACH(checks, sig_check_t *, check, tor_free(check));
+  smartlist_free(checks);
+}
+
 /** Given a v3 networkstatus consensus in <b>consensus</b>, check every
  * as-yet-unchecked signature on <b>consensus</b>.  Return 1 if there is a
  * signature from every recognized authority on it, 0 if there are
@@ -532,6 +660,9 @@ networkstatus_check_consensus_signature(networkstatus_t *consensus,
 
   tor_assert(consensus->type == NS_TYPE_CONSENSUS);
 
+  if (networkstatus_parallel_parsing_enabled())
+    networkstatus_check_consensus_signatures_in_parallel(consensus, now);
+
   SMARTLIST_FOREACH_BEGIN(consensus->voters, networkstatus_voter_info_t *,
                           voter) {
     int good_here = 0;
@@ -1947,6 +2078,8 @@ networkstatus_set_current_consensus(const char *consensus,
   time_t current_valid_after = 0;
   int free_consensus = 1; /* Free 'c' at the end of the function */
   int checked_protocols_already = 0;
+  tor_mmap_t *snapshot = NULL;
+  int used_snapshot = 0;
 
   if (flav < 0) {
     /* XXXX we don't handle unrecognized flavors yet. */
@@ -1954,10 +2087,20 @@ networkstatus_set_current_consensus(const char *consensus,
     return -2;
   }
 
-  /* Make sure it's parseable. */
-  c = networkstatus_parse_vote_from_string(consensus,
-                                           consensus_len,
-                                           NULL, NS_TYPE_CONSENSUS);
+  /* Make sure it's parseable.  If this is our cached consensus, we have
+   * probably parsed it before: try the snapshot we saved then. */
+  if (from_cache && !was_waiting_for_certs) {
+    char *snapshot_fname = networkstatus_get_snapshot_fname(flav);
+    snapshot = tor_mmap_file(snapshot_fname);
+    tor_free(snapshot_fname);
+  }
+  c = networkstatus_parse_consensus_with_snapshot(consensus, consensus_len,
+                                      snapshot ? snapshot->data : NULL,
+                                      snapshot ? snapshot->size : 0,
+                                      &used_snapshot);
+  if (snapshot && !used_snapshot)
+    log_info(LD_DIR, "Cached %s consensus snapshot didn't match; "
+             "parsed the consensus instead.", flavor);
   if (!c) {
     log_warn(LD_DIR, "Unable to parse networkstatus consensus");
     result = -2;
@@ -2180,6 +2323,8 @@ networkstatus_set_current_consensus(const char *consensus,
   if (!from_cache) {
     write_bytes_to_file(consensus_fname, consensus, consensus_len, 1);
   }
+  if (!used_snapshot)
+    networkstatus_write_snapshot(c, consensus, consensus_len);
 
   warn_early_consensus(c, flavor, now);
 
@@ -2192,6 +2337,7 @@ networkstatus_set_current_consensus(const char *consensus,
  done:
   if (free_consensus)
     networkstatus_vote_free(c);
+  tor_munmap_file(snapshot);
   tor_free(consensus_fname);
   tor_free(unverified_fname);
   return result;
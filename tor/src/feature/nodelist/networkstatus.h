@@ -34,6 +34,7 @@ document_signature_t *networkstatus_get_voter_sig_by_alg(
                                     const networkstatus_voter_info_t *voter,
                                     digest_algorithm_t alg);
 
+int networkstatus_parallel_parsing_enabled(void);
 int networkstatus_check_consensus_signature(networkstatus_t *consensus,
                                             int warn);
 int networkstatus_check_document_signature(const networkstatus_t *consensus,
@@ -21,6 +21,7 @@
 #include "feature/dirclient/dirclient.h"
 #include "feature/dirclient/dirclient_modes.h"
 #include "feature/dircommon/directory.h"
+#include "feature/dirauth/authmode.h"
 #include "feature/nodelist/describe.h"
 #include "feature/nodelist/dirlist.h"
 #include "feature/nodelist/microdesc.h"
@@ -932,6 +933,149 @@ nodelist_subtract(smartlist_t *sl, const smartlist_t *excluded)
   bitarray_free(excluded_idx);
 }
 
+/** A precomputed table for choosing a node from the whole of
+ * nodelist_get_list(), weighted by bandwidth according to one
+ * bandwidth_weight_rule_t. */
+typedef struct node_weight_table_t {
+  /** The value of nodelist_get_weights_generation() when we built this
+   * table. */
+  uint32_t generation;
+  /** The list and the consensus that we built this table from. */
+  const smartlist_t *source;
+  const networkstatus_t *consensus;
+  /** A copy of the nodes in <b>source</b>. */
+  smartlist_t *nodes;
+  /** For each i, the total weighted bandwidth of nodes 0 through i. */
+  uint64_t *cumulative;
+} node_weight_table_t;
+
+/** One lazily built weight table for each bandwidth_weight_rule_t. */
+static node_weight_table_t *node_weight_tables[WEIGHT_FOR_DIR + 1];
+
+/** How many times do we draw from a weight table before giving up and
+ * choosing the slow way? */
+#define NODE_WEIGHT_TABLE_MAX_TRIES 64
+
+/** Release all storage held by <b>table</b>. */
+static void
+node_weight_table_free_(node_weight_table_t *table)
+{
+  if (!table)
+    return;
+  smartlist_free(table->nodes);
+  tor_free(table->cumulative);
+  tor_free(table);
+}
+#define node_weight_table_free(table) \
+  FREE_AND_NULL(node_weight_table_t, node_weight_table_free_, (table))
+
+/** Return a weight table for choosing among all the nodes we know about,
+ * weighted according to <b>rule</b>, building it if the one we have is out of
+ * date.  Return NULL if the nodes have no total weight, or if we should not
+ * use a table at all. */
+static const node_weight_table_t *
+node_weight_table_get(bandwidth_weight_rule_t rule)
+{
+  node_weight_table_t *table = node_weight_tables[rule];
+  const smartlist_t *nodes = nodelist_get_list();
+  const networkstatus_t *ns = networkstatus_get_latest_consensus();
+  const uint32_t generation = nodelist_get_weights_generation();
+  double *bandwidths_dbl = NULL;
+  int i, n;
+
+  /* Authorities change the flags on their nodes as they vote, without
+   * telling the nodelist. */
+  if (authdir_mode(get_options()))
+    return NULL;
+
+  if (table && table->generation == generation && table->source == nodes &&
+      table->consensus == ns &&
+      smartlist_len(table->nodes) == smartlist_len(nodes))
+    return table->cumulative ? table : NULL;
+
+  node_weight_table_free(node_weight_tables[rule]);
+  table = node_weight_tables[rule] = tor_malloc_zero(sizeof(*table));
+  table->generation = generation;
+  table->source = nodes;
+  table->consensus = ns;
+  table->nodes = smartlist_new();
+  smartlist_add_all(table->nodes, nodes);
+
+  n = smartlist_len(table->nodes);
+  if (compute_weighted_bandwidths(table->nodes, rule, &bandwidths_dbl,
+                                  NULL) < 0)
+    return NULL;
+
+  table->cumulative = tor_calloc(n, sizeof(uint64_t));
+  scale_array_elements_to_u64(table->cumulative, bandwidths_dbl, n, NULL);
+  tor_free(bandwidths_dbl);
+  for (i = 1; i < n; ++i)
+    table->cumulative[i] += table->cumulative[i - 1];
+
+  if (table->cumulative[n - 1] == 0)
+    tor_free(table->cumulative);
+
+  return table->cumulative ? table : NULL;
+}
+
+/** Try to choose a node for router_choose_random_node_helper() from the weight
+ * table for <b>rule</b>, by drawing nodes from it until one of them satisfies
+ * <b>flags</b> and is not excluded.  This gives each acceptable node the same
+ * chance as weighting the list of acceptable nodes directly would.
+ *
+ * Set *<b>done_out</b> to true if the returned value is our final answer, and
+ * to false if the caller should choose the slow way instead. */
+static const node_t *
+router_choose_random_node_from_table(smartlist_t *excludednodes,
+                                     routerset_t *excludedset,
+                                     router_crn_flags_t flags,
+                                     bandwidth_weight_rule_t rule,
+                                     bool *done_out)
+{
+  const node_weight_table_t *table = node_weight_table_get(rule);
+  int n_nodes, tries;
+  uint64_t total;
+
+  *done_out = false;
+  if (!table)
+    return NULL;
+
+  n_nodes = smartlist_len(table->nodes);
+  total = table->cumulative[n_nodes - 1];
+  tor_assert(total < INT64_MAX);
+
+  for (tries = 0; tries < NODE_WEIGHT_TABLE_MAX_TRIES; ++tries) {
+    uint64_t rand_val = crypto_rand_uint64(total);
+    int idx = select_array_member_sorted_timei(table->cumulative, n_nodes,
+                                               rand_val);
+    const node_t *node = smartlist_get(table->nodes, idx);
+
+    if (!router_can_choose_node(node, flags))
+      continue;
+    if (excludednodes && smartlist_contains(excludednodes, node))
+      continue;
+    if (excludedset && routerset_contains_node(excludedset, node))
+      continue;
+
+    *done_out = true;
+    return node;
+  }
+
+  log_debug(LD_CIRC, "No acceptable node in %d draws for rule %s; "
+            "choosing the slow way.", NODE_WEIGHT_TABLE_MAX_TRIES,
+            bandwidth_weight_rule_to_string(rule));
+  return NULL;
+}
+
+/** Release all storage held by the node selection weight tables. */
+void
+node_select_free_all(void)
+{
+  unsigned i;
+  for (i = 0; i < ARRAY_LENGTH(node_weight_tables); ++i)
+    node_weight_table_free(node_weight_tables[i]);
+}
+
 /* Node selection helper for router_choose_random_node().
  *
  * Populates a node list based on <b>flags</b>, ignoring nodes in
@@ -943,9 +1087,16 @@ router_choose_random_node_helper(smartlist_t *excludednodes,
                                  router_crn_flags_t flags,
                                  bandwidth_weight_rule_t rule)
 {
-  smartlist_t *sl=smartlist_new();
+  smartlist_t *sl;
   const node_t *choice = NULL;
+  bool done = false;
+
+  choice = router_choose_random_node_from_table(excludednodes, excludedset,
+                                                flags, rule, &done);
+  if (done)
+    return choice;
 
+  sl = smartlist_new();
   router_add_running_nodes_to_smartlist(sl, flags);
   log_debug(LD_CIRC,
            "We found %d running nodes.",
@@ -104,6 +104,11 @@ struct node_t {
    * in order to know what's the hs directory index for this node at the time
    * the consensus is set. */
   struct hsdir_index_t hsdir_index;
+  /** The ed25519 identity that hsdir_index was computed from. */
+  ed25519_public_key_t hsdir_index_id;
+  /** The nodelist's hsdir_index_gen when hsdir_index was computed, or 0 if
+   * it never was. */
+  uint32_t hsdir_index_gen;
 };
 
 #endif /* !defined(NODE_ST_H) */
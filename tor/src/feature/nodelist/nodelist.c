@@ -64,6 +64,7 @@
 #include "feature/nodelist/routerlist.h"
 #include "feature/nodelist/routerset.h"
 #include "feature/nodelist/torcert.h"
+#include "lib/container/bitarray.h"
 #include "lib/encoding/binascii.h"
 #include "lib/err/backtrace.h"
 #include "lib/geoip/geoip.h"
@@ -113,6 +114,26 @@ static double get_frac_paths_needed_for_circs(const or_options_t *options,
                                               const networkstatus_t *ns);
 static void node_add_to_address_set(const node_t *node);
 
+/** The inputs to the hsdir indices of every node, other than the node's own
+ * ed25519 identity.  See node_set_hsdir_index(). */
+typedef struct hsdir_index_params_t {
+  uint64_t fetch_tp;
+  uint64_t store_first_tp;
+  uint64_t store_second_tp;
+  uint8_t fetch_srv[DIGEST256_LEN];
+  uint8_t store_first_srv[DIGEST256_LEN];
+  uint8_t store_second_srv[DIGEST256_LEN];
+  /** Which of the SRVs above we have.  For the others, we use the disaster
+   * SRV of their time period. */
+  unsigned int have_fetch_srv:1;
+  unsigned int have_store_first_srv:1;
+  unsigned int have_store_second_srv:1;
+  /** True iff we are between the start of a time period and the next SRV,
+   * so that the fetch index is the second store index rather than the
+   * first. */
+  unsigned int between_tp_and_srv:1;
+} hsdir_index_params_t;
+
 /** A nodelist_t holds a node_t object for every router we're "willing to use
  * for something".  Specifically, it should hold a node_t for every node that
  * is currently in the routerlist, or currently in the consensus we're using.
@@ -142,8 +163,32 @@ typedef struct nodelist_t {
    * nodelist.  We use this to detect outdated nodelists that need to be
    * rebuilt using a newer consensus. */
   time_t live_consensus_valid_after;
+
+  /* A list of exit_port_index_t, built lazily for the ports that we're asked
+   * about, and discarded whenever we get a new consensus.  NULL if we have
+   * not built any yet. */
+  smartlist_t *exit_port_indices;
+  /* How many bits each bitarray in exit_port_indices can hold. */
+  int exit_port_index_bits;
+
+  /* The inputs to the hsdir indices we computed most recently, and a counter
+   * that we increment whenever they change.  A node whose hsdir_index_gen
+   * matches, and whose identity hasn't changed, doesn't need its hsdir
+   * indices computed again. */
+  hsdir_index_params_t hsdir_index_params;
+  uint32_t hsdir_index_gen;
 } nodelist_t;
 
+/** For one port, the nodes (indexed by nodelist_idx) whose exit policy might
+ * allow connections to some address on that port. */
+typedef struct exit_port_index_t {
+  uint16_t port;
+  bitarray_t *nodes;
+} exit_port_index_t;
+
+/** Largest number of ports for which we keep an exit_port_index_t. */
+#define MAX_EXIT_PORT_INDICES 32
+
 static inline unsigned int
 node_id_hash(const node_t *node)
 {
@@ -180,6 +225,29 @@ HT_GENERATE2(nodelist_ed_map, node_t, ed_ht_ent, node_ed_id_hash,
 /** The global nodelist. */
 static nodelist_t *the_nodelist=NULL;
 
+/** A counter that we increment whenever a node is added to or removed from
+ * the nodelist, or whenever anything that feeds into a node's weighted
+ * bandwidth might have changed.  Kept outside of the_nodelist so that it
+ * never repeats a value across nodelist_free_all(). */
+static uint32_t nodelist_weights_gen = 1;
+
+/** Note that the weighted bandwidths of the nodes in the nodelist, or the
+ * set of nodes itself, might have changed. */
+static inline void
+nodelist_note_weights_changed(void)
+{
+  if (++nodelist_weights_gen == 0)
+    ++nodelist_weights_gen;
+}
+
+/** Return a value that changes whenever the set of nodes in
+ * nodelist_get_list(), or their weighted bandwidths, might have changed. */
+uint32_t
+nodelist_get_weights_generation(void)
+{
+  return nodelist_weights_gen;
+}
+
 /** Create an empty nodelist if we haven't done so already. */
 static void
 init_nodelist(void)
@@ -192,6 +260,126 @@ init_nodelist(void)
   }
 }
 
+/** Return true iff <b>node</b>'s exit policy might allow connections to some
+ * address on <b>port</b>. */
+static int
+node_exit_policy_might_allow_port(const node_t *node, uint16_t port)
+{
+  addr_policy_result_t r = compare_tor_addr_to_node_policy(NULL, port, node);
+  return r != ADDR_POLICY_REJECTED && r != ADDR_POLICY_PROBABLY_REJECTED;
+}
+
+/** Set or clear the bit for <b>node</b> in every exit port index, according
+ * to its current exit policy. */
+static void
+exit_port_indices_update_node(const node_t *node)
+{
+  if (!the_nodelist->exit_port_indices || node->nodelist_idx < 0)
+    return;
+
+  if (node->nodelist_idx >= the_nodelist->exit_port_index_bits) {
+    int n_bits = MAX(the_nodelist->exit_port_index_bits * 2,
+                     node->nodelist_idx + 1);
+    SMARTLIST_FOREACH(the_nodelist->exit_port_indices, exit_port_index_t *,
+                      ent,
+      ent->nodes = bitarray_expand(ent->nodes,
+                                   the_nodelist->exit_port_index_bits,
+                                   n_bits));
+    the_nodelist->exit_port_index_bits = n_bits;
+  }
+
+  SMARTLIST_FOREACH_BEGIN(the_nodelist->exit_port_indices,
+                          exit_port_index_t *, ent) {
+    if (node_exit_policy_might_allow_port(node, ent->port))
+      bitarray_set(ent->nodes, node->nodelist_idx);
+    else
+      bitarray_clear(ent->nodes, node->nodelist_idx);
+  } SMARTLIST_FOREACH_END(ent);
+}
+
+/** Release all of the nodelist's exit port indices.  They will be rebuilt,
+ * one port at a time, as they are needed. */
+static void
+exit_port_indices_clear(void)
+{
+  if (!the_nodelist->exit_port_indices)
+    return;
+  SMARTLIST_FOREACH_BEGIN(the_nodelist->exit_port_indices,
+                          exit_port_index_t *, ent) {
+    bitarray_free(ent->nodes);
+    tor_free(ent);
+  } SMARTLIST_FOREACH_END(ent);
+  smartlist_free(the_nodelist->exit_port_indices);
+  the_nodelist->exit_port_index_bits = 0;
+}
+
+/** Return the exit port index for <b>port</b>, building it if we don't have
+ * one yet. */
+static const exit_port_index_t *
+exit_port_index_get(uint16_t port)
+{
+  exit_port_index_t *ent;
+
+  if (!the_nodelist->exit_port_indices) {
+    the_nodelist->exit_port_indices = smartlist_new();
+    the_nodelist->exit_port_index_bits =
+      MAX(smartlist_len(the_nodelist->nodes), 64);
+  }
+
+  SMARTLIST_FOREACH_BEGIN(the_nodelist->exit_port_indices,
+                          exit_port_index_t *, e) {
+    if (e->port == port)
+      return e;
+  } SMARTLIST_FOREACH_END(e);
+
+  if (smartlist_len(the_nodelist->exit_port_indices) >=
+      MAX_EXIT_PORT_INDICES) {
+    /* Forget the index we built longest ago. */
+    ent = smartlist_get(the_nodelist->exit_port_indices, 0);
+    smartlist_del_keeporder(the_nodelist->exit_port_indices, 0);
+    bitarray_free(ent->nodes);
+    tor_free(ent);
+  }
+
+  ent = tor_malloc_zero(sizeof(exit_port_index_t));
+  ent->port = port;
+  ent->nodes = bitarray_init_zero(the_nodelist->exit_port_index_bits);
+  SMARTLIST_FOREACH_BEGIN(the_nodelist->nodes, const node_t *, node) {
+    if (node_exit_policy_might_allow_port(node, port))
+      bitarray_set(ent->nodes, node_sl_idx);
+  } SMARTLIST_FOREACH_END(node);
+  smartlist_add(the_nodelist->exit_port_indices, ent);
+  return ent;
+}
+
+/** Return true iff the exit policy of <b>node</b> might allow connections to
+ * some address on <b>port</b>.  This is the same question as asking
+ * compare_tor_addr_to_node_policy() about an unknown address, but it is
+ * answered from a per-port bitmap over the nodelist, so choosing among many
+ * nodes costs one bit test each rather than one policy walk each. */
+int
+node_exit_policy_allows_port(const node_t *node, uint16_t port)
+{
+  tor_assert(port != 0);
+  if (PREDICT_UNLIKELY(the_nodelist == NULL) || node->nodelist_idx < 0 ||
+      smartlist_get(the_nodelist->nodes, node->nodelist_idx) != node) {
+    /* Not in the nodelist: just look at the policy. */
+    return node_exit_policy_might_allow_port(node, port);
+  }
+  return bitarray_is_set(exit_port_index_get(port)->nodes,
+                         node->nodelist_idx) != 0;
+}
+
+/** Tell the nodelist that the exit policy of <b>node</b> has changed for a
+ * reason other than a new descriptor, so that its exit port indices can be
+ * updated. */
+void
+nodelist_note_exit_policy_changed(const node_t *node)
+{
+  if (the_nodelist)
+    exit_port_indices_update_node(node);
+}
+
 /** As node_get_by_id, but returns a non-const pointer */
 MOCK_IMPL(node_t *,
 node_get_mutable_by_id,(const char *identity_digest))
@@ -256,6 +444,8 @@ node_get_or_create(const char *identity_digest)
 
   smartlist_add(the_nodelist->nodes, node);
   node->nodelist_idx = smartlist_len(the_nodelist->nodes) - 1;
+  exit_port_indices_update_node(node);
+  nodelist_note_weights_changed();
 
   node->country = -1;
 
@@ -350,90 +540,159 @@ node_add_to_ed25519_map(node_t *node)
   return 1;
 }
 
-/* For a given <b>node</b> for the consensus <b>ns</b>, set the hsdir index
- * for the node, both current and next if possible. This can only fails if the
- * node_t ed25519 identity key can't be found which would be a bug. */
-STATIC void
-node_set_hsdir_index(node_t *node, const networkstatus_t *ns)
+/** Set *<b>params</b> to the inputs of the hsdir indices for the consensus
+ * <b>ns</b> at <b>now</b>.  Return 0 on success, or -1 if <b>ns</b> isn't
+ * live enough to compute hsdir indices from. */
+static int
+hsdir_index_params_get(hsdir_index_params_t *params,
+                       const networkstatus_t *ns, time_t now)
 {
-  time_t now = approx_time();
-  const ed25519_public_key_t *node_identity_pk;
   uint8_t *fetch_srv = NULL, *store_first_srv = NULL, *store_second_srv = NULL;
   uint64_t next_time_period_num, current_time_period_num;
-  uint64_t fetch_tp, store_first_tp, store_second_tp;
-
-  tor_assert(node);
-  tor_assert(ns);
 
   if (!networkstatus_consensus_reasonably_live(ns, now)) {
     static struct ratelim_t live_consensus_ratelim = RATELIM_INIT(30 * 60);
     log_fn_ratelim(&live_consensus_ratelim, LOG_INFO, LD_GENERAL,
                    "Not setting hsdir index with a non-live consensus.");
-    goto done;
+    return -1;
   }
 
-  node_identity_pk = node_get_ed25519_id(node);
-  if (node_identity_pk == NULL) {
-    log_debug(LD_GENERAL, "ed25519 identity public key not found when "
-                          "trying to build the hsdir indexes for node %s",
-              node_describe(node));
-    goto done;
-  }
+  /* We compare these with memcmp, so clear the padding too. */
+  memset(params, 0, sizeof(*params));
 
   /* Get the current and next time period number. */
   current_time_period_num = hs_get_time_period_num(0);
   next_time_period_num = hs_get_next_time_period_num(0);
 
   /* We always use the current time period for fetching descs */
-  fetch_tp = current_time_period_num;
+  params->fetch_tp = current_time_period_num;
 
   /* Now extract the needed SRVs and time periods for building hsdir indices */
-  if (hs_in_period_between_tp_and_srv(ns, now)) {
-    fetch_srv = hs_get_current_srv(fetch_tp, ns);
+  params->between_tp_and_srv = hs_in_period_between_tp_and_srv(ns, now);
+  if (params->between_tp_and_srv) {
+    fetch_srv = hs_get_current_srv(params->fetch_tp, ns);
 
-    store_first_tp = hs_get_previous_time_period_num(0);
-    store_second_tp = current_time_period_num;
+    params->store_first_tp = hs_get_previous_time_period_num(0);
+    params->store_second_tp = current_time_period_num;
   } else {
-    fetch_srv = hs_get_previous_srv(fetch_tp, ns);
+    fetch_srv = hs_get_previous_srv(params->fetch_tp, ns);
 
-    store_first_tp = current_time_period_num;
-    store_second_tp = next_time_period_num;
+    params->store_first_tp = current_time_period_num;
+    params->store_second_tp = next_time_period_num;
   }
 
   /* We always use the old SRV for storing the first descriptor and the latest
    * SRV for storing the second descriptor */
-  store_first_srv = hs_get_previous_srv(store_first_tp, ns);
-  store_second_srv = hs_get_current_srv(store_second_tp, ns);
+  store_first_srv = hs_get_previous_srv(params->store_first_tp, ns);
+  store_second_srv = hs_get_current_srv(params->store_second_tp, ns);
+
+#define COPY_SRV(name) do {                                     \
+    if (name) {                                                 \
+      memcpy(params->name, (name), DIGEST256_LEN);              \
+      params->have_ ## name = 1;                                \
+    }                                                           \
+  } while (0)
+  COPY_SRV(fetch_srv);
+  COPY_SRV(store_first_srv);
+  COPY_SRV(store_second_srv);
+#undef COPY_SRV
+
+  tor_free(fetch_srv);
+  tor_free(store_first_srv);
+  tor_free(store_second_srv);
+  return 0;
+}
+
+/** Set the hsdir indices of <b>node</b> from <b>params</b>.  Skip the work
+ * if we already computed them from the same inputs. */
+static void
+node_set_hsdir_index_from_params(node_t *node,
+                                 const hsdir_index_params_t *params)
+{
+  const ed25519_public_key_t *node_identity_pk;
+
+  node_identity_pk = node_get_ed25519_id(node);
+  if (node_identity_pk == NULL) {
+    log_debug(LD_GENERAL, "ed25519 identity public key not found when "
+                          "trying to build the hsdir indexes for node %s",
+              node_describe(node));
+    return;
+  }
+
+  if (the_nodelist &&
+      node->hsdir_index_gen == the_nodelist->hsdir_index_gen &&
+      ed25519_pubkey_eq(node_identity_pk, &node->hsdir_index_id))
+    return;
+
+#define SRV_OR_NULL(name) (params->have_ ## name ? params->name : NULL)
 
   /* Build the fetch index. */
-  hs_build_hsdir_index(node_identity_pk, fetch_srv, fetch_tp,
-                       node->hsdir_index.fetch);
+  hs_build_hsdir_index(node_identity_pk, SRV_OR_NULL(fetch_srv),
+                       params->fetch_tp, node->hsdir_index.fetch);
 
   /* If we are in the time segment between SRV#N and TP#N, the fetch index is
      the same as the first store index */
-  if (!hs_in_period_between_tp_and_srv(ns, now)) {
+  if (!params->between_tp_and_srv) {
     memcpy(node->hsdir_index.store_first, node->hsdir_index.fetch,
            sizeof(node->hsdir_index.store_first));
   } else {
-    hs_build_hsdir_index(node_identity_pk, store_first_srv, store_first_tp,
+    hs_build_hsdir_index(node_identity_pk, SRV_OR_NULL(store_first_srv),
+                         params->store_first_tp,
                          node->hsdir_index.store_first);
   }
 
   /* If we are in the time segment between TP#N and SRV#N+1, the fetch index is
      the same as the second store index */
-  if (hs_in_period_between_tp_and_srv(ns, now)) {
+  if (params->between_tp_and_srv) {
     memcpy(node->hsdir_index.store_second, node->hsdir_index.fetch,
            sizeof(node->hsdir_index.store_second));
   } else {
-    hs_build_hsdir_index(node_identity_pk, store_second_srv, store_second_tp,
+    hs_build_hsdir_index(node_identity_pk, SRV_OR_NULL(store_second_srv),
+                         params->store_second_tp,
                          node->hsdir_index.store_second);
   }
 
- done:
-  tor_free(fetch_srv);
-  tor_free(store_first_srv);
-  tor_free(store_second_srv);
-  return;
+#undef SRV_OR_NULL
+
+  if (the_nodelist) {
+    node->hsdir_index_gen = the_nodelist->hsdir_index_gen;
+    memcpy(&node->hsdir_index_id, node_identity_pk,
+           sizeof(node->hsdir_index_id));
+  }
+}
+
+/** Remember <b>params</b> as the inputs of the hsdir indices we are about to
+ * compute.  If they changed, every node's hsdir indices need computing
+ * again. */
+static void
+nodelist_note_hsdir_index_params(const hsdir_index_params_t *params)
+{
+  if (!the_nodelist)
+    return;
+  if (the_nodelist->hsdir_index_gen == 0 ||
+      fast_memneq(params, &the_nodelist->hsdir_index_params,
+                  sizeof(*params))) {
+    memcpy(&the_nodelist->hsdir_index_params, params, sizeof(*params));
+    if (++the_nodelist->hsdir_index_gen == 0)
+      ++the_nodelist->hsdir_index_gen;
+  }
+}
+
+/* For a given <b>node</b> for the consensus <b>ns</b>, set the hsdir index
+ * for the node, both current and next if possible. This can only fails if the
+ * node_t ed25519 identity key can't be found which would be a bug. */
+STATIC void
+node_set_hsdir_index(node_t *node, const networkstatus_t *ns)
+{
+  hsdir_index_params_t params;
+
+  tor_assert(node);
+  tor_assert(ns);
+
+  if (hsdir_index_params_get(&params, ns, approx_time()) < 0)
+    return;
+  nodelist_note_hsdir_index_params(&params);
+  node_set_hsdir_index_from_params(node, &params);
 }
 
 /** Called when a node's address changes. */
@@ -601,8 +860,10 @@ nodelist_set_routerinfo(routerinfo_t *ri, routerinfo_t **ri_old_out)
       *ri_old_out = NULL;
   }
   node->ri = ri;
+  nodelist_note_weights_changed();
 
   node_add_to_ed25519_map(node);
+  exit_port_indices_update_node(node);
 
   if (node->country == -1)
     node_set_country(node);
@@ -665,6 +926,7 @@ nodelist_add_microdesc(microdesc_t *md)
   }
   node_add_to_ed25519_map(node);
   node_add_to_address_set(node);
+  exit_port_indices_update_node(node);
 
   return node;
 }
@@ -690,8 +952,11 @@ nodelist_set_consensus(const networkstatus_t *ns)
 {
   const or_options_t *options = get_options();
   int authdir = authdir_mode_v3(options);
+  hsdir_index_params_t hsdir_index_params;
+  int have_hsdir_index_params;
 
   init_nodelist();
+  nodelist_note_weights_changed();
   if (ns->flavor == FLAV_MICRODESC)
     (void) get_microdesc_cache(); /* Make sure it exists first. */
 
@@ -710,6 +975,16 @@ nodelist_set_consensus(const networkstatus_t *ns)
   the_nodelist->node_addrs = address_set_new(estimated_addresses);
   digestmap_free(the_nodelist->reentry_set, NULL);
   the_nodelist->reentry_set = digestmap_new();
+  /* Nearly every node's policy may have changed; rebuild the exit port
+   * indices from scratch as they're needed. */
+  exit_port_indices_clear();
+
+  /* Most hsdir indices are the same as last time, unless the time period or
+   * the SRVs changed. */
+  have_hsdir_index_params =
+    hsdir_index_params_get(&hsdir_index_params, ns, approx_time()) == 0;
+  if (have_hsdir_index_params)
+    nodelist_note_hsdir_index_params(&hsdir_index_params);
 
   SMARTLIST_FOREACH_BEGIN(ns->routerstatus_list, routerstatus_t *, rs) {
     node_t *node = node_get_or_create(rs->identity_digest);
@@ -728,8 +1003,8 @@ nodelist_set_consensus(const networkstatus_t *ns)
       }
     }
 
-    if (rs->pv.supports_v3_hsdir) {
-      node_set_hsdir_index(node, ns);
+    if (rs->pv.supports_v3_hsdir && have_hsdir_index_params) {
+      node_set_hsdir_index_from_params(node, &hsdir_index_params);
     }
     node_set_country(node);
 
@@ -815,6 +1090,7 @@ nodelist_remove_microdesc(const char *identity_digest, microdesc_t *md)
     if (! node_get_ed25519_id(node)) {
       node_remove_from_ed25519_map(node);
     }
+    exit_port_indices_update_node(node);
   }
 }
 
@@ -825,9 +1101,12 @@ nodelist_remove_routerinfo(routerinfo_t *ri)
   node_t *node = node_get_mutable_by_id(ri->cache_info.identity_digest);
   if (node && node->ri == ri) {
     node->ri = NULL;
+    nodelist_note_weights_changed();
     if (! node_is_usable(node)) {
       nodelist_drop_node(node, 1);
       node_free(node);
+    } else {
+      exit_port_indices_update_node(node);
     }
   }
 }
@@ -844,6 +1123,7 @@ nodelist_drop_node(node_t *node, int remove_from_ht)
     tor_assert(tmp == node);
   }
   node_remove_from_ed25519_map(node);
+  nodelist_note_weights_changed();
 
   idx = node->nodelist_idx;
   tor_assert(idx >= 0);
@@ -853,6 +1133,13 @@ nodelist_drop_node(node_t *node, int remove_from_ht)
   if (idx < smartlist_len(the_nodelist->nodes)) {
     tmp = smartlist_get(the_nodelist->nodes, idx);
     tmp->nodelist_idx = idx;
+    exit_port_indices_update_node(tmp);
+  }
+  if (the_nodelist->exit_port_indices) {
+    /* The slot past the end of the list is now empty. */
+    SMARTLIST_FOREACH(the_nodelist->exit_port_indices, exit_port_index_t *,
+                      ent,
+      bitarray_clear(ent->nodes, smartlist_len(the_nodelist->nodes)));
   }
   node->nodelist_idx = -1;
 }
@@ -922,6 +1209,9 @@ nodelist_purge(void)
 void
 nodelist_free_all(void)
 {
+  node_select_free_all();
+  nodelist_note_weights_changed();
+
   if (PREDICT_UNLIKELY(the_nodelist == NULL))
     return;
 
@@ -938,6 +1228,7 @@ nodelist_free_all(void)
   the_nodelist->node_addrs = NULL;
   digestmap_free(the_nodelist->reentry_set, NULL);
   the_nodelist->reentry_set = NULL;
+  exit_port_indices_clear();
 
   tor_free(the_nodelist);
 }
@@ -64,6 +64,8 @@ int node_get_purpose(const node_t *node);
 int node_is_me(const node_t *node);
 int node_exit_policy_rejects_all(const node_t *node);
 int node_exit_policy_is_exact(const node_t *node, sa_family_t family);
+int node_exit_policy_allows_port(const node_t *node, uint16_t port);
+void nodelist_note_exit_policy_changed(const node_t *node);
 smartlist_t *node_get_all_orports(const node_t *node);
 int node_allows_single_hop_exits(const node_t *node);
 const char *node_get_nickname(const node_t *node);
@@ -111,6 +113,7 @@ const struct curve25519_public_key_t *node_get_curve25519_onion_key(
 crypto_pk_t *node_get_rsa_onion_key(const node_t *node);
 
 MOCK_DECL(const smartlist_t *, nodelist_get_list, (void));
+uint32_t nodelist_get_weights_generation(void);
 
 /* Temporary during transition to multiple addresses.  */
 void node_get_addr(const node_t *node, tor_addr_t *addr_out);
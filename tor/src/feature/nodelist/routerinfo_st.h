@@ -58,6 +58,8 @@ struct routerinfo_t {
   uint32_t bandwidthcapacity;
   smartlist_t *exit_policy; /**< What streams will this OR permit
                              * to exit on IPv4?  NULL for 'reject *:*'. */
+  /** Compiled form of <b>exit_policy</b>, if we have built one. */
+  struct addr_policy_matcher_t *exit_policy_matcher;
   /** What streams will this OR permit to exit on IPv6?
    * NULL for 'reject *:*' */
   struct short_policy_t *ipv6_exit_policy;
@@ -938,6 +938,7 @@ routerinfo_free_(routerinfo_t *router)
     smartlist_free(router->declared_family);
   }
   addr_policy_list_free(router->exit_policy);
+  addr_policy_matcher_free(router->exit_policy_matcher);
   short_policy_free(router->ipv6_exit_policy);
 
   memset(router, 77, sizeof(routerinfo_t));
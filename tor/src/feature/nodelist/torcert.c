@@ -271,6 +271,64 @@ tor_cert_checksig(tor_cert_t *cert,
   }
 }
 
+/** Validate the signatures on the <b>n_certs</b> certificates in
+ * <b>certs</b>, each against the signing key included in it, relative to
+ * the current time <b>now</b>.  (If <b>now</b> is 0, do not check the
+ * expiration times.)  The signatures are checked as one batch.  Sets flags
+ * in each certificate as tor_cert_checksig() does.  Return 0 if every
+ * certificate is valid, or -N where N is the number that are not.
+ */
+int
+tor_cert_checksig_batch(tor_cert_t **certs, int n_certs, time_t now)
+{
+  ed25519_checkable_t *checkable;
+  tor_cert_t **checking;
+  int *okay;
+  int i, n_checking = 0, n_bad = 0;
+
+  if (n_certs <= 0)
+    return 0;
+
+  checkable = tor_calloc(n_certs, sizeof(ed25519_checkable_t));
+  checking = tor_calloc(n_certs, sizeof(tor_cert_t *));
+  okay = tor_calloc(n_certs, sizeof(int));
+
+  for (i = 0; i < n_certs; ++i) {
+    tor_cert_t *cert = certs[i];
+    time_t expires = TIME_MAX;
+
+    if (tor_cert_get_checkable_sig(&checkable[n_checking], cert, NULL,
+                                   &expires) < 0) {
+      ++n_bad;
+      continue;
+    }
+    if (now && now > expires) {
+      cert->cert_expired = 1;
+      ++n_bad;
+      continue;
+    }
+    checking[n_checking++] = cert;
+  }
+
+  if (n_checking)
+    ed25519_checksig_batch(okay, checkable, n_checking);
+
+  for (i = 0; i < n_checking; ++i) {
+    if (okay[i]) {
+      checking[i]->sig_ok = 1;
+      checking[i]->cert_valid = 1;
+    } else {
+      checking[i]->sig_bad = 1;
+      ++n_bad;
+    }
+  }
+
+  tor_free(checkable);
+  tor_free(checking);
+  tor_free(okay);
+  return -n_bad;
+}
+
 /** Return a string describing the status of the signature on <b>cert</b>
  *
  * Will always be "unchecked" unless tor_cert_checksig has been called.
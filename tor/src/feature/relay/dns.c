@@ -85,6 +85,13 @@
  * that the resolver is wedged? */
 #define RESOLVE_MAX_TIMEOUT 300
 
+/** How many streams must a cached resolve have answered before we refresh it
+ * ahead of its expiry? */
+#define DNS_PREFETCH_MIN_HITS 3
+/** How close to its expiry, in seconds, must a popular cached resolve be
+ * before we refresh it? */
+#define DNS_PREFETCH_WINDOW 30
+
 /** Our evdns_base; this structure handles all our name lookups. */
 static struct evdns_base *the_evdns_base = NULL;
 
@@ -100,17 +107,13 @@ static char *resolv_conf_fname = NULL;
 static time_t resolv_conf_mtime = 0;
 
 static void purge_expired_resolves(time_t now);
-static void dns_found_answer(const char *address, uint8_t query_type,
-                             int dns_answer,
-                             const tor_addr_t *addr,
-                             const char *hostname,
-                             uint32_t ttl);
 static void add_wildcarded_test_address(const char *address);
 static int configure_nameservers(int force);
 static int answer_is_wildcarded(const char *ip);
 static int evdns_err_is_transient(int err);
 static void inform_pending_connections(cached_resolve_t *resolve);
 static void make_pending_resolve_cached(cached_resolve_t *cached);
+static void finish_cached_resolve_refresh(cached_resolve_t *resolve);
 static void configure_libevent_options(void);
 
 #ifdef DEBUG_DNS_CACHE
@@ -288,6 +291,7 @@ free_cached_resolve_(cached_resolve_t *r)
   }
   if (r->res_status_hostname == RES_STATUS_DONE_OK)
     tor_free(r->result_ptr.hostname);
+  free_cached_resolve_(r->refresh);
   r->magic = 0xFF00FF00;
   tor_free(r);
 }
@@ -371,6 +375,41 @@ cached_resolve_have_all_answers(const cached_resolve_t *resolve)
           resolve->res_status_hostname != RES_STATUS_INFLIGHT);
 }
 
+/** Return true iff at least one of the lookups of <b>resolve</b> gave us an
+ * answer. */
+static int
+cached_resolve_has_answer(const cached_resolve_t *resolve)
+{
+  return (resolve->res_status_ipv4 == RES_STATUS_DONE_OK ||
+          resolve->res_status_ipv6 == RES_STATUS_DONE_OK ||
+          resolve->res_status_hostname == RES_STATUS_DONE_OK);
+}
+
+/** Return the smallest TTL of the finished lookups of <b>resolve</b>, or
+ * UINT32_MAX if none finished. */
+static uint32_t
+cached_resolve_get_ttl(const cached_resolve_t *resolve)
+{
+  uint32_t ttl = UINT32_MAX;
+
+  if ((resolve->res_status_ipv4 == RES_STATUS_DONE_OK ||
+       resolve->res_status_ipv4 == RES_STATUS_DONE_ERR) &&
+      resolve->ttl_ipv4 < ttl)
+    ttl = resolve->ttl_ipv4;
+
+  if ((resolve->res_status_ipv6 == RES_STATUS_DONE_OK ||
+       resolve->res_status_ipv6 == RES_STATUS_DONE_ERR) &&
+      resolve->ttl_ipv6 < ttl)
+    ttl = resolve->ttl_ipv6;
+
+  if ((resolve->res_status_hostname == RES_STATUS_DONE_OK ||
+       resolve->res_status_hostname == RES_STATUS_DONE_ERR) &&
+      resolve->ttl_hostname < ttl)
+    ttl = resolve->ttl_hostname;
+
+  return ttl;
+}
+
 /** Set an expiry time for a cached_resolve_t, and add it to the expiry
  * priority queue */
 static void
@@ -484,6 +523,9 @@ purge_expired_resolves(time_t now)
     }
     if (resolve->res_status_hostname == RES_STATUS_DONE_OK)
       tor_free(resolve->result_ptr.hostname);
+    /* A refresh that didn't finish in time is simply dropped: any late
+     * answer for it is ignored like any other unasked answer. */
+    free_cached_resolve_(resolve->refresh);
     resolve->magic = 0xF0BBF0BB;
     tor_free(resolve);
   }
@@ -688,6 +730,42 @@ dns_resolve(edge_connection_t *exitconn)
   return r;
 }
 
+/** Called when the cached resolve <b>resolve</b> answered a stream at
+ * <b>now</b>. If it has been popular and is about to expire, launch a
+ * refresh in the background, so that it gets replaced by a fresh answer
+ * before it goes away and the next stream doesn't wait on the resolver.
+ *
+ * The refreshed entry gets its expiry from clip_dns_ttl() like any other
+ * resolve, so this doesn't change how long an answer may be served. */
+static void
+dns_maybe_prefetch(cached_resolve_t *resolve, time_t now)
+{
+  cached_resolve_t *refresh;
+
+  if (++resolve->n_hits < DNS_PREFETCH_MIN_HITS ||
+      resolve->expire - now > DNS_PREFETCH_WINDOW ||
+      resolve->refresh)
+    return;
+  /* Failed lookups are negatively cached until they expire; refreshing them
+   * would only load the resolver on behalf of names that don't work. */
+  if (!cached_resolve_has_answer(resolve))
+    return;
+
+  refresh = tor_malloc_zero(sizeof(cached_resolve_t));
+  refresh->magic = CACHED_RESOLVE_MAGIC;
+  refresh->state = CACHE_STATE_PENDING;
+  refresh->minheap_idx = -1;
+  strlcpy(refresh->address, resolve->address, sizeof(refresh->address));
+
+  log_debug(LD_EXIT, "Refreshing popular cached resolve for %s.",
+            escaped_safe_str(resolve->address));
+  resolve->refresh = refresh;
+  if (launch_resolve(refresh) < 0) {
+    resolve->refresh = NULL;
+    free_cached_resolve_(refresh);
+  }
+}
+
 /** Helper function for dns_resolve: same functionality, but does not handle:
  *     - marking connections on error and clearing their on_circuit
  *     - linking connections to n_streams/resolving_streams,
@@ -807,6 +885,7 @@ dns_resolve_impl,(edge_connection_t *exitconn, int is_resolve,
                   escaped_safe_str(resolve->address));
 
         *resolve_out = resolve;
+        dns_maybe_prefetch(resolve, now);
 
         return set_exitconn_info_from_resolve(exitconn, resolve, hostname_out);
       case CACHE_STATE_DONE:
@@ -1125,7 +1204,7 @@ is_test_address(const char *address)
  * got one; <b>hostname</b> is a hostname fora PTR request if we got one, and
  * <b>ttl</b> is the time-to-live of this answer, in seconds.)
  */
-static void
+STATIC void
 dns_found_answer(const char *address, uint8_t query_type,
                  int dns_answer,
                  const tor_addr_t *addr,
@@ -1148,6 +1227,14 @@ dns_found_answer(const char *address, uint8_t query_type,
   }
   assert_resolve_ok(resolve);
 
+  if (resolve->state == CACHE_STATE_CACHED && resolve->refresh) {
+    cached_resolve_add_answer(resolve->refresh, query_type, dns_answer,
+                              addr, hostname, ttl);
+    if (cached_resolve_have_all_answers(resolve->refresh))
+      finish_cached_resolve_refresh(resolve);
+    return;
+  }
+
   if (resolve->state != CACHE_STATE_PENDING) {
     /* XXXX Maybe update addr? or check addr for consistency? Or let
      * VALID replace FAILED? */
@@ -1256,6 +1343,36 @@ inform_pending_connections(cached_resolve_t *resolve)
   }
 }
 
+/** Given a cached resolve whose refresh just got all its answers, replace it
+ * in the cache by the refresh, unless the refresh has no answer at all: in
+ * that case we keep serving the answer we have until it expires. */
+static void
+finish_cached_resolve_refresh(cached_resolve_t *resolve)
+{
+  cached_resolve_t *fresh = resolve->refresh, *removed;
+
+  resolve->refresh = NULL;
+  if (!cached_resolve_has_answer(fresh)) {
+    log_debug(LD_EXIT, "Refresh of %s failed; keeping the cached answer.",
+              escaped_safe_str(resolve->address));
+    free_cached_resolve_(fresh);
+    return;
+  }
+
+  /* As in make_pending_resolve_cached(), the old entry leaves the hash table
+   * but stays in the expiry queue, as DONE, until it expires. */
+  resolve->state = CACHE_STATE_DONE;
+  removed = HT_REMOVE(cache_map, &cache_root, resolve);
+  tor_assert(removed == resolve);
+
+  fresh->state = CACHE_STATE_CACHED;
+  assert_resolve_ok(fresh);
+  HT_INSERT(cache_map, &cache_root, fresh);
+  set_expiry(fresh, time(NULL) + clip_dns_ttl(cached_resolve_get_ttl(fresh)));
+
+  assert_cache_ok();
+}
+
 /** Remove a pending cached_resolve_t from the hashtable, and add a
  * corresponding cached cached_resolve_t.
  *
@@ -1284,7 +1401,7 @@ make_pending_resolve_cached(cached_resolve_t *resolve)
   {
     cached_resolve_t *new_resolve = tor_memdup(resolve,
                                                sizeof(cached_resolve_t));
-    uint32_t ttl = UINT32_MAX;
+    uint32_t ttl = cached_resolve_get_ttl(resolve);
     new_resolve->expire = 0; /* So that set_expiry won't croak. */
     if (resolve->res_status_hostname == RES_STATUS_DONE_OK)
       new_resolve->result_ptr.hostname =
@@ -1295,21 +1412,6 @@ make_pending_resolve_cached(cached_resolve_t *resolve)
     assert_resolve_ok(new_resolve);
     HT_INSERT(cache_map, &cache_root, new_resolve);
 
-    if ((resolve->res_status_ipv4 == RES_STATUS_DONE_OK ||
-         resolve->res_status_ipv4 == RES_STATUS_DONE_ERR) &&
-        resolve->ttl_ipv4 < ttl)
-      ttl = resolve->ttl_ipv4;
-
-    if ((resolve->res_status_ipv6 == RES_STATUS_DONE_OK ||
-         resolve->res_status_ipv6 == RES_STATUS_DONE_ERR) &&
-        resolve->ttl_ipv6 < ttl)
-      ttl = resolve->ttl_ipv6;
-
-    if ((resolve->res_status_hostname == RES_STATUS_DONE_OK ||
-         resolve->res_status_hostname == RES_STATUS_DONE_ERR) &&
-        resolve->ttl_hostname < ttl)
-      ttl = resolve->ttl_hostname;
-
     set_expiry(new_resolve, time(NULL) + clip_dns_ttl(ttl));
   }
 
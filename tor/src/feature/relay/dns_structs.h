@@ -96,6 +96,13 @@ typedef struct cached_resolve_t {
   uint32_t ttl_hostname; /**< What TTL did the nameserver tell us? */
   /** Connections that want to know when we get an answer for this resolve. */
   pending_connection_t *pending_connections;
+  /** How many streams have been answered from this cached resolve? Used to
+   * decide whether it is worth refreshing before it expires. */
+  uint32_t n_hits;
+  /** If we are refreshing this cached resolve before it expires, the resolve
+   * that will replace it once all its answers are in. It is in neither the
+   * hash table nor the expiry queue. */
+  struct cached_resolve_t *refresh;
   /** Position of this element in the heap*/
   int minheap_idx;
 } cached_resolve_t;
@@ -817,6 +817,8 @@ router_initialize_tls_context(void)
   int lifetime = options->SSLKeyLifetime;
   if (public_server_mode(options))
     flags |= TOR_TLS_CTX_IS_PUBLIC_SERVER;
+  if (options->UseKernelTLS)
+    flags |= TOR_TLS_CTX_USE_KTLS;
   if (!lifetime) { /* we should guess a good ssl cert lifetime */
 
     /* choose between 5 and 365 days, and round to the day */
@@ -1707,8 +1709,8 @@ router_compare_to_my_exit_policy(const tor_addr_t *addr, uint16_t port)
    * summary. */
   if ((tor_addr_family(addr) == AF_INET ||
        tor_addr_family(addr) == AF_INET6)) {
-    return compare_tor_addr_to_addr_policy(addr, port,
-                               me->exit_policy) != ADDR_POLICY_ACCEPTED;
+    return compare_tor_addr_to_compiled_policy(addr, port, me->exit_policy,
+                    me->exit_policy_matcher) != ADDR_POLICY_ACCEPTED;
 #if 0
   } else if (tor_addr_family(addr) == AF_INET6) {
     return get_options()->IPv6Exit &&
@@ -2175,6 +2177,9 @@ router_build_fresh_unsigned_routerinfo,(routerinfo_t **ri_out))
   ri->policy_is_reject_star =
     policy_is_reject_star(ri->exit_policy, AF_INET, 1) &&
     policy_is_reject_star(ri->exit_policy, AF_INET6, 1);
+  /* We consult our own exit policy for every BEGIN cell and every resolved
+   * address, so compile it once here. */
+  ri->exit_policy_matcher = addr_policy_matcher_new(ri->exit_policy);
 
   if (options->IPv6Exit) {
     char *p_tmp = policy_summarize(ri->exit_policy, AF_INET6);
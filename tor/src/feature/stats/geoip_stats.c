@@ -235,9 +235,9 @@ geoip_note_client_seen(geoip_client_action_t action,
   clientmap_entry_t *ent;
 
   if (action == GEOIP_CLIENT_CONNECT) {
-    /* Only remember statistics if the DoS mitigation subsystem is enabled. If
+    /* Only remember statistics if the DoS mitigation subsystem needs them. If
      * not, only if as entry guard or as bridge. */
-    if (!dos_enabled()) {
+    if (!dos_uses_geoip_client_map()) {
       if (!options->EntryStatistics && !should_record_bridge_info(options)) {
         return;
       }
@@ -62,6 +62,10 @@
  * Every chunk, except the tail, contains at least one byte of data.  Data in
  * each chunk is contiguous.
  *
+ * A chunk can also refer to memory that somebody else owns, such as a cached
+ * file that we're serving.  Such chunks have no room for more data, and we
+ * never write to them.
+ *
  * When you need to treat the first N characters on a buffer as a contiguous
  * string, use the buf_pullup function to make them so.  Don't do this more
  * than necessary.
@@ -125,24 +129,114 @@ chunk_repack(chunk_t *chunk)
 
 /** Keep track of total size of allocated chunks for consistency asserts */
 static size_t total_bytes_allocated_in_chunks = 0;
+/** Keep track of total size of the chunks waiting on freelists. */
+static size_t total_bytes_in_freelists = 0;
+
+/** A freelist of chunks of a single allocation size.
+ *
+ * Connections come and go all the time, and each one allocates and releases
+ * buffer chunks of a handful of sizes. Keeping a bounded number of released
+ * chunks around for reuse spares the allocator most of that churn, which
+ * otherwise fragments the heap on busy relays. */
+typedef struct chunk_freelist_t {
+  size_t alloc_size; /**< What size chunks does this freelist hold? */
+  int max_length; /**< Never allow more than this number of chunks in the
+                   * freelist. */
+  int slack; /**< When trimming the freelist, leave this number of extra
+              * chunks beyond lowest_length.*/
+  int cur_length; /**< How many chunks on the freelist now? */
+  int lowest_length; /**< What's the smallest value of cur_length since the
+                      * last time we cleaned this freelist? */
+  uint64_t n_alloc; /**< How many chunks of this size did we malloc? */
+  uint64_t n_free; /**< How many chunks of this size did we free because the
+                    * freelist was full? */
+  uint64_t n_hit; /**< How many allocations were served from the freelist? */
+  chunk_t *head; /**< First chunk on the freelist. */
+} chunk_freelist_t;
+
+/** Macro to help define freelists. */
+#define FL(a,m,s) { a, m, s, 0, 0, 0, 0, 0, NULL }
+
+/** Static array of freelists, sorted by alloc_size, terminated by an entry
+ * with alloc_size of 0. Each one holds at most a megabyte. */
+static chunk_freelist_t freelists[] = {
+  FL(4096, 256, 8), FL(8192, 128, 4), FL(16384, 64, 4), FL(32768, 32, 2),
+  FL(65536, 16, 1),
+  FL(0, 0, 0)
+};
+#undef FL
+/** How many times have we looked for a chunk of a size that no freelist
+ * could help with? */
+static uint64_t n_freelist_miss = 0;
+
+/** Return the freelist to hold chunks of size <b>alloc</b>, or NULL if
+ * no freelist exists for that size. */
+static inline chunk_freelist_t *
+get_freelist(size_t alloc)
+{
+  int i;
+  for (i = 0; freelists[i].alloc_size && freelists[i].alloc_size <= alloc;
+       ++i) {
+    if (freelists[i].alloc_size == alloc)
+      return &freelists[i];
+  }
+  return NULL;
+}
+
+/** Deallocate a chunk or put it on a freelist */
 static void
 buf_chunk_free_unchecked(chunk_t *chunk)
 {
+  size_t alloc;
+  chunk_freelist_t *freelist;
+
   if (!chunk)
     return;
+  alloc = CHUNK_ALLOC_SIZE(chunk->memlen);
 #ifdef DEBUG_CHUNK_ALLOC
-  tor_assert(CHUNK_ALLOC_SIZE(chunk->memlen) == chunk->DBG_alloc);
+  tor_assert(alloc == chunk->DBG_alloc);
 #endif
-  tor_assert(total_bytes_allocated_in_chunks >=
-             CHUNK_ALLOC_SIZE(chunk->memlen));
-  total_bytes_allocated_in_chunks -= CHUNK_ALLOC_SIZE(chunk->memlen);
-  tor_free(chunk);
+  tor_assert(total_bytes_allocated_in_chunks >= alloc);
+  total_bytes_allocated_in_chunks -= alloc;
+  if (chunk->release_fn) {
+    chunk->release_fn(chunk->release_arg);
+    chunk->release_fn = NULL;
+  }
+
+  freelist = get_freelist(alloc);
+  if (freelist && freelist->cur_length < freelist->max_length) {
+    chunk->next = freelist->head;
+    freelist->head = chunk;
+    ++freelist->cur_length;
+    total_bytes_in_freelists += alloc;
+  } else {
+    if (freelist)
+      ++freelist->n_free;
+    tor_free(chunk);
+  }
 }
 static inline chunk_t *
 chunk_new_with_alloc_size(size_t alloc)
 {
   chunk_t *ch;
-  ch = tor_malloc(alloc);
+  chunk_freelist_t *freelist;
+
+  freelist = get_freelist(alloc);
+  if (freelist && freelist->head) {
+    ch = freelist->head;
+    freelist->head = ch->next;
+    if (--freelist->cur_length < freelist->lowest_length)
+      freelist->lowest_length = freelist->cur_length;
+    ++freelist->n_hit;
+    tor_assert(total_bytes_in_freelists >= alloc);
+    total_bytes_in_freelists -= alloc;
+  } else {
+    if (freelist)
+      ++freelist->n_alloc;
+    else
+      ++n_freelist_miss;
+    ch = tor_malloc(alloc);
+  }
   ch->next = NULL;
   ch->datalen = 0;
 #ifdef DEBUG_CHUNK_ALLOC
@@ -151,10 +245,89 @@ chunk_new_with_alloc_size(size_t alloc)
   ch->memlen = CHUNK_SIZE_WITH_ALLOC(alloc);
   total_bytes_allocated_in_chunks += alloc;
   ch->data = &ch->mem[0];
+  ch->release_fn = NULL;
+  ch->release_arg = NULL;
   CHUNK_SET_SENTINEL(ch, alloc);
   return ch;
 }
 
+/** Remove from the freelists the chunks that have gone unused since the last
+ * call to this function, except for a few spare ones. If <b>free_all</b> is
+ * true, empty the freelists entirely.
+ *
+ * Return the number of bytes released to the allocator. */
+size_t
+buf_shrink_freelists(int free_all)
+{
+  size_t bytes_freed = 0;
+  int i;
+
+  for (i = 0; freelists[i].alloc_size; ++i) {
+    chunk_freelist_t *freelist = &freelists[i];
+    const int n_to_free = free_all ? freelist->cur_length :
+      freelist->lowest_length - freelist->slack;
+
+    if (n_to_free > 0) {
+      /* The chunks at the bottom of the list are the ones that nobody has
+       * needed since the last time we got here: free those, and keep the
+       * recently used ones at the top. */
+      const int n_to_keep = freelist->cur_length - n_to_free;
+      chunk_t **chp = &freelist->head;
+      chunk_t *chunk;
+      int n_kept;
+
+      for (n_kept = 0; n_kept < n_to_keep; ++n_kept) {
+        tor_assert(*chp);
+        chp = &(*chp)->next;
+      }
+      chunk = *chp;
+      *chp = NULL;
+      while (chunk) {
+        chunk_t *next = chunk->next;
+        const size_t alloc = CHUNK_ALLOC_SIZE(chunk->memlen);
+        tor_assert(total_bytes_in_freelists >= alloc);
+        total_bytes_in_freelists -= alloc;
+        bytes_freed += alloc;
+        ++freelist->n_free;
+        tor_free(chunk);
+        chunk = next;
+      }
+      freelist->cur_length = n_to_keep;
+    }
+    freelist->lowest_length = freelist->cur_length;
+  }
+  return bytes_freed;
+}
+
+/** Return the number of bytes held in chunks that are waiting on freelists
+ * to be reused. */
+size_t
+buf_get_freelist_allocation(void)
+{
+  return total_bytes_in_freelists;
+}
+
+/** Describe the current status of the freelists at log level
+ * <b>severity</b>. */
+void
+buf_dump_freelist_sizes(int severity)
+{
+  int i;
+  tor_log(severity, LD_MM, "====== Buffer freelists:");
+  for (i = 0; freelists[i].alloc_size; ++i) {
+    uint64_t total = ((uint64_t)freelists[i].cur_length) *
+      freelists[i].alloc_size;
+    tor_log(severity, LD_MM,
+            "  %"PRIu64" bytes in %d %"TOR_PRIuSZ"-byte chunks "
+            "[%"PRIu64" misses; %"PRIu64" frees; %"PRIu64" hits]",
+            (total), freelists[i].cur_length, freelists[i].alloc_size,
+            (freelists[i].n_alloc), (freelists[i].n_free),
+            (freelists[i].n_hit));
+  }
+  tor_log(severity, LD_MM, "  %"PRIu64" allocations in non-freelist sizes",
+          (n_freelist_miss));
+}
+
 /** Expand <b>chunk</b> until it can hold <b>sz</b> bytes, and return a
  * new pointer to <b>chunk</b>.  Old pointers are no longer valid. */
 static inline chunk_t *
@@ -229,6 +402,21 @@ buf_pullup(buf_t *buf, size_t bytes, const char **head_out, size_t *len_out)
     return;
   }
 
+  if (buf->head->release_fn) {
+    /* We can't write into memory that we don't own, so start with a copy of
+     * the first chunk. */
+    chunk_t *newhead =
+      chunk_new_with_alloc_size(buf_preferred_chunk_size(capacity));
+    memcpy(newhead->data, buf->head->data, buf->head->datalen);
+    newhead->datalen = buf->head->datalen;
+    newhead->inserted_time = buf->head->inserted_time;
+    newhead->next = buf->head->next;
+    if (buf->tail == buf->head)
+      buf->tail = newhead;
+    buf_chunk_free_unchecked(buf->head);
+    buf->head = newhead;
+  }
+
   if (buf->head->memlen >= capacity) {
     /* We don't need to grow the first chunk, but we might need to repack it.*/
     size_t needed = capacity - buf->head->datalen;
@@ -435,6 +623,15 @@ buf_free_(buf_t *buf)
 static chunk_t *
 chunk_copy(const chunk_t *in_chunk)
 {
+  if (in_chunk->release_fn) {
+    /* Don't share memory that we don't own: copy it instead. */
+    chunk_t *newch =
+      chunk_new_with_alloc_size(buf_preferred_chunk_size(in_chunk->datalen));
+    memcpy(newch->data, in_chunk->data, in_chunk->datalen);
+    newch->datalen = in_chunk->datalen;
+    newch->inserted_time = in_chunk->inserted_time;
+    return newch;
+  }
   chunk_t *newch = tor_memdup(in_chunk, CHUNK_ALLOC_SIZE(in_chunk->memlen));
   total_bytes_allocated_in_chunks += CHUNK_ALLOC_SIZE(in_chunk->memlen);
 #ifdef DEBUG_CHUNK_ALLOC
@@ -563,6 +760,64 @@ buf_add_string(buf_t *buf, const char *string)
   buf_add(buf, string, strlen(string));
 }
 
+/** Append the <b>data_len</b> bytes at <b>data</b> to the end of <b>buf</b>
+ * without copying them. The bytes must stay valid and unchanged until
+ * <b>buf</b> is done with them, at which point we call
+ * <b>release_fn</b>(<b>release_arg</b>).  We call it exactly once, even if
+ * this function fails.
+ *
+ * Return the new length of the buffer on success, -1 on failure.
+ */
+int
+buf_add_external(buf_t *buf, const char *data, size_t data_len,
+                 buf_release_fn_t release_fn, void *release_arg)
+{
+  chunk_t *chunk;
+  tor_assert(release_fn);
+  check();
+
+  if (!data_len) {
+    release_fn(release_arg);
+    return (int)buf->datalen;
+  }
+  if (BUG(buf->datalen > BUF_MAX_LEN) ||
+      BUG(buf->datalen > BUF_MAX_LEN - data_len)) {
+    release_fn(release_arg);
+    return -1;
+  }
+
+  if (buf->tail && buf->tail->datalen == 0) {
+    /* Only the tail may be empty, so get rid of it. */
+    chunk_t *prev = NULL, *ch;
+    for (ch = buf->head; ch != buf->tail; ch = ch->next)
+      prev = ch;
+    buf_chunk_free_unchecked(buf->tail);
+    if (prev)
+      prev->next = NULL;
+    else
+      buf->head = NULL;
+    buf->tail = prev;
+  }
+
+  chunk = chunk_new_with_alloc_size(CHUNK_ALLOC_SIZE(0));
+  chunk->data = (char *) data;
+  chunk->datalen = data_len;
+  chunk->release_fn = release_fn;
+  chunk->release_arg = release_arg;
+  chunk->inserted_time = monotime_coarse_get_stamp();
+
+  if (buf->tail) {
+    buf->tail->next = chunk;
+    buf->tail = chunk;
+  } else {
+    buf->head = buf->tail = chunk;
+  }
+  buf->datalen += data_len;
+
+  check();
+  return (int)buf->datalen;
+}
+
 /** As tor_snprintf, but write the results into a buf_t */
 void
 buf_add_printf(buf_t *buf, const char *format, ...)
@@ -921,8 +1176,17 @@ buf_assert_ok(buf_t *buf)
     tor_assert(buf->tail);
     for (ch = buf->head; ch; ch = ch->next) {
       total += ch->datalen;
-      tor_assert(ch->datalen <= ch->memlen);
       tor_assert(ch->datalen <= BUF_MAX_LEN);
+      if (ch->release_fn) {
+        /* The data lives somewhere else. */
+        tor_assert(ch->memlen == 0);
+        tor_assert(ch->data);
+        tor_assert(ch->datalen > 0);
+        if (!ch->next)
+          tor_assert(ch == buf->tail);
+        continue;
+      }
+      tor_assert(ch->datalen <= ch->memlen);
       tor_assert(ch->data >= &ch->mem[0]);
       tor_assert(ch->data <= &ch->mem[0]+ch->memlen);
       if (ch->data == &ch->mem[0]+ch->memlen) {
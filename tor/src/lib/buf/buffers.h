@@ -21,6 +21,10 @@
 
 typedef struct buf_t buf_t;
 
+/** A function to call when a buffer no longer needs memory that was added
+ * to it with buf_add_external(). */
+typedef void (*buf_release_fn_t)(void *arg);
+
 buf_t *buf_new(void);
 buf_t *buf_new_with_capacity(size_t size);
 size_t buf_get_default_chunk_size(const buf_t *buf);
@@ -38,9 +42,14 @@ size_t buf_slack(const buf_t *buf);
 
 uint32_t buf_get_oldest_chunk_timestamp(const buf_t *buf, uint32_t now);
 size_t buf_get_total_allocation(void);
+size_t buf_get_freelist_allocation(void);
+size_t buf_shrink_freelists(int free_all);
+void buf_dump_freelist_sizes(int severity);
 
 int buf_add(buf_t *buf, const char *string, size_t string_len);
 void buf_add_string(buf_t *buf, const char *string);
+int buf_add_external(buf_t *buf, const char *data, size_t data_len,
+                     buf_release_fn_t release_fn, void *release_arg);
 void buf_add_printf(buf_t *buf, const char *format, ...)
   CHECK_PRINTF(2, 3);
 void buf_add_vprintf(buf_t *buf, const char *format, va_list args)
@@ -80,7 +89,13 @@ typedef struct chunk_t {
 #ifdef DEBUG_CHUNK_ALLOC
   size_t DBG_alloc;
 #endif
-  char *data; /**< A pointer to the first byte of data stored in <b>mem</b>. */
+  char *data; /**< A pointer to the first byte of data stored in <b>mem</b>,
+              * or in external memory if <b>release_fn</b> is set. */
+  /** If set, this chunk's data is not in <b>mem</b>, but in memory that
+   * someone else owns: call this function with <b>release_arg</b> when the
+   * chunk is freed. */
+  buf_release_fn_t release_fn;
+  void *release_arg; /**< Argument for <b>release_fn</b>. */
   uint32_t inserted_time; /**< Timestamp when this chunk was inserted. */
   char mem[FLEXIBLE_ARRAY_MEMBER]; /**< The actual memory used for storage in
                 * this chunk. */
@@ -109,6 +124,8 @@ chunk_t *buf_add_chunk_with_capacity(buf_t *buf, size_t capacity, int capped);
 static inline size_t
 CHUNK_REMAINING_CAPACITY(const chunk_t *chunk)
 {
+  if (chunk->release_fn)
+    return 0;
   return (chunk->mem + chunk->memlen) - (chunk->data + chunk->datalen);
 }
 
@@ -102,7 +102,7 @@ static const ed25519_impl_t impl_donna = {
 
   ed25519_donna_open,
   ed25519_donna_sign,
-  NULL, /* Don't use donna's batching code because of #40078 */
+  ed25519_sign_open_batch_donna,
 
   ed25519_donna_blind_secret_key,
   ed25519_donna_blind_public_key,
@@ -115,6 +115,21 @@ static const ed25519_impl_t impl_donna = {
  * yet. */
 static const ed25519_impl_t *ed25519_impl = NULL;
 
+/** True iff ed25519_checksig_batch() may use the batch verification code of
+ * the current implementation.
+ *
+ * This is off by default: a random linear combination of signatures can
+ * accept inputs with a small-order component that a single verification
+ * would reject (see #40078), so two relays could disagree about the
+ * validity of a crafted signature.  A failing batch is always re-checked
+ * one signature at a time, so batching never rejects a signature that a
+ * single check would accept. */
+static int ed25519_batch_verification_enabled = 0;
+
+/** Below this many signatures, batch verification is never faster than
+ * checking each signature on its own. */
+#define ED25519_BATCH_MIN_SIZE 4
+
 /** Helper: Return our chosen Ed25519 implementation.
  *
  * This should only be called after we've picked an implementation, but
@@ -378,9 +393,11 @@ ed25519_checksig_batch,(int *okay_out,
   int i, res;
   const ed25519_impl_t *impl = get_ed_impl();
 
-  if (impl->open_batch == NULL) {
-    /* No batch verification implementation available, fake it by checking the
-     * each signature individually.
+  if (impl->open_batch == NULL ||
+      !ed25519_batch_verification_enabled ||
+      n_checkable < ED25519_BATCH_MIN_SIZE) {
+    /* No batch verification implementation available (or it isn't worth
+     * using), fake it by checking the each signature individually.
      */
     res = 0;
     for (i = 0; i < n_checkable; ++i) {
@@ -392,12 +409,7 @@ ed25519_checksig_batch,(int *okay_out,
         okay_out[i] = (r == 0);
     }
   } else {
-    /* ed25519-donna style batch verification available.
-     *
-     * Theoretically, this should only be called if n_checkable >= 3, since
-     * that's the threshold where the batch verification actually kicks in,
-     * but the only difference is a few mallocs/frees.
-     */
+    /* ed25519-donna style batch verification available. */
     const uint8_t **ms;
     size_t *lens;
     const uint8_t **pks;
@@ -421,15 +433,18 @@ ed25519_checksig_batch,(int *okay_out,
 
     res = 0;
     all_ok = impl->open_batch(ms, lens, pks, sigs, n_checkable, oks);
+    if (all_ok != 0) {
+      /* The batch failed: fall back to checking every signature on its own,
+       * so that the set of signatures we reject is exactly the set that
+       * ed25519_checksig() would reject. */
+      for (i = 0; i < n_checkable; ++i) {
+        oks[i] = impl->open(sigs[i], ms[i], lens[i], pks[i]) < 0 ? 0 : 1;
+      }
+    }
     for (i = 0; i < n_checkable; ++i) {
       if (!oks[i])
         --res;
     }
-    /* XXX: For now sanity check oks with the return value.  Once we have
-     * more confidence in the code, if `all_ok == 0` we can skip iterating
-     * over oks since all the signatures were found to be valid.
-     */
-    tor_assert(((res == 0) && !all_ok) || ((res < 0) && all_ok));
 
     tor_free(ms);
     tor_free(lens);
@@ -751,6 +766,21 @@ ed25519_set_impl_params(int use_donna)
     ed25519_impl = &impl_ref10;
 }
 
+/** Set whether ed25519_checksig_batch() should use batch verification when
+ * the current implementation supports it. */
+void
+ed25519_set_batch_verification(int enabled)
+{
+  ed25519_batch_verification_enabled = !!enabled;
+}
+
+/** Return true iff ed25519_checksig_batch() may use batch verification. */
+int
+ed25519_get_batch_verification(void)
+{
+  return ed25519_batch_verification_enabled;
+}
+
 /** Choose whether to use the Ed25519-donna implementation. */
 static void
 pick_ed25519_impl(void)
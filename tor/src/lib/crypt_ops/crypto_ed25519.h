@@ -128,6 +128,8 @@ void ed25519_pubkey_copy(ed25519_public_key_t *dest,
                          const ed25519_public_key_t *src);
 
 void ed25519_set_impl_params(int use_donna);
+void ed25519_set_batch_verification(int enabled);
+int ed25519_get_batch_verification(void);
 void ed25519_init(void);
 
 int ed25519_validate_pubkey(const ed25519_public_key_t *pubkey);
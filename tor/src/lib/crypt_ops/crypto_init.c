@@ -312,6 +312,7 @@ crypto_set_options(void *arg)
     log_err(LD_BUG, "Unable to initialize the crypto subsystem. Exiting.");
     return -1;
   }
+  ed25519_set_batch_verification(options->Ed25519BatchVerification);
   return 0;
 }
 
@@ -280,6 +280,34 @@ select_array_member_cumulative_timei(const uint64_t *entries, int n_entries,
   return i_chosen;
 }
 
+/**
+ * Given an array of <b>n_entries</b> nondecreasing uint64_t values, each the
+ * running total of some list of weights, find the first i such that
+ * <b>cumulative</b>[i] is greater than rand_val.  The last entry must be
+ * greater than rand_val.
+ *
+ * This is a binary search that always takes the same number of steps for a
+ * given <b>n_entries</b>, and that does not branch on the values it reads.
+ */
+int
+select_array_member_sorted_timei(const uint64_t *cumulative, int n_entries,
+                                 uint64_t rand_val)
+{
+  int base = 0, len = n_entries;
+
+  raw_assert(n_entries >= 1);
+  raw_assert(gt_i64_timei(cumulative[n_entries - 1], rand_val));
+
+  while (len > 1) {
+    const int half = len / 2;
+    const int le = !gt_i64_timei(cumulative[base + half - 1], rand_val);
+    base += half & -le;
+    len -= half;
+  }
+
+  return base;
+}
+
 /**
  * If <b>s</b> is true, then copy <b>n</b> bytes from <b>src</b> to
  * <b>dest</b>.  Otherwise leave <b>dest</b> alone.
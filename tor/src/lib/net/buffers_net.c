@@ -25,6 +25,16 @@
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
+
+#if defined(HAVE_WRITEV) && defined(HAVE_SYS_UIO_H)
+/** Defined if we can flush several chunks with a single writev() call. */
+#define USE_WRITEV
+/** Largest number of chunks we hand to a single writev() call. */
+#define FLUSH_MAX_IOV 16
+#endif
 
 #ifdef PARANOIA
 /** Helper: If PARANOIA is defined, assert that the buffer in local variable
@@ -173,6 +183,53 @@ flush_chunk(tor_socket_t fd, buf_t *buf, chunk_t *chunk, size_t sz,
   }
 }
 
+#ifdef USE_WRITEV
+/** Helper for buf_flush_to_socket(): try to write up to <b>sz</b> bytes from
+ * the first few chunks of buffer <b>buf</b> onto file descriptor <b>fd</b>
+ * with a single writev() call, and set *<b>attempted_out</b> to the number
+ * of bytes we tried to write.  Return the number of bytes written on
+ * success, 0 on blocking, -1 on failure.
+ */
+static inline int
+flush_chunks_v(tor_socket_t fd, buf_t *buf, size_t sz, size_t *attempted_out)
+{
+  struct iovec iov[FLUSH_MAX_IOV];
+  int n_iov = 0;
+  ssize_t write_result;
+  chunk_t *chunk;
+
+  *attempted_out = 0;
+
+  for (chunk = buf->head; chunk && sz && n_iov < FLUSH_MAX_IOV;
+       chunk = chunk->next) {
+    size_t len = chunk->datalen < sz ? chunk->datalen : sz;
+    if (!len)
+      continue;
+    iov[n_iov].iov_base = chunk->data;
+    iov[n_iov].iov_len = len;
+    ++n_iov;
+    sz -= len;
+    *attempted_out += len;
+  }
+
+  write_result = writev(fd, iov, n_iov);
+
+  if (write_result < 0) {
+    int e = errno;
+
+    if (!ERRNO_IS_EAGAIN(e)) { /* it's a real error */
+      return -1;
+    }
+    log_debug(LD_NET,"writev() would block, returning.");
+    return 0;
+  } else {
+    buf_drain(buf, write_result);
+    tor_assert(write_result <= BUF_MAX_LEN);
+    return (int)write_result;
+  }
+}
+#endif /* defined(USE_WRITEV) */
+
 /** Write data from <b>buf</b> to the file descriptor <b>fd</b>.  Write at most
  * <b>sz</b> bytes, and remove the written bytes
  * from the buffer.  Return the number of bytes written on success,
@@ -201,7 +258,16 @@ buf_flush_to_fd(buf_t *buf, int fd, size_t sz,
     else
       flushlen0 = buf->head->datalen;
 
+#ifdef USE_WRITEV
+    /* When the data spans several chunks, write as many of them as we can
+     * with one syscall instead of one send() per chunk. */
+    if (flushlen0 < sz)
+      r = flush_chunks_v(fd, buf, sz, &flushlen0);
+    else
+      r = flush_chunk(fd, buf, buf->head, flushlen0, is_socket);
+#else
     r = flush_chunk(fd, buf, buf->head, flushlen0, is_socket);
+#endif /* defined(USE_WRITEV) */
     check();
     if (r < 0)
       return r;
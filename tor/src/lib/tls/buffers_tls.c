@@ -15,6 +15,7 @@
 #include "lib/buf/buffers.h"
 #include "lib/tls/buffers_tls.h"
 #include "lib/cc/torint.h"
+#include "lib/intmath/cmp.h"
 #include "lib/log/log.h"
 #include "lib/log/util_bug.h"
 #include "lib/tls/tortls.h"
@@ -131,6 +132,35 @@ flush_chunk_tls(tor_tls_t *tls, buf_t *buf, chunk_t *chunk, size_t sz)
   return r;
 }
 
+/** Largest amount of data that fits in one TLS record.  When the data we
+ * want to flush is spread over several small chunks, we gather up to this
+ * much of it into a single TLS write, so that we emit one full record (and
+ * usually one syscall) instead of a short record for every chunk. */
+#define TLS_GATHER_MAX 16384
+
+/** Helper for buf_flush_to_tls(): try to write the first <b>sz</b> bytes of
+ * <b>buf</b>, which span more than one chunk, onto <b>tls</b> in a single
+ * write.  Return the number of bytes written on success, and a TOR_TLS error
+ * code on failure or blocking.
+ */
+static inline int
+flush_gathered_tls(tor_tls_t *tls, buf_t *buf, size_t sz)
+{
+  char data[TLS_GATHER_MAX];
+  int r;
+
+  tor_assert(sz <= sizeof(data));
+  tor_assert(sz <= buf->datalen);
+  buf_peek(buf, data, sz);
+  r = tor_tls_write(tls, data, sz);
+  if (r < 0)
+    return r;
+  buf_drain(buf, r);
+  log_debug(LD_NET,"flushed %d gathered bytes, %d remain.",
+            r,(int)buf->datalen);
+  return r;
+}
+
 /** As buf_flush_to_socket(), but writes data to a TLS connection.  Can write
  * more than <b>flushlen</b> bytes.
  */
@@ -151,6 +181,7 @@ buf_flush_to_tls(buf_t *buf, tor_tls_t *tls, size_t flushlen)
 
   do {
     size_t flushlen0;
+    size_t gatherlen = MIN((size_t)sz, TLS_GATHER_MAX);
     if (buf->head) {
       if ((ssize_t)buf->head->datalen >= sz)
         flushlen0 = sz;
@@ -160,7 +191,16 @@ buf_flush_to_tls(buf_t *buf, tor_tls_t *tls, size_t flushlen)
       flushlen0 = 0;
     }
 
-    r = flush_chunk_tls(tls, buf, buf->head, flushlen0);
+    /* A write that previously blocked must be retried with the same size;
+     * make sure we hand over at least that much. */
+    gatherlen = MAX(gatherlen, tor_tls_get_forced_write_size(tls));
+
+    if (buf->head && buf->head->datalen < gatherlen &&
+        gatherlen <= TLS_GATHER_MAX && gatherlen <= buf->datalen) {
+      r = flush_gathered_tls(tls, buf, gatherlen);
+    } else {
+      r = flush_chunk_tls(tls, buf, buf->head, flushlen0);
+    }
     if (r < 0)
       return r;
     flushed += r;
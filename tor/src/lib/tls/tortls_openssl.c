@@ -633,6 +633,23 @@ tor_tls_context_new(crypto_pk_t *identity, unsigned int key_lifetime,
 #ifdef SSL_MODE_RELEASE_BUFFERS
   SSL_CTX_set_mode(result->ctx, SSL_MODE_RELEASE_BUFFERS);
 #endif
+  if (flags & TOR_TLS_CTX_USE_KTLS) {
+#ifdef SSL_OP_ENABLE_KTLS
+    /* OpenSSL decides after the handshake whether the negotiated cipher and
+     * the kernel allow offloading; if not, it keeps doing the record layer
+     * itself. */
+    SSL_CTX_set_options(result->ctx, SSL_OP_ENABLE_KTLS);
+#else
+    /* We build a client and a server context, and rebuild both at every
+     * link key rotation; one notice is enough. */
+    static int warned_no_ktls = 0;
+    if (!warned_no_ktls) {
+      log_notice(LD_NET, "UseKernelTLS is set, but this OpenSSL was built "
+                 "without kernel TLS support. Ignoring.");
+      warned_no_ktls = 1;
+    }
+#endif
+  }
   if (! is_client) {
     if (result->my_link_cert &&
         !SSL_CTX_use_certificate(result->ctx,
@@ -1278,8 +1295,8 @@ STATIC uint64_t total_bytes_written_by_tls = 0;
  * number of characters written.  On failure, returns TOR_TLS_ERROR,
  * TOR_TLS_WANTREAD, or TOR_TLS_WANTWRITE.
  */
-int
-tor_tls_write(tor_tls_t *tls, const char *cp, size_t n)
+MOCK_IMPL(int,
+tor_tls_write, (tor_tls_t *tls, const char *cp, size_t n))
 {
   int r, err;
   tor_assert(tls);
@@ -1491,10 +1508,27 @@ tor_tls_get_pending_bytes(tor_tls_t *tls)
   return SSL_pending(tls->ssl);
 }
 
+/** Set *<b>send_out</b> and *<b>recv_out</b> to true iff the kernel is
+ * doing the TLS record layer for data sent and received on <b>tls</b>,
+ * respectively. */
+void
+tor_tls_get_kernel_offload(tor_tls_t *tls, int *send_out, int *recv_out)
+{
+  tor_assert(tls);
+  tor_assert(send_out);
+  tor_assert(recv_out);
+#ifdef BIO_get_ktls_send
+  *send_out = BIO_get_ktls_send(SSL_get_wbio(tls->ssl)) ? 1 : 0;
+  *recv_out = BIO_get_ktls_recv(SSL_get_rbio(tls->ssl)) ? 1 : 0;
+#else
+  *send_out = *recv_out = 0;
+#endif
+}
+
 /** If <b>tls</b> requires that the next write be of a particular size,
  * return that size.  Otherwise, return 0. */
-size_t
-tor_tls_get_forced_write_size(tor_tls_t *tls)
+MOCK_IMPL(size_t,
+tor_tls_get_forced_write_size, (tor_tls_t *tls))
 {
   return tls->wantwrite_n;
 }
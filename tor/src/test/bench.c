@@ -10,6 +10,9 @@
 
 #include "orconfig.h"
 
+#define BUFFERS_PRIVATE
+#define CHANNEL_OBJECT_PRIVATE
+
 #include "core/or/or.h"
 #include "core/crypto/onion_tap.h"
 #include "core/crypto/relay_crypto.h"
@@ -25,24 +28,66 @@
 #endif /* defined(ENABLE_OPENSSL) */
 
 #include "core/or/circuitlist.h"
+#include "core/or/circuitmux.h"
+#include "core/or/circuitmux_ewma.h"
+#include "core/or/channel.h"
+#include "core/or/connection_edge.h"
+#include "core/or/relay.h"
+#include "core/or/scheduler.h"
+#include "core/mainloop/connection.h"
+#include "core/mainloop/mainloop.h"
+#include "lib/evloop/compat_libevent.h"
 #include "app/config/config.h"
 #include "app/main/subsysmgr.h"
 #include "lib/crypt_ops/crypto_curve25519.h"
 #include "lib/crypt_ops/crypto_dh.h"
+#include "lib/crypt_ops/crypto_digest.h"
 #include "core/crypto/onion_ntor.h"
 #include "lib/crypt_ops/crypto_ed25519.h"
+#include "lib/crypt_ops/crypto_format.h"
 #include "lib/crypt_ops/crypto_rand.h"
 #include "feature/dircommon/consdiff.h"
 #include "lib/compress/compress.h"
+#include "core/or/policies.h"
+#include "core/or/dos_sketch.h"
+#include "feature/stats/geoip_stats.h"
+#include "feature/stats/rephist.h"
 
 #include "core/or/cell_st.h"
+#include "core/or/circuit_st.h"
+#include "core/proto/proto_cell.h"
+#include "lib/buf/buffers.h"
 #include "core/or/or_circuit_st.h"
+#include "core/or/edge_connection_st.h"
 
 #include "lib/crypt_ops/digestset.h"
 #include "lib/crypt_ops/crypto_init.h"
 
 #include "feature/dirparse/microdesc_parse.h"
 #include "feature/nodelist/microdesc.h"
+#include "feature/nodelist/nodelist.h"
+#include "feature/nodelist/node_select.h"
+#include "feature/nodelist/routerlist.h"
+#include "feature/dirparse/ns_parse.h"
+#include "feature/dirparse/ns_snapshot.h"
+#include "feature/dirparse/parsecommon.h"
+#include "lib/memarea/memarea.h"
+#include "lib/fs/dir.h"
+#include "lib/fs/files.h"
+#include "lib/net/buffers_net.h"
+#include "lib/net/socket.h"
+#include "lib/tls/buffers_tls.h"
+#include "lib/tls/tortls.h"
+#include "feature/dircache/conscache.h"
+#include "feature/dircache/dirserv.h"
+#include "feature/dircommon/directory.h"
+#include "lib/encoding/confline.h"
+#include "feature/dircommon/dir_connection_st.h"
+#include "feature/nodelist/networkstatus.h"
+#include "feature/nodelist/microdesc_st.h"
+#include "feature/nodelist/networkstatus_st.h"
+#include "feature/nodelist/routerinfo_st.h"
+#include "feature/nodelist/routerlist_st.h"
 
 #if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_PROCESS_CPUTIME_ID)
 static uint64_t nanostart;
@@ -267,6 +312,42 @@ bench_onion_ntor(void)
   }
 }
 
+static void
+bench_ed25519_batch(int n_sigs)
+{
+  uint64_t start, end;
+  const int iters = 1<<8;
+  int i, batch;
+  const uint8_t msg[] = "but leaving, could not tell what they had heard";
+  ed25519_keypair_t *kps = tor_calloc(n_sigs, sizeof(ed25519_keypair_t));
+  ed25519_checkable_t *ch = tor_calloc(n_sigs, sizeof(ed25519_checkable_t));
+  const int was_batching = ed25519_get_batch_verification();
+
+  for (i = 0; i < n_sigs; ++i) {
+    ed25519_keypair_generate(&kps[i], 0);
+    ed25519_sign(&ch[i].signature, msg, sizeof(msg), &kps[i]);
+    ch[i].pubkey = &kps[i].pubkey;
+    ch[i].msg = msg;
+    ch[i].len = sizeof(msg);
+  }
+
+  for (batch = 0; batch <= 1; ++batch) {
+    ed25519_set_batch_verification(batch);
+    start = perftime();
+    for (i = 0; i < iters; ++i) {
+      ed25519_checksig_batch(NULL, ch, n_sigs);
+    }
+    end = perftime();
+    printf("Verify %d signatures (batching %s): %.2f usec/sig\n",
+           n_sigs, batch ? "on" : "off",
+           MICROCOUNT(start, end, iters * n_sigs));
+  }
+
+  ed25519_set_batch_verification(was_batching);
+  tor_free(kps);
+  tor_free(ch);
+}
+
 static void
 bench_ed25519_impl(void)
 {
@@ -304,6 +385,9 @@ bench_ed25519_impl(void)
   printf("Verify signature: %.2f usec\n",
          MICROCOUNT(start, end, iters));
 
+  bench_ed25519_batch(8);
+  bench_ed25519_batch(64);
+
   curve25519_keypair_generate(&curve_kp, 0);
   start = perftime();
   for (i = 0; i < iters; ++i) {
@@ -616,6 +700,654 @@ bench_cell_ops(void)
   tor_free(cell);
 }
 
+static void
+bench_exit_package(void)
+{
+  /* An exit streaming a bulk download back to the client: the stream's
+   * inbuf fills up with data from the server, and we turn it into cells. */
+  const int iters = 1<<12;
+  const int cells_per_read = 64;
+  const size_t read_len = RELAY_PAYLOAD_SIZE * cells_per_read;
+  channel_t *chan = tor_malloc_zero(sizeof(channel_t));
+  char *data = tor_malloc_zero(read_len);
+  char keys[CPATH_KEY_MATERIAL_LEN];
+  struct tor_libevent_cfg_t cfg;
+  or_options_t *options = get_options_mutable();
+  const int vanilla = SCHEDULER_VANILLA;
+  or_circuit_t *or_circ;
+  edge_connection_t *exitconn;
+  uint64_t start, end;
+  int i;
+
+  memset(&cfg, 0, sizeof(cfg));
+  tor_libevent_initialize(&cfg);
+  tor_init_connection_lists();
+  options->MaxMemInQueues = options->MaxMemInQueues_low_threshold = SIZE_MAX;
+  options->SchedulerTypes_ = smartlist_new();
+  smartlist_add(options->SchedulerTypes_, tor_memdup(&vanilla, sizeof(int)));
+  scheduler_init();
+
+  channel_init(chan);
+  chan->state = CHANNEL_STATE_OPEN;
+  chan->wide_circ_ids = 1;
+  /* Don't let the scheduler try to flush anything. */
+  chan->scheduler_state = SCHED_CHAN_PENDING;
+  chan->cmux = circuitmux_alloc();
+  circuitmux_set_policy(chan->cmux, &ewma_policy);
+
+  or_circ = or_circuit_new(1, chan);
+  or_circ->base_.purpose = CIRCUIT_PURPOSE_OR;
+  crypto_rand(keys, sizeof(keys));
+  relay_crypto_init(&or_circ->crypto, keys, sizeof(keys), 0, 0);
+  or_circ->base_.package_window = INT_MAX;
+
+  exitconn = edge_connection_new(CONN_TYPE_EXIT, AF_INET);
+  exitconn->stream_id = 1;
+  exitconn->on_circuit = TO_CIRCUIT(or_circ);
+  exitconn->package_window = INT_MAX;
+  or_circ->n_streams = exitconn;
+
+  reset_perftime();
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    buf_add(TO_CONN(exitconn)->inbuf, data, read_len);
+    connection_edge_package_raw_inbuf(exitconn, 1, NULL);
+    /* Pretend the channel flushed everything. */
+    cell_queue_clear(&or_circ->p_chan_cells);
+    circuitmux_set_num_cells(chan->cmux, TO_CIRCUIT(or_circ), 0);
+  }
+  end = perftime();
+  printf("Exit packaging, %d cells per read: %.2f ns per cell "
+         "(%.2f MB/s)\n", cells_per_read,
+         NANOCOUNT(start, end, iters * cells_per_read),
+         ((double)read_len) * iters * 1000.0 / (end - start));
+
+  or_circ->n_streams = NULL;
+  connection_free_(TO_CONN(exitconn));
+  circuitmux_detach_circuit(chan->cmux, TO_CIRCUIT(or_circ));
+  circuit_free_all();
+  circuitmux_free(chan->cmux);
+  tor_free(chan);
+  tor_free(data);
+  scheduler_free_all();
+  SMARTLIST_FOREACH(options->SchedulerTypes_, int *, t, tor_free(t));
+  smartlist_free(options->SchedulerTypes_);
+}
+
+static void
+bench_circid_lookup(void)
+{
+  /* Cells arriving on busy channels, each one for a different circuit. */
+  const int iters = 1<<20;
+  const int n_chans = 4;
+  const int circs_per_chan = 10000;
+  channel_t *chans[4];
+  circid_t *ids = tor_calloc(n_chans * circs_per_chan, sizeof(circid_t));
+  uint64_t start, end;
+  int i, j, found = 0;
+
+  for (i = 0; i < n_chans; ++i) {
+    chans[i] = tor_malloc_zero(sizeof(channel_t));
+    channel_init(chans[i]);
+    chans[i]->cmux = circuitmux_alloc();
+    circuitmux_set_policy(chans[i]->cmux, &ewma_policy);
+    chans[i]->wide_circ_ids = 1;
+  }
+  for (i = 0; i < circs_per_chan; ++i) {
+    for (j = 0; j < n_chans; ++j) {
+      circid_t id;
+      do {
+        id = crypto_rand_u32() | 0x80000000u;
+      } while (circuit_id_in_use_on_channel(id, chans[j]));
+      ids[i * n_chans + j] = id;
+      or_circuit_new(id, chans[j]);
+    }
+  }
+  /* Look up the circuits in a random order. */
+  for (i = circs_per_chan - 1; i > 0; --i) {
+    int k = crypto_rand_int(i + 1);
+    for (j = 0; j < n_chans; ++j) {
+      circid_t tmp = ids[i * n_chans + j];
+      ids[i * n_chans + j] = ids[k * n_chans + j];
+      ids[k * n_chans + j] = tmp;
+    }
+  }
+
+  reset_perftime();
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    const int idx = i % (n_chans * circs_per_chan);
+    if (circuit_get_by_circid_channel(ids[idx], chans[idx % n_chans]))
+      ++found;
+  }
+  end = perftime();
+  printf("Circuit lookup, %d channels of %d circuits: %.2f ns per cell "
+         "(%d found)\n", n_chans, circs_per_chan,
+         NANOCOUNT(start, end, iters), found);
+
+  SMARTLIST_FOREACH_BEGIN(circuit_get_global_list(), circuit_t *, circ) {
+    channel_t *chan = TO_OR_CIRCUIT(circ)->p_chan;
+    circuitmux_detach_circuit(chan->cmux, circ);
+  } SMARTLIST_FOREACH_END(circ);
+  circuit_free_all();
+  for (i = 0; i < n_chans; ++i) {
+    circuitmux_free(chans[i]->cmux);
+    channel_free_circid_table(chans[i]);
+    tor_free(chans[i]);
+  }
+  tor_free(ids);
+}
+
+static void
+bench_cell_fetch(void)
+{
+  const int iters = 1<<16;
+  const int cells_per_fill = 64;
+  const size_t cell_network_size = get_cell_network_size(1);
+  char wire[CELL_MAX_NETWORK_SIZE];
+  buf_t *buf = buf_new();
+  cell_t cell;
+  uint64_t start, end;
+  int i, j, copy_first;
+
+  crypto_rand(wire, sizeof(wire));
+
+  reset_perftime();
+
+  for (copy_first = 1; copy_first >= 0; --copy_first) {
+    start = perftime();
+    for (i = 0; i < iters; i += cells_per_fill) {
+      for (j = 0; j < cells_per_fill; ++j)
+        buf_add(buf, wire, cell_network_size);
+      for (j = 0; j < cells_per_fill; ++j) {
+        if (copy_first) {
+          /* What we used to do: copy the wire cell out, then unpack it. */
+          char tmp[CELL_MAX_NETWORK_SIZE];
+          buf_get_bytes(buf, tmp, cell_network_size);
+          cell.circ_id = ntohl(get_uint32(tmp));
+          cell.command = get_uint8(tmp + 4);
+          memcpy(cell.payload, tmp + 5, CELL_PAYLOAD_SIZE);
+        } else {
+          fetch_cell_from_buf(buf, &cell, 1);
+        }
+      }
+    }
+    end = perftime();
+    printf("Fetch cells from buf (%s): %.2f ns per cell.\n",
+           copy_first ? "copy, then unpack" : "fetch_cell_from_buf",
+           NANOCOUNT(start, end, iters));
+  }
+
+  buf_free(buf);
+}
+
+static void
+bench_exit_policy(void)
+{
+  const int iters = 1<<18;
+  smartlist_t *policy = NULL;
+  addr_policy_matcher_t *matcher;
+  tor_addr_t addrs[64];
+  uint16_t ports[64];
+  uint64_t start, end;
+  int i, compiled, accepted;
+
+  /* The reduced exit policy is one of the largest we see in practice. */
+  policies_parse_exit_policy(NULL, &policy,
+                             EXIT_POLICY_IPV6_ENABLED |
+                             EXIT_POLICY_REJECT_PRIVATE |
+                             EXIT_POLICY_ADD_REDUCED, NULL);
+  matcher = addr_policy_matcher_new(policy);
+  for (i = 0; i < 64; ++i) {
+    tor_addr_from_ipv4h(&addrs[i], crypto_rand_int(INT_MAX));
+    /* Half well-known ports, half anything at all. */
+    ports[i] = (i & 1) ? 443 : 1 + crypto_rand_int(65535);
+  }
+
+  reset_perftime();
+
+  for (compiled = 0; compiled <= 1; ++compiled) {
+    accepted = 0;
+    start = perftime();
+    for (i = 0; i < iters; ++i) {
+      const tor_addr_t *a = &addrs[i & 63];
+      uint16_t p = ports[i & 63];
+      if (compiled)
+        accepted += addr_policy_matcher_lookup(matcher, a, p) ==
+          ADDR_POLICY_ACCEPTED;
+      else
+        accepted += compare_tor_addr_to_addr_policy(a, p, policy) ==
+          ADDR_POLICY_ACCEPTED;
+    }
+    end = perftime();
+    printf("Reduced exit policy (%d rules), %s: %.2f ns per lookup "
+           "(%d accepted)\n", smartlist_len(policy),
+           compiled ? "compiled" : "linear",
+           NANOCOUNT(start, end, iters), accepted);
+  }
+
+  addr_policy_matcher_free(matcher);
+  addr_policy_list_free(policy);
+}
+
+static void
+bench_dos_sketch(void)
+{
+  /* An IP-spray: every connection comes from a new address. */
+  const uint32_t n_addrs = 1<<20;
+  const time_t now = time(NULL);
+  or_options_t *options = get_options_mutable();
+  const int old_entry_statistics = options->EntryStatistics;
+  dos_conn_sketch_t *sketch = dos_conn_sketch_new(1<<20);
+  tor_addr_t addr;
+  uint64_t start, end;
+  uint32_t i, marked = 0, found = 0;
+
+  reset_perftime();
+
+  start = perftime();
+  for (i = 0; i < n_addrs; ++i) {
+    tor_addr_from_ipv4h(&addr, 0x0a000000 + i);
+    marked += dos_conn_sketch_is_marked(sketch, &addr, (uint32_t) now);
+    if (dos_conn_sketch_note_connect(sketch, &addr, (uint32_t) now, 20) >= 40)
+      dos_conn_sketch_mark(sketch, &addr, (uint32_t) now + 60);
+  }
+  end = perftime();
+  printf("Connection sketch, %u addresses: %.2f ns per connection, "
+         "%" TOR_PRIuSZ " bytes (%u marked)\n", n_addrs,
+         NANOCOUNT(start, end, n_addrs),
+         dos_conn_sketch_get_allocation(sketch), marked);
+
+  /* Make the geoip cache remember clients, as it does for the DoS
+   * subsystem when it uses it. */
+  options->EntryStatistics = 1;
+  start = perftime();
+  for (i = 0; i < n_addrs; ++i) {
+    tor_addr_from_ipv4h(&addr, 0x0a000000 + i);
+    geoip_note_client_seen(GEOIP_CLIENT_CONNECT, &addr, NULL, now);
+    found += geoip_lookup_client(&addr, NULL, GEOIP_CLIENT_CONNECT) != NULL;
+  }
+  end = perftime();
+  printf("Geoip client map, %u addresses: %.2f ns per connection, "
+         "%" TOR_PRIuSZ " bytes (%u found)\n", n_addrs,
+         NANOCOUNT(start, end, n_addrs),
+         geoip_client_cache_total_allocation(), found);
+
+  geoip_remove_old_clients(now + 3600);
+  options->EntryStatistics = old_entry_statistics;
+  dos_conn_sketch_free(sketch);
+}
+
+/** Helper for bench_buf_churn: open, use and close <b>n_conns</b>
+ * connections' worth of buffers <b>rounds</b> times. If <b>trim</b>, empty
+ * the buffer freelists after each round, as if we had none. */
+static void
+bench_buf_churn_(int n_conns, int rounds, int trim)
+{
+  /* Mostly cell-sized traffic on OR connections, with the odd directory
+   * response or bulk exit read that needs a large chunk. */
+  static const size_t sizes[] = { 514, 514*4, 514, 8000, 514*8, 60000 };
+  buf_t **bufs = tor_calloc(n_conns, sizeof(buf_t *));
+  char *junk = tor_malloc_zero(60000);
+  uint64_t start, end;
+  int i, r;
+
+  reset_perftime();
+  start = perftime();
+  for (r = 0; r < rounds; ++r) {
+    for (i = 0; i < n_conns; ++i) {
+      const size_t sz = sizes[(i + r) % ARRAY_LENGTH(sizes)];
+      bufs[i] = buf_new();
+      buf_add(bufs[i], junk, sz);
+      buf_add(bufs[i], junk, sz);
+    }
+    for (i = 0; i < n_conns; ++i) {
+      buf_drain(bufs[i], buf_datalen(bufs[i]) / 2);
+      buf_free(bufs[i]);
+    }
+    if (trim)
+      buf_shrink_freelists(1);
+  }
+  end = perftime();
+  printf("%d connections x %d rounds, %s: %.2f ns per connection "
+         "(%"TOR_PRIuSZ" bytes left on freelists)\n",
+         n_conns, rounds, trim ? "no freelists" : "freelists",
+         NANOCOUNT(start, end, ((uint64_t)n_conns) * rounds),
+         buf_get_freelist_allocation());
+
+  buf_shrink_freelists(1);
+  tor_free(bufs);
+  tor_free(junk);
+}
+
+static void
+bench_buf_churn(void)
+{
+  bench_buf_churn_(64, 4096, 1);
+  bench_buf_churn_(64, 4096, 0);
+  bench_buf_churn_(16384, 16, 1);
+  bench_buf_churn_(16384, 16, 0);
+}
+
+/** Helper for bench_buf_flush: <b>iters</b> times, fill a buffer with
+ * <b>len</b> bytes of cells and flush it to a socket. If <b>per_chunk</b>,
+ * flush one chunk per call, as we did before we had writev(). */
+static void
+bench_buf_flush_(size_t len, int iters, int per_chunk)
+{
+  tor_socket_t sv[2] = { TOR_INVALID_SOCKET, TOR_INVALID_SOCKET };
+  buf_t *buf = buf_new();
+  char *junk = tor_malloc_zero(len);
+  uint64_t start, end, total = 0;
+  int i;
+
+  if (tor_socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+    puts("Couldn't open a socketpair.");
+    goto done;
+  }
+
+  reset_perftime();
+  for (i = 0; i < iters; ++i) {
+    size_t n_read = 0;
+    int r = 1;
+    /* Queue cell by cell, as an OR connection would, so that the data is
+     * spread over several default-sized chunks. */
+    while (buf_datalen(buf) < len)
+      buf_add(buf, junk, MIN(len - buf_datalen(buf), CELL_MAX_NETWORK_SIZE));
+    start = perftime();
+    while (buf_datalen(buf) && r > 0) {
+      if (per_chunk)
+        r = buf_flush_to_socket(buf, sv[0], buf->head->datalen);
+      else
+        r = buf_flush_to_socket(buf, sv[0], buf_datalen(buf));
+    }
+    end = perftime();
+    total += end - start;
+    if (r <= 0) {
+      puts("Couldn't flush the buffer.");
+      goto done;
+    }
+    /* Keep the socket's queue empty for the next round. */
+    while (n_read < len) {
+      ssize_t n = tor_socket_recv(sv[1], junk, len - n_read, 0);
+      if (n <= 0)
+        goto done;
+      n_read += n;
+    }
+  }
+  printf("Flush %d KB, %s: %.2f usec per flush\n",
+         (int)(len >> 10), per_chunk ? "one chunk per call" : "writev",
+         NANOCOUNT(0, total, iters) / 1000.0);
+
+ done:
+  if (SOCKET_OK(sv[0]))
+    tor_close_socket(sv[0]);
+  if (SOCKET_OK(sv[1]))
+    tor_close_socket(sv[1]);
+  buf_free(buf);
+  tor_free(junk);
+}
+
+static void
+bench_buf_flush(void)
+{
+  bench_buf_flush_(16 << 10, 8192, 1);
+  bench_buf_flush_(16 << 10, 8192, 0);
+  bench_buf_flush_(64 << 10, 4096, 1);
+  bench_buf_flush_(64 << 10, 4096, 0);
+}
+
+/** Set up a TLS context with <b>flags</b>, and complete a handshake between
+ * two in-process TLS objects over a socketpair.  On success, set
+ * *<b>server_out</b> and *<b>client_out</b> and return 0; the caller frees
+ * them and closes <b>sv</b>.  Return -1 on failure. */
+static int
+bench_tls_pair_new(unsigned flags, tor_socket_t *sv,
+                   tor_tls_t **server_out, tor_tls_t **client_out)
+{
+  crypto_pk_t *key = crypto_pk_new();
+  tor_tls_t *tls[2] = { NULL, NULL };
+  int done[2] = { 0, 0 };
+  int i, r = -1;
+
+  if (crypto_pk_generate_key(key) < 0 ||
+      tor_tls_context_init(flags, key, key, 86400) < 0) {
+    puts("Couldn't set up a TLS context.");
+    goto done;
+  }
+  if (tor_socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0 ||
+      set_socket_nonblocking(sv[0]) < 0 ||
+      set_socket_nonblocking(sv[1]) < 0) {
+    puts("Couldn't open a socketpair.");
+    goto done;
+  }
+  tls[0] = tor_tls_new(sv[0], 1);
+  tls[1] = tor_tls_new(sv[1], 0);
+  if (!tls[0] || !tls[1])
+    goto done;
+  for (i = 0; i < 1000 && !(done[0] && done[1]); ++i) {
+    for (int j = 0; j < 2; ++j) {
+      if (done[j])
+        continue;
+      int res = tor_tls_handshake(tls[j]);
+      if (res == TOR_TLS_DONE)
+        done[j] = 1;
+      else if (res != TOR_TLS_WANTREAD && res != TOR_TLS_WANTWRITE)
+        goto done;
+    }
+  }
+  if (!(done[0] && done[1]))
+    goto done;
+  r = 0;
+ done:
+  if (r < 0) {
+    puts("Couldn't complete a TLS handshake.");
+    tor_tls_free(tls[0]);
+    tor_tls_free(tls[1]);
+  } else {
+    *server_out = tls[0];
+    *client_out = tls[1];
+  }
+  crypto_pk_free(key);
+  return r;
+}
+
+/** Read exactly <b>len</b> bytes from <b>tls</b> into <b>out</b>, which
+ * must have room for them.  Return 0 on success, -1 on failure. */
+static int
+bench_tls_read_all(tor_tls_t *tls, char *out, size_t len)
+{
+  size_t n_read = 0;
+  while (n_read < len) {
+    int r = tor_tls_read(tls, out + n_read, len - n_read);
+    if (r == TOR_TLS_WANTREAD)
+      continue;
+    if (r <= 0)
+      return -1;
+    n_read += r;
+  }
+  return 0;
+}
+
+static void
+bench_tls_flush_(size_t len, int iters, int per_chunk)
+{
+  tor_socket_t sv[2] = { TOR_INVALID_SOCKET, TOR_INVALID_SOCKET };
+  tor_tls_t *server = NULL, *client = NULL;
+  buf_t *buf = buf_new();
+  char *junk = tor_malloc_zero(len);
+  uint64_t start, end;
+  int i;
+
+  if (bench_tls_pair_new(0, sv, &server, &client) < 0)
+    goto done;
+
+  reset_perftime();
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    int r = 1;
+    /* Queue cell by cell, as an OR connection would, so that the data is
+     * spread over several default-sized chunks. */
+    while (buf_datalen(buf) < len)
+      buf_add(buf, junk, MIN(len - buf_datalen(buf), CELL_MAX_NETWORK_SIZE));
+    while (buf_datalen(buf) && r >= 0) {
+      if (per_chunk)
+        r = buf_flush_to_tls(buf, server, buf->head->datalen);
+      else
+        r = buf_flush_to_tls(buf, server, buf_datalen(buf));
+    }
+    /* The receiving side pays for every record too, so count it. */
+    if (r < 0 || bench_tls_read_all(client, junk, len) < 0) {
+      puts("Couldn't move data over TLS.");
+      goto done;
+    }
+  }
+  end = perftime();
+  printf("TLS flush %d KB, %s: %.2f usec per flush and read\n",
+         (int)(len >> 10), per_chunk ? "one chunk per write" : "gathered",
+         NANOCOUNT(start, end, iters) / 1000.0);
+
+ done:
+  tor_tls_free(server);
+  tor_tls_free(client);
+  if (SOCKET_OK(sv[0]))
+    tor_close_socket(sv[0]);
+  if (SOCKET_OK(sv[1]))
+    tor_close_socket(sv[1]);
+  buf_free(buf);
+  tor_free(junk);
+}
+
+static void
+bench_tls_flush(void)
+{
+  bench_tls_flush_(16 << 10, 4096, 1);
+  bench_tls_flush_(16 << 10, 4096, 0);
+  bench_tls_flush_(64 << 10, 1024, 1);
+  bench_tls_flush_(64 << 10, 1024, 0);
+}
+
+static void
+bench_tls_ktls_(int use_ktls)
+{
+  const size_t len = 16384;
+  const int iters = 8192;
+  tor_socket_t sv[2] = { TOR_INVALID_SOCKET, TOR_INVALID_SOCKET };
+  tor_tls_t *server = NULL, *client = NULL;
+  char *junk = tor_malloc_zero(len);
+  int send_offload = 0, recv_offload = 0;
+  uint64_t start, end;
+  int i;
+
+  if (bench_tls_pair_new(use_ktls ? TOR_TLS_CTX_USE_KTLS : 0,
+                         sv, &server, &client) < 0)
+    goto done;
+  tor_tls_get_kernel_offload(server, &send_offload, &recv_offload);
+
+  reset_perftime();
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    if (tor_tls_write(server, junk, len) != (int)len ||
+        bench_tls_read_all(client, junk, len) < 0) {
+      puts("Couldn't move data over TLS.");
+      goto done;
+    }
+  }
+  end = perftime();
+  /* Nanoseconds per bit is the same as CPU seconds per gigabit. */
+  printf("UseKernelTLS %d (offload send %d, recv %d): "
+         "%.3f CPU sec per Gbit\n",
+         use_ktls, send_offload, recv_offload,
+         NANOCOUNT(start, end, (double)len * 8 * iters));
+
+ done:
+  tor_tls_free(server);
+  tor_tls_free(client);
+  if (SOCKET_OK(sv[0]))
+    tor_close_socket(sv[0]);
+  if (SOCKET_OK(sv[1]))
+    tor_close_socket(sv[1]);
+  tor_free(junk);
+}
+
+static void
+bench_tls_ktls(void)
+{
+  bench_tls_ktls_(0);
+  bench_tls_ktls_(1);
+}
+
+static void
+bench_cmux_ewma_(int n_circs)
+{
+  const int iters = 1<<18;
+  circuitmux_t *cmux = circuitmux_alloc();
+  circuitmux_policy_data_t *pol_data;
+  circuitmux_policy_circ_data_t **circ_data;
+  circuit_t **circs;
+  char *active;
+  uint64_t start, end;
+  int i;
+
+  cmux_ewma_set_options(NULL, NULL);
+  pol_data = ewma_policy.alloc_cmux_data(cmux);
+  circ_data = tor_calloc(n_circs, sizeof(*circ_data));
+  circs = tor_calloc(n_circs, sizeof(*circs));
+  active = tor_calloc(n_circs, 1);
+  for (i = 0; i < n_circs; ++i) {
+    circs[i] = tor_malloc_zero(sizeof(circuit_t));
+    circs[i]->n_circ_id = i;
+    circ_data[i] = ewma_policy.alloc_circ_data(cmux, pol_data, circs[i],
+                                               CELL_DIRECTION_OUT, 0);
+    ewma_policy.notify_circ_active(cmux, pol_data, circs[i], circ_data[i]);
+    active[i] = 1;
+  }
+
+  reset_perftime();
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    /* Flush a cell from the best circuit, the way the channel does... */
+    circuit_t *c = ewma_policy.pick_active_circuit(cmux, pol_data);
+    int j = (int) c->n_circ_id;
+    ewma_policy.notify_xmit_cells(cmux, pol_data, c, circ_data[j], 1);
+    /* ...and every so often, let some other circuit drain or refill. */
+    if ((i & 7) == 0) {
+      j = (i * 7919) % n_circs;
+      if (active[j])
+        ewma_policy.notify_circ_inactive(cmux, pol_data, circs[j],
+                                         circ_data[j]);
+      else
+        ewma_policy.notify_circ_active(cmux, pol_data, circs[j],
+                                       circ_data[j]);
+      active[j] = !active[j];
+    }
+  }
+  end = perftime();
+  printf("EWMA cmux, %d circuits: %.2f ns per cell\n", n_circs,
+         NANOCOUNT(start, end, iters));
+
+  for (i = 0; i < n_circs; ++i) {
+    if (active[i])
+      ewma_policy.notify_circ_inactive(cmux, pol_data, circs[i],
+                                       circ_data[i]);
+    ewma_policy.free_circ_data(cmux, pol_data, circs[i], circ_data[i]);
+    tor_free(circs[i]);
+  }
+  ewma_policy.free_cmux_data(cmux, pol_data);
+  tor_free(circ_data);
+  tor_free(circs);
+  tor_free(active);
+  circuitmux_free(cmux);
+}
+
+static void
+bench_cmux_ewma(void)
+{
+  bench_cmux_ewma_(16);
+  bench_cmux_ewma_(256);
+  bench_cmux_ewma_(4096);
+}
+
 static void
 bench_dh(void)
 {
@@ -738,6 +1470,673 @@ bench_md_parse(void)
   printf("Microdesc parse: %f nsec\n", NANOCOUNT(start, end, N));
 }
 
+/** Set <b>id_out</b> to the identity digest of the <b>i</b>th relay in
+ * bench_make_md_consensus(). */
+static void
+bench_md_consensus_relay_id(char *id_out, int i)
+{
+  memset(id_out, 0x5a, DIGEST_LEN);
+  set_uint32(id_out, htonl((uint32_t) i * 7919));
+}
+
+/** Return a newly allocated microdesc consensus with up to <b>n_routers</b>
+ * entries, as it might look <b>epoch</b> hours after the first one.  Its
+ * signature is junk, so it only works for parsing and diffing. */
+static char *
+bench_make_md_consensus(int n_routers, int epoch)
+{
+  smartlist_t *chunks = smartlist_new();
+  char *consensus;
+
+  smartlist_add_asprintf(chunks,
+    "network-status-version 3 microdesc\n"
+    "vote-status consensus\n"
+    "consensus-method 32\n"
+    "valid-after 2022-10-01 %02d:00:00\n"
+    "fresh-until 2022-10-01 %02d:00:00\n"
+    "valid-until 2022-10-01 %02d:00:00\n"
+    "voting-delay 300 300\n"
+    "client-versions 0.4.5.14,0.4.6.10,0.4.7.10\n"
+    "server-versions 0.4.5.14,0.4.6.10,0.4.7.10\n"
+    "known-flags Authority BadExit Exit Fast Guard HSDir Running Stable "
+    "StaleDesc Sybil V2Dir Valid\n"
+    "recommended-client-protocols Cons=2 Desc=2 DirCache=2 HSDir=2 "
+    "HSIntro=4 HSRend=2 Link=4-5 Microdesc=2 Relay=2\n"
+    "params CircuitPriorityHalflifeMsec=30000 cc_alg=2 "
+    "guard-n-primary-guards-to-use=2\n"
+    "dir-source moria1 D586D18309DED4CD6D57C18FDB97EFA96D330566 "
+    "128.31.0.34 128.31.0.34 9131 9101\n"
+    "contact 1024D/EB5A896A28988BF5 arma mit edu\n"
+    "vote-digest 0123456789ABCDEF0123456789ABCDEF01234567\n",
+    epoch % 24, (epoch + 1) % 24, (epoch + 3) % 24);
+
+  for (int i = 0; i < n_routers; ++i) {
+    char id[DIGEST_LEN], id64[BASE64_DIGEST_LEN+1];
+    char md[DIGEST256_LEN], md64[BASE64_DIGEST256_LEN+1];
+
+    /* Each hour, some relays leave or join, and some others get a new
+     * bandwidth. */
+    if (epoch && (i + epoch) % 97 == 0)
+      continue;
+
+    /* Entries must be sorted by identity. */
+    bench_md_consensus_relay_id(id, i);
+    memset(md, 0xa5, sizeof(md));
+    set_uint32(md, (uint32_t) i);
+    digest_to_base64(id64, id);
+    digest256_to_base64(md64, md);
+    smartlist_add_asprintf(chunks,
+      "r relay%d %s 2022-09-30 %02d:%02d:%02d 10.%d.%d.%d 9001 0\n"
+      "a [2001:db8::%x]:9001\n"
+      "m %s\n"
+      "s Fast Guard HSDir Running Stable V2Dir Valid\n"
+      "v Tor 0.4.7.10\n"
+      "pr Cons=1-2 Desc=1-2 DirCache=2 FlowCtrl=1-2 HSDir=2 HSIntro=4-5 "
+      "HSRend=1-2 Link=1-5 LinkAuth=1,3 Microdesc=1-2 Padding=2 Relay=1-4\n"
+      "w Bandwidth=%d\n",
+      i, id64, i % 24, i % 60, (i / 60) % 60,
+      (i >> 16) & 0xff, (i >> 8) & 0xff, i & 0xff, i,
+      md64, 20 + (i * 37 + ((i + epoch) % 5 ? 0 : epoch)) % 50000);
+  }
+
+  char sig[256], sig64[512];
+  memset(sig, 0, sizeof(sig));
+  base64_encode(sig64, sizeof(sig64), sig, sizeof(sig),
+                BASE64_ENCODE_MULTILINE);
+  smartlist_add_asprintf(chunks,
+    "directory-footer\n"
+    "bandwidth-weights Wbd=0 Wbe=0 Wbg=4131 Wbm=10000 Wdb=10000 Web=10000 "
+    "Wed=10000 Wee=10000 Weg=10000 Wem=10000 Wgb=10000 Wgd=0 Wgg=5869 "
+    "Wgm=5869 Wmb=10000 Wmd=0 Wme=0 Wmg=4131 Wmm=10000\n"
+    "directory-signature sha256 D586D18309DED4CD6D57C18FDB97EFA96D330566 "
+    "0123456789ABCDEF0123456789ABCDEF01234567\n"
+    "-----BEGIN SIGNATURE-----\n"
+    "%s"
+    "-----END SIGNATURE-----\n", sig64);
+
+  consensus = smartlist_join_strings(chunks, "", 0, NULL);
+  SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
+  smartlist_free(chunks);
+  return consensus;
+}
+
+/** The routerstatus rules of ns_parse.c, for timing the tokenizer alone. */
+static token_rule_t bench_rtrstatus_token_table[] = {
+  T01("p",                   K_P,               CONCAT_ARGS, NO_OBJ ),
+  T1( "r",                   K_R,                   GE(7),   NO_OBJ ),
+  T0N("a",                   K_A,                   GE(1),   NO_OBJ ),
+  T1( "s",                   K_S,                   ARGS,    NO_OBJ ),
+  T01("v",                   K_V,               CONCAT_ARGS, NO_OBJ ),
+  T01("w",                   K_W,                   ARGS,    NO_OBJ ),
+  T0N("m",                   K_M,               CONCAT_ARGS, NO_OBJ ),
+  T0N("id",                  K_ID,                  GE(2),   NO_OBJ ),
+  T1("pr",                   K_PROTO,           CONCAT_ARGS, NO_OBJ ),
+  T0N("opt",                 K_OPT,             CONCAT_ARGS, OBJ_OK ),
+  END_OF_TABLE
+};
+
+static void
+bench_consensus_parse(void)
+{
+  uint64_t start, end;
+  const int N = 10, n_routers = 7000;
+  char *consensus = bench_make_md_consensus(n_routers, 0);
+  const size_t len = strlen(consensus);
+  const char *routers = strstr(consensus, "\nr ") + 1;
+  const char *footer = strstr(consensus, "\ndirectory-footer") + 1;
+  memarea_t *area = memarea_new();
+  smartlist_t *tokens = smartlist_new();
+  char *snapshot = NULL;
+  size_t snapshot_len = 0;
+
+  reset_perftime();
+  start = perftime();
+  for (int i = 0; i < N; ++i) {
+    if (tokenize_string(area, routers, footer, tokens,
+                        bench_rtrstatus_token_table, TS_NOCHECK) < 0) {
+      puts("Couldn't tokenize consensus.");
+      goto done;
+    }
+    SMARTLIST_FOREACH(tokens, directory_token_t *, t, token_clear(t));
+    smartlist_clear(tokens);
+    memarea_clear(area);
+  }
+  end = perftime();
+  printf("Tokenize routerstatus entries: %f nsec per router\n",
+         NANOCOUNT(start, end, (uint64_t)N * n_routers));
+
+  reset_perftime();
+  start = perftime();
+  for (int i = 0; i < N; ++i) {
+    networkstatus_t *ns =
+      networkstatus_parse_vote_from_string(consensus, len, NULL,
+                                           NS_TYPE_CONSENSUS);
+    if (!ns || smartlist_len(ns->routerstatus_list) != n_routers) {
+      puts("Couldn't parse consensus.");
+      networkstatus_vote_free(ns);
+      goto done;
+    }
+    networkstatus_vote_free(ns);
+  }
+  end = perftime();
+  printf("Consensus parse (%d routers, %d KB): %f usec per consensus, "
+         "%f nsec per router\n", n_routers, (int)(len / 1024),
+         NANOCOUNT(start, end, N) / 1000,
+         NANOCOUNT(start, end, (uint64_t)N * n_routers));
+
+  /* Now as we would on restart, with the snapshot we saved last time. */
+  {
+    networkstatus_t *ns =
+      networkstatus_parse_vote_from_string(consensus, len, NULL,
+                                           NS_TYPE_CONSENSUS);
+    snapshot = ns_snapshot_encode(ns, consensus, len, &snapshot_len);
+    networkstatus_vote_free(ns);
+  }
+  if (!snapshot) {
+    puts("Couldn't make consensus snapshot.");
+    goto done;
+  }
+  reset_perftime();
+  start = perftime();
+  for (int i = 0; i < N; ++i) {
+    int used = 0;
+    networkstatus_t *ns =
+      networkstatus_parse_consensus_with_snapshot(consensus, len,
+                                                  snapshot, snapshot_len,
+                                                  &used);
+    if (!ns || !used || smartlist_len(ns->routerstatus_list) != n_routers) {
+      puts("Couldn't parse consensus with snapshot.");
+      networkstatus_vote_free(ns);
+      goto done;
+    }
+    networkstatus_vote_free(ns);
+  }
+  end = perftime();
+  printf("Consensus parse with snapshot (%d KB): %f usec per consensus, "
+         "%f nsec per router\n", (int)(snapshot_len / 1024),
+         NANOCOUNT(start, end, N) / 1000,
+         NANOCOUNT(start, end, (uint64_t)N * n_routers));
+
+ done:
+  smartlist_free(tokens);
+  memarea_drop_all(area);
+  tor_free(consensus);
+  tor_free(snapshot);
+}
+
+static void
+bench_consdiff(void)
+{
+  uint64_t start, end;
+  const int n_old = 6, n_routers = 7000;
+  char *target = bench_make_md_consensus(n_routers, n_old);
+  char *old[6];
+  size_t difflen = 0;
+  consensus_diff_input_t *target_input = NULL;
+
+  for (int i = 0; i < n_old; ++i)
+    old[i] = bench_make_md_consensus(n_routers, i);
+
+  reset_perftime();
+  start = perftime();
+  for (int i = 0; i < n_old; ++i) {
+    char *diff = consensus_diff_generate(old[i], strlen(old[i]),
+                                         target, strlen(target));
+    if (!diff) {
+      puts("Couldn't generate consensus diff.");
+      goto done;
+    }
+    difflen += strlen(diff);
+    tor_free(diff);
+  }
+  end = perftime();
+  printf("Generate consensus diff (%d routers, %d KB of diffs): "
+         "%f usec per pair\n", n_routers, (int)(difflen / 1024),
+         NANOCOUNT(start, end, n_old) / 1000);
+
+  /* Now do it the way the diff cache does: the digests are already known,
+   * and the target is split into lines only once for all the pairs.  The
+   * digests only end up in the diff header, so any value will do here. */
+  uint8_t sha3[DIGEST256_LEN];
+  crypto_digest256((char *)sha3, target, strlen(target), DIGEST_SHA3_256);
+  reset_perftime();
+  start = perftime();
+  target_input = consensus_diff_input_new(target, strlen(target), sha3);
+  for (int i = 0; i < n_old; ++i) {
+    consensus_diff_input_t *from =
+      consensus_diff_input_new(old[i], strlen(old[i]), sha3);
+    char *diff = consensus_diff_generate_from_inputs(from, target_input);
+    consensus_diff_input_free(from);
+    if (!diff) {
+      puts("Couldn't generate consensus diff.");
+      goto done;
+    }
+    tor_free(diff);
+  }
+  end = perftime();
+  printf("Generate consensus diff with a shared target: "
+         "%f usec per pair\n", NANOCOUNT(start, end, n_old) / 1000);
+
+ done:
+  consensus_diff_input_free(target_input);
+  for (int i = 0; i < n_old; ++i)
+    tor_free(old[i]);
+  tor_free(target);
+}
+
+/** Return a newly allocated string holding <b>n</b> made-up
+ * microdescriptors, with random keys and a mix of exit policies.  If
+ * <b>onion_key</b> is set, use it as every microdescriptor's TAP onion key, so
+ * that they can be parsed; otherwise, use random bytes. */
+static char *
+bench_make_microdescs(int n, crypto_pk_t *onion_key)
+{
+  smartlist_t *chunks = smartlist_new();
+  char *result, *onion_key_pem = NULL;
+  size_t onion_key_pem_len;
+
+  if (onion_key &&
+      crypto_pk_write_public_key_to_string(onion_key, &onion_key_pem,
+                                           &onion_key_pem_len) < 0)
+    onion_key_pem = NULL;
+
+  for (int i = 0; i < n; ++i) {
+    char rsa[140], rsa64[256], ntor[32], ntor64[64], ed[32], ed64[64];
+    crypto_rand(rsa, sizeof(rsa));
+    crypto_rand(ntor, sizeof(ntor));
+    crypto_rand(ed, sizeof(ed));
+    base64_encode(rsa64, sizeof(rsa64), rsa, sizeof(rsa),
+                  BASE64_ENCODE_MULTILINE);
+    base64_encode(ntor64, sizeof(ntor64), ntor, sizeof(ntor), 0);
+    base64_encode_nopad(ed64, sizeof(ed64), (uint8_t *)ed, sizeof(ed));
+    if (onion_key_pem) {
+      smartlist_add_asprintf(chunks, "onion-key\n%s", onion_key_pem);
+    } else {
+      smartlist_add_asprintf(chunks,
+        "onion-key\n"
+        "-----BEGIN RSA PUBLIC KEY-----\n"
+        "%s"
+        "-----END RSA PUBLIC KEY-----\n", rsa64);
+    }
+    smartlist_add_asprintf(chunks,
+      "ntor-onion-key %s\n"
+      "%s"
+      "id ed25519 %s\n",
+      ntor64,
+      (i % 4 == 0) ?
+      "p accept 20-23,43,53,79-81,88,110,143,194,220,389,443,464-465,531,"
+      "543-544,554,563,587,636,706,749,873,902-904,981,989-995,1194,1220,"
+      "1293,1500,1533,1677,1723,1755,1863,2082-2083,2086-2087,2095-2096,"
+      "2102-2104,3128,3389,3690,4321,4643,5050,5190,5222-5223,5228,5900,"
+      "6660-6669,6679,6697,8000,8008,8074,8080,8082,8087-8088,8232-8233,"
+      "8332-8333,8443,8888,9418,9999-10000,11371,19294,19638,50002,64738\n"
+      : (i % 4 == 1) ? "p accept 80,443\n" : "",
+      ed64);
+  }
+
+  result = smartlist_join_strings(chunks, "", 0, NULL);
+  SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
+  smartlist_free(chunks);
+  tor_free(onion_key_pem);
+  return result;
+}
+
+/** Add a microdescriptor to the cache for each of the first
+ * <b>n_routers</b> relays in bench_make_md_consensus(), with random ed25519
+ * identities and ntor onion keys. */
+static void
+bench_add_md_consensus_microdescs(int n_routers)
+{
+  smartlist_t *mds = smartlist_new(), *added;
+
+  for (int i = 0; i < n_routers; ++i) {
+    microdesc_t *md = tor_malloc_zero(sizeof(microdesc_t));
+    md->ed25519_identity_pkey = tor_malloc(sizeof(ed25519_public_key_t));
+    crypto_rand((char *) md->ed25519_identity_pkey->pubkey,
+                ED25519_PUBKEY_LEN);
+    md->onion_curve25519_pkey = tor_malloc(sizeof(curve25519_public_key_t));
+    crypto_rand((char *) md->onion_curve25519_pkey->public_key,
+                CURVE25519_PUBKEY_LEN);
+    memset(md->digest, 0xa5, DIGEST256_LEN);
+    set_uint32(md->digest, (uint32_t) i);
+    smartlist_add(mds, md);
+  }
+  added = microdescs_add_list_to_cache(get_microdesc_cache(), mds,
+                                       SAVED_NOWHERE, 1);
+  smartlist_free(added);
+  smartlist_free(mds);
+}
+
+/** Add a router descriptor to the routerlist for each of the first
+ * <b>n_routers</b> relays in bench_make_md_consensus(), published at
+ * <b>published</b>.  Our consensuses have junk signatures, so they can't
+ * become the current consensus; the descriptors are what keep every node
+ * that nodelist_set_consensus() creates backed by directory info that
+ * nodelist_assert_ok() can check it against. */
+static void
+bench_add_md_consensus_routers(int n_routers, time_t published)
+{
+  for (int i = 0; i < n_routers; ++i) {
+    routerinfo_t *ri = tor_malloc_zero(sizeof(routerinfo_t));
+    const char *msg = NULL;
+    bench_md_consensus_relay_id(ri->cache_info.identity_digest, i);
+    memset(ri->cache_info.signed_descriptor_digest, 0x3c, DIGEST_LEN);
+    set_uint32(ri->cache_info.signed_descriptor_digest, (uint32_t) i);
+    ri->cache_info.published_on = published;
+    ri->cache_info.routerlist_index = -1;
+    ri->cert_expiration_time = TIME_MAX;
+    ri->purpose = ROUTER_PURPOSE_GENERAL;
+    tor_asprintf(&ri->nickname, "relay%d", i);
+    tor_addr_from_ipv4h(&ri->ipv4_addr, 0x0a000000 | (uint32_t) i);
+    ri->ipv4_orport = 9001;
+    if (!WRA_WAS_ADDED(router_add_to_routerlist(ri, &msg, 1, 0)))
+      printf("Couldn't add relay%d: %s\n", i, msg ? msg : "?");
+  }
+}
+
+/** Release everything bench_add_md_consensus_routers() added.  Call this
+ * after nodelist_free_all(), so that the nodelist isn't left with nodes
+ * that nothing backs. */
+static void
+bench_remove_md_consensus_routers(void)
+{
+  routerlist_t *rl = router_get_routerlist();
+  for (int i = smartlist_len(rl->routers) - 1; i >= 0; --i)
+    routerlist_remove(rl, smartlist_get(rl->routers, i), 0, time(NULL));
+}
+
+/** Time applying successive consensuses to the nodelist, as a client does
+ * every hour. */
+static void
+bench_nodelist_apply(void)
+{
+  uint64_t start, end;
+  networkstatus_t *cons[7];
+  const int n_epochs = (int) ARRAY_LENGTH(cons) - 1, n_routers = 7000;
+  uint64_t total = 0;
+
+  /* Give every relay a microdescriptor with an ed25519 identity, so that
+   * we compute its hsdir indices. */
+  bench_add_md_consensus_microdescs(n_routers);
+
+  for (int i = 0; i <= n_epochs; ++i) {
+    char *text = bench_make_md_consensus(n_routers, i);
+    cons[i] = networkstatus_parse_vote_from_string(text, strlen(text), NULL,
+                                                   NS_TYPE_CONSENSUS);
+    tor_free(text);
+  }
+  update_approx_time(cons[0]->valid_after + 60);
+  bench_add_md_consensus_routers(n_routers, cons[0]->valid_after);
+
+  for (int i = 0; i <= n_epochs; ++i) {
+    update_approx_time(cons[i]->valid_after + 60);
+    start = perftime();
+    nodelist_set_consensus(cons[i]);
+    end = perftime();
+    if (i == 0) {
+      printf("Apply first consensus: %f usec\n",
+             NANOCOUNT(start, end, 1) / 1000);
+    } else {
+      total += end - start;
+    }
+    if (i)
+      networkstatus_vote_free(cons[i-1]);
+  }
+  printf("Apply next consensus: %f usec\n",
+         NANOCOUNT(0, total, n_epochs) / 1000);
+
+  nodelist_free_all();
+  bench_remove_md_consensus_routers();
+  networkstatus_vote_free(cons[n_epochs]);
+  microdesc_free_all();
+  update_approx_time(time(NULL));
+}
+
+/** Time choosing middle nodes for circuits, the way we used to by weighting
+ * the list of acceptable nodes each time, and the way we do now. */
+static void
+bench_node_select(void)
+{
+  uint64_t start, end;
+  const int n_routers = 7000, N = 10000;
+  const router_crn_flags_t flags = CRN_NEED_DESC | CRN_NEED_UPTIME;
+  networkstatus_t *ns;
+  char *text;
+  int n_chosen = 0;
+
+  bench_add_md_consensus_microdescs(n_routers);
+  text = bench_make_md_consensus(n_routers, 0);
+  ns = networkstatus_parse_vote_from_string(text, strlen(text), NULL,
+                                            NS_TYPE_CONSENSUS);
+  tor_free(text);
+  update_approx_time(ns->valid_after + 60);
+  bench_add_md_consensus_routers(n_routers, ns->valid_after);
+  nodelist_set_consensus(ns);
+
+  reset_perftime();
+  start = perftime();
+  for (int i = 0; i < N / 100; ++i) {
+    smartlist_t *sl = smartlist_new();
+    router_add_running_nodes_to_smartlist(sl, flags);
+    n_chosen += node_sl_choose_by_bandwidth(sl, WEIGHT_FOR_MID) != NULL;
+    smartlist_free(sl);
+  }
+  end = perftime();
+  printf("Choose by weighting the acceptable nodes: %f usec\n",
+         NANOCOUNT(start, end, N / 100) / 1000);
+
+  start = perftime();
+  n_chosen += router_choose_random_node(NULL, NULL, flags) != NULL;
+  end = perftime();
+  printf("Choose first node from table: %f usec\n",
+         NANOCOUNT(start, end, 1) / 1000);
+
+  start = perftime();
+  for (int i = 0; i < N; ++i)
+    n_chosen += router_choose_random_node(NULL, NULL, flags) != NULL;
+  end = perftime();
+  printf("Choose next node from table: %f usec\n",
+         NANOCOUNT(start, end, N) / 1000);
+
+  if (n_chosen != N / 100 + 1 + N)
+    puts("Couldn't choose a node.");
+
+  nodelist_free_all();
+  bench_remove_md_consensus_routers();
+  networkstatus_vote_free(ns);
+  microdesc_free_all();
+  update_approx_time(time(NULL));
+}
+
+/** Time adding downloaded microdescriptors to a cache on disk, rebuilding
+ * the cache file, and loading it again. */
+static void
+bench_microdesc_cache(void)
+{
+  uint64_t start, end;
+  const int n_mds = 7000, n_new = 700;
+  or_options_t *options = get_options_mutable();
+  char *old_cachedir = options->CacheDirectory;
+  char *dir = NULL, *mds = NULL, *new_mds = NULL;
+  crypto_pk_t *onion_key = crypto_pk_new();
+  microdesc_cache_t *cache;
+  smartlist_t *added;
+  int n = 0;
+
+  tor_asprintf(&dir, "/tmp/tor_bench_%d", (int) getpid());
+  if (check_private_dir(dir, CPD_CREATE, NULL) < 0 ||
+      crypto_pk_generate_key(onion_key) < 0) {
+    puts("Couldn't set up cache directory.");
+    goto done;
+  }
+  options->CacheDirectory = dir;
+  mds = bench_make_microdescs(n_mds, onion_key);
+  new_mds = bench_make_microdescs(n_new, onion_key);
+
+  cache = get_microdesc_cache();
+  start = perftime();
+  added = microdescs_add_to_cache(cache, mds, mds + strlen(mds),
+                                  SAVED_NOWHERE, 0, time(NULL), NULL);
+  end = perftime();
+  n = smartlist_len(added);
+  smartlist_free(added);
+  printf("Add %d microdescs: %f msec\n", n, NANOCOUNT(start, end, 1) / 1e6);
+
+  start = perftime();
+  microdesc_cache_rebuild(cache, 1);
+  end = perftime();
+  printf("Rebuild from journal: %f msec\n", NANOCOUNT(start, end, 1) / 1e6);
+
+  added = microdescs_add_to_cache(cache, new_mds, new_mds + strlen(new_mds),
+                                  SAVED_NOWHERE, 0, time(NULL), NULL);
+  smartlist_free(added);
+  start = perftime();
+  microdesc_cache_rebuild(cache, 1);
+  end = perftime();
+  printf("Rebuild with %d new: %f msec\n", n_new,
+         NANOCOUNT(start, end, 1) / 1e6);
+
+  start = perftime();
+  microdesc_cache_reload(cache);
+  end = perftime();
+  printf("Reload: %f msec\n", NANOCOUNT(start, end, 1) / 1e6);
+
+ done:
+  microdesc_free_all();
+  if (dir) {
+    char *fn = NULL;
+    tor_asprintf(&fn, "%s/cached-microdescs", dir);
+    tor_unlink(fn);
+    tor_free(fn);
+    tor_asprintf(&fn, "%s/cached-microdescs.new", dir);
+    tor_unlink(fn);
+    tor_free(fn);
+    rmdir(dir);
+  }
+  options->CacheDirectory = old_cachedir;
+  crypto_pk_free(onion_key);
+  tor_free(dir);
+  tor_free(mds);
+  tor_free(new_mds);
+}
+
+/** Serve <b>body</b> from <b>ent</b> on <b>conn</b> the way a directory
+ * cache does. If <b>s</b> is a valid socket, write it there and have
+ * <b>sink</b> read it back, as for a DirPort request; otherwise move it to a
+ * linked connection's inbuf and take it out one cell payload at a time, as
+ * for a tunneled request. */
+static void
+bench_dircache_serve_one(consensus_cache_entry_t *ent, tor_socket_t s,
+                         tor_socket_t sink)
+{
+  dir_connection_t *conn = dir_connection_new(AF_INET);
+  buf_t *linked_inbuf = buf_new();
+  char payload[RELAY_PAYLOAD_SIZE];
+  char drain[65536];
+
+  conn->base_.state = DIR_CONN_STATE_SERVER_WRITING;
+  conn->spool = smartlist_new();
+  smartlist_add(conn->spool, spooled_resource_new_from_cache_entry(ent));
+
+  while (conn->spool || connection_get_outbuf_len(TO_CONN(conn))) {
+    connection_dirserv_flushed_some(conn);
+    if (SOCKET_OK(s)) {
+      buf_flush_to_socket(conn->base_.outbuf, s,
+                          buf_datalen(conn->base_.outbuf));
+      while (tor_socket_recv(sink, drain, sizeof(drain), 0) > 0)
+        ;
+    } else {
+      buf_move_all(linked_inbuf, conn->base_.outbuf);
+      while (buf_datalen(linked_inbuf)) {
+        buf_get_bytes(linked_inbuf, payload,
+                      MIN(sizeof(payload), buf_datalen(linked_inbuf)));
+      }
+    }
+  }
+
+  connection_free_(TO_CONN(conn));
+  buf_free(linked_inbuf);
+}
+
+/** Time how many bytes per CPU-second a directory cache can serve out of its
+ * consensus cache. */
+static void
+bench_dircache_serve(void)
+{
+  const size_t body_len = 2<<20;
+  const int iters = 64;
+  or_options_t *options = get_options_mutable();
+  char *old_cachedir = options->CacheDirectory;
+  char *dir = NULL;
+  uint8_t *body = tor_malloc(body_len);
+  consensus_cache_t *cache = NULL;
+  consensus_cache_entry_t *ent = NULL;
+  config_line_t *labels = NULL;
+  tor_socket_t sv[2] = { TOR_INVALID_SOCKET, TOR_INVALID_SOCKET };
+  uint64_t start, end;
+  int i;
+
+  tor_init_connection_lists();
+  tor_asprintf(&dir, "/tmp/tor_bench_%d", (int) getpid());
+  if (check_private_dir(dir, CPD_CREATE, NULL) < 0 ||
+      tor_socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0 ||
+      set_socket_nonblocking(sv[0]) < 0 ||
+      set_socket_nonblocking(sv[1]) < 0) {
+    puts("Couldn't set up cache directory.");
+    goto done;
+  }
+  options->CacheDirectory = dir;
+  crypto_rand((char *) body, body_len);
+  config_line_append(&labels, "consensus-flavor", "microdesc");
+  cache = consensus_cache_open("bench", 8);
+  if (cache)
+    ent = consensus_cache_add(cache, labels, body, body_len);
+  if (!ent) {
+    puts("Couldn't add consensus cache entry.");
+    goto done;
+  }
+
+  reset_perftime();
+  start = perftime();
+  for (i = 0; i < iters; ++i)
+    bench_dircache_serve_one(ent, sv[0], sv[1]);
+  end = perftime();
+  printf("Serve %d KB to a socket: %.2f MB per CPU-second\n",
+         (int)(body_len >> 10),
+         ((double)body_len) * iters * 1000.0 / (end - start));
+
+  start = perftime();
+  for (i = 0; i < iters; ++i)
+    bench_dircache_serve_one(ent, TOR_INVALID_SOCKET, TOR_INVALID_SOCKET);
+  end = perftime();
+  printf("Serve %d KB to a linked connection: %.2f MB per CPU-second\n",
+         (int)(body_len >> 10),
+         ((double)body_len) * iters * 1000.0 / (end - start));
+
+ done:
+  if (ent) {
+    consensus_cache_entry_mark_for_removal(ent);
+    consensus_cache_entry_decref(ent);
+    consensus_cache_delete_pending(cache, 1);
+  }
+  consensus_cache_free(cache);
+  if (dir) {
+    char *fn = NULL;
+    tor_asprintf(&fn, "%s/bench", dir);
+    rmdir(fn);
+    tor_free(fn);
+    rmdir(dir);
+  }
+  options->CacheDirectory = old_cachedir;
+  if (SOCKET_OK(sv[0]))
+    tor_close_socket(sv[0]);
+  if (SOCKET_OK(sv[1]))
+    tor_close_socket(sv[1]);
+  config_free_lines(labels);
+  tor_free(dir);
+  tor_free(body);
+}
+
 typedef void (*bench_fn)(void);
 
 typedef struct benchmark_t {
@@ -760,6 +2159,16 @@ static struct benchmark_t benchmarks[] = {
 
   ENT(cell_aes),
   ENT(cell_ops),
+  ENT(exit_package),
+  ENT(circid_lookup),
+  ENT(cell_fetch),
+  ENT(exit_policy),
+  ENT(cmux_ewma),
+  ENT(dos_sketch),
+  ENT(buf_churn),
+  ENT(buf_flush),
+  ENT(tls_flush),
+  ENT(tls_ktls),
   ENT(dh),
 
 #ifdef ENABLE_OPENSSL
@@ -768,6 +2177,12 @@ static struct benchmark_t benchmarks[] = {
 #endif
 
   ENT(md_parse),
+  ENT(consensus_parse),
+  ENT(consdiff),
+  ENT(nodelist_apply),
+  ENT(node_select),
+  ENT(microdesc_cache),
+  ENT(dircache_serve),
   {NULL,NULL,0}
 };
 
@@ -853,6 +2268,7 @@ main(int argc, const char **argv)
     tor_free(errmsg);
     return 1;
   }
+  rep_hist_init();
 
   for (benchmark_t *b = benchmarks; b->name; ++b) {
     if (b->enabled || n_enabled == 0) {
@@ -778,6 +778,7 @@ struct testgroup_t testgroups[] = {
   { "config/", config_tests },
   { "config/mgr/", confmgr_tests },
   { "config/parse/", confparse_tests },
+  { "congestion_control/", congestion_control_tests },
   { "connection/", connection_tests },
   { "conscache/", conscache_tests },
   { "consdiff/", consdiff_tests },
@@ -7,6 +7,7 @@
 #define PROTO_HTTP_PRIVATE
 #include "core/or/or.h"
 #include "lib/buf/buffers.h"
+#include "lib/net/buffers_net.h"
 #include "lib/tls/buffers_tls.h"
 #include "lib/tls/tortls.h"
 #include "lib/compress/compress.h"
@@ -498,6 +499,66 @@ test_buffer_allocation_tracking(void *arg)
   tor_free(junk);
 }
 
+static void
+test_buffer_freelists(void *arg)
+{
+  char *junk = tor_malloc_zero(65000);
+  buf_t *buf = NULL;
+  size_t n_chunks;
+  int i;
+
+  (void)arg;
+
+  buf_shrink_freelists(1);
+  tt_int_op(buf_get_freelist_allocation(), OP_EQ, 0);
+
+  /* Each of these lands in a 64k chunk of its own. */
+  buf = buf_new_with_capacity(60000);
+  for (i = 0; i < 4; ++i)
+    buf_add(buf, junk, 60000);
+  tt_int_op(buf_allocation(buf), OP_EQ, 4*65536);
+  buf_free(buf);
+
+  /* The chunks went onto the freelist, and don't count as allocated to
+   * buffers anymore. */
+  tt_int_op(buf_get_total_allocation(), OP_EQ, 0);
+  tt_int_op(buf_get_freelist_allocation(), OP_EQ, 4*65536);
+
+  /* New buffers take them back. */
+  buf = buf_new_with_capacity(60000);
+  buf_add(buf, junk, 60000);
+  buf_assert_ok(buf);
+  tt_int_op(buf_get_total_allocation(), OP_EQ, 65536);
+  tt_int_op(buf_get_freelist_allocation(), OP_EQ, 3*65536);
+  buf_free(buf);
+  tt_int_op(buf_get_freelist_allocation(), OP_EQ, 4*65536);
+
+  /* The freelist dipped to 3 chunks since the last cleanup: keep those,
+   * since we needed them. */
+  tt_int_op(buf_shrink_freelists(0), OP_EQ, 0);
+  tt_int_op(buf_get_freelist_allocation(), OP_EQ, 4*65536);
+  /* Nobody used them since then: keep only the slack. */
+  tt_int_op(buf_shrink_freelists(0), OP_EQ, 3*65536);
+  tt_int_op(buf_get_freelist_allocation(), OP_EQ, 65536);
+  tt_int_op(buf_shrink_freelists(1), OP_EQ, 65536);
+  tt_int_op(buf_get_freelist_allocation(), OP_EQ, 0);
+
+  /* The freelist never holds more than its cap. */
+  buf = buf_new_with_capacity(65000);
+  for (i = 0; i < 20; ++i)
+    buf_add(buf, junk, 65000);
+  n_chunks = buf_allocation(buf) / 65536;
+  tt_int_op(n_chunks, OP_GE, 17);
+  buf_free(buf);
+  tt_int_op(buf_get_total_allocation(), OP_EQ, 0);
+  tt_int_op(buf_get_freelist_allocation(), OP_EQ, 16*65536);
+
+ done:
+  buf_free(buf);
+  buf_shrink_freelists(1);
+  tor_free(junk);
+}
+
 static void
 test_buffer_time_tracking(void *arg)
 {
@@ -768,6 +829,258 @@ test_buffers_tls_read_mocked(void *arg)
   buf_free(buf);
 }
 
+static void
+test_buffers_flush_to_socket(void *arg)
+{
+  char *mem, *out = NULL;
+  buf_t *buf = NULL, *rbuf = NULL;
+  tor_socket_t fds[2] = { TOR_INVALID_SOCKET, TOR_INVALID_SOCKET };
+  int i, eof = 0;
+  (void)arg;
+
+  mem = tor_malloc(64*1024);
+  crypto_rand(mem, 64*1024);
+  tt_int_op(0, OP_EQ, tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+
+  /* Cell-sized adds leave the data spread over several chunks; the whole
+   * thing must come out the other end intact and in order. */
+  buf = buf_new();
+  for (i = 0; i < 40; ++i)
+    buf_add(buf, mem + i*514, 514);
+  tt_int_op(40*514, OP_EQ, buf_flush_to_socket(buf, fds[0], 40*514));
+  tt_int_op(0, OP_EQ, buf_datalen(buf));
+
+  /* A partial flush stops in the middle of a chunk. */
+  buf_add(buf, mem, 10000);
+  tt_int_op(5000, OP_EQ, buf_flush_to_socket(buf, fds[0], 5000));
+  tt_int_op(5000, OP_EQ, buf_datalen(buf));
+
+  rbuf = buf_new();
+  while (buf_datalen(rbuf) < 40*514 + 5000) {
+    tt_int_op(buf_read_from_socket(rbuf, fds[1], 64*1024, &eof, NULL),
+              OP_GT, 0);
+  }
+  tt_int_op(40*514 + 5000, OP_EQ, buf_datalen(rbuf));
+  out = tor_malloc(40*514 + 5000);
+  buf_get_bytes(rbuf, out, 40*514 + 5000);
+  tt_mem_op(out, OP_EQ, mem, 40*514);
+  tt_mem_op(out + 40*514, OP_EQ, mem, 5000);
+
+ done:
+  tor_close_socket(fds[0]);
+  tor_close_socket(fds[1]);
+  tor_free(mem);
+  tor_free(out);
+  buf_free(buf);
+  buf_free(rbuf);
+}
+
+/** Number of times that count_external_release() has been called. */
+static int n_external_releases;
+
+static void
+count_external_release(void *arg)
+{
+  tt_ptr_op(arg, OP_EQ, &n_external_releases);
+  ++n_external_releases;
+ done:
+  ;
+}
+
+static void
+test_buffers_external(void *arg)
+{
+  char *mem, *out = NULL;
+  const char *cp;
+  size_t sz;
+  buf_t *buf = NULL, *buf2 = NULL, *rbuf = NULL;
+  tor_socket_t fds[2] = { TOR_INVALID_SOCKET, TOR_INVALID_SOCKET };
+  int eof = 0;
+  (void)arg;
+
+  mem = tor_malloc(64*1024);
+  crypto_rand(mem, 64*1024);
+  n_external_releases = 0;
+
+  /* Empty additions are released right away. */
+  buf = buf_new();
+  tt_int_op(0, OP_EQ, buf_add_external(buf, mem, 0, count_external_release,
+                                       &n_external_releases));
+  tt_int_op(1, OP_EQ, n_external_releases);
+
+  /* External memory goes between ordinary chunks, and nothing gets written
+   * onto it. */
+  buf_add(buf, "abc", 3);
+  tt_int_op(3 + 20000, OP_EQ,
+            buf_add_external(buf, mem, 20000, count_external_release,
+                             &n_external_releases));
+  buf_add(buf, "xyz", 3);
+  buf_assert_ok(buf);
+  tt_int_op(20006, OP_EQ, buf_datalen(buf));
+  tt_ptr_op(buf->head->next->data, OP_EQ, mem);
+  tt_int_op(20000, OP_EQ, buf->head->next->datalen);
+
+  /* Copies don't share it. */
+  buf2 = buf_copy(buf);
+  buf_assert_ok(buf2);
+  tt_int_op(20006, OP_EQ, buf_datalen(buf2));
+  tt_ptr_op(buf2->head->next->data, OP_NE, mem);
+  buf_free(buf2);
+  tt_int_op(1, OP_EQ, n_external_releases);
+
+  /* Draining part of it keeps it. */
+  out = tor_malloc(20006);
+  buf_get_bytes(buf, out, 1003);
+  tt_mem_op(out, OP_EQ, "abc", 3);
+  tt_mem_op(out + 3, OP_EQ, mem, 1000);
+  tt_int_op(1, OP_EQ, n_external_releases);
+
+  /* Pulling it up copies it into memory that we own. */
+  buf_pullup(buf, 19003, &cp, &sz);
+  buf_assert_ok(buf);
+  tt_uint_op(sz, OP_GE, 19003);
+  tt_mem_op(cp, OP_EQ, mem + 1000, 19000);
+  tt_mem_op(cp + 19000, OP_EQ, "xyz", 3);
+  tt_int_op(2, OP_EQ, n_external_releases);
+  buf_clear(buf);
+
+  /* An empty tail doesn't stay in front of it. */
+  buf_add_chunk_with_capacity(buf, 100, 1);
+  buf_add_external(buf, mem, 30000, count_external_release,
+                   &n_external_releases);
+  buf_assert_ok(buf);
+  tt_ptr_op(buf->head, OP_EQ, buf->tail);
+
+  /* It moves along with the chunk, and comes out the other end of a
+   * socket intact. */
+  buf2 = buf_new();
+  buf_add_external(buf2, mem + 30000, 30000, count_external_release,
+                   &n_external_releases);
+  buf_move_all(buf, buf2);
+  buf_assert_ok(buf);
+  tt_int_op(0, OP_EQ, buf_datalen(buf2));
+  tt_int_op(60000, OP_EQ, buf_datalen(buf));
+  tt_int_op(0, OP_EQ, tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  tt_int_op(60000, OP_EQ, buf_flush_to_socket(buf, fds[0], 60000));
+  tt_int_op(0, OP_EQ, buf_datalen(buf));
+  tt_int_op(4, OP_EQ, n_external_releases);
+
+  rbuf = buf_new();
+  while (buf_datalen(rbuf) < 60000) {
+    tt_int_op(buf_read_from_socket(rbuf, fds[1], 64*1024, &eof, NULL),
+              OP_GT, 0);
+  }
+  tor_free(out);
+  out = tor_malloc(60000);
+  buf_get_bytes(rbuf, out, 60000);
+  tt_mem_op(out, OP_EQ, mem, 60000);
+
+ done:
+  tor_close_socket(fds[0]);
+  tor_close_socket(fds[1]);
+  tor_free(mem);
+  tor_free(out);
+  buf_free(buf);
+  buf_free(buf2);
+  buf_free(rbuf);
+}
+
+static smartlist_t *tls_write_lens;
+static buf_t *tls_written;
+static size_t tls_forced_write_size;
+
+static int
+mock_tls_write(tor_tls_t *tls, const char *cp, size_t n)
+{
+  (void)tls;
+  tt_uint_op(n, OP_GE, tls_forced_write_size);
+  if (tls_forced_write_size)
+    n = tls_forced_write_size;
+  smartlist_add(tls_write_lens, tor_memdup(&n, sizeof(n)));
+  buf_add(tls_written, cp, n);
+  tls_forced_write_size = 0;
+  return (int)n;
+ done:
+  return TOR_TLS_ERROR_MISC;
+}
+
+static int
+mock_tls_write_blocked(tor_tls_t *tls, const char *cp, size_t n)
+{
+  (void)tls;
+  (void)cp;
+  tls_forced_write_size = n;
+  return TOR_TLS_WANTWRITE;
+}
+
+static size_t
+mock_tls_get_forced_write_size(tor_tls_t *tls)
+{
+  (void)tls;
+  return tls_forced_write_size;
+}
+
+static void
+test_buffers_tls_flush_mocked(void *arg)
+{
+  char *mem, *out = NULL;
+  buf_t *buf;
+  int i;
+  (void)arg;
+
+  mem = tor_malloc(64*1024);
+  crypto_rand(mem, 64*1024);
+  tls_write_lens = smartlist_new();
+  tls_written = buf_new();
+  tls_forced_write_size = 0;
+
+  MOCK(tor_tls_write, mock_tls_write);
+  MOCK(tor_tls_get_forced_write_size, mock_tls_get_forced_write_size);
+
+  /* Cell-sized adds leave the data spread over several small chunks. */
+  buf = buf_new();
+  for (i = 0; i < 40; ++i)
+    buf_add(buf, mem + i*514, 514);
+  tt_int_op(40*514, OP_EQ, buf_datalen(buf));
+
+  /* Flushing them gathers full records instead of writing each chunk. */
+  tt_int_op(40*514, OP_EQ, buf_flush_to_tls(buf, NULL, 40*514));
+  tt_int_op(smartlist_len(tls_write_lens), OP_EQ, 2);
+  tt_uint_op(*(size_t*)smartlist_get(tls_write_lens, 0), OP_EQ, 16384);
+  tt_uint_op(*(size_t*)smartlist_get(tls_write_lens, 1), OP_EQ,
+             40*514 - 16384);
+  tt_int_op(0, OP_EQ, buf_datalen(buf));
+  out = tor_malloc(40*514);
+  buf_get_bytes(tls_written, out, 40*514);
+  tt_mem_op(out, OP_EQ, mem, 40*514);
+  SMARTLIST_FOREACH(tls_write_lens, size_t *, n, tor_free(n));
+  smartlist_clear(tls_write_lens);
+
+  /* A blocked gathered write is retried with the same size, even if we are
+   * asked to flush less this time. */
+  for (i = 0; i < 40; ++i)
+    buf_add(buf, mem + i*514, 514);
+  MOCK(tor_tls_write, mock_tls_write_blocked);
+  tt_int_op(TOR_TLS_WANTWRITE, OP_EQ, buf_flush_to_tls(buf, NULL, 40*514));
+  tt_int_op(40*514, OP_EQ, buf_datalen(buf));
+  MOCK(tor_tls_write, mock_tls_write);
+  tt_int_op(16384, OP_EQ, buf_flush_to_tls(buf, NULL, 1000));
+  tt_int_op(smartlist_len(tls_write_lens), OP_EQ, 1);
+  tt_int_op(40*514 - 16384, OP_EQ, buf_datalen(buf));
+  buf_get_bytes(tls_written, out, 16384);
+  tt_mem_op(out, OP_EQ, mem, 16384);
+
+ done:
+  UNMOCK(tor_tls_write);
+  UNMOCK(tor_tls_get_forced_write_size);
+  SMARTLIST_FOREACH(tls_write_lens, size_t *, n, tor_free(n));
+  smartlist_free(tls_write_lens);
+  buf_free(tls_written);
+  tor_free(mem);
+  tor_free(out);
+  buf_free(buf);
+}
+
 static void
 test_buffers_chunk_size(void *arg)
 {
@@ -866,7 +1179,12 @@ struct testcase_t buffer_tests[] = {
   { "startswith", test_buffer_peek_startswith, 0, NULL, NULL },
   { "allocation_tracking", test_buffer_allocation_tracking, TT_FORK,
     NULL, NULL },
+  { "freelists", test_buffer_freelists, TT_FORK, NULL, NULL },
   { "time_tracking", test_buffer_time_tracking, TT_FORK, NULL, NULL },
+  { "flush_to_socket", test_buffers_flush_to_socket, 0, NULL, NULL },
+  { "external", test_buffers_external, 0, NULL, NULL },
+  { "tls_flush_mocked", test_buffers_tls_flush_mocked, 0,
+    NULL, NULL },
   { "tls_read_mocked", test_buffers_tls_read_mocked, 0,
     NULL, NULL },
   { "chunk_size", test_buffers_chunk_size, 0, NULL, NULL },
@@ -295,6 +295,7 @@ free_fake_channel(channel_t *chan)
   if (chan->cmux)
     circuitmux_free(chan->cmux);
 
+  channel_free_circid_table(chan);
   tor_free(chan);
 }
 
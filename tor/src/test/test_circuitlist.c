@@ -314,6 +314,57 @@ mock_channel_dump_statistics(channel_t *chan, int severity)
   (void)severity;
 }
 
+static void
+test_clist_circid_table(void *arg)
+{
+  channel_t *ch1 = new_fake_channel();
+  channel_t *ch2 = new_fake_channel();
+  const int n = 5000;
+  int i;
+
+  (void) arg;
+
+  /* Enough circuit IDs on one channel to grow its table several times, some
+   * of them also on another channel. */
+  for (i = 0; i < n; ++i) {
+    channel_mark_circid_unusable(ch1, 0x80000000u + i * 7);
+    if (i % 3 == 0)
+      channel_mark_circid_unusable(ch2, 0x80000000u + i * 7);
+  }
+  for (i = 0; i < n; ++i) {
+    tt_int_op(circuit_id_in_use_on_channel(0x80000000u + i * 7, ch1),
+              OP_EQ, 2);
+    tt_int_op(circuit_id_in_use_on_channel(0x80000000u + i * 7 + 1, ch1),
+              OP_EQ, 0);
+    tt_int_op(circuit_id_in_use_on_channel(0x80000000u + i * 7, ch2),
+              OP_EQ, i % 3 == 0 ? 2 : 0);
+  }
+
+  /* Removing entries mustn't lose any of the others, including while the
+   * table shrinks. */
+  for (i = 0; i < n; i += 2)
+    channel_mark_circid_usable(ch1, 0x80000000u + i * 7);
+  for (i = 0; i < n; ++i) {
+    tt_int_op(circuit_id_in_use_on_channel(0x80000000u + i * 7, ch1),
+              OP_EQ, i % 2 ? 2 : 0);
+  }
+  for (i = 1; i < n - 10; i += 2)
+    channel_mark_circid_usable(ch1, 0x80000000u + i * 7);
+  for (i = 0; i < n; ++i) {
+    tt_int_op(circuit_id_in_use_on_channel(0x80000000u + i * 7, ch1),
+              OP_EQ, (i % 2 && i >= n - 10) ? 2 : 0);
+    tt_int_op(circuit_id_in_use_on_channel(0x80000000u + i * 7, ch2),
+              OP_EQ, i % 3 == 0 ? 2 : 0);
+  }
+
+ done:
+  channel_free_circid_table(ch1);
+  channel_free_circid_table(ch2);
+  tor_free(ch1);
+  tor_free(ch2);
+  circuit_free_all();
+}
+
 static void
 test_pick_circid(void *arg)
 {
@@ -487,6 +538,7 @@ test_hs_circuitmap_isolation(void *arg)
 struct testcase_t circuitlist_tests[] = {
   { "maps", test_clist_maps, TT_FORK, NULL, NULL },
   { "rend_token_maps", test_rend_token_maps, TT_FORK, NULL, NULL },
+  { "circid_table", test_clist_circid_table, TT_FORK, NULL, NULL },
   { "pick_circid", test_pick_circid, TT_FORK, NULL, NULL },
   { "hs_circuitmap_isolation", test_hs_circuitmap_isolation,
     TT_FORK, NULL, NULL },
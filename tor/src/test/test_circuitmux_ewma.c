@@ -7,6 +7,7 @@
 #include "core/or/or.h"
 #include "core/or/circuitmux.h"
 #include "core/or/circuitmux_ewma.h"
+#include "lib/crypt_ops/crypto_rand.h"
 
 #include "test/fakechans.h"
 #include "test/fakecircs.h"
@@ -67,9 +68,9 @@ test_cmux_ewma_xmit_cell(void *arg)
 
   /* Move back in time the last time we calibrated so we scale the active
    * circuit when emitting a cell. */
-  ewma_pol_data->active_circuit_pqueue_last_recalibrated -= 100;
+  ewma_pol_data->active_circuits_scale_tick -= 100;
   ewma_data->cell_ewma.last_adjusted_tick =
-    ewma_pol_data->active_circuit_pqueue_last_recalibrated;
+    ewma_pol_data->active_circuits_scale_tick;
 
   /* Grab old cell count. */
   old_cell_count = ewma_data->cell_ewma.cell_count;
@@ -109,14 +110,14 @@ test_cmux_ewma_notify_circ(void *arg)
   /* We should have an active circuit in the queue so its EWMA value can be
    * tracked. */
   ewma_pol_data = TO_EWMA_POL_DATA(pol_data);
-  tt_int_op(smartlist_len(ewma_pol_data->active_circuit_pqueue), OP_EQ, 1);
-  tt_uint_op(ewma_pol_data->active_circuit_pqueue_last_recalibrated, OP_NE, 0);
+  tt_int_op(ewma_pol_data->n_active_circuits, OP_EQ, 1);
+  tt_uint_op(ewma_pol_data->active_circuits_scale_tick, OP_NE, 0);
 
   ewma_policy.notify_circ_inactive(&cmux, pol_data, &circ, circ_data);
   /* Should be removed from the active queue. */
   ewma_pol_data = TO_EWMA_POL_DATA(pol_data);
-  tt_int_op(smartlist_len(ewma_pol_data->active_circuit_pqueue), OP_EQ, 0);
-  tt_uint_op(ewma_pol_data->active_circuit_pqueue_last_recalibrated, OP_NE, 0);
+  tt_int_op(ewma_pol_data->n_active_circuits, OP_EQ, 0);
+  tt_uint_op(ewma_pol_data->active_circuits_scale_tick, OP_NE, 0);
 
  done:
   ewma_policy.free_circ_data(&cmux, pol_data, &circ, circ_data);
@@ -178,13 +179,191 @@ test_cmux_ewma_policy_data(void *arg)
 
   /* Test EWMA object. */
   ewma_pol_data = TO_EWMA_POL_DATA(pol_data);
-  tt_assert(ewma_pol_data->active_circuit_pqueue);
-  tt_uint_op(ewma_pol_data->active_circuit_pqueue_last_recalibrated, OP_NE, 0);
+  tt_int_op(ewma_pol_data->n_active_circuits, OP_EQ, 0);
+  tt_uint_op(ewma_pol_data->active_circuits_scale_tick, OP_NE, 0);
 
  done:
   ewma_policy.free_cmux_data(&cmux, pol_data);
 }
 
+static void
+test_cmux_ewma_heap_order(void *arg)
+{
+#define N_CIRCS 200
+  circuitmux_t cmux; /* garbage */
+  circuitmux_policy_data_t *pol_data = NULL;
+  circuit_t circs[N_CIRCS]; /* garbage */
+  circuitmux_policy_circ_data_t *circ_data[N_CIRCS];
+  ewma_policy_data_t *ewma_pol_data;
+  double last = -1.0;
+  int i;
+
+  (void) arg;
+  memset(circ_data, 0, sizeof(circ_data));
+
+  pol_data = ewma_policy.alloc_cmux_data(&cmux);
+  ewma_pol_data = TO_EWMA_POL_DATA(pol_data);
+  tt_assert(ewma_pol_data);
+  for (i = 0; i < N_CIRCS; ++i) {
+    ewma_policy_circ_data_t *ewma_data;
+    circ_data[i] = ewma_policy.alloc_circ_data(&cmux, pol_data, &circs[i],
+                                               CELL_DIRECTION_OUT, 0);
+    ewma_data = TO_EWMA_POL_CIRC_DATA(circ_data[i]);
+    tt_assert(ewma_data);
+    ewma_data->cell_ewma.cell_count = crypto_rand_double() * 1000;
+    ewma_data->cell_ewma.last_adjusted_tick =
+      ewma_pol_data->active_circuits_scale_tick;
+    ewma_policy.notify_circ_active(&cmux, pol_data, &circs[i], circ_data[i]);
+  }
+  tt_int_op(ewma_pol_data->n_active_circuits, OP_EQ, N_CIRCS);
+
+  /* Take out every third circuit, from wherever it is in the heap. */
+  for (i = 0; i < N_CIRCS; i += 3)
+    ewma_policy.notify_circ_inactive(&cmux, pol_data, &circs[i],
+                                     circ_data[i]);
+
+  /* Send on some of the rest; they should sink. */
+  for (i = 0; i < N_CIRCS; ++i) {
+    circuit_t *c = ewma_policy.pick_active_circuit(&cmux, pol_data);
+    ewma_policy.notify_xmit_cells(&cmux, pol_data, c,
+                                  circ_data[c - circs], 3);
+  }
+
+  /* Draining the heap from the top must give us circuits in order. */
+  while (ewma_pol_data->n_active_circuits) {
+    circuit_t *c = ewma_policy.pick_active_circuit(&cmux, pol_data);
+    ewma_policy_circ_data_t *ewma_data =
+      TO_EWMA_POL_CIRC_DATA(circ_data[c - circs]);
+    tt_assert(ewma_data);
+    tt_double_op(ewma_data->cell_ewma.cell_count, OP_GE, last);
+    last = ewma_data->cell_ewma.cell_count;
+    ewma_policy.notify_circ_inactive(&cmux, pol_data, c,
+                                     circ_data[c - circs]);
+    tt_int_op(ewma_data->cell_ewma.heap_index, OP_EQ, -1);
+  }
+  tt_ptr_op(ewma_policy.pick_active_circuit(&cmux, pol_data), OP_EQ, NULL);
+
+ done:
+  for (i = 0; i < N_CIRCS; ++i)
+    ewma_policy.free_circ_data(&cmux, pol_data, &circs[i], circ_data[i]);
+  ewma_policy.free_cmux_data(&cmux, pol_data);
+#undef N_CIRCS
+}
+
+static void
+test_cmux_ewma_lazy_rescale(void *arg)
+{
+  circuitmux_t cmux; /* garbage */
+  circuitmux_policy_data_t *pol_data = NULL;
+  circuit_t circ; /* garbage */
+  circuitmux_policy_circ_data_t *circ_data = NULL;
+  ewma_policy_data_t *ewma_pol_data;
+  ewma_policy_circ_data_t *ewma_data;
+  unsigned scale_tick;
+  double rem;
+
+  (void) arg;
+
+  pol_data = ewma_policy.alloc_cmux_data(&cmux);
+  circ_data = ewma_policy.alloc_circ_data(&cmux, pol_data, &circ,
+                                          CELL_DIRECTION_OUT, 42);
+  ewma_pol_data = TO_EWMA_POL_DATA(pol_data);
+  ewma_data = TO_EWMA_POL_CIRC_DATA(circ_data);
+  tt_assert(ewma_pol_data);
+  tt_assert(ewma_data);
+  ewma_policy.notify_circ_active(&cmux, pol_data, &circ, circ_data);
+
+  /* A few ticks behind: new cells just count for more. */
+  ewma_pol_data->active_circuits_scale_tick -= 3;
+  ewma_data->cell_ewma.last_adjusted_tick -= 3;
+  scale_tick = ewma_pol_data->active_circuits_scale_tick;
+  ewma_policy.notify_xmit_cells(&cmux, pol_data, &circ, circ_data, 1);
+  tt_uint_op(ewma_pol_data->active_circuits_scale_tick, OP_EQ, scale_tick);
+  tt_double_op(ewma_data->cell_ewma.cell_count, OP_GT, 1.0);
+
+  /* Far enough behind that new cells would count for too much: everything
+   * gets rescaled to the current tick. */
+  ewma_pol_data->active_circuits_scale_tick -= 10000;
+  ewma_data->cell_ewma.last_adjusted_tick -= 10000;
+  ewma_policy.notify_xmit_cells(&cmux, pol_data, &circ, circ_data, 1);
+  tt_uint_op(ewma_pol_data->active_circuits_scale_tick, OP_EQ,
+             cell_ewma_get_current_tick_and_fraction(&rem));
+  tt_uint_op(ewma_data->cell_ewma.last_adjusted_tick, OP_EQ,
+             ewma_pol_data->active_circuits_scale_tick);
+  tt_double_op(ewma_data->cell_ewma.cell_count, OP_LT, 10.0);
+  tt_ptr_op(ewma_pol_data->active_circuits[0].ewma, OP_EQ,
+            &ewma_data->cell_ewma);
+  tt_double_op(ewma_pol_data->active_circuits[0].cell_count, OP_LE,
+               ewma_data->cell_ewma.cell_count);
+  tt_double_op(ewma_pol_data->active_circuits[0].cell_count, OP_GE,
+               ewma_data->cell_ewma.cell_count);
+
+ done:
+  ewma_policy.free_circ_data(&cmux, pol_data, &circ, circ_data);
+  ewma_policy.free_cmux_data(&cmux, pol_data);
+}
+
+static void
+test_cmux_ewma_idle_cmux(void *arg)
+{
+  circuitmux_t cmux1, cmux2; /* garbage */
+  circuitmux_policy_data_t *pol_data1 = NULL, *pol_data2 = NULL;
+  circuit_t circ1, circ2; /* garbage */
+  circuitmux_policy_circ_data_t *circ_data1 = NULL, *circ_data2 = NULL;
+  ewma_policy_data_t *ewma_pol_data1, *ewma_pol_data2;
+  ewma_policy_circ_data_t *ewma_data1, *ewma_data2;
+  double rem;
+  unsigned now;
+
+  (void) arg;
+
+  /* A circuitmux that has sent nothing for longer than it takes the scale
+   * factor to overflow a double: with the default halflife, that is about
+   * 3000 ticks. */
+  pol_data1 = ewma_policy.alloc_cmux_data(&cmux1);
+  ewma_pol_data1 = TO_EWMA_POL_DATA(pol_data1);
+  tt_assert(ewma_pol_data1);
+  ewma_pol_data1->active_circuits_scale_tick -= 4000;
+
+  /* A new circuit on it still gets a finite count. */
+  circ_data1 = ewma_policy.alloc_circ_data(&cmux1, pol_data1, &circ1,
+                                           CELL_DIRECTION_OUT, 0);
+  ewma_data1 = TO_EWMA_POL_CIRC_DATA(circ_data1);
+  tt_assert(ewma_data1);
+  ewma_policy.notify_circ_active(&cmux1, pol_data1, &circ1, circ_data1);
+  now = cell_ewma_get_current_tick_and_fraction(&rem);
+  tt_uint_op(ewma_pol_data1->active_circuits_scale_tick, OP_EQ, now);
+  tt_double_op(ewma_data1->cell_ewma.cell_count, OP_LE, 0.0);
+  ewma_policy.notify_xmit_cells(&cmux1, pol_data1, &circ1, circ_data1, 1);
+  tt_double_op(ewma_data1->cell_ewma.cell_count, OP_GE, 1.0);
+  tt_double_op(ewma_data1->cell_ewma.cell_count, OP_LT, 10.0);
+
+  /* Comparing it against a circuitmux whose scale tick is just as far
+   * behind, in either order, doesn't overflow either. */
+  pol_data2 = ewma_policy.alloc_cmux_data(&cmux2);
+  ewma_pol_data2 = TO_EWMA_POL_DATA(pol_data2);
+  tt_assert(ewma_pol_data2);
+  circ_data2 = ewma_policy.alloc_circ_data(&cmux2, pol_data2, &circ2,
+                                           CELL_DIRECTION_OUT, 0);
+  ewma_data2 = TO_EWMA_POL_CIRC_DATA(circ_data2);
+  tt_assert(ewma_data2);
+  ewma_policy.notify_circ_active(&cmux2, pol_data2, &circ2, circ_data2);
+  ewma_pol_data2->active_circuits_scale_tick -= 4000;
+  ewma_data2->cell_ewma.last_adjusted_tick -= 4000;
+  ewma_data2->cell_ewma.cell_count = 5.0;
+  ewma_pol_data2->active_circuits[0].cell_count = 5.0;
+  tt_int_op(ewma_policy.cmp_cmux(&cmux1, pol_data1, &cmux2, pol_data2),
+            OP_EQ, 1);
+  tt_int_op(ewma_policy.cmp_cmux(&cmux2, pol_data2, &cmux1, pol_data1),
+            OP_EQ, -1);
+
+ done:
+  ewma_policy.free_circ_data(&cmux1, pol_data1, &circ1, circ_data1);
+  ewma_policy.free_circ_data(&cmux2, pol_data2, &circ2, circ_data2);
+  ewma_policy.free_cmux_data(&cmux1, pol_data1);
+  ewma_policy.free_cmux_data(&cmux2, pol_data2);
+}
+
 static void *
 cmux_ewma_setup_test(const struct testcase_t *tc)
 {
@@ -223,6 +402,9 @@ struct testcase_t circuitmux_ewma_tests[] = {
   TEST_CMUX_EWMA(policy_circ_data),
   TEST_CMUX_EWMA(notify_circ),
   TEST_CMUX_EWMA(xmit_cell),
+  TEST_CMUX_EWMA(heap_order),
+  TEST_CMUX_EWMA(lazy_rescale),
+  TEST_CMUX_EWMA(idle_cmux),
 
   END_OF_TESTCASES
 };
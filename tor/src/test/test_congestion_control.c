@@ -0,0 +1,232 @@
+/* Copyright (c) 2022, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file test_congestion_control.c
+ * \brief Tests for the congestion control algorithms, run against a
+ *        simulated bottleneck link.
+ */
+
+#define CIRCUITLIST_PRIVATE
+#define TOR_CONGESTION_CONTROL_COMMON_PRIVATE
+#define TOR_CONGESTION_CONTROL_PRIVATE
+
+#include "core/or/or.h"
+#include "core/or/circuitlist.h"
+#include "core/crypto/onion_crypto.h"
+#include "core/or/congestion_control_common.h"
+#include "core/or/congestion_control_st.h"
+#include "core/or/edge_connection_st.h"
+#include "core/or/origin_circuit_st.h"
+#include "feature/nodelist/networkstatus.h"
+#include "lib/time/compat_time.h"
+
+#include "test/test.h"
+
+/** Simulated monotonic time, in usec. */
+static uint64_t sim_now_usec;
+/** Value of the "cc_alg" consensus parameter. */
+static int32_t sim_cc_alg;
+
+static uint64_t
+mock_monotime_absolute_usec(void)
+{
+  return sim_now_usec;
+}
+
+static int32_t
+mock_networkstatus_get_param(const networkstatus_t *ns,
+                             const char *param_name, int32_t default_val,
+                             int32_t min_val, int32_t max_val)
+{
+  (void) ns;
+  (void) min_val;
+  (void) max_val;
+
+  if (!strcmp(param_name, "cc_alg"))
+    return sim_cc_alg;
+  return default_val;
+}
+
+/** Number of SENDMEs that can be on their way back at once. */
+#define SIM_MAX_SENDMES 4096
+
+/**
+ * Run a bulk transfer over a simulated path using the congestion control
+ * algorithm <b>alg</b>, for <b>duration_msec</b>. The path has a single
+ * bottleneck that forwards <b>cells_per_sec</b> cells per second in FIFO
+ * order, and a round trip time of <b>rtt_msec</b> without any queue.
+ *
+ * Return the number of cells acked after the first <b>warmup_msec</b>, as a
+ * percentage of what the bottleneck can forward in the same time. If
+ * <b>cwnd_out</b> is set, store the final congestion window there.
+ */
+static int
+simulate_bulk_transfer(cc_alg_t alg, uint64_t cells_per_sec,
+                       uint64_t rtt_msec, uint64_t duration_msec,
+                       uint64_t warmup_msec, uint64_t *cwnd_out)
+{
+  circuit_params_t params;
+  origin_circuit_t *ocirc = origin_circuit_new();
+  circuit_t *circ = TO_CIRCUIT(ocirc);
+  edge_connection_t stream;
+  congestion_control_t *cc;
+  uint64_t *sendmes = tor_calloc(SIM_MAX_SENDMES, sizeof(uint64_t));
+  unsigned int sendme_head = 0, sendme_tail = 0;
+  const uint64_t usec_per_cell = 1000*1000 / cells_per_sec;
+  const uint64_t end_usec = duration_msec*1000;
+  uint64_t link_free_usec = 0, acked = 0;
+  int pct = -1;
+
+  /* A stream that always has more to send. */
+  memset(&stream, 0, sizeof(stream));
+  ocirc->p_streams = &stream;
+  circ->purpose = CIRCUIT_PURPOSE_C_GENERAL;
+
+  sim_cc_alg = alg;
+  sim_now_usec = 1;
+  congestion_control_new_consensus_params(NULL);
+
+  memset(&params, 0, sizeof(params));
+  params.cc_enabled = 1;
+  params.sendme_inc_cells = congestion_control_sendme_inc();
+  cc = circ->ccontrol = congestion_control_new(&params, CC_PATH_EXIT);
+  tt_int_op(cc->cc_alg, OP_EQ, alg);
+
+  while (sim_now_usec < end_usec) {
+    /* Send as much as the window allows. */
+    while (congestion_control_get_package_window(circ, NULL) > 0) {
+      bool wants_sendme = circuit_sent_cell_for_sendme(circ, NULL);
+
+      link_free_usec = MAX(sim_now_usec, link_free_usec) + usec_per_cell;
+      congestion_control_note_cell_sent(cc, circ, NULL);
+      if (wants_sendme) {
+        tt_uint_op(sendme_tail - sendme_head, OP_LT, SIM_MAX_SENDMES);
+        sendmes[sendme_tail++ % SIM_MAX_SENDMES] =
+          link_free_usec + rtt_msec*1000;
+      }
+    }
+
+    /* Wait for the next SENDME. */
+    tt_uint_op(sendme_head, OP_LT, sendme_tail);
+    sim_now_usec = sendmes[sendme_head++ % SIM_MAX_SENDMES];
+    if (sim_now_usec >= warmup_msec*1000 && sim_now_usec < end_usec)
+      acked += cc->sendme_inc;
+    tt_int_op(congestion_control_dispatch_cc_alg(cc, circ, NULL), OP_EQ, 0);
+  }
+
+  pct = (int) (acked * 100 * 1000 /
+               (cells_per_sec * (duration_msec - warmup_msec)));
+  if (cwnd_out)
+    *cwnd_out = cc->cwnd;
+
+ done:
+  ocirc->p_streams = NULL;
+  circuit_free_(circ);
+  tor_free(sendmes);
+  return pct;
+}
+
+static void
+test_cc_bbr_high_bdp(void *arg)
+{
+  uint64_t cwnd = 0;
+  int bbr_pct, vegas_pct;
+  (void) arg;
+
+  MOCK(monotime_absolute_usec, mock_monotime_absolute_usec);
+  MOCK(networkstatus_get_param, mock_networkstatus_get_param);
+
+  /* 20000 cells/sec at 300 msec is a BDP of 6000 cells: more than Vegas
+   * allows itself to reach in slow start. */
+  bbr_pct = simulate_bulk_transfer(CC_ALG_BBR, 20000, 300, 30*1000,
+                                   5*1000, &cwnd);
+  vegas_pct = simulate_bulk_transfer(CC_ALG_VEGAS, 20000, 300, 30*1000,
+                                     5*1000, NULL);
+  tt_int_op(bbr_pct, OP_GE, 90);
+  tt_int_op(bbr_pct, OP_GE, vegas_pct);
+  /* BBR keeps cwnd close to the BDP rather than filling the queue. */
+  tt_u64_op(cwnd, OP_GE, 6000);
+  tt_u64_op(cwnd, OP_LE, 6000 * 2);
+
+ done:
+  UNMOCK(monotime_absolute_usec);
+  UNMOCK(networkstatus_get_param);
+}
+
+static void
+test_cc_bbr_low_bdp(void *arg)
+{
+  uint64_t cwnd = 0;
+  int pct;
+  (void) arg;
+
+  MOCK(monotime_absolute_usec, mock_monotime_absolute_usec);
+  MOCK(networkstatus_get_param, mock_networkstatus_get_param);
+
+  /* 2000 cells/sec at 50 msec is a BDP of 100 cells. */
+  pct = simulate_bulk_transfer(CC_ALG_BBR, 2000, 50, 30*1000, 5*1000, &cwnd);
+  tt_int_op(pct, OP_GE, 90);
+  tt_u64_op(cwnd, OP_LE, 100 * 3);
+
+ done:
+  UNMOCK(monotime_absolute_usec);
+  UNMOCK(networkstatus_get_param);
+}
+
+static void
+test_cc_bbr_late_start(void *arg)
+{
+  circuit_params_t params;
+  origin_circuit_t *ocirc = origin_circuit_new();
+  circuit_t *circ = TO_CIRCUIT(ocirc);
+  edge_connection_t stream;
+  congestion_control_t *cc;
+  uint64_t cwnd;
+  (void) arg;
+
+  MOCK(monotime_absolute_usec, mock_monotime_absolute_usec);
+  MOCK(networkstatus_get_param, mock_networkstatus_get_param);
+
+  memset(&stream, 0, sizeof(stream));
+  ocirc->p_streams = &stream;
+  circ->purpose = CIRCUIT_PURPOSE_C_GENERAL;
+
+  /* A circuit built a minute after we started: the monotonic clock is
+   * already well past the min-RTT window. */
+  sim_cc_alg = CC_ALG_BBR;
+  sim_now_usec = 60*1000*1000;
+  congestion_control_new_consensus_params(NULL);
+
+  memset(&params, 0, sizeof(params));
+  params.cc_enabled = 1;
+  params.sendme_inc_cells = congestion_control_sendme_inc();
+  cc = circ->ccontrol = congestion_control_new(&params, CC_PATH_EXIT);
+  tt_u64_op(cc->bbr_params.rtt_window_msec*UINT64_C(1000), OP_LT,
+            sim_now_usec);
+  cwnd = cc->cwnd;
+
+  /* Send a window of cells, and get the first SENDME back 50 msec later.
+   * That is our first RTT sample, so it can't have expired. */
+  while (congestion_control_get_package_window(circ, NULL) > 0) {
+    circuit_sent_cell_for_sendme(circ, NULL);
+    congestion_control_note_cell_sent(cc, circ, NULL);
+  }
+  sim_now_usec += 50*1000;
+  tt_int_op(congestion_control_dispatch_cc_alg(cc, circ, NULL), OP_EQ, 0);
+  tt_int_op(cc->bbr_params.mode, OP_EQ, BBR_MODE_STARTUP);
+  tt_u64_op(cc->cwnd, OP_GE, cwnd);
+
+ done:
+  ocirc->p_streams = NULL;
+  circuit_free_(circ);
+  UNMOCK(monotime_absolute_usec);
+  UNMOCK(networkstatus_get_param);
+}
+
+struct testcase_t congestion_control_tests[] = {
+  { "bbr_high_bdp", test_cc_bbr_high_bdp, TT_FORK, NULL, NULL },
+  { "bbr_low_bdp", test_cc_bbr_low_bdp, TT_FORK, NULL, NULL },
+  { "bbr_late_start", test_cc_bbr_late_start, TT_FORK, NULL, NULL },
+  END_OF_TESTCASES
+};
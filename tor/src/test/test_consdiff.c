@@ -95,9 +95,9 @@ test_consdiff_smartlist_slice_string_pos(void *arg)
 
   /* See that smartlist_slice_string_pos respects the bounds of the slice. */
   sls = smartlist_slice(sl, 2, 5);
-  cdline_t a_line = { "a", 1 };
+  cdline_t a_line = { "a", 1, 0 };
   tt_int_op(3, OP_EQ, smartlist_slice_string_pos(sls, &a_line));
-  cdline_t d_line = { "d", 1 };
+  cdline_t d_line = { "d", 1, 0 };
   tt_int_op(-1, OP_EQ, smartlist_slice_string_pos(sls, &d_line));
 
  done:
@@ -348,9 +348,9 @@ test_consdiff_get_id_hash(void *arg)
 {
   (void)arg;
 
-  cdline_t line1 = { "r name", 6 };
-  cdline_t line2 = { "r name _hash_isnt_base64 etc", 28 };
-  cdline_t line3 = { "r name hash+valid+base64 etc", 28 };
+  cdline_t line1 = { "r name", 6, 0 };
+  cdline_t line2 = { "r name _hash_isnt_base64 etc", 28, 0 };
+  cdline_t line3 = { "r name hash+valid+base64 etc", 28, 0 };
   cdline_t tmp;
 
   /* No hash. */
@@ -372,15 +372,15 @@ test_consdiff_is_valid_router_entry(void *arg)
 {
   /* Doesn't start with "r ". */
   (void)arg;
-  cdline_t line0 = { "foo", 3 };
+  cdline_t line0 = { "foo", 3, 0 };
   tt_int_op(0, OP_EQ, is_valid_router_entry(&line0));
 
   /* These are already tested with get_id_hash, but make sure it's run
    * properly. */
 
-  cdline_t line1 = { "r name", 6 };
-  cdline_t line2 = { "r name _hash_isnt_base64 etc", 28 };
-  cdline_t line3 = { "r name hash+valid+base64 etc", 28 };
+  cdline_t line1 = { "r name", 6, 0 };
+  cdline_t line2 = { "r name _hash_isnt_base64 etc", 28, 0 };
+  cdline_t line3 = { "r name hash+valid+base64 etc", 28, 0 };
   tt_int_op(0, OP_EQ, is_valid_router_entry(&line1));
   tt_int_op(0, OP_EQ, is_valid_router_entry(&line2));
   tt_int_op(1, OP_EQ, is_valid_router_entry(&line3));
@@ -423,8 +423,8 @@ test_consdiff_next_router(void *arg)
 static int
 base64cmp_wrapper(const char *a, const char *b)
 {
-  cdline_t aa = { a, a ? (uint32_t) strlen(a) : 0 };
-  cdline_t bb = { b, b ? (uint32_t) strlen(b) : 0 };
+  cdline_t aa = { a, a ? (uint32_t) strlen(a) : 0, 0 };
+  cdline_t bb = { b, b ? (uint32_t) strlen(b) : 0, 0 };
   return base64cmp(&aa, &bb);
 }
 
@@ -1195,6 +1195,114 @@ test_consdiff_apply_diff(void *arg)
   memarea_drop_all(area);
 }
 
+static void
+test_consdiff_lines_eq(void *arg)
+{
+  smartlist_t *lines = smartlist_new();
+  memarea_t *area = memarea_new();
+  (void)arg;
+
+  consensus_split_lines_(lines, "abc\nabd\nabc\nab\n", area);
+  tt_int_op(4, OP_EQ, smartlist_len(lines));
+  tt_assert(lines_eq(smartlist_get(lines, 0), smartlist_get(lines, 2)));
+  tt_assert(!lines_eq(smartlist_get(lines, 0), smartlist_get(lines, 1)));
+  tt_assert(!lines_eq(smartlist_get(lines, 0), smartlist_get(lines, 3)));
+
+  /* Lines without a hash are compared by their contents alone. */
+  cdline_t unhashed = { "abc", 3, 0 };
+  tt_assert(lines_eq(&unhashed, smartlist_get(lines, 0)));
+  tt_assert(!lines_eq(smartlist_get(lines, 1), &unhashed));
+
+  /* Equal hashes are never trusted on their own. */
+  cdline_t fake = { "abc", 3, 0 };
+  fake.hash = ((const cdline_t *)smartlist_get(lines, 1))->hash;
+  tt_assert(!lines_eq(&fake, smartlist_get(lines, 1)));
+
+ done:
+  smartlist_free(lines);
+  memarea_drop_all(area);
+}
+
+static void
+test_consdiff_generate_from_inputs(void *arg)
+{
+  char *old1_str=NULL, *old2_str=NULL, *new_str=NULL;
+  char *diff=NULL, *diff_expected=NULL, *applied=NULL;
+  consensus_diff_input_t *old1=NULL, *old2=NULL, *target=NULL;
+  consensus_digest_t digest;
+  (void)arg;
+
+  old1_str = tor_strdup(
+      "network-status-version foo\n"
+      "r name ccccccccccccccccc etc\nfoo\n"
+      "r name eeeeeeeeeeeeeeeee etc\nbar\n"
+      "directory-signature foo bar\nbar\n"
+      );
+  old2_str = tor_strdup(
+      "network-status-version foo\n"
+      "r name aaaaaaaaaaaaaaaaa etc\nbaz\n"
+      "r name ccccccccccccccccc etc\nfoo\n"
+      "directory-signature foo bar\nbar\n"
+      );
+  new_str = tor_strdup(
+      "network-status-version foo\n"
+      "r name aaaaaaaaaaaaaaaaa etc\nfoo\n"
+      "r name ccccccccccccccccc etc\nbar\n"
+      "directory-signature foo bar\nbar\n"
+      );
+
+  tt_int_op(0, OP_EQ, consensus_compute_digest_(new_str, &digest));
+  target = consensus_diff_input_new(new_str, strlen(new_str),
+                                    digest.sha3_256);
+  tt_assert(target);
+  tt_int_op(0, OP_EQ, consensus_compute_digest_as_signed_(old1_str, &digest));
+  old1 = consensus_diff_input_new(old1_str, strlen(old1_str),
+                                  digest.sha3_256);
+  tt_assert(old1);
+  tt_int_op(0, OP_EQ, consensus_compute_digest_as_signed_(old2_str, &digest));
+  old2 = consensus_diff_input_new(old2_str, strlen(old2_str),
+                                  digest.sha3_256);
+  tt_assert(old2);
+
+  /* Using the same target for two diffs gives the same results as computing
+   * each diff from scratch. */
+  diff = consensus_diff_generate_from_inputs(old1, target);
+  diff_expected = consensus_diff_generate(old1_str, strlen(old1_str),
+                                          new_str, strlen(new_str));
+  tt_assert(diff);
+  tt_str_op(diff, OP_EQ, diff_expected);
+  applied = consensus_diff_apply(old1_str, strlen(old1_str),
+                                 diff, strlen(diff));
+  tt_str_op(applied, OP_EQ, new_str);
+  tor_free(diff);
+  tor_free(diff_expected);
+  tor_free(applied);
+
+  diff = consensus_diff_generate_from_inputs(old2, target);
+  diff_expected = consensus_diff_generate(old2_str, strlen(old2_str),
+                                          new_str, strlen(new_str));
+  tt_assert(diff);
+  tt_str_op(diff, OP_EQ, diff_expected);
+  applied = consensus_diff_apply(old2_str, strlen(old2_str),
+                                 diff, strlen(diff));
+  tt_str_op(applied, OP_EQ, new_str);
+
+  /* A document that isn't made of lines can't be an input. */
+  tt_ptr_op(NULL, OP_EQ,
+            consensus_diff_input_new("no newline", 10, digest.sha3_256));
+
+ done:
+  consensus_diff_input_free(old1);
+  consensus_diff_input_free(old2);
+  consensus_diff_input_free(target);
+  tor_free(old1_str);
+  tor_free(old2_str);
+  tor_free(new_str);
+  tor_free(diff);
+  tor_free(diff_expected);
+  tor_free(applied);
+}
+
 #define CONSDIFF_LEGACY(name)                                          \
   { #name, test_consdiff_ ## name , 0, NULL, NULL }
 
@@ -1213,5 +1321,7 @@ struct testcase_t consdiff_tests[] = {
   CONSDIFF_LEGACY(apply_ed_diff),
   CONSDIFF_LEGACY(gen_diff),
   CONSDIFF_LEGACY(apply_diff),
+  CONSDIFF_LEGACY(lines_eq),
+  CONSDIFF_LEGACY(generate_from_inputs),
   END_OF_TESTCASES
 };
@@ -2289,6 +2289,33 @@ test_crypto_ed25519_simple(void *arg)
     tt_int_op(0, OP_EQ, ed25519_checksig_batch(NULL, ch, 2));
   }
 
+  /* Batch verification, when enabled, agrees with single verification. */
+  ed25519_set_batch_verification(1);
+  {
+    ed25519_checkable_t ch[] = {
+      { &pub1, sig2, msg, msg_len }, /*ok*/
+      { &kp2.pubkey, sig1, msg, msg_len }, /*ok*/
+      { &pub1, sig2, msg, msg_len }, /*ok*/
+      { &kp2.pubkey, sig1, msg, msg_len }, /*ok*/
+      { &pub1, sig2, msg, msg_len }, /*ok*/
+    };
+    int okay[5];
+    tt_int_op(0, OP_EQ, ed25519_checksig_batch(okay, ch, 5));
+    for (int i = 0; i < 5; ++i)
+      tt_int_op(okay[i], OP_EQ, 1);
+
+    /* One bad signature makes the batch fall back to single checks. */
+    ch[3].len = msg_len - 1;
+    tt_int_op(-1, OP_EQ, ed25519_checksig_batch(okay, ch, 5));
+    tt_int_op(okay[0], OP_EQ, 1);
+    tt_int_op(okay[1], OP_EQ, 1);
+    tt_int_op(okay[2], OP_EQ, 1);
+    tt_int_op(okay[3], OP_EQ, 0);
+    tt_int_op(okay[4], OP_EQ, 1);
+    tt_int_op(-1, OP_EQ, ed25519_checksig_batch(NULL, ch, 5));
+  }
+  ed25519_set_batch_verification(0);
+
   /* Test the string-prefixed sign/checksig functions */
   {
     ed25519_signature_t manual_sig;
@@ -2325,7 +2352,7 @@ test_crypto_ed25519_simple(void *arg)
   }
 
  done:
-  ;
+  ed25519_set_batch_verification(0);
 }
 
 static void
@@ -17,6 +17,7 @@
 #define HIBERNATE_PRIVATE
 #define NETWORKSTATUS_PRIVATE
 #define NS_PARSE_PRIVATE
+#define NS_SNAPSHOT_PRIVATE
 #define NODE_SELECT_PRIVATE
 #define RELAY_PRIVATE
 #define ROUTERLIST_PRIVATE
@@ -28,6 +29,7 @@
 #include "app/config/config.h"
 #include "lib/confmgt/confmgt.h"
 #include "core/mainloop/connection.h"
+#include "core/mainloop/cpuworker.h"
 #include "core/or/relay.h"
 #include "core/or/protover.h"
 #include "core/or/versions.h"
@@ -59,6 +61,7 @@
 #include "feature/nodelist/routerlist.h"
 #include "feature/dirparse/authcert_parse.h"
 #include "feature/dirparse/ns_parse.h"
+#include "feature/dirparse/ns_snapshot.h"
 #include "feature/dirparse/routerparse.h"
 #include "feature/dirparse/unparseable.h"
 #include "feature/nodelist/routerset.h"
@@ -71,8 +74,10 @@
 #include "lib/crypt_ops/crypto_format.h"
 #include "lib/crypt_ops/crypto_rand.h"
 #include "lib/encoding/confline.h"
+#include "lib/evloop/workqueue.h"
 #include "lib/memarea/memarea.h"
 #include "lib/osinfo/uname.h"
+#include "lib/thread/threads.h"
 #include "test/log_test_helpers.h"
 #include "test/opts_test_helpers.h"
 #include "test/test.h"
@@ -126,6 +131,245 @@ networkstatus_parse_vote_from_string_(const char *s,
   return result;
 }
 
+static int
+mock_cpuworker_get_n_threads(void)
+{
+  return 3;
+}
+
+/** A cpuworker job that we run on a thread of its own. */
+typedef struct spawned_work_t {
+  workqueue_reply_t (*fn)(void *, void *);
+  void *arg;
+} spawned_work_t;
+
+static void
+spawned_work_run(void *arg)
+{
+  spawned_work_t *work = arg;
+  work->fn(NULL, work->arg);
+  tor_free(work);
+}
+
+static struct workqueue_entry_t *
+mock_cpuworker_queue_work_spawn(workqueue_priority_t prio,
+                                workqueue_reply_t (*fn)(void *, void *),
+                                void (*reply_fn)(void *),
+                                void *arg)
+{
+  static char fake_entry;
+  spawned_work_t *work = tor_malloc_zero(sizeof(spawned_work_t));
+  (void) prio;
+  (void) reply_fn;
+
+  work->fn = fn;
+  work->arg = arg;
+  if (spawn_func(spawned_work_run, work) < 0) {
+    tor_free(work);
+    return NULL;
+  }
+  return (struct workqueue_entry_t *)&fake_entry;
+}
+
+/** Check that <b>a</b> and <b>b</b> are the same routerstatus. */
+static void
+check_routerstatus_eq(const routerstatus_t *a, const routerstatus_t *b)
+{
+  routerstatus_t a_copy, b_copy;
+
+  if (a->exitsummary || b->exitsummary) {
+    tt_assert(a->exitsummary && b->exitsummary);
+    tt_str_op(a->exitsummary, OP_EQ, b->exitsummary);
+  }
+  memcpy(&a_copy, a, sizeof(a_copy));
+  memcpy(&b_copy, b, sizeof(b_copy));
+  a_copy.exitsummary = b_copy.exitsummary = NULL;
+  tt_mem_op(&a_copy, OP_EQ, &b_copy, sizeof(a_copy));
+
+ done:
+  ;
+}
+
+/** Parse the networkstatus document in <b>text</b> once on its own, and once
+ * with ParallelDirParsing, splitting its entries into as many chunks as we
+ * can and running the cpuworker jobs on threads of their own.  Check that
+ * we get the same result both times. */
+static void
+check_parallel_parse(const char *text, networkstatus_type_t ns_type)
+{
+  networkstatus_t *ns = NULL, *ns2 = NULL;
+  const size_t old_chunk_min_bytes = rs_chunk_min_bytes;
+  int i;
+
+  ns = networkstatus_parse_vote_from_string_(text, NULL, ns_type);
+  tt_assert(ns);
+
+  MOCK(cpuworker_get_n_threads, mock_cpuworker_get_n_threads);
+  MOCK(cpuworker_queue_work, mock_cpuworker_queue_work_spawn);
+  get_options_mutable()->ParallelDirParsing = 1;
+  rs_chunk_min_bytes = 1;
+  tt_assert(networkstatus_parallel_parsing_enabled());
+
+  ns2 = networkstatus_parse_vote_from_string_(text, NULL, ns_type);
+  tt_assert(ns2);
+
+  tt_mem_op(&ns->digests, OP_EQ, &ns2->digests, sizeof(ns->digests));
+  tt_mem_op(ns->digest_sha3_as_signed, OP_EQ, ns2->digest_sha3_as_signed,
+            DIGEST256_LEN);
+  tt_int_op(smartlist_len(ns->routerstatus_list), OP_GT, 1);
+  tt_int_op(smartlist_len(ns->routerstatus_list), OP_EQ,
+            smartlist_len(ns2->routerstatus_list));
+  for (i = 0; i < smartlist_len(ns->routerstatus_list); ++i) {
+    if (ns_type == NS_TYPE_CONSENSUS) {
+      check_routerstatus_eq(smartlist_get(ns->routerstatus_list, i),
+                            smartlist_get(ns2->routerstatus_list, i));
+    } else {
+      const vote_routerstatus_t *a = smartlist_get(ns->routerstatus_list, i);
+      const vote_routerstatus_t *b = smartlist_get(ns2->routerstatus_list, i);
+      check_routerstatus_eq(&a->status, &b->status);
+      tt_str_op(a->version, OP_EQ, b->version);
+      tt_str_op(a->protocols, OP_EQ, b->protocols);
+      tt_u64_op(a->flags, OP_EQ, b->flags);
+      tt_mem_op(a->ed25519_id, OP_EQ, b->ed25519_id, DIGEST256_LEN);
+    }
+  }
+
+ done:
+  UNMOCK(cpuworker_get_n_threads);
+  UNMOCK(cpuworker_queue_work);
+  get_options_mutable()->ParallelDirParsing = 0;
+  rs_chunk_min_bytes = old_chunk_min_bytes;
+  networkstatus_vote_free(ns);
+  networkstatus_vote_free(ns2);
+}
+
+/** Compute both consensus flavors from <b>votes</b> again, with
+ * AuthDirParallelConsensus, one router to a range, and the cpuworker jobs
+ * running on threads of their own.  Check that we get exactly
+ * <b>ns_text</b> and <b>md_text</b>. */
+static void
+check_parallel_consensus(smartlist_t *votes, crypto_pk_t *identity_key,
+                         crypto_pk_t *signing_key,
+                         const char *legacy_id_digest,
+                         crypto_pk_t *legacy_signing_key,
+                         const char *ns_text, const char *md_text)
+{
+  dirauth_options_t *dirauth_opts =
+    (dirauth_options_t *) dirauth_get_options();
+  const int old_routers_per_range = consensus_routers_per_range;
+  consensus_build_t *ns_build = NULL, *md_build = NULL;
+  char *ns_text2 = NULL, *md_text2 = NULL;
+
+  MOCK(cpuworker_get_n_threads, mock_cpuworker_get_n_threads);
+  MOCK(cpuworker_queue_work, mock_cpuworker_queue_work_spawn);
+  dirauth_opts->AuthDirParallelConsensus = 1;
+  consensus_routers_per_range = 1;
+
+  /* Start both flavors before we finish either, the way
+   * dirvote_compute_consensuses() does. */
+  ns_build = networkstatus_compute_consensus_start(votes, 3, FLAV_NS);
+  md_build = networkstatus_compute_consensus_start(votes, 3, FLAV_MICRODESC);
+  tt_assert(ns_build);
+  tt_assert(md_build);
+  ns_text2 = networkstatus_compute_consensus_finish(ns_build, identity_key,
+                                                    signing_key,
+                                                    legacy_id_digest,
+                                                    legacy_signing_key);
+  md_text2 = networkstatus_compute_consensus_finish(md_build, identity_key,
+                                                    signing_key,
+                                                    legacy_id_digest,
+                                                    legacy_signing_key);
+  tt_str_op(ns_text2, OP_EQ, ns_text);
+  tt_str_op(md_text2, OP_EQ, md_text);
+
+ done:
+  UNMOCK(cpuworker_get_n_threads);
+  UNMOCK(cpuworker_queue_work);
+  dirauth_opts->AuthDirParallelConsensus = 0;
+  consensus_routers_per_range = old_routers_per_range;
+  tor_free(ns_text2);
+  tor_free(md_text2);
+}
+
+/** Parse the consensus in <b>text</b> with the snapshot at
+ * <b>snapshot</b>, and check whether we used the snapshot as
+ * <b>expect_used</b> says, and that we got the same entries as in
+ * <b>ns</b>. */
+static void
+check_snapshot_parse_result(const networkstatus_t *ns, const char *text,
+                            const char *snapshot, size_t snapshot_len,
+                            int expect_used)
+{
+  networkstatus_t *ns2 = NULL;
+  int used = -1;
+  int i;
+
+  ns2 = networkstatus_parse_consensus_with_snapshot(text, strlen(text),
+                                                    snapshot, snapshot_len,
+                                                    &used);
+  tt_assert(ns2);
+  tt_int_op(used, OP_EQ, expect_used);
+  tt_mem_op(&ns->digests, OP_EQ, &ns2->digests, sizeof(ns->digests));
+  tt_int_op(ns->valid_after, OP_EQ, ns2->valid_after);
+  tt_int_op(smartlist_len(ns->voters), OP_EQ, smartlist_len(ns2->voters));
+  tt_int_op(smartlist_len(ns->routerstatus_list), OP_EQ,
+            smartlist_len(ns2->routerstatus_list));
+  for (i = 0; i < smartlist_len(ns->routerstatus_list); ++i) {
+    check_routerstatus_eq(smartlist_get(ns->routerstatus_list, i),
+                          smartlist_get(ns2->routerstatus_list, i));
+  }
+
+ done:
+  networkstatus_vote_free(ns2);
+}
+
+/** Make a snapshot of the consensus in <b>text</b>, and check that parsing
+ * the consensus with it gives the same result as parsing it without.  Check
+ * that we ignore the snapshot if it is damaged or made from another
+ * consensus. */
+static void
+check_snapshot_parse(const char *text)
+{
+  networkstatus_t *ns = NULL;
+  char *snapshot = NULL;
+  size_t snapshot_len = 0;
+
+  ns = networkstatus_parse_vote_from_string_(text, NULL, NS_TYPE_CONSENSUS);
+  tt_assert(ns);
+  tt_int_op(smartlist_len(ns->routerstatus_list), OP_GT, 1);
+  snapshot = ns_snapshot_encode(ns, text, strlen(text), &snapshot_len);
+  tt_assert(snapshot);
+  tt_uint_op(snapshot_len, OP_GT, NS_SNAPSHOT_HEADER_LEN);
+
+  check_snapshot_parse_result(ns, text, snapshot, snapshot_len, 1);
+
+  /* Truncated. */
+  check_snapshot_parse_result(ns, text, snapshot, snapshot_len - 1, 0);
+  check_snapshot_parse_result(ns, text, snapshot, 10, 0);
+
+  /* Damaged entries: the checksum no longer matches. */
+  snapshot[snapshot_len - 1] ^= 1;
+  check_snapshot_parse_result(ns, text, snapshot, snapshot_len, 0);
+  snapshot[snapshot_len - 1] ^= 1;
+
+  /* Made from some other consensus. */
+  snapshot[16] ^= 1;
+  check_snapshot_parse_result(ns, text, snapshot, snapshot_len, 0);
+  snapshot[16] ^= 1;
+
+  /* Made by some other version of Tor. */
+  snapshot[NS_SNAPSHOT_CHECKSUM_OFFSET + DIGEST256_LEN] ^= 1;
+  check_snapshot_parse_result(ns, text, snapshot, snapshot_len, 0);
+  snapshot[NS_SNAPSHOT_CHECKSUM_OFFSET + DIGEST256_LEN] ^= 1;
+
+  /* And it still works once it's back the way it was. */
+  check_snapshot_parse_result(ns, text, snapshot, snapshot_len, 1);
+
+ done:
+  tor_free(snapshot);
+  networkstatus_vote_free(ns);
+}
+
 static void
 test_dir_nicknames(void *arg)
 {
@@ -3454,6 +3698,12 @@ test_a_networkstatus(
                                          &v1, &n_vrs, now, 1));
   tt_assert(v1);
 
+  /* Make sure we parse it the same way with help from the cpuworkers. */
+  cp = format_networkstatus_vote(sign_skey_1, vote);
+  tt_assert(cp);
+  check_parallel_parse(cp, NS_TYPE_VOTE);
+  tor_free(cp);
+
   /* Make sure the parsed thing was right. */
   tt_int_op(v1->type,OP_EQ, NS_TYPE_VOTE);
   tt_int_op(v1->published,OP_EQ, vote->published);
@@ -3536,6 +3786,8 @@ test_a_networkstatus(
   con = networkstatus_parse_vote_from_string_(consensus_text, NULL,
                                              NS_TYPE_CONSENSUS);
   tt_assert(con);
+  check_parallel_parse(consensus_text, NS_TYPE_CONSENSUS);
+  check_snapshot_parse(consensus_text);
   //log_notice(LD_GENERAL, "<<%s>>\n<<%s>>\n<<%s>>\n",
   //           v1_text, v2_text, v3_text);
   consensus_text_md = networkstatus_compute_consensus(votes, 3,
@@ -3548,6 +3800,11 @@ test_a_networkstatus(
   con_md = networkstatus_parse_vote_from_string_(consensus_text_md, NULL,
                                                 NS_TYPE_CONSENSUS);
   tt_assert(con_md);
+  check_parallel_parse(consensus_text_md, NS_TYPE_CONSENSUS);
+  check_snapshot_parse(consensus_text_md);
+  check_parallel_consensus(votes, cert3->identity_key, sign_skey_3,
+                           "AAAAAAAAAAAAAAAAAAAA", sign_skey_leg1,
+                           consensus_text, consensus_text_md);
   tt_int_op(con_md->flavor,OP_EQ, FLAV_MICRODESC);
 
   /* Check consensus contents. */
@@ -773,6 +773,111 @@ test_dns_impl_cache_miss(void *arg)
   return;
 }
 
+/* Given a popular cached resolve that is about to expire, we want
+ * dns_resolve_impl() to launch exactly one refresh for it while still
+ * answering from the cache, and we want the refresh to replace the cached
+ * entry once its answers are in.
+ */
+static int n_prefetch_launch_resolve = 0;
+
+static int
+dns_impl_cache_hit_prefetch_launch_resolve(cached_resolve_t *resolve)
+{
+  ++n_prefetch_launch_resolve;
+  last_launched_resolve = resolve;
+  resolve->res_status_ipv4 = RES_STATUS_INFLIGHT;
+
+  return 0;
+}
+
+static void
+test_dns_impl_cache_hit_prefetch(void *arg)
+{
+  int retval;
+  int made_pending = 0;
+  int replaced;
+  const time_t now = time(NULL);
+  tor_addr_t answer;
+
+  edge_connection_t *exitconn = create_valid_exitconn();
+  or_circuit_t *on_circ = tor_malloc_zero(sizeof(or_circuit_t));
+
+  cached_resolve_t *resolve_out = NULL;
+  cached_resolve_t *fresh = NULL;
+  cached_resolve_t query;
+
+  cached_resolve_t *cache_entry = tor_malloc_zero(sizeof(cached_resolve_t));
+  cache_entry->magic = CACHED_RESOLVE_MAGIC;
+  cache_entry->state = CACHE_STATE_CACHED;
+  cache_entry->minheap_idx = -1;
+  cache_entry->expire = now + 10;
+  cache_entry->res_status_ipv4 = RES_STATUS_DONE_OK;
+  cache_entry->result_ipv4.addr_ipv4 = 0x01020304;
+
+  (void)arg;
+
+  TO_CONN(exitconn)->address = tor_strdup("torproject.org");
+
+  strlcpy(cache_entry->address, TO_CONN(exitconn)->address,
+          sizeof(cache_entry->address));
+  strlcpy(query.address, TO_CONN(exitconn)->address, sizeof(query.address));
+
+  MOCK(router_my_exit_policy_is_reject_star,
+       dns_impl_cache_hit_cached_router_my_exit_policy_is_reject_star);
+  MOCK(set_exitconn_info_from_resolve,
+       dns_impl_cache_hit_cached_set_exitconn_info_from_resolve);
+  MOCK(launch_resolve,
+       dns_impl_cache_hit_prefetch_launch_resolve);
+
+  dns_init();
+
+  dns_insert_cache_entry(cache_entry);
+
+  /* Every hit is answered from the cache; only once the entry has been
+   * popular enough do we refresh it, and only once. */
+  for (int i = 0; i < 5; ++i) {
+    retval = dns_resolve_impl(exitconn, 1, on_circ, NULL, &made_pending,
+                              &resolve_out);
+    tt_int_op(retval,OP_EQ,0);
+    tt_int_op(made_pending,OP_EQ,0);
+    tt_assert(resolve_out == cache_entry);
+    tt_int_op(n_prefetch_launch_resolve,OP_EQ, i >= 2 ? 1 : 0);
+  }
+  tt_assert(cache_entry->refresh);
+  tt_assert(last_launched_resolve == cache_entry->refresh);
+  tt_str_op(cache_entry->refresh->address,OP_EQ,"torproject.org");
+  tt_assert(dns_get_cache_entry(&query) == cache_entry);
+
+  /* The answer goes to the refresh, which then takes the entry's place. */
+  tor_addr_from_ipv4h(&answer, 0x05060708);
+  dns_found_answer("torproject.org", DNS_IPv4_A, DNS_ERR_NONE, &answer,
+                   NULL, 60);
+  fresh = dns_get_cache_entry(&query);
+  tt_assert(fresh);
+  tt_assert(fresh != cache_entry);
+  tt_int_op(fresh->state,OP_EQ,CACHE_STATE_CACHED);
+  tt_int_op(fresh->res_status_ipv4,OP_EQ,RES_STATUS_DONE_OK);
+  tt_uint_op(fresh->result_ipv4.addr_ipv4,OP_EQ,0x05060708);
+  tt_int_op(fresh->expire,OP_GE,now + MIN_DNS_TTL);
+  tt_int_op(cache_entry->state,OP_EQ,CACHE_STATE_DONE);
+  tt_ptr_op(cache_entry->refresh,OP_EQ,NULL);
+
+  done:
+  UNMOCK(router_my_exit_policy_is_reject_star);
+  UNMOCK(set_exitconn_info_from_resolve);
+  UNMOCK(launch_resolve);
+  tor_free(on_circ);
+  tor_free(TO_CONN(exitconn)->address);
+  tor_free(exitconn);
+  /* A replaced entry is out of the cache, and this one was never in the
+   * expiry queue, so dns_free_all() won't free it for us. */
+  replaced = cache_entry->state == CACHE_STATE_DONE;
+  dns_free_all();
+  if (replaced)
+    tor_free(cache_entry);
+  return;
+}
+
 struct testcase_t dns_tests[] = {
 #ifdef HAVE_EVDNS_BASE_GET_NAMESERVER_ADDR
    { "configure_ns_fallback", test_dns_configure_ns_fallback,
@@ -790,5 +895,7 @@ struct testcase_t dns_tests[] = {
    { "impl_cache_hit_cached", test_dns_impl_cache_hit_cached,
      TT_FORK, NULL, NULL },
    { "impl_cache_miss", test_dns_impl_cache_miss, TT_FORK, NULL, NULL },
+   { "impl_cache_hit_prefetch", test_dns_impl_cache_hit_prefetch,
+     TT_FORK, NULL, NULL },
    END_OF_TESTCASES
 };
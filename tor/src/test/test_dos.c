@@ -7,6 +7,8 @@
 
 #include "core/or/or.h"
 #include "core/or/dos.h"
+#include "core/or/dos_sketch.h"
+#include "core/or/dos_sys.h"
 #include "core/or/circuitlist.h"
 #include "lib/crypt_ops/crypto_rand.h"
 #include "feature/stats/geoip_stats.h"
@@ -17,6 +19,7 @@
 #include "feature/nodelist/routerlist.h"
 
 #include "feature/nodelist/networkstatus_st.h"
+#include "core/or/dos_options_st.h"
 #include "core/or/or_connection_st.h"
 #include "feature/nodelist/routerstatus_st.h"
 
@@ -556,6 +559,139 @@ test_dos_conn_rate(void *arg)
   dos_free_all();
 }
 
+/** Test the count-min sketch used by the sketch connection backend. */
+static void
+test_dos_conn_sketch(void *arg)
+{
+  dos_conn_sketch_t *sketch = NULL;
+  tor_addr_t a, b, other;
+  const uint32_t now = 1281533250;
+  size_t alloc;
+  (void) arg;
+
+  tor_addr_parse(&a, "18.0.0.1");
+  tor_addr_parse(&b, "2001:db8::1");
+
+  /* Memory is bounded by the requested size, with a minimum width. */
+  sketch = dos_conn_sketch_new(1 << 20);
+  alloc = dos_conn_sketch_get_allocation(sketch);
+  tt_u64_op(alloc, OP_LE, (1 << 20) + 64);
+  tt_u64_op(alloc, OP_GT, (1 << 19));
+  dos_conn_sketch_free(sketch);
+  sketch = dos_conn_sketch_new(0);
+  tt_u64_op(dos_conn_sketch_get_allocation(sketch), OP_GE,
+            DOS_CONN_SKETCH_DEPTH * DOS_CONN_SKETCH_MIN_WIDTH * 16);
+  dos_conn_sketch_free(sketch);
+
+  sketch = dos_conn_sketch_new(1 << 16);
+
+  /* Concurrent counts go up and down per address. */
+  tt_uint_op(dos_conn_sketch_get_concurrent_count(sketch, &a), OP_EQ, 0);
+  tt_uint_op(dos_conn_sketch_note_connect(sketch, &a, now, 1), OP_EQ, 1);
+  tt_uint_op(dos_conn_sketch_note_connect(sketch, &a, now, 1), OP_EQ, 2);
+  tt_uint_op(dos_conn_sketch_note_connect(sketch, &b, now, 1), OP_EQ, 1);
+  tt_uint_op(dos_conn_sketch_get_concurrent_count(sketch, &a), OP_EQ, 2);
+  tt_uint_op(dos_conn_sketch_get_concurrent_count(sketch, &b), OP_EQ, 1);
+  dos_conn_sketch_note_close(sketch, &a);
+  tt_uint_op(dos_conn_sketch_get_concurrent_count(sketch, &a), OP_EQ, 1);
+  dos_conn_sketch_note_close(sketch, &b);
+  tt_uint_op(dos_conn_sketch_get_concurrent_count(sketch, &b), OP_EQ, 0);
+
+  /* The connect level drains at the given rate per second. */
+  tt_uint_op(dos_conn_sketch_note_connect(sketch, &a, now + 1, 1), OP_EQ, 2);
+  tt_uint_op(dos_conn_sketch_note_connect(sketch, &a, now + 3, 1), OP_EQ, 1);
+  tt_uint_op(dos_conn_sketch_note_connect(sketch, &a, now + 60, 10), OP_EQ,
+             1);
+
+  /* Marks expire by themselves. */
+  tt_assert(!dos_conn_sketch_is_marked(sketch, &a, now));
+  dos_conn_sketch_mark(sketch, &a, now + 10);
+  tt_assert(dos_conn_sketch_is_marked(sketch, &a, now + 10));
+  tt_assert(!dos_conn_sketch_is_marked(sketch, &a, now + 11));
+  tt_assert(!dos_conn_sketch_is_marked(sketch, &b, now));
+
+  /* Spray a lot of other addresses through the sketch: memory doesn't move
+   * and counts can only be overestimated. */
+  alloc = dos_conn_sketch_get_allocation(sketch);
+  for (uint32_t i = 0; i < 100000; ++i) {
+    tor_addr_from_ipv4h(&other, 0x0a000000 + i);
+    dos_conn_sketch_note_connect(sketch, &other, now, 1);
+  }
+  tt_u64_op(dos_conn_sketch_get_allocation(sketch), OP_EQ, alloc);
+  tt_uint_op(dos_conn_sketch_get_concurrent_count(sketch, &a), OP_GE, 4);
+  tt_assert(dos_conn_sketch_is_marked(sketch, &a, now + 10));
+
+ done:
+  dos_conn_sketch_free(sketch);
+}
+
+/** Test that the connection tracker blocks clients the same way with the
+ * sketch backend, without keeping anything in the geoip cache. */
+static void
+test_dos_conn_creation_sketch(void *arg)
+{
+  dos_options_t *dos_options = (dos_options_t *) dos_get_options();
+  (void) arg;
+
+  MOCK(get_param_conn_enabled, mock_enable_dos_protection);
+
+  or_connection_t or_conn;
+  memset(&or_conn, 0, sizeof(or_conn));
+  time_t now = 1281533250; /* 2010-08-11 13:27:30 UTC */
+  tt_int_op(AF_INET,OP_EQ, tor_addr_parse(&TO_CONN(&or_conn)->addr,
+                                          "18.0.0.1"));
+  tor_addr_t *addr = &TO_CONN(&or_conn)->addr;
+  update_approx_time(now);
+
+  dos_options->DoSConnectionSketchSize = 1 << 16;
+  dos_init();
+  uint32_t max_concurrent_conns = get_param_conn_max_concurrent_count(NULL);
+  uint32_t burst_conn = get_param_conn_connect_burst(NULL);
+  /* Without circuit creation defense, the geoip cache isn't needed. */
+  tt_assert(!dos_uses_geoip_client_map());
+
+  /* Concurrent connections. */
+  for (unsigned int i = 0; i < max_concurrent_conns; i++) {
+    update_approx_time(++now);
+    dos_new_client_conn(&or_conn, NULL);
+  }
+  tt_assert(or_conn.tracked_in_dos_sketch);
+  tt_int_op(DOS_CONN_DEFENSE_NONE, OP_EQ,
+            dos_conn_addr_get_defense_type(addr));
+  dos_new_client_conn(&or_conn, NULL);
+  tt_int_op(DOS_CONN_DEFENSE_CLOSE, OP_EQ,
+            dos_conn_addr_get_defense_type(addr));
+  dos_close_client_conn(&or_conn);
+  tt_int_op(DOS_CONN_DEFENSE_NONE, OP_EQ,
+            dos_conn_addr_get_defense_type(addr));
+
+  /* Connect rate, from another address. */
+  tt_int_op(AF_INET,OP_EQ, tor_addr_parse(addr, "18.0.0.2"));
+  for (unsigned int i = 0; i < burst_conn - 1; i++) {
+    dos_new_client_conn(&or_conn, NULL);
+  }
+  tt_int_op(DOS_CONN_DEFENSE_NONE, OP_EQ,
+            dos_conn_addr_get_defense_type(addr));
+  dos_new_client_conn(&or_conn, NULL);
+  tt_int_op(DOS_CONN_DEFENSE_CLOSE, OP_EQ,
+            dos_conn_addr_get_defense_type(addr));
+  /* Close them all so only the marking blocks the address. */
+  for (unsigned int i = 0; i < burst_conn; i++) {
+    dos_close_client_conn(&or_conn);
+  }
+  update_approx_time(now + (12 * 60 * 60));
+  tt_int_op(DOS_CONN_DEFENSE_CLOSE, OP_EQ,
+            dos_conn_addr_get_defense_type(addr));
+  update_approx_time(now + (37 * 60 * 60));
+  tt_int_op(DOS_CONN_DEFENSE_NONE, OP_EQ,
+            dos_conn_addr_get_defense_type(addr));
+
+ done:
+  dos_options->DoSConnectionSketchSize = 0;
+  dos_free_all();
+  UNMOCK(get_param_conn_enabled);
+}
+
 struct testcase_t dos_tests[] = {
   { "conn_creation", test_dos_conn_creation, TT_FORK, NULL, NULL },
   { "circuit_creation", test_dos_circuit_creation, TT_FORK, NULL, NULL },
@@ -563,5 +699,8 @@ struct testcase_t dos_tests[] = {
   { "known_relay" , test_known_relay, TT_FORK,
     NULL, NULL },
   { "conn_rate", test_dos_conn_rate, TT_FORK, NULL, NULL },
+  { "conn_sketch", test_dos_conn_sketch, TT_FORK, NULL, NULL },
+  { "conn_creation_sketch", test_dos_conn_creation_sketch, TT_FORK,
+    NULL, NULL },
   END_OF_TESTCASES
 };
@@ -264,6 +264,101 @@ test_md_cache(void *data)
   tor_free(encoded_family);
 }
 
+/* Add enough microdescriptors that writing them out takes more than one
+ * write, and make sure every one of them ends up at the offset we think. */
+static void
+test_md_cache_many(void *data)
+{
+  or_options_t *options = NULL;
+  microdesc_cache_t *mc = NULL;
+  smartlist_t *chunks = smartlist_new(), *added = NULL;
+  smartlist_t *all = smartlist_new(), *digests = smartlist_new();
+  char *mds = NULL, *fn = NULL, *s = NULL;
+  const char *split;
+  const time_t now = time(NULL);
+  const int n_mds = 400;
+  int i;
+  (void)data;
+
+  options = get_options_mutable();
+  tor_free(options->CacheDirectory);
+  options->CacheDirectory = tor_strdup(get_fname("md_many_test"));
+#ifdef _WIN32
+  tt_int_op(0, OP_EQ, mkdir(options->CacheDirectory));
+#else
+  tt_int_op(0, OP_EQ, mkdir(options->CacheDirectory, 0700));
+#endif
+
+  /* Give each one a different family so that they all differ. */
+  for (i = 0; i < n_mds; ++i) {
+    smartlist_add_asprintf(chunks, "%sfamily node%d\n", test_md1, i);
+  }
+  mds = smartlist_join_strings(chunks, "", 0, NULL);
+  tt_int_op(strlen(mds), OP_GT, 2*64*1024);
+
+  mc = get_microdesc_cache();
+  /* Add them in two batches, so that the second one appends to a journal
+   * that isn't empty. */
+  split = strstr(mds + strlen(mds) / 2, "\nonion-key");
+  tt_assert(split);
+  ++split;
+  added = microdescs_add_to_cache(mc, mds, split,
+                                  SAVED_NOWHERE, 0, now, NULL);
+  smartlist_add_all(all, added);
+  smartlist_free(added);
+  added = microdescs_add_to_cache(mc, split, NULL,
+                                  SAVED_NOWHERE, 0, now, NULL);
+  smartlist_add_all(all, added);
+  tt_int_op(smartlist_len(all), OP_EQ, n_mds);
+
+  tor_asprintf(&fn, "%s"PATH_SEPARATOR"cached-microdescs.new",
+               options->CacheDirectory);
+  s = read_file_to_str(fn, RFTS_BIN, NULL);
+  tt_assert(s);
+  SMARTLIST_FOREACH_BEGIN(all, microdesc_t *, md) {
+    tt_int_op(md->saved_location, OP_EQ, SAVED_IN_JOURNAL);
+    tt_mem_op(md->body, OP_EQ, s + md->off, md->bodylen);
+  } SMARTLIST_FOREACH_END(md);
+  tor_free(s);
+  tor_free(fn);
+
+  tt_int_op(microdesc_cache_rebuild(mc, 1), OP_EQ, 0);
+  tor_asprintf(&fn, "%s"PATH_SEPARATOR"cached-microdescs",
+               options->CacheDirectory);
+  s = read_file_to_str(fn, RFTS_BIN, NULL);
+  tt_assert(s);
+  SMARTLIST_FOREACH_BEGIN(all, microdesc_t *, md) {
+    tt_int_op(md->saved_location, OP_EQ, SAVED_IN_CACHE);
+    tt_mem_op(md->body, OP_EQ, s + md->off, md->bodylen);
+    tt_int_op(md->last_listed, OP_EQ, now);
+    smartlist_add(digests, tor_memdup(md->digest, DIGEST256_LEN));
+  } SMARTLIST_FOREACH_END(md);
+  smartlist_clear(all);
+
+  /* Reloading the cache finds every one of them. */
+  tt_int_op(microdesc_cache_reload(mc), OP_EQ, 0);
+  SMARTLIST_FOREACH_BEGIN(digests, const char *, d) {
+    microdesc_t *md = microdesc_cache_lookup_by_digest256(mc, d);
+    tt_assert(md);
+    tt_int_op(md->saved_location, OP_EQ, SAVED_IN_CACHE);
+    tt_int_op(md->last_listed, OP_EQ, now);
+  } SMARTLIST_FOREACH_END(d);
+
+ done:
+  if (options)
+    tor_free(options->CacheDirectory);
+  microdesc_free_all();
+  SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
+  smartlist_free(chunks);
+  smartlist_free(added);
+  smartlist_free(all);
+  SMARTLIST_FOREACH(digests, char *, d, tor_free(d));
+  smartlist_free(digests);
+  tor_free(mds);
+  tor_free(fn);
+  tor_free(s);
+}
+
 static const char truncated_md[] =
   "@last-listed 2013-08-08 19:02:59\n"
   "onion-key\n"
@@ -922,6 +1017,7 @@ test_md_corrupt_desc(void *arg)
 
 struct testcase_t microdesc_tests[] = {
   { "cache", test_md_cache, TT_FORK, NULL, NULL },
+  { "cache_many", test_md_cache_many, TT_FORK, NULL, NULL },
   { "broken_cache", test_md_cache_broken, TT_FORK, NULL, NULL },
   { "generate", test_md_generate, 0, NULL, NULL },
   { "parse", test_md_parse, 0, NULL, NULL },
@@ -12,8 +12,12 @@
 #include "core/or/or.h"
 #include "lib/crypt_ops/crypto_rand.h"
 #include "lib/crypt_ops/crypto_format.h"
+#include "lib/encoding/confline.h"
+#include "core/or/policies.h"
 #include "feature/nodelist/describe.h"
+#include "feature/nodelist/microdesc.h"
 #include "feature/nodelist/networkstatus.h"
+#include "feature/nodelist/node_select.h"
 #include "feature/nodelist/nodefamily.h"
 #include "feature/nodelist/nodelist.h"
 #include "feature/nodelist/torcert.h"
@@ -241,6 +245,271 @@ test_nodelist_ed_id(void *arg)
 #undef N_NODES
 }
 
+static void
+test_nodelist_exit_port_index(void *arg)
+{
+#define N_NODES 4
+  routerstatus_t *rs[N_NODES];
+  microdesc_t *md[N_NODES];
+  node_t *n[N_NODES];
+  routerinfo_t *ri = NULL;
+  networkstatus_t *ns;
+  config_line_t line;
+  int i;
+  (void)arg;
+
+  ns = tor_malloc_zero(sizeof(networkstatus_t));
+  ns->flavor = FLAV_MICRODESC;
+  ns->routerstatus_list = smartlist_new();
+  dummy_ns = ns;
+  MOCK(networkstatus_get_latest_consensus,
+       mock_networkstatus_get_latest_consensus);
+  MOCK(networkstatus_get_latest_consensus_by_flavor,
+       mock_networkstatus_get_latest_consensus_by_flavor);
+
+  for (i = 0; i < N_NODES; ++i) {
+    rs[i] = tor_malloc_zero(sizeof(*rs[i]));
+    md[i] = tor_malloc_zero(sizeof(*md[i]));
+    crypto_rand(md[i]->digest, sizeof(md[i]->digest));
+    crypto_rand(rs[i]->identity_digest, sizeof(rs[i]->identity_digest));
+    memcpy(rs[i]->descriptor_digest, md[i]->digest, DIGEST256_LEN);
+    if (i < 3)
+      smartlist_add(ns->routerstatus_list, rs[i]);
+  }
+  md[0]->exit_policy = parse_short_policy("accept 80,443");
+  md[1]->exit_policy = parse_short_policy("accept 22");
+  md[2]->exit_policy = parse_short_policy("reject 1-65535");
+
+  nodelist_set_consensus(ns);
+  for (i = 0; i < 3; ++i) {
+    n[i] = node_get_mutable_by_id(rs[i]->identity_digest);
+    tt_assert(n[i]);
+    /* Without a microdescriptor, we know of no exit policy at all. */
+    tt_assert(!node_exit_policy_allows_port(n[i], 80));
+  }
+
+  /* Microdescriptors arriving after we built an index update it. */
+  tt_ptr_op(nodelist_add_microdesc(md[0]), OP_EQ, n[0]);
+  tt_assert(node_exit_policy_allows_port(n[0], 80));
+  tt_assert(node_exit_policy_allows_port(n[0], 443));
+  tt_assert(!node_exit_policy_allows_port(n[0], 22));
+  tt_assert(!node_exit_policy_allows_port(n[1], 22));
+  tt_ptr_op(nodelist_add_microdesc(md[1]), OP_EQ, n[1]);
+  tt_ptr_op(nodelist_add_microdesc(md[2]), OP_EQ, n[2]);
+  tt_assert(node_exit_policy_allows_port(n[1], 22));
+  tt_assert(!node_exit_policy_allows_port(n[1], 80));
+  tt_assert(!node_exit_policy_allows_port(n[2], 22));
+  tt_assert(!node_exit_policy_allows_port(n[2], 80));
+
+  /* So does finding out that a node won't exit at all. */
+  policies_set_node_exitpolicy_to_reject_all(n[0]);
+  tt_assert(!node_exit_policy_allows_port(n[0], 80));
+  tt_assert(node_exit_policy_allows_port(n[1], 22));
+
+  /* A node that's only known by its descriptor. */
+  ri = tor_malloc_zero(sizeof(routerinfo_t));
+  memcpy(ri->cache_info.identity_digest, rs[3]->identity_digest, DIGEST_LEN);
+  memset(&line, 0, sizeof(line));
+  line.key = (char *) "ExitPolicy";
+  line.value = (char *) "accept *:22,reject *:*";
+  tt_int_op(0, OP_EQ, policies_parse_exit_policy(&line, &ri->exit_policy,
+                                                 EXIT_POLICY_IPV6_ENABLED,
+                                                 NULL));
+  n[3] = nodelist_set_routerinfo(ri, NULL);
+  tt_int_op(n[3]->nodelist_idx, OP_EQ, 3);
+  tt_assert(node_exit_policy_allows_port(n[3], 22));
+  tt_assert(!node_exit_policy_allows_port(n[3], 443));
+
+  /* Dropping a node moves another one into its slot; the indices follow. */
+  nodelist_remove_routerinfo(ri);
+  tt_int_op(3, OP_EQ, smartlist_len(nodelist_get_list()));
+  tt_assert(!node_exit_policy_allows_port(n[0], 80));
+  tt_assert(node_exit_policy_allows_port(n[1], 22));
+  tt_assert(!node_exit_policy_allows_port(n[2], 22));
+
+ done:
+  for (i = 0; i < N_NODES; ++i) {
+    tor_free(rs[i]);
+    short_policy_free(md[i]->exit_policy);
+    tor_free(md[i]);
+  }
+  if (ri)
+    addr_policy_list_free(ri->exit_policy);
+  tor_free(ri);
+  smartlist_clear(ns->routerstatus_list);
+  networkstatus_vote_free(ns);
+  UNMOCK(networkstatus_get_latest_consensus);
+  UNMOCK(networkstatus_get_latest_consensus_by_flavor);
+#undef N_NODES
+}
+
+static void
+test_nodelist_hsdir_index_cache(void *arg)
+{
+  routerstatus_t *rs;
+  microdesc_t *md;
+  node_t *node;
+  networkstatus_t *ns;
+  smartlist_t *mds = smartlist_new(), *added = NULL;
+  uint8_t fetch[DIGEST256_LEN], garbage[DIGEST256_LEN];
+  ed25519_public_key_t ed_id;
+  const time_t now = 1664582400; /* 2022-10-01 00:00 */
+  (void)arg;
+
+  update_approx_time(now);
+  ns = tor_malloc_zero(sizeof(networkstatus_t));
+  ns->flavor = FLAV_MICRODESC;
+  ns->valid_after = now - 600;
+  ns->fresh_until = ns->valid_after + 3600;
+  ns->valid_until = ns->valid_after + 3*3600;
+  ns->routerstatus_list = smartlist_new();
+  dummy_ns = ns;
+  MOCK(networkstatus_get_latest_consensus,
+       mock_networkstatus_get_latest_consensus);
+  MOCK(networkstatus_get_latest_consensus_by_flavor,
+       mock_networkstatus_get_latest_consensus_by_flavor);
+
+  rs = tor_malloc_zero(sizeof(*rs));
+  md = tor_malloc_zero(sizeof(*md));
+  crypto_rand(md->digest, sizeof(md->digest));
+  md->ed25519_identity_pkey = tor_malloc(sizeof(ed25519_public_key_t));
+  crypto_rand((char*)md->ed25519_identity_pkey, sizeof(ed25519_public_key_t));
+  memcpy(&ed_id, md->ed25519_identity_pkey, sizeof(ed_id));
+  crypto_rand(rs->identity_digest, sizeof(rs->identity_digest));
+  memcpy(rs->descriptor_digest, md->digest, DIGEST256_LEN);
+  rs->pv.supports_v3_hsdir = 1;
+  smartlist_add(ns->routerstatus_list, rs);
+  memset(garbage, 0x99, sizeof(garbage));
+
+  /* Without an ed25519 identity, there's no index to compute. */
+  nodelist_set_consensus(ns);
+  node = node_get_mutable_by_id(rs->identity_digest);
+  tt_assert(node);
+  tt_uint_op(node->hsdir_index_gen, OP_EQ, 0);
+
+  /* Adding the microdescriptor to the cache also adds it to the node. */
+  smartlist_add(mds, md);
+  added = microdescs_add_list_to_cache(get_microdesc_cache(), mds,
+                                       SAVED_NOWHERE, 1);
+  tt_int_op(smartlist_len(added), OP_EQ, 1);
+  tt_ptr_op(node->md, OP_EQ, md);
+  nodelist_set_consensus(ns);
+  tt_uint_op(node->hsdir_index_gen, OP_NE, 0);
+  memcpy(fetch, node->hsdir_index.fetch, sizeof(fetch));
+
+  /* The same inputs next time: we don't compute the index again. */
+  memcpy(node->hsdir_index.fetch, garbage, sizeof(garbage));
+  nodelist_set_consensus(ns);
+  tt_mem_op(node->hsdir_index.fetch, OP_EQ, garbage, sizeof(garbage));
+
+  /* But we do if the node's identity changes... */
+  crypto_rand((char*)md->ed25519_identity_pkey, sizeof(ed25519_public_key_t));
+  nodelist_set_consensus(ns);
+  tt_mem_op(node->hsdir_index.fetch, OP_NE, garbage, sizeof(garbage));
+  tt_mem_op(node->hsdir_index.fetch, OP_NE, fetch, sizeof(fetch));
+  memcpy(md->ed25519_identity_pkey, &ed_id, sizeof(ed_id));
+  nodelist_set_consensus(ns);
+  tt_mem_op(node->hsdir_index.fetch, OP_EQ, fetch, sizeof(fetch));
+
+  /* ... or if the time period does. */
+  memcpy(node->hsdir_index.fetch, garbage, sizeof(garbage));
+  update_approx_time(now + 86400);
+  ns->valid_after += 86400;
+  ns->fresh_until += 86400;
+  ns->valid_until += 86400;
+  nodelist_set_consensus(ns);
+  tt_mem_op(node->hsdir_index.fetch, OP_NE, garbage, sizeof(garbage));
+  tt_mem_op(node->hsdir_index.fetch, OP_NE, fetch, sizeof(fetch));
+
+ done:
+  nodelist_free_all();
+  microdesc_free_all();
+  smartlist_free(mds);
+  smartlist_free(added);
+  tor_free(rs);
+  smartlist_clear(ns->routerstatus_list);
+  networkstatus_vote_free(ns);
+  UNMOCK(networkstatus_get_latest_consensus);
+  UNMOCK(networkstatus_get_latest_consensus_by_flavor);
+}
+
+static void
+test_nodelist_choose_random_node(void *arg)
+{
+  routerstatus_t *rs[4];
+  const node_t *nodes[4], *choice;
+  networkstatus_t *ns;
+  smartlist_t *excluded = smartlist_new();
+  int counts[4];
+  int i;
+  const uint32_t bw[4] = { 1000, 10, 100000, 0 };
+  (void)arg;
+
+  ns = tor_malloc_zero(sizeof(networkstatus_t));
+  ns->type = NS_TYPE_CONSENSUS;
+  ns->flavor = FLAV_MICRODESC;
+  ns->routerstatus_list = smartlist_new();
+  dummy_ns = ns;
+  MOCK(networkstatus_get_latest_consensus,
+       mock_networkstatus_get_latest_consensus);
+  MOCK(networkstatus_get_latest_consensus_by_flavor,
+       mock_networkstatus_get_latest_consensus_by_flavor);
+
+  /* Node 2 has nearly all the bandwidth, but isn't running.  Node 3 has
+   * none. */
+  for (i = 0; i < 4; ++i) {
+    rs[i] = tor_malloc_zero(sizeof(routerstatus_t));
+    crypto_rand(rs[i]->identity_digest, sizeof(rs[i]->identity_digest));
+    rs[i]->is_flagged_running = (i != 2);
+    rs[i]->is_valid = 1;
+    rs[i]->has_bandwidth = 1;
+    rs[i]->bandwidth_kb = bw[i];
+    smartlist_add(ns->routerstatus_list, rs[i]);
+  }
+  nodelist_set_consensus(ns);
+  for (i = 0; i < 4; ++i) {
+    nodes[i] = node_get_by_id(rs[i]->identity_digest);
+    tt_assert(nodes[i]);
+  }
+
+  memset(counts, 0, sizeof(counts));
+  for (i = 0; i < 1000; ++i) {
+    choice = router_choose_random_node(NULL, NULL, 0);
+    tt_assert(choice);
+    counts[smartlist_pos(nodelist_get_list(), choice)]++;
+  }
+  tt_int_op(counts[0], OP_GT, 900);
+  tt_int_op(counts[2], OP_EQ, 0);
+  tt_int_op(counts[3], OP_EQ, 0);
+
+  /* Excluded nodes are never chosen. */
+  smartlist_add(excluded, (void *)nodes[0]);
+  for (i = 0; i < 100; ++i) {
+    tt_ptr_op(router_choose_random_node(excluded, NULL, 0), OP_EQ, nodes[1]);
+  }
+
+  /* A new consensus changes the weights. */
+  rs[1]->bandwidth_kb = 0;
+  rs[3]->bandwidth_kb = 1000;
+  nodelist_set_consensus(ns);
+  for (i = 0; i < 100; ++i) {
+    tt_ptr_op(router_choose_random_node(excluded, NULL, 0), OP_EQ, nodes[3]);
+  }
+
+  /* If every node we may choose has no weight, we still choose one. */
+  smartlist_add(excluded, (void *)nodes[3]);
+  for (i = 0; i < 10; ++i) {
+    tt_ptr_op(router_choose_random_node(excluded, NULL, 0), OP_EQ, nodes[1]);
+  }
+
+ done:
+  nodelist_free_all();
+  smartlist_free(excluded);
+  networkstatus_vote_free(ns);
+  UNMOCK(networkstatus_get_latest_consensus);
+  UNMOCK(networkstatus_get_latest_consensus_by_flavor);
+}
+
 static void
 test_nodelist_nodefamily(void *arg)
 {
@@ -1426,6 +1695,9 @@ struct testcase_t nodelist_tests[] = {
   NODE(node_get_verbose_nickname_not_named, TT_FORK),
   NODE(node_is_dir, TT_FORK),
   NODE(ed_id, TT_FORK),
+  NODE(exit_port_index, TT_FORK),
+  NODE(hsdir_index_cache, TT_FORK),
+  NODE(choose_random_node, TT_FORK),
   NODE(nodefamily, TT_FORK),
   NODE(nodefamily_parse_err, TT_FORK),
   NODE(nodefamily_lookup, TT_FORK),
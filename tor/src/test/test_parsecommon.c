@@ -253,6 +253,45 @@ test_parsecommon_get_next_token_success(void *arg)
   return;
 }
 
+static void
+test_parsecommon_get_next_token_whitespace(void *arg)
+{
+  memarea_t *area = memarea_new();
+  const char *str = "\n  # a comment\n"
+                    "opt  \tk  a\tb\r c#d   # trailing comment\n"
+                    "kx 1\n";
+  const char *end = str + strlen(str);
+  const char **s = &str;
+  token_rule_t table[] = {
+    T01("k", K_UPTIME, ARGS, NO_OBJ),
+    T01("kx", K_PLATFORM, ARGS, NO_OBJ),
+    END_OF_TABLE
+  };
+  directory_token_t *token = NULL;
+  (void)arg;
+
+  /* Comments and blank lines are skipped, "opt" is ignored, and arguments
+   * are split on spaces, tabs, CRs and comment starts. */
+  token = get_next_token(area, s, end, table);
+  tt_int_op(token->tp, OP_EQ, K_UPTIME);
+  tt_int_op(token->n_args, OP_EQ, 4);
+  tt_str_op(token->args[0], OP_EQ, "a");
+  tt_str_op(token->args[1], OP_EQ, "b");
+  tt_str_op(token->args[2], OP_EQ, "c");
+  tt_str_op(token->args[3], OP_EQ, "d");
+
+  /* A keyword that is a prefix of another one doesn't match it. */
+  token = get_next_token(area, s, end, table);
+  tt_int_op(token->tp, OP_EQ, K_PLATFORM);
+  tt_int_op(token->n_args, OP_EQ, 1);
+  tt_str_op(token->args[0], OP_EQ, "1");
+  tt_ptr_op(*s, OP_EQ, end);
+
+ done:
+  memarea_drop_all(area);
+  return;
+}
+
 static void
 test_parsecommon_get_next_token_concat_args(void *arg)
 {
@@ -578,6 +617,7 @@ struct testcase_t parsecommon_tests[] = {
   PARSECOMMON_TEST(tokenize_string_at_end),
   PARSECOMMON_TEST(tokenize_string_no_annotations),
   PARSECOMMON_TEST(get_next_token_success),
+  PARSECOMMON_TEST(get_next_token_whitespace),
   PARSECOMMON_TEST(get_next_token_concat_args),
   PARSECOMMON_TEST(get_next_token_parse_keys),
   PARSECOMMON_TEST(get_next_token_object),
@@ -13,6 +13,7 @@
 #include "feature/hs/hs_common.h"
 #include "feature/hs/hs_descriptor.h"
 #include "feature/relay/router.h"
+#include "lib/crypt_ops/crypto_rand.h"
 #include "lib/encoding/confline.h"
 #include "test/test.h"
 #include "test/log_test_helpers.h"
@@ -2662,6 +2663,179 @@ test_policies_fascist_firewall_choose_address(void *arg)
   UNMOCK(get_options);
 }
 
+/** Helper: check that the compiled form of <b>policy</b> agrees with the
+ * linear walk on <b>addr</b> for a handful of ports. */
+static void
+test_policy_matcher_agrees(const smartlist_t *policy,
+                           const addr_policy_matcher_t *m,
+                           const tor_addr_t *addr)
+{
+  static const uint16_t ports[] = {
+    1, 20, 22, 25, 80, 85, 88, 89, 443, 1000, 1001, 6667, 65535
+  };
+  char buf[TOR_ADDR_BUF_LEN];
+
+  for (unsigned i = 0; i < ARRAY_LENGTH(ports) + 4; ++i) {
+    uint16_t port = i < ARRAY_LENGTH(ports) ? ports[i] :
+      (uint16_t) (1 + crypto_rand_int(65535));
+    addr_policy_result_t expected =
+      compare_tor_addr_to_addr_policy(addr, port, policy);
+    addr_policy_result_t got;
+    tt_int_op(compare_tor_addr_to_compiled_policy(addr, port, policy, m),
+              OP_EQ, expected);
+    /* The null address means "unknown"; only the wrapper handles that. */
+    if (tor_addr_is_null(addr))
+      continue;
+    got = addr_policy_matcher_lookup(m, addr, port);
+    if (expected != got) {
+      TT_DIE(("Compiled policy disagrees on %s:%d: %d vs %d",
+              tor_addr_to_str(buf, addr, sizeof(buf), 1), port,
+              (int)got, (int)expected));
+    }
+  }
+ done:
+  ;
+}
+
+static void
+test_policies_compiled_matcher(void *arg)
+{
+  static const char *policies[] = {
+    "accept *:80-88,reject *:85,accept *:20-30,reject *:*",
+    "reject 18.0.0.0/8:1-1000,accept 18.244.0.0/16:*,accept 18.244.1.5:22,"
+    "reject 1.2.3.4:*,reject6 [2001:db8::]/32:443,"
+    "accept6 [2001:db8::1]:443,accept *6:443,reject *4:443,"
+    "accept 0.0.0.0/1:6000-7000,reject *:*",
+    "reject 127.0.0.1:*,accept 127.0.0.0/8:80,accept [::1]:22,reject *:25",
+  };
+  static const char *addrs[] = {
+    "1.2.3.4", "18.0.0.1", "18.244.1.5", "18.244.9.9", "127.0.0.1",
+    "127.1.2.3", "192.168.1.1", "10.0.0.1", "255.255.255.255", "0.0.0.0",
+    "[2001:db8::1]", "[2001:db8::2]", "[::1]", "[fe80::1]", "[::]",
+  };
+  smartlist_t *policy = NULL;
+  addr_policy_matcher_t *m = NULL;
+  short_policy_t *sp = NULL;
+  config_line_t line;
+  tor_addr_t addr;
+  (void)arg;
+
+  for (unsigned i = 0; i <= ARRAY_LENGTH(policies); ++i) {
+    memset(&line, 0, sizeof(line));
+    line.key = (char *) "ExitPolicy";
+    if (i < ARRAY_LENGTH(policies)) {
+      line.value = (char *) policies[i];
+      tt_int_op(0, OP_EQ,
+                policies_parse_exit_policy(&line, &policy,
+                                           EXIT_POLICY_IPV6_ENABLED, NULL));
+    } else {
+      /* The full reduced exit policy, with private addresses rejected. */
+      tt_int_op(0, OP_EQ,
+                policies_parse_exit_policy(NULL, &policy,
+                                           EXIT_POLICY_IPV6_ENABLED |
+                                           EXIT_POLICY_REJECT_PRIVATE |
+                                           EXIT_POLICY_ADD_REDUCED, NULL));
+    }
+    m = addr_policy_matcher_new(policy);
+
+    for (unsigned j = 0; j < ARRAY_LENGTH(addrs); ++j) {
+      tt_int_op(tor_addr_parse(&addr, addrs[j]), OP_GE, 0);
+      test_policy_matcher_agrees(policy, m, &addr);
+    }
+    for (int j = 0; j < 64; ++j) {
+      uint8_t bytes[16];
+      crypto_rand((char *) bytes, sizeof(bytes));
+      if (j & 1)
+        tor_addr_from_ipv4n(&addr, get_uint32(bytes));
+      else
+        tor_addr_from_ipv6_bytes(&addr, bytes);
+      test_policy_matcher_agrees(policy, m, &addr);
+    }
+
+    addr_policy_matcher_free(m);
+    addr_policy_list_free(policy);
+  }
+
+  /* An empty policy accepts everything. */
+  m = addr_policy_matcher_new(NULL);
+  tor_addr_parse(&addr, "1.2.3.4");
+  tt_int_op(addr_policy_matcher_lookup(m, &addr, 80), OP_EQ,
+            ADDR_POLICY_ACCEPTED);
+  addr_policy_matcher_free(m);
+
+  /* Short policies are binary-searched only when they are sorted. */
+  sp = parse_short_policy("accept 22,80-88,443,6000-7000");
+  tt_assert(sp);
+  tt_uint_op(sp->entries_sorted, OP_EQ, 1);
+  tt_int_op(compare_tor_addr_to_short_policy(NULL, 85, sp), OP_EQ,
+            ADDR_POLICY_PROBABLY_ACCEPTED);
+  tt_int_op(compare_tor_addr_to_short_policy(NULL, 6000, sp), OP_EQ,
+            ADDR_POLICY_PROBABLY_ACCEPTED);
+  tt_int_op(compare_tor_addr_to_short_policy(NULL, 23, sp), OP_EQ,
+            ADDR_POLICY_REJECTED);
+  tt_int_op(compare_tor_addr_to_short_policy(NULL, 65535, sp), OP_EQ,
+            ADDR_POLICY_REJECTED);
+  short_policy_free(sp);
+  sp = parse_short_policy("reject 443,80-88,85");
+  tt_assert(sp);
+  tt_uint_op(sp->entries_sorted, OP_EQ, 0);
+  tt_int_op(compare_tor_addr_to_short_policy(NULL, 85, sp), OP_EQ,
+            ADDR_POLICY_REJECTED);
+  tt_int_op(compare_tor_addr_to_short_policy(NULL, 444, sp), OP_EQ,
+            ADDR_POLICY_PROBABLY_ACCEPTED);
+
+ done:
+  addr_policy_matcher_free(m);
+  addr_policy_list_free(policy);
+  short_policy_free(sp);
+}
+
+static void
+test_policies_node_lazy_matcher(void *arg)
+{
+  routerinfo_t *ri = NULL;
+  node_t node;
+  config_line_t line;
+  tor_addr_t addr;
+  (void)arg;
+
+  memset(&node, 0, sizeof(node));
+  memset(&line, 0, sizeof(line));
+  ri = tor_malloc_zero(sizeof(routerinfo_t));
+  line.key = (char *) "ExitPolicy";
+  line.value = (char *) "reject 18.0.0.0/8:*,accept *:80,reject *:*";
+  tt_int_op(0, OP_EQ,
+            policies_parse_exit_policy(&line, &ri->exit_policy,
+                                       EXIT_POLICY_IPV6_ENABLED, NULL));
+  node.ri = ri;
+
+  /* Lookups that can't use the matcher don't build it. */
+  tt_int_op(compare_tor_addr_to_node_policy(NULL, 80, &node), OP_EQ,
+            ADDR_POLICY_PROBABLY_ACCEPTED);
+  tor_addr_make_null(&addr, AF_INET);
+  tt_int_op(compare_tor_addr_to_node_policy(&addr, 80, &node), OP_EQ,
+            ADDR_POLICY_PROBABLY_ACCEPTED);
+  tt_ptr_op(ri->exit_policy_matcher, OP_EQ, NULL);
+
+  /* The first real lookup compiles the policy, and later ones reuse it. */
+  tor_addr_parse(&addr, "18.1.2.3");
+  tt_int_op(compare_tor_addr_to_node_policy(&addr, 80, &node), OP_EQ,
+            ADDR_POLICY_REJECTED);
+  tt_assert(ri->exit_policy_matcher);
+  tor_addr_parse(&addr, "1.2.3.4");
+  tt_int_op(compare_tor_addr_to_node_policy(&addr, 80, &node), OP_EQ,
+            ADDR_POLICY_ACCEPTED);
+  tt_int_op(compare_tor_addr_to_node_policy(&addr, 443, &node), OP_EQ,
+            ADDR_POLICY_REJECTED);
+
+ done:
+  if (ri) {
+    addr_policy_list_free(ri->exit_policy);
+    addr_policy_matcher_free(ri->exit_policy_matcher);
+    tor_free(ri);
+  }
+}
+
 #undef TEST_IPV4_ADDR_STR
 #undef TEST_IPV6_ADDR_STR
 #undef TEST_IPV4_OR_PORT
@@ -2676,6 +2850,8 @@ test_policies_fascist_firewall_choose_address(void *arg)
 struct testcase_t policy_tests[] = {
   { "router_dump_exit_policy_to_string", test_dump_exit_policy_to_string, 0,
     NULL, NULL },
+  { "compiled_matcher", test_policies_compiled_matcher, 0, NULL, NULL },
+  { "node_lazy_matcher", test_policies_node_lazy_matcher, 0, NULL, NULL },
   { "general", test_policies_general, 0, NULL, NULL },
   { "getinfo_helper_policies", test_policies_getinfo_helper_policies, 0, NULL,
     NULL },
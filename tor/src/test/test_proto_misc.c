@@ -15,6 +15,7 @@
 #include "core/proto/proto_control0.h"
 #include "core/proto/proto_ext_or.h"
 
+#include "core/or/cell_st.h"
 #include "core/or/var_cell_st.h"
 
 static void
@@ -104,6 +105,48 @@ test_proto_var_cell(void *arg)
   tor_free(mem_op_hex_tmp);
 }
 
+static void
+test_proto_cell(void *arg)
+{
+  (void)arg;
+  char tmp[CELL_PAYLOAD_SIZE];
+  buf_t *buf = NULL;
+  cell_t cell;
+
+  buf = buf_new();
+  memset(tmp, 0xf0, sizeof(tmp));
+  memset(&cell, 0, sizeof(cell));
+
+  /* An incomplete cell makes us say "no cell yet" and leaves the buffer. */
+  tt_int_op(0, OP_EQ, fetch_cell_from_buf(buf, &cell, 1));
+  buf_add(buf, "\x01\x02\x03\x04\x03", 5);
+  buf_add(buf, tmp, CELL_PAYLOAD_SIZE - 1);
+  tt_int_op(0, OP_EQ, fetch_cell_from_buf(buf, &cell, 1));
+  tt_int_op(buf_datalen(buf), OP_EQ, 5 + CELL_PAYLOAD_SIZE - 1);
+
+  /* Complete it, and leave a byte of the next cell on the end. */
+  buf_add(buf, "\x55\x66", 2);
+  tt_int_op(1, OP_EQ, fetch_cell_from_buf(buf, &cell, 1));
+  tt_uint_op(cell.circ_id, OP_EQ, 0x01020304);
+  tt_int_op(cell.command, OP_EQ, CELL_RELAY);
+  tt_mem_op(cell.payload, OP_EQ, tmp, CELL_PAYLOAD_SIZE - 1);
+  tt_int_op(cell.payload[CELL_PAYLOAD_SIZE - 1], OP_EQ, 0x55);
+  tt_int_op(buf_datalen(buf), OP_EQ, 1);
+  buf_clear(buf);
+
+  /* With narrow circuit IDs the header is two bytes shorter. */
+  buf_add(buf, "\x23\x45\x04", 3);
+  buf_add(buf, tmp, CELL_PAYLOAD_SIZE);
+  tt_int_op(1, OP_EQ, fetch_cell_from_buf(buf, &cell, 0));
+  tt_uint_op(cell.circ_id, OP_EQ, 0x2345);
+  tt_int_op(cell.command, OP_EQ, CELL_DESTROY);
+  tt_mem_op(cell.payload, OP_EQ, tmp, CELL_PAYLOAD_SIZE);
+  tt_int_op(buf_datalen(buf), OP_EQ, 0);
+
+ done:
+  buf_free(buf);
+}
+
 static void
 test_proto_control0(void *arg)
 {
@@ -256,6 +299,7 @@ test_proto_line(void *arg)
 
 struct testcase_t proto_misc_tests[] = {
   { "var_cell", test_proto_var_cell, 0, NULL, NULL },
+  { "cell", test_proto_cell, 0, NULL, NULL },
   { "control0", test_proto_control0, 0, NULL, NULL },
   { "ext_or_cmd", test_proto_ext_or_cmd, TT_FORK, NULL, NULL },
   { "line", test_proto_line, 0, NULL, NULL },
@@ -4,19 +4,26 @@
 #define CIRCUITBUILD_PRIVATE
 #define RELAY_PRIVATE
 #define BWHIST_PRIVATE
+#define CONNECTION_PRIVATE
 #include "core/or/or.h"
 #include "core/or/circuitbuild.h"
 #include "core/or/circuitlist.h"
 #include "core/or/channeltls.h"
 #include "feature/stats/bwhist.h"
 #include "core/or/relay.h"
+#include "core/crypto/relay_crypto.h"
+#include "core/mainloop/connection.h"
 #include "lib/container/order.h"
+#include "lib/crypt_ops/crypto_rand.h"
 #include "lib/encoding/confline.h"
 /* For init/free stuff */
 #include "core/or/scheduler.h"
 
 #include "core/or/cell_st.h"
+#include "core/or/cell_queue_st.h"
+#include "core/or/edge_connection_st.h"
 #include "core/or/or_circuit_st.h"
+#include "core/or/relay_crypto_st.h"
 
 #define RESOLVE_ADDR_PRIVATE
 #include "feature/nodelist/dirlist.h"
@@ -210,6 +217,106 @@ test_relay_append_cell_to_circuit_queue(void *arg)
   return;
 }
 
+static void
+test_relay_exit_package_bulk(void *arg)
+{
+  channel_t *nchan = NULL, *pchan = NULL;
+  or_circuit_t *orcirc = NULL;
+  edge_connection_t *exitconn = NULL;
+  relay_crypto_t client_crypto;
+  char keys[CPATH_KEY_MATERIAL_LEN];
+  /* Ten full cells, then half of one. */
+  const size_t data_len = RELAY_PAYLOAD_SIZE * 10 + RELAY_PAYLOAD_SIZE / 2;
+  char *data = tor_malloc(data_len);
+  const packed_cell_t *packed;
+  size_t offset = 0;
+  int old_count, old_window, n_cells = 0;
+  uint64_t old_packaged;
+
+  (void)arg;
+  memset(&client_crypto, 0, sizeof(client_crypto));
+  crypto_rand(data, data_len);
+  crypto_rand(keys, sizeof(keys));
+
+  nchan = new_fake_channel();
+  pchan = new_fake_channel();
+  orcirc = new_fake_orcirc(nchan, pchan);
+  tt_assert(orcirc);
+  circuitmux_attach_circuit(pchan->cmux, TO_CIRCUIT(orcirc),
+                            CELL_DIRECTION_IN);
+  /* Use keys we know, so that we can decrypt what we package. */
+  relay_crypto_clear(&orcirc->crypto);
+  tt_int_op(0, OP_EQ, relay_crypto_init(&orcirc->crypto, keys, sizeof(keys),
+                                        0, 0));
+  tt_int_op(0, OP_EQ, relay_crypto_init(&client_crypto, keys, sizeof(keys),
+                                        0, 0));
+  /* Don't let the sendme randomness shorten any cell. */
+  TO_CIRCUIT(orcirc)->send_randomness_after_n_cells = 100;
+
+  exitconn = edge_connection_new(CONN_TYPE_EXIT, AF_INET);
+  exitconn->stream_id = 42;
+  exitconn->package_window = STREAMWINDOW_START;
+  exitconn->on_circuit = TO_CIRCUIT(orcirc);
+  orcirc->n_streams = exitconn;
+  buf_add(TO_CONN(exitconn)->inbuf, data, data_len);
+
+  MOCK(scheduler_channel_has_waiting_cells,
+       scheduler_channel_has_waiting_cells_mock);
+
+  old_count = get_mock_scheduler_has_waiting_cells_count();
+  old_window = exitconn->package_window;
+  old_packaged = stats_n_data_cells_packaged;
+  tt_int_op(0, OP_EQ, connection_edge_package_raw_inbuf(exitconn, 1, NULL));
+
+  /* The full cells went in one batch, the half one on its own. */
+  tt_int_op(get_mock_scheduler_has_waiting_cells_count(), OP_EQ,
+            old_count + 2);
+  tt_int_op(orcirc->p_chan_cells.n, OP_EQ, 11);
+  tt_u64_op(stats_n_data_cells_packaged, OP_EQ, old_packaged + 11);
+  tt_int_op(exitconn->package_window, OP_EQ, old_window - 11);
+  tt_int_op(TO_CIRCUIT(orcirc)->package_window, OP_EQ,
+            CIRCWINDOW_START_MAX - 11);
+  tt_int_op(connection_get_inbuf_len(TO_CONN(exitconn)), OP_EQ, 0);
+  tt_int_op(circuitmux_num_cells(pchan->cmux), OP_EQ, 11);
+
+  /* The client gets all the data back, in order. */
+  TOR_SIMPLEQ_FOREACH(packed, &orcirc->p_chan_cells.head, next) {
+    uint8_t payload[CELL_PAYLOAD_SIZE];
+    relay_header_t rh;
+    const size_t expected_len = MIN(RELAY_PAYLOAD_SIZE, data_len - offset);
+
+    memcpy(payload, packed->body + (pchan->wide_circ_ids ? 5 : 3),
+           CELL_PAYLOAD_SIZE);
+    relay_crypt_one_payload(client_crypto.b_crypto, payload);
+    relay_header_unpack(&rh, payload);
+    tt_int_op(rh.command, OP_EQ, RELAY_COMMAND_DATA);
+    tt_int_op(rh.stream_id, OP_EQ, 42);
+    tt_int_op(rh.length, OP_EQ, expected_len);
+    tt_mem_op(payload + RELAY_HEADER_SIZE, OP_EQ, data + offset,
+              expected_len);
+    offset += expected_len;
+    ++n_cells;
+  }
+  tt_int_op(n_cells, OP_EQ, 11);
+  tt_int_op(offset, OP_EQ, data_len);
+
+ done:
+  UNMOCK(scheduler_channel_has_waiting_cells);
+  if (exitconn) {
+    orcirc->n_streams = NULL;
+    connection_free_minimal(TO_CONN(exitconn));
+  }
+  if (orcirc) {
+    circuitmux_detach_circuit(pchan->cmux, TO_CIRCUIT(orcirc));
+    cell_queue_clear(&orcirc->p_chan_cells);
+  }
+  relay_crypto_clear(&client_crypto);
+  free_fake_orcirc(orcirc);
+  free_fake_channel(nchan);
+  free_fake_channel(pchan);
+  tor_free(data);
+}
+
 static void
 test_suggested_address(void *arg)
 {
@@ -379,6 +486,8 @@ struct testcase_t relay_tests[] = {
     TT_FORK, NULL, NULL },
   { "close_circ_rephist", test_relay_close_circuit,
     TT_FORK, NULL, NULL },
+  { "exit_package_bulk", test_relay_exit_package_bulk,
+    TT_FORK, NULL, NULL },
   { "suggested_address", test_suggested_address,
     TT_FORK, NULL, NULL },
   { "find_addr_to_publish", test_find_addr_to_publish,
@@ -248,6 +248,51 @@ test_routerkeys_ed_certs(void *args)
   tor_free(base64);
 }
 
+static void
+test_routerkeys_ed_certs_batch(void *args)
+{
+  (void)args;
+  ed25519_keypair_t kp1, kp2;
+  tor_cert_t *cert = NULL;
+  tor_cert_t *parsed_cert[6] = {NULL};
+  time_t now = 1412094534;
+  int i;
+
+  ed25519_set_batch_verification(1);
+  tt_int_op(0,OP_EQ,ed25519_keypair_generate(&kp1, 0));
+  tt_int_op(0,OP_EQ,ed25519_keypair_generate(&kp2, 0));
+
+  for (i = 0; i < 6; ++i) {
+    /* The last one expires before we check it. */
+    cert = tor_cert_create_ed25519(&kp1, 5, &kp2.pubkey, now,
+                                   i == 5 ? 10 : 100000,
+                                   CERT_FLAG_INCLUDE_SIGNING_KEY);
+    tt_assert(cert);
+    parsed_cert[i] = tor_cert_parse(cert->encoded, cert->encoded_len);
+    tt_assert(parsed_cert[i]);
+    tor_cert_free(cert);
+  }
+  /* Spoil the signature on the second one. */
+  parsed_cert[1]->encoded[parsed_cert[1]->encoded_len - 1] ^= 1;
+
+  tt_int_op(tor_cert_checksig_batch(parsed_cert, 6, now + 20000),
+            OP_EQ, -2);
+  for (i = 0; i < 6; ++i) {
+    tt_uint_op(parsed_cert[i]->cert_valid, OP_EQ, i != 1 && i != 5);
+    tt_uint_op(parsed_cert[i]->sig_ok, OP_EQ, i != 1 && i != 5);
+  }
+  tt_uint_op(parsed_cert[1]->sig_bad, OP_EQ, 1);
+  tt_uint_op(parsed_cert[5]->cert_expired, OP_EQ, 1);
+  tt_uint_op(parsed_cert[5]->sig_bad, OP_EQ, 0);
+
+  tt_int_op(tor_cert_checksig_batch(parsed_cert, 0, now), OP_EQ, 0);
+
+ done:
+  ed25519_set_batch_verification(0);
+  for (i = 0; i < 6; ++i)
+    tor_cert_free(parsed_cert[i]);
+}
+
 static void
 test_routerkeys_ed_key_create(void *arg)
 {
@@ -742,6 +787,7 @@ struct testcase_t routerkeys_tests[] = {
   TEST(write_fingerprint, TT_FORK),
   TEST(write_ed25519_identity, TT_FORK),
   TEST(ed_certs, TT_FORK),
+  TEST(ed_certs_batch, TT_FORK),
   TEST(ed_key_create, TT_FORK),
   TEST(ed_key_init_basic, TT_FORK),
   TEST(ed_key_init_split, TT_FORK),
@@ -1265,6 +1265,81 @@ test_scheduler_kist_pending_list(void *arg)
   UNMOCK(channel_should_write_to_kernel);
 }
 
+static void
+test_scheduler_kist_many_channels(void *arg)
+{
+  const int n_chans = 1000;
+  smartlist_t *chans = NULL;
+  (void) arg;
+
+#ifndef HAVE_KIST_SUPPORT
+  return;
+#endif
+
+  chans = smartlist_new();
+
+  /* Every channel is blocked by its socket limit but has more to flush, so
+   * the whole pending list goes through the re-add path at the end of the
+   * run. Each channel must come back exactly once. */
+  MOCK(get_options, mock_get_options);
+  MOCK(channel_flush_some_cells, channel_flush_some_cells_mock_var);
+  MOCK(channel_more_to_flush, channel_more_to_flush_mock_var);
+  MOCK(update_socket_info_impl, update_socket_info_impl_mock_var);
+  MOCK(channel_write_to_kernel, channel_write_to_kernel_mock);
+  MOCK(channel_should_write_to_kernel, channel_should_write_to_kernel_mock);
+
+  mocked_options.KISTSchedRunInterval = 10;
+  set_scheduler_options(SCHEDULER_KIST);
+  scheduler_init();
+
+  for (int i = 0; i < n_chans; ++i) {
+    channel_t *chan = new_fake_channel();
+    tt_assert(chan);
+    chan->magic = TLS_CHAN_MAGIC;
+    channel_register(chan);
+    smartlist_add(chans, chan);
+    scheduler_channel_wants_writes(chan);
+    scheduler_channel_has_waiting_cells(chan);
+  }
+  tt_int_op(smartlist_len(get_channels_pending()), OP_EQ, n_chans);
+
+  mock_update_socket_info_limit = 0;
+  mock_more_to_flush = 1;
+  mock_flush_some_cells_num = 1;
+  the_scheduler->run();
+  tt_int_op(smartlist_len(get_channels_pending()), OP_EQ, n_chans);
+  SMARTLIST_FOREACH_BEGIN(chans, channel_t *, chan) {
+    tt_int_op(chan->scheduler_state, OP_EQ, SCHED_CHAN_PENDING);
+    tt_int_op(chan->sched_heap_idx, OP_GE, 0);
+    tt_ptr_op(smartlist_get(get_channels_pending(), chan->sched_heap_idx),
+              OP_EQ, chan);
+  } SMARTLIST_FOREACH_END(chan);
+
+  /* Now every socket can write and nothing is left: the list drains. */
+  mock_update_socket_info_limit = INT_MAX;
+  mock_more_to_flush = 0;
+  the_scheduler->run();
+  tt_int_op(smartlist_len(get_channels_pending()), OP_EQ, 0);
+  SMARTLIST_FOREACH(chans, channel_t *, chan,
+    tt_int_op(chan->scheduler_state, OP_EQ, SCHED_CHAN_WAITING_FOR_CELLS));
+
+ done:
+  SMARTLIST_FOREACH_BEGIN(chans, channel_t *, chan) {
+    chan->state = CHANNEL_STATE_CLOSED;
+    chan->registered = 0;
+    channel_free(chan);
+  } SMARTLIST_FOREACH_END(chan);
+  smartlist_free(chans);
+  scheduler_free_all();
+
+  UNMOCK(get_options);
+  UNMOCK(channel_flush_some_cells);
+  UNMOCK(channel_more_to_flush);
+  UNMOCK(update_socket_info_impl);
+  UNMOCK(channel_write_to_kernel);
+  UNMOCK(channel_should_write_to_kernel);
+}
+
 struct testcase_t scheduler_tests[] = {
   { "compare_channels", test_scheduler_compare_channels,
     TT_FORK, NULL, NULL },
@@ -1276,6 +1351,8 @@ struct testcase_t scheduler_tests[] = {
   { "should_use_kist", test_scheduler_can_use_kist, TT_FORK, NULL, NULL },
   { "kist_pending_list", test_scheduler_kist_pending_list, TT_FORK,
     NULL, NULL },
+  { "kist_many_channels", test_scheduler_kist_many_channels, TT_FORK,
+    NULL, NULL },
   END_OF_TESTCASES
 };
 
@@ -473,6 +473,36 @@ test_tortls_is_server(void *arg)
   crypto_pk_free(pk2);
 }
 
+static void
+test_tortls_kernel_offload(void *arg)
+{
+  (void)arg;
+  crypto_pk_t *pk1=NULL, *pk2=NULL;
+  tor_tls_t *tls = NULL;
+  int ktls_send = -1, ktls_recv = -1;
+  pk1 = pk_generate(2);
+  pk2 = pk_generate(0);
+
+  /* Asking for kTLS must never stop us from building a context, whether or
+   * not the TLS library supports it. */
+  int r = tor_tls_context_init(TOR_TLS_CTX_IS_PUBLIC_SERVER |
+                               TOR_TLS_CTX_USE_KTLS,
+                               pk1, pk2, 86400);
+  tt_int_op(r, OP_EQ, 0);
+  tls = tor_tls_new(-1, 0);
+  tt_assert(tls);
+
+  /* Nothing can be offloaded before the handshake is done. */
+  tor_tls_get_kernel_offload(tls, &ktls_send, &ktls_recv);
+  tt_int_op(ktls_send, OP_EQ, 0);
+  tt_int_op(ktls_recv, OP_EQ, 0);
+
+ done:
+  tor_tls_free(tls);
+  crypto_pk_free(pk1);
+  crypto_pk_free(pk2);
+}
+
 static void
 test_tortls_verify(void *ignored)
 {
@@ -603,6 +633,7 @@ struct testcase_t tortls_tests[] = {
   LOCAL_TEST_CASE(double_init, TT_FORK),
   LOCAL_TEST_CASE(address, TT_FORK),
   LOCAL_TEST_CASE(is_server, 0),
+  LOCAL_TEST_CASE(kernel_offload, TT_FORK),
   LOCAL_TEST_CASE(bridge_init, TT_FORK),
   LOCAL_TEST_CASE(verify, TT_FORK),
   LOCAL_TEST_CASE(cert_matches_key, 0),
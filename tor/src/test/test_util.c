@@ -5222,6 +5222,38 @@ test_util_memcpy_iftrue_timei(void *arg)
   ;
 }
 
+static void
+test_util_select_sorted_timei(void *arg)
+{
+  (void)arg;
+  /* Running totals of {3,1,2,0,6,0,7,5}. */
+  const uint64_t cumulative[] = { 3, 4, 6, 6, 12, 12, 19, 24 };
+  int n, i;
+  uint64_t r;
+
+  for (n = 1; n <= (int)ARRAY_LENGTH(cumulative); ++n) {
+    for (r = 0; r < cumulative[n-1]; ++r) {
+      /* Compare against a linear search. */
+      for (i = 0; cumulative[i] <= r; ++i)
+        ;
+      tt_int_op(i, OP_EQ, select_array_member_sorted_timei(cumulative, n, r));
+    }
+  }
+
+  /* Big values. */
+  {
+    const uint64_t big[] = { INT64_MAX/4, INT64_MAX/4, INT64_MAX/2 };
+    tt_int_op(0, OP_EQ, select_array_member_sorted_timei(big, 3, 0));
+    tt_int_op(2, OP_EQ, select_array_member_sorted_timei(big, 3,
+                                                         INT64_MAX/4));
+    tt_int_op(2, OP_EQ, select_array_member_sorted_timei(big, 3,
+                                                         INT64_MAX/2 - 1));
+  }
+
+ done:
+  ;
+}
+
 static void
 test_util_di_map(void *arg)
 {
@@ -6998,6 +7030,7 @@ struct testcase_t util_tests[] = {
   UTIL_LEGACY(strtok),
   UTIL_LEGACY(di_ops),
   UTIL_TEST(memcpy_iftrue_timei, 0),
+  UTIL_TEST(select_sorted_timei, 0),
   UTIL_TEST(di_map, 0),
   UTIL_TEST(round_to_next_multiple_of, 0),
   UTIL_TEST(laplace, 0),